@@ -0,0 +1,72 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#include "airhive_boot.h"
+
+static const char* TAG = "Airhive-Boot";
+
+static EventGroupHandle_t boot_events;
+static int64_t phase_timestamps_us[AIRHIVE_BOOT_PHASE_COUNT];
+static esp_err_t phase_errors[AIRHIVE_BOOT_PHASE_COUNT];
+
+static const char* phase_names[AIRHIVE_BOOT_PHASE_COUNT] = {
+    [AIRHIVE_BOOT_CORE_READY] = "core_ready",
+    [AIRHIVE_BOOT_USB_READY] = "usb_ready",
+    [AIRHIVE_BOOT_WIFI_STARTED] = "wifi_started",
+    [AIRHIVE_BOOT_GOT_IP] = "got_ip",
+    [AIRHIVE_BOOT_HTTP_READY] = "http_ready",
+    [AIRHIVE_BOOT_MDNS_READY] = "mdns_ready",
+    [AIRHIVE_BOOT_BRIDGE_READY] = "bridge_ready",
+    [AIRHIVE_BOOT_FIRST_REQUEST] = "first_request"
+};
+
+esp_err_t airhive_boot_init()
+{
+    boot_events = xEventGroupCreate();
+    if(boot_events == NULL)
+    {
+        ESP_LOGE(TAG, "Couldn't create boot event group.");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void airhive_boot_mark(airhive_boot_phase_t phase)
+{
+    if(phase >= AIRHIVE_BOOT_PHASE_COUNT || boot_events == NULL) return;
+    if(xEventGroupGetBits(boot_events) & (1 << phase)) return;
+    phase_timestamps_us[phase] = esp_timer_get_time();
+    xEventGroupSetBits(boot_events, 1 << phase);
+    ESP_LOGI(TAG, "Boot phase %s reached at %lld ms.", phase_names[phase], phase_timestamps_us[phase] / 1000);
+}
+
+void airhive_boot_fail(airhive_boot_phase_t phase, esp_err_t error)
+{
+    if(phase >= AIRHIVE_BOOT_PHASE_COUNT) return;
+    phase_errors[phase] = error;
+    ESP_LOGE(TAG, "Boot phase %s failed: %s", phase_names[phase], esp_err_to_name(error));
+}
+
+esp_err_t airhive_boot_wait(uint32_t phases_mask, uint32_t timeout_ms)
+{
+    if(phases_mask == 0) return ESP_OK;
+    EventBits_t bits = xEventGroupWaitBits(boot_events, phases_mask, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+    return ((bits & phases_mask) == phases_mask) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+int64_t airhive_boot_timestamp_us(airhive_boot_phase_t phase)
+{
+    return (phase < AIRHIVE_BOOT_PHASE_COUNT) ? phase_timestamps_us[phase] : 0;
+}
+
+esp_err_t airhive_boot_error(airhive_boot_phase_t phase)
+{
+    return (phase < AIRHIVE_BOOT_PHASE_COUNT) ? phase_errors[phase] : ESP_ERR_INVALID_ARG;
+}
+
+const char* airhive_boot_phase_name(airhive_boot_phase_t phase)
+{
+    return (phase < AIRHIVE_BOOT_PHASE_COUNT) ? phase_names[phase] : "unknown";
+}
@@ -0,0 +1,55 @@
+#include "esp_err.h"
+#include "stdint.h"
+
+// Boot phases, each one is marked once when it completes, in whatever order the concurrent startup stages finish.
+typedef enum {
+    AIRHIVE_BOOT_CORE_READY,        // NVS, default event loop and netif.
+    AIRHIVE_BOOT_USB_READY,         // USB host and CDC-ACM driver installed.
+    AIRHIVE_BOOT_WIFI_STARTED,      // WiFi station started and connecting.
+    AIRHIVE_BOOT_GOT_IP,
+    AIRHIVE_BOOT_HTTP_READY,        // HTTP server listening.
+    AIRHIVE_BOOT_MDNS_READY,        // mDNS hostname and service registered.
+    AIRHIVE_BOOT_BRIDGE_READY,      // TCP serial bridge started, if enabled.
+    AIRHIVE_BOOT_FIRST_REQUEST,     // First HTTP request served.
+    AIRHIVE_BOOT_PHASE_COUNT
+} airhive_boot_phase_t;
+
+/**
+ * @brief Initializes boot phase tracking. Must be called first before any function in this file, as early as possible.
+ * @return ESP_ERR_NO_MEM if the event group couldn't be created, ESP_OK otherwise.
+ */
+esp_err_t airhive_boot_init();
+
+/**
+ * @brief Marks a phase as completed and records its time since boot, only the first mark of each phase counts.
+ */
+void airhive_boot_mark(airhive_boot_phase_t phase);
+
+/**
+ * @brief Records that a phase failed, phases waiting on it will time out instead of running.
+ */
+void airhive_boot_fail(airhive_boot_phase_t phase, esp_err_t error);
+
+/**
+ * @brief Blocks until all the phases in a mask are completed.
+ * @param phases_mask [IN] bitmask of (1 << phase) for every phase to wait for, 0 returns immediately.
+ * @return ESP_ERR_TIMEOUT if they didn't complete within timeout_ms, ESP_OK otherwise.
+ */
+esp_err_t airhive_boot_wait(uint32_t phases_mask, uint32_t timeout_ms);
+
+/**
+ * @brief Gets the time since boot a phase completed at.
+ * @return the time in microseconds, or 0 if it didn't complete (yet).
+ */
+int64_t airhive_boot_timestamp_us(airhive_boot_phase_t phase);
+
+/**
+ * @brief Gets the error a phase failed with.
+ * @return ESP_OK if it didn't fail.
+ */
+esp_err_t airhive_boot_error(airhive_boot_phase_t phase);
+
+/**
+ * @brief Gets a short name of a phase, e.g. "usb_ready".
+ */
+const char* airhive_boot_phase_name(airhive_boot_phase_t phase);
@@ -0,0 +1,279 @@
+#include "esp_log.h"
+#include "esp_task.h"
+#include "nvs_flash.h"
+#include "lwip/sockets.h"
+#include "sys/param.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "cncm.h"
+
+#include "airhive_bridge.h"
+
+static const char* TAG = "Airhive-Bridge";
+
+static nvs_handle_t bridge_nvs;
+static SemaphoreHandle_t bridge_lock;   // Guards bridge_enabled and bridge_task_hdl.
+static bool bridge_enabled = false;
+static TaskHandle_t bridge_task_hdl = NULL;
+static volatile bool client_connected = false;
+
+typedef struct {
+    int sock;
+    uint64_t rx_cursor;
+} bridge_client_t;
+
+static bool bridge_should_run()
+{
+    xSemaphoreTake(bridge_lock, portMAX_DELAY);
+    bool enabled = bridge_enabled;
+    xSemaphoreGive(bridge_lock);
+    return enabled;
+}
+
+static bool bridge_send_all(int sock, const uint8_t* data, size_t len)
+{
+    while(len > 0)
+    {
+        int sent = send(sock, data, len, 0);
+        if(sent < 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// Writes everything the machine sent since the last call to the client, returns false if the client is gone.
+static bool bridge_rx_forward(bridge_client_t* client)
+{
+    static uint8_t chunk[AIRHIVE_BRIDGE_RX_CHUNK_SIZE];
+    size_t chunk_len = 0;
+    do
+    {
+        uint64_t lost_bytes = 0;
+        if(cncm_rx_read(&client->rx_cursor, chunk, &chunk_len, sizeof(chunk), &lost_bytes) != ESP_OK) return true;
+        if(lost_bytes > 0) ESP_LOGW(TAG, "Client fell behind, %" PRIu64 " bytes of machine output lost.", lost_bytes);
+        if(!bridge_send_all(client->sock, chunk, chunk_len)) return false;
+    } while(chunk_len == sizeof(chunk));
+    return true;
+}
+
+// Queues a line, waiting while the tx_queue is full. Not reading the socket meanwhile lets TCP push back on the host.
+static bool bridge_line_enqueue(bridge_client_t* client, const char* line)
+{
+    while(bridge_should_run())
+    {
+        esp_err_t ret = cncm_tx_producer(line);
+        if(ret != ESP_ERR_NO_MEM)
+        {
+            if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to queue line %s, error: %s", line, esp_err_to_name(ret));
+            return true;
+        }
+        if(!bridge_rx_forward(client)) return false;
+        vTaskDelay(pdMS_TO_TICKS(AIRHIVE_BRIDGE_POLL_MS));
+    }
+    return false;
+}
+
+static void bridge_client_configure(int sock)
+{
+    int enable = 1;
+    int idle = AIRHIVE_BRIDGE_KEEPALIVE_IDLE_S;
+    int interval = AIRHIVE_BRIDGE_KEEPALIVE_INTERVAL_S;
+    int count = AIRHIVE_BRIDGE_KEEPALIVE_COUNT;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+// Serves one client until it disconnects or the bridge is disabled, connections to listen_sock meanwhile are refused.
+static void bridge_serve(int listen_sock, int client_sock)
+{
+    static char line[CNCM_MAX_COMMAND_SIZE + 1];
+    size_t line_len = 0;
+    bool line_too_long = false;
+    bridge_client_t client = {
+        .sock = client_sock,
+        .rx_cursor = cncm_rx_head()    // Only output from now on, not the history in the rx_queue.
+    };
+    bridge_client_configure(client_sock);
+
+    while(bridge_should_run())
+    {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(listen_sock, &read_fds);
+        FD_SET(client_sock, &read_fds);
+        struct timeval timeout = { .tv_sec = 0, .tv_usec = AIRHIVE_BRIDGE_POLL_MS * 1000 };
+        int ready = select(MAX(listen_sock, client_sock) + 1, &read_fds, NULL, NULL, &timeout);
+        if(ready < 0)
+        {
+            ESP_LOGE(TAG, "select failed, errno: %d", errno);
+            return;
+        }
+        if(ready > 0 && FD_ISSET(listen_sock, &read_fds))
+        {
+            int other_sock = accept(listen_sock, NULL, NULL);
+            if(other_sock >= 0)
+            {
+                ESP_LOGW(TAG, "Refused a second client, the bridge is in use.");
+                close(other_sock);
+            }
+        }
+        if(ready > 0 && FD_ISSET(client_sock, &read_fds))
+        {
+            char data[256];
+            int received = recv(client_sock, data, sizeof(data), 0);
+            if(received <= 0) return;   // Closed by the client or broken.
+            for(int i = 0; i < received; i++)
+            {
+                if(data[i] != '\n' && data[i] != '\r')
+                {
+                    if(line_len < CNCM_MAX_COMMAND_SIZE) line[line_len++] = data[i];
+                    else line_too_long = true;
+                    continue;
+                }
+                if(line_too_long) ESP_LOGE(TAG, "Dropped a line longer than %d bytes.", CNCM_MAX_COMMAND_SIZE);
+                else if(line_len > 0)
+                {
+                    line[line_len] = '\0';
+                    if(!bridge_line_enqueue(&client, line)) return;
+                }
+                line_len = 0;
+                line_too_long = false;
+            }
+        }
+        if(!bridge_rx_forward(&client)) return;
+    }
+}
+
+static int bridge_listen()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if(sock < 0) return -1;
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(AIRHIVE_BRIDGE_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void bridge_task(void* arg)
+{
+    int listen_sock = -1;
+    while(true)
+    {
+        xSemaphoreTake(bridge_lock, portMAX_DELAY);
+        if(!bridge_enabled)
+        {
+            bridge_task_hdl = NULL;     // Decided under the lock, so airhive_bridge_set_enabled() knows to start a new task.
+            xSemaphoreGive(bridge_lock);
+            break;
+        }
+        xSemaphoreGive(bridge_lock);
+
+        if(listen_sock < 0)
+        {
+            listen_sock = bridge_listen();
+            if(listen_sock < 0)
+            {
+                ESP_LOGE(TAG, "Failed to listen on port %d, errno: %d", AIRHIVE_BRIDGE_PORT, errno);
+                vTaskDelay(pdMS_TO_TICKS(1000));
+                continue;
+            }
+            ESP_LOGI(TAG, "Listening on port %d.", AIRHIVE_BRIDGE_PORT);
+        }
+
+        // Wait with a timeout so that disabling the bridge is noticed.
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(listen_sock, &read_fds);
+        struct timeval timeout = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+        if(select(listen_sock + 1, &read_fds, NULL, NULL, &timeout) <= 0) continue;
+        int client_sock = accept(listen_sock, NULL, NULL);
+        if(client_sock < 0) continue;
+        ESP_LOGI(TAG, "Client connected.");
+        client_connected = true;
+        bridge_serve(listen_sock, client_sock);
+        client_connected = false;
+        close(client_sock);
+        ESP_LOGI(TAG, "Client disconnected.");
+    }
+    if(listen_sock >= 0) close(listen_sock);
+    ESP_LOGI(TAG, "Bridge stopped.");
+    vTaskDelete(NULL);
+}
+
+// Must be called with bridge_lock taken.
+static esp_err_t bridge_apply(bool enabled)
+{
+    bridge_enabled = enabled;
+    if(enabled && bridge_task_hdl == NULL &&
+       xTaskCreate(bridge_task, "bridge_task", AIRHIVE_BRIDGE_STACK_SIZE, NULL, ESP_TASK_MAIN_PRIO, &bridge_task_hdl) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create bridge task.");
+        bridge_enabled = false;
+        bridge_task_hdl = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t airhive_bridge_init()
+{
+    bridge_lock = xSemaphoreCreateMutex();
+    if(bridge_lock == NULL) return ESP_ERR_NO_MEM;
+    esp_err_t ret = nvs_open("BRIDGE", NVS_READWRITE, &bridge_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    uint8_t enabled = 0;
+    ret = nvs_get_u8(bridge_nvs, "enabled", &enabled);
+    if(ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND)
+    {
+        ESP_LOGE(TAG, "Error reading NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    xSemaphoreTake(bridge_lock, portMAX_DELAY);
+    ret = bridge_apply(enabled != 0);
+    xSemaphoreGive(bridge_lock);
+    return ret;
+}
+
+esp_err_t airhive_bridge_set_enabled(bool enabled)
+{
+    if(bridge_lock == NULL) return ESP_ERR_INVALID_STATE;
+    esp_err_t ret = nvs_set_u8(bridge_nvs, "enabled", enabled ? 1 : 0);
+    if(ret == ESP_OK) ret = nvs_commit(bridge_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error writing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    xSemaphoreTake(bridge_lock, portMAX_DELAY);
+    ret = bridge_apply(enabled);
+    xSemaphoreGive(bridge_lock);
+    return ret;
+}
+
+bool airhive_bridge_is_enabled()
+{
+    return bridge_lock != NULL && bridge_should_run();
+}
+
+bool airhive_bridge_has_client()
+{
+    return client_connected;
+}
@@ -0,0 +1,28 @@
+#include "esp_err.h"
+#include "stdbool.h"
+
+#define AIRHIVE_BRIDGE_PORT (23)
+#define AIRHIVE_BRIDGE_STACK_SIZE (4096)
+#define AIRHIVE_BRIDGE_POLL_MS (10)         // How often machine output is forwarded while the host is quiet.
+#define AIRHIVE_BRIDGE_RX_CHUNK_SIZE (1024)
+#define AIRHIVE_BRIDGE_KEEPALIVE_IDLE_S (30)
+#define AIRHIVE_BRIDGE_KEEPALIVE_INTERVAL_S (5)
+#define AIRHIVE_BRIDGE_KEEPALIVE_COUNT (3)
+
+/**
+ * @brief Starts the raw TCP serial bridge if it was enabled, cncm must be initialized first.
+ * One client at a time: every line it writes goes into the tx_queue, and the machine output is written back unmodified.
+ * @return NVS error codes, ESP_ERR_NO_MEM if the task couldn't be created, ESP_OK otherwise.
+ */
+esp_err_t airhive_bridge_init();
+
+/**
+ * @brief Enables or disables the bridge, stored persistently and applied immediately.
+ * Disabling it drops the connected client, if any.
+ * @return NVS error codes, ESP_ERR_NO_MEM if the task couldn't be created, ESP_OK otherwise.
+ */
+esp_err_t airhive_bridge_set_enabled(bool enabled);
+
+bool airhive_bridge_is_enabled();
+
+bool airhive_bridge_has_client();
@@ -0,0 +1,500 @@
+#include "esp_log.h"
+#include "esp_task.h"
+#include "esp_timer.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "inttypes.h"
+#include "string.h"
+#include "strings.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "sys/param.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "cncm.h"
+
+#include "airhive_fetch.h"
+
+static const char* TAG = "Airhive-Fetch";
+
+static SemaphoreHandle_t fetch_lock;    // Guards fetch_status and fetch_task_hdl.
+static airhive_fetch_status_t fetch_status;
+static TaskHandle_t fetch_task_hdl = NULL;
+static volatile bool fetch_stop = false;
+
+typedef struct {
+    esp_http_client_handle_t client;
+    uint32_t job_id;
+    bool to_sd;             // Bytes go to cncm_sd_transfer_write() as they are instead of lines to the job.
+    uint64_t offset;
+    uint64_t range_total;   // Total size from the Content-Range of the last response, 0 if unknown.
+    bool streaming;         // A 200 answer to a Range request is open and read on from offset.
+    char* buffer;           // Fetched bytes, [start, len) are not queued or written yet.
+    size_t start;
+    size_t len;
+    bool eof;
+} fetch_ctx_t;
+
+// Waits for ms, or until airhive_fetch_cancel() wakes the task up.
+static void fetch_wait(uint32_t ms)
+{
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ms));
+}
+
+static esp_err_t fetch_event_handler(esp_http_client_event_t* evt)
+{
+    fetch_ctx_t* ctx = (fetch_ctx_t*)evt->user_data;
+    if(evt->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(evt->header_key, "Content-Range") == 0)
+    {
+        const char* slash = strchr(evt->header_value, '/');    // "bytes <first>-<last>/<total>", total may be '*'.
+        if(slash != NULL && slash[1] != '*') ctx->range_total = strtoull(slash + 1, NULL, 10);
+    }
+    return ESP_OK;
+}
+
+static void fetch_status_set_error(int http_status, esp_err_t error)
+{
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    if(http_status != 0) fetch_status.last_http_status = http_status;
+    if(error != ESP_OK) fetch_status.last_error = error;
+    xSemaphoreGive(fetch_lock);
+}
+
+// Asks for the file from ctx->offset on, http_status is 206 if the server sent that range. A server that ignores Range
+// answers 200 with the whole file: what's before the offset is read and dropped once, and the rest of that response is
+// then read chunk by chunk (ctx->streaming), asking again for every chunk would download the start of the file each time.
+// Returns ESP_ERR_INVALID_RESPONSE if retrying can't help, other errors if it can.
+static esp_err_t fetch_open(fetch_ctx_t* ctx, int* http_status)
+{
+    char range[48];
+    snprintf(range, sizeof(range), "bytes=%" PRIu64 "-%" PRIu64, ctx->offset, ctx->offset + AIRHIVE_FETCH_CHUNK_SIZE - 1);
+    esp_http_client_set_header(ctx->client, "Range", range);
+    ctx->range_total = 0;
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    fetch_status.requests++;
+    xSemaphoreGive(fetch_lock);
+
+    esp_err_t ret = esp_http_client_open(ctx->client, 0);
+    if(ret != ESP_OK) return ret;
+    int64_t content_length = esp_http_client_fetch_headers(ctx->client);
+    if(content_length < 0)
+    {
+        esp_http_client_close(ctx->client);
+        return ESP_FAIL;
+    }
+    *http_status = esp_http_client_get_status_code(ctx->client);
+    fetch_status_set_error(*http_status, ESP_OK);
+    if(*http_status == 416)  // Range Not Satisfiable, the offset is at the end of the file.
+    {
+        ctx->eof = true;
+        esp_http_client_close(ctx->client);
+        return ESP_OK;
+    }
+    if(*http_status == 206) return ESP_OK;
+    if(*http_status != 200)
+    {
+        ESP_LOGE(TAG, "Server answered %d.", *http_status);
+        esp_http_client_close(ctx->client);
+        return (*http_status >= 500) ? ESP_FAIL : ESP_ERR_INVALID_RESPONSE;
+    }
+
+    if(ctx->offset > 0) ESP_LOGW(TAG, "Server doesn't support Range, skipping %" PRIu64 " bytes.", ctx->offset);
+    if(content_length > 0) ctx->range_total = content_length;
+    uint64_t skip = ctx->offset;
+    char* scratch = ctx->buffer + ctx->len;    // The buffer has room for a chunk.
+    while(skip > 0)
+    {
+        int read = esp_http_client_read(ctx->client, scratch, MIN(skip, AIRHIVE_FETCH_CHUNK_SIZE));
+        if(read <= 0)
+        {
+            esp_http_client_close(ctx->client);
+            return ESP_FAIL;
+        }
+        skip -= read;
+    }
+    ctx->streaming = true;
+    return ESP_OK;
+}
+
+// Reads the next AIRHIVE_FETCH_CHUNK_SIZE bytes from ctx->offset and appends what arrives to the buffer, which must
+// have room for them. Whatever was received before a failure is kept, so the retry starts after it.
+// Returns ESP_ERR_INVALID_RESPONSE if retrying can't help, other errors if it can.
+static esp_err_t fetch_range(fetch_ctx_t* ctx)
+{
+    int http_status = 200;
+    if(!ctx->streaming)
+    {
+        esp_err_t ret = fetch_open(ctx, &http_status);
+        if(ret != ESP_OK || ctx->eof) return ret;
+    }
+
+    char* destination = ctx->buffer + ctx->len;
+    int read = 0;
+    size_t received = 0;
+    while(read >= 0 && received < AIRHIVE_FETCH_CHUNK_SIZE)
+    {
+        read = esp_http_client_read(ctx->client, destination + received, AIRHIVE_FETCH_CHUNK_SIZE - received);
+        if(read == 0) break;
+        if(read > 0) received += read;
+    }
+    ctx->len += received;
+    ctx->offset += received;
+    bool complete = esp_http_client_is_complete_data_received(ctx->client);
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    fetch_status.offset = ctx->offset;
+    if(ctx->range_total > 0) fetch_status.total_size = ctx->range_total;
+    xSemaphoreGive(fetch_lock);
+
+    // A fully read range leaves the connection reusable for the next one, a streamed response stays open until its end.
+    bool stream_on = ctx->streaming && !complete && read >= 0 && received == AIRHIVE_FETCH_CHUNK_SIZE;
+    if(!stream_on && (http_status != 206 || !complete))
+    {
+        esp_http_client_close(ctx->client);
+        ctx->streaming = false;
+    }
+    if(read < 0 || (received < AIRHIVE_FETCH_CHUNK_SIZE && !complete)) return ESP_FAIL;  // Dropped mid-body.
+    if(ctx->range_total > 0) ctx->eof = ctx->offset >= ctx->range_total;
+    else ctx->eof = received < AIRHIVE_FETCH_CHUNK_SIZE;
+    return ESP_OK;
+}
+
+// Queues a line in the job, waiting while the tx_queue is full. Returns ESP_ERR_INVALID_STATE if the job is over or
+// the fetch was cancelled.
+static esp_err_t fetch_line_enqueue(fetch_ctx_t* ctx, const char* line)
+{
+    bool waited = false;
+    while(!fetch_stop)
+    {
+        esp_err_t ret = cncm_job_append(ctx->job_id, line);
+        if(ret == ESP_OK)
+        {
+            xSemaphoreTake(fetch_lock, portMAX_DELAY);
+            fetch_status.lines++;
+            if(waited) fetch_status.full_waits++;
+            xSemaphoreGive(fetch_lock);
+            return ESP_OK;
+        }
+        if(ret == ESP_ERR_NOT_FOUND || ret == ESP_ERR_INVALID_STATE) return ESP_ERR_INVALID_STATE;
+        if(ret != ESP_ERR_NO_MEM)
+        {
+            ESP_LOGE(TAG, "Failed to queue line %s, error: %s", line, esp_err_to_name(ret));
+            return ret;
+        }
+        waited = true;
+        fetch_wait(AIRHIVE_FETCH_POLL_MS);
+    }
+    return ESP_ERR_INVALID_STATE;
+}
+
+// Takes the next line out of the buffer into line, without its comment and surrounding whitespace, which may leave it
+// empty. Returns false if there is no complete line yet.
+static bool fetch_line_take(fetch_ctx_t* ctx, char* line, size_t* line_len)
+{
+    char* begin = ctx->buffer + ctx->start;
+    size_t pending = ctx->len - ctx->start;
+    char* newline = memchr(begin, '\n', pending);
+    if(newline == NULL && (!ctx->eof || pending == 0)) return false;
+    size_t raw_len = (newline != NULL) ? (size_t)(newline - begin) : pending;
+    ctx->start += raw_len + ((newline != NULL) ? 1 : 0);
+
+    char* comment = memchr(begin, ';', raw_len);
+    if(comment != NULL) raw_len = comment - begin;
+    while(raw_len > 0 && (begin[raw_len - 1] == '\r' || begin[raw_len - 1] == ' ' || begin[raw_len - 1] == '\t')) raw_len--;
+    while(raw_len > 0 && (begin[0] == ' ' || begin[0] == '\t'))
+    {
+        begin++;
+        raw_len--;
+    }
+    *line_len = raw_len;
+    if(raw_len <= CNCM_MAX_COMMAND_SIZE)
+    {
+        memcpy(line, begin, raw_len);
+        line[raw_len] = '\0';
+    }
+    return true;
+}
+
+// Feeds the job, or the SD card, until the file is queued, it fails or it's cancelled. Lines are queued while a failed
+// request waits for its retry, so the machine keeps going through short outages.
+static airhive_fetch_state_t fetch_run(fetch_ctx_t* ctx)
+{
+    static char line[CNCM_MAX_COMMAND_SIZE + 1];
+    uint32_t failures = 0;
+    uint32_t retry_delay_ms = AIRHIVE_FETCH_RETRY_MIN_MS;
+    int64_t retry_at_us = 0;
+    while(!fetch_stop)
+    {
+        bool can_fetch = !ctx->eof && ctx->len - ctx->start + AIRHIVE_FETCH_CHUNK_SIZE <= AIRHIVE_FETCH_BUFFER_SIZE;
+        if(can_fetch && esp_timer_get_time() >= retry_at_us)
+        {
+            memmove(ctx->buffer, ctx->buffer + ctx->start, ctx->len - ctx->start);
+            ctx->len -= ctx->start;
+            ctx->start = 0;
+            esp_err_t ret = fetch_range(ctx);
+            if(ret == ESP_OK)
+            {
+                failures = 0;
+                retry_delay_ms = AIRHIVE_FETCH_RETRY_MIN_MS;
+                continue;
+            }
+            fetch_status_set_error(0, ret);
+            if(ret == ESP_ERR_INVALID_RESPONSE || ++failures > AIRHIVE_FETCH_MAX_RETRIES) return AIRHIVE_FETCH_FAILED;
+            ESP_LOGW(TAG, "Request failed (%s), retrying from byte %" PRIu64 " in %" PRIu32 " ms.",
+                     esp_err_to_name(ret), ctx->offset, retry_delay_ms);
+            xSemaphoreTake(fetch_lock, portMAX_DELAY);
+            fetch_status.retries++;
+            xSemaphoreGive(fetch_lock);
+            retry_at_us = esp_timer_get_time() + retry_delay_ms * 1000LL;
+            retry_delay_ms = MIN(retry_delay_ms * 2, AIRHIVE_FETCH_RETRY_MAX_MS);
+            continue;
+        }
+
+        if(ctx->to_sd && ctx->start < ctx->len)
+        {
+            esp_err_t ret = cncm_sd_transfer_write((const uint8_t*)ctx->buffer + ctx->start, ctx->len - ctx->start);
+            if(ret != ESP_OK)
+            {
+                fetch_status_set_error(0, ret);
+                return AIRHIVE_FETCH_FAILED;
+            }
+            ctx->start = ctx->len;
+            continue;
+        }
+        size_t line_len;
+        if(!ctx->to_sd && fetch_line_take(ctx, line, &line_len))
+        {
+            if(line_len > CNCM_MAX_COMMAND_SIZE)
+            {
+                ESP_LOGE(TAG, "Line longer than %d bytes at byte %" PRIu64 ".", CNCM_MAX_COMMAND_SIZE, ctx->offset);
+                fetch_status_set_error(0, ESP_ERR_INVALID_SIZE);
+                return AIRHIVE_FETCH_FAILED;
+            }
+            if(line_len == 0) continue;
+            esp_err_t ret = fetch_line_enqueue(ctx, line);
+            if(ret == ESP_ERR_INVALID_STATE) return AIRHIVE_FETCH_CANCELLED;
+            if(ret != ESP_OK)
+            {
+                fetch_status_set_error(0, ret);
+                return AIRHIVE_FETCH_FAILED;
+            }
+            continue;
+        }
+        if(ctx->eof) return AIRHIVE_FETCH_DONE;
+        if(!can_fetch)
+        {
+            ESP_LOGE(TAG, "No line end in %d bytes at byte %" PRIu64 ".", AIRHIVE_FETCH_BUFFER_SIZE, ctx->offset);
+            fetch_status_set_error(0, ESP_ERR_INVALID_SIZE);
+            return AIRHIVE_FETCH_FAILED;
+        }
+        // Everything fetched is queued, nothing to do until the retry is due.
+        fetch_wait((uint32_t)MAX(1, (retry_at_us - esp_timer_get_time()) / 1000));
+    }
+    return AIRHIVE_FETCH_CANCELLED;
+}
+
+static void fetch_task(void* arg)
+{
+    fetch_ctx_t ctx = { 0 };
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    ctx.job_id = fetch_status.job_id;
+    ctx.to_sd = fetch_status.to_sd;
+    char filename[AIRHIVE_FETCH_MAX_FILENAME_SIZE];
+    strcpy(filename, fetch_status.filename);
+    bool print = fetch_status.print;
+    esp_http_client_config_t config = {
+        .url = fetch_status.url,
+        .event_handler = fetch_event_handler,
+        .user_data = &ctx,
+        .timeout_ms = AIRHIVE_FETCH_TIMEOUT_MS,
+        .keep_alive_enable = true,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+    };
+    ctx.client = esp_http_client_init(&config);    // Copies the URL.
+    xSemaphoreGive(fetch_lock);
+    ctx.buffer = malloc(AIRHIVE_FETCH_BUFFER_SIZE);
+
+    airhive_fetch_state_t state = AIRHIVE_FETCH_FAILED;
+    if(ctx.client == NULL || ctx.buffer == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate the HTTP client or the buffer.");
+        fetch_status_set_error(0, ESP_ERR_NO_MEM);
+    }
+    else if(ctx.to_sd)
+    {
+        // Connects before the first request, the drain and the handshake take a while.
+        esp_err_t ret = cncm_sd_transfer_begin(filename);
+        if(ret != ESP_OK) fetch_status_set_error(0, ret);
+        else state = fetch_run(&ctx);
+    }
+    else state = fetch_run(&ctx);
+
+    if(ctx.to_sd)
+    {
+        if(state == AIRHIVE_FETCH_DONE)
+        {
+            esp_err_t ret = cncm_sd_transfer_end(print);
+            if(ret != ESP_OK)
+            {
+                fetch_status_set_error(0, ret);
+                state = AIRHIVE_FETCH_FAILED;
+            }
+        }
+        else cncm_sd_transfer_abort();  // Fails harmlessly if a failed write already ended the transfer.
+    }
+    else if(state == AIRHIVE_FETCH_DONE)
+    {
+        // The lines arc fitting still holds are queued as the tx_queue drains.
+        while(cncm_job_close(ctx.job_id) == ESP_ERR_NO_MEM) fetch_wait(AIRHIVE_FETCH_POLL_MS);
+    }
+    else cncm_job_cancel(ctx.job_id);  // Fails harmlessly if the job was already cancelled.
+    if(ctx.client != NULL) esp_http_client_cleanup(ctx.client);
+    free(ctx.buffer);
+    if(ctx.to_sd) ESP_LOGI(TAG, "Copy to %s %s at byte %" PRIu64 ".", filename, airhive_fetch_state_name(state), ctx.offset);
+    else ESP_LOGI(TAG, "Fetch of job %" PRIu32 " %s at byte %" PRIu64 ".", ctx.job_id, airhive_fetch_state_name(state), ctx.offset);
+
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    fetch_status.state = state;
+    fetch_task_hdl = NULL;      // Decided under the lock, so airhive_fetch_start() knows it can start a new task.
+    xSemaphoreGive(fetch_lock);
+    vTaskDelete(NULL);
+}
+
+esp_err_t airhive_fetch_init()
+{
+    fetch_lock = xSemaphoreCreateMutex();
+    return (fetch_lock == NULL) ? ESP_ERR_NO_MEM : ESP_OK;
+}
+
+// Writes the last segment of the URL path, without the query, as the job name.
+static void fetch_default_name(const char* url, char* name, size_t name_size)
+{
+    const char* path = strstr(url, "://") + 3;
+    size_t path_len = strcspn(path, "?#");
+    const char* segment = path;
+    for(size_t i = 0; i < path_len; i++)
+    {
+        if(path[i] == '/' && i + 1 < path_len) segment = path + i + 1;
+    }
+    size_t segment_len = strcspn(segment, "/?#");
+    snprintf(name, name_size, "%.*s", (int)segment_len, segment);
+}
+
+static bool fetch_url_valid(const char* url)
+{
+    size_t url_len = strlen(url);
+    size_t scheme_len = (strncmp(url, "http://", 7) == 0) ? 7 : (strncmp(url, "https://", 8) == 0) ? 8 : 0;
+    return scheme_len > 0 && url_len > scheme_len && url_len < AIRHIVE_FETCH_MAX_URL_SIZE;
+}
+
+// Starts fetch_task on fetch_status, which the caller filled in, with fetch_lock held.
+static esp_err_t fetch_task_create()
+{
+    fetch_stop = false;
+    if(xTaskCreate(fetch_task, "fetch_task", AIRHIVE_FETCH_STACK_SIZE, NULL, ESP_TASK_MAIN_PRIO, &fetch_task_hdl) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create fetch task.");
+        fetch_task_hdl = NULL;
+        fetch_status.state = AIRHIVE_FETCH_FAILED;
+        fetch_status.last_error = ESP_ERR_NO_MEM;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t airhive_fetch_start(const char* url, const char* name, uint32_t* job_id)
+{
+    if(fetch_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(!fetch_url_valid(url)) return ESP_ERR_INVALID_ARG;
+
+    char default_name[CNCM_MAX_JOB_NAME_SIZE + 1];
+    if(name == NULL)
+    {
+        fetch_default_name(url, default_name, sizeof(default_name));
+        name = default_name;
+    }
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    if(fetch_task_hdl != NULL) ret = ESP_ERR_INVALID_STATE;
+    else ret = cncm_job_create(name, job_id);
+    if(ret == ESP_OK)
+    {
+        memset(&fetch_status, 0, sizeof(fetch_status));
+        fetch_status.state = AIRHIVE_FETCH_RUNNING;
+        strcpy(fetch_status.url, url);
+        fetch_status.job_id = *job_id;
+        ret = fetch_task_create();
+        if(ret != ESP_OK) cncm_job_cancel(*job_id);
+    }
+    xSemaphoreGive(fetch_lock);
+    if(ret == ESP_OK) ESP_LOGI(TAG, "Fetching %s as job %" PRIu32 ".", url, *job_id);
+    return ret;
+}
+
+esp_err_t airhive_fetch_start_sd(const char* url, const char* filename, bool print)
+{
+    if(fetch_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(!fetch_url_valid(url) || filename == NULL) return ESP_ERR_INVALID_ARG;
+    size_t filename_len = strlen(filename);
+    if(filename_len == 0 || filename_len > MIN(CNCM_SD_MAX_FILENAME_SIZE, AIRHIVE_FETCH_MAX_FILENAME_SIZE - 1)) return ESP_ERR_INVALID_ARG;
+
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    if(fetch_task_hdl != NULL) ret = ESP_ERR_INVALID_STATE;
+    else
+    {
+        memset(&fetch_status, 0, sizeof(fetch_status));
+        fetch_status.state = AIRHIVE_FETCH_RUNNING;
+        strcpy(fetch_status.url, url);
+        fetch_status.to_sd = true;
+        strcpy(fetch_status.filename, filename);
+        fetch_status.print = print;
+        ret = fetch_task_create();
+    }
+    xSemaphoreGive(fetch_lock);
+    if(ret == ESP_OK) ESP_LOGI(TAG, "Copying %s to %s on the SD card.", url, filename);
+    return ret;
+}
+
+esp_err_t airhive_fetch_cancel()
+{
+    if(fetch_lock == NULL) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    if(fetch_task_hdl == NULL || fetch_status.state != AIRHIVE_FETCH_RUNNING) ret = ESP_ERR_INVALID_STATE;
+    else
+    {
+        fetch_stop = true;
+        xTaskNotifyGive(fetch_task_hdl);    // Cuts a wait short, a request in progress ends on its own timeout.
+        if(!fetch_status.to_sd) cncm_job_cancel(fetch_status.job_id);
+    }
+    xSemaphoreGive(fetch_lock);
+    return ret;
+}
+
+esp_err_t airhive_fetch_get_status(airhive_fetch_status_t* status)
+{
+    if(fetch_lock == NULL) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(fetch_lock, portMAX_DELAY);
+    *status = fetch_status;
+    xSemaphoreGive(fetch_lock);
+    return ESP_OK;
+}
+
+bool airhive_fetch_is_running()
+{
+    return fetch_task_hdl != NULL;
+}
+
+const char* airhive_fetch_state_name(airhive_fetch_state_t state)
+{
+    switch(state)
+    {
+        case AIRHIVE_FETCH_IDLE: return "idle";
+        case AIRHIVE_FETCH_RUNNING: return "running";
+        case AIRHIVE_FETCH_DONE: return "done";
+        case AIRHIVE_FETCH_FAILED: return "failed";
+        case AIRHIVE_FETCH_CANCELLED: return "cancelled";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,89 @@
+#include "esp_err.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+#define AIRHIVE_FETCH_STACK_SIZE (6144)
+#define AIRHIVE_FETCH_MAX_URL_SIZE (256)
+#define AIRHIVE_FETCH_MAX_FILENAME_SIZE (64)    // Holds CNCM_SD_MAX_FILENAME_SIZE and its terminator.
+#define AIRHIVE_FETCH_CHUNK_SIZE (4096)     // Bytes asked for by each Range request.
+#define AIRHIVE_FETCH_BUFFER_SIZE (2 * AIRHIVE_FETCH_CHUNK_SIZE)    // Lines fetched and not queued yet, at most.
+#define AIRHIVE_FETCH_POLL_MS (10)          // How often a full tx_queue is retried.
+#define AIRHIVE_FETCH_TIMEOUT_MS (10000)    // Per request.
+#define AIRHIVE_FETCH_MAX_RETRIES (10)      // Consecutive failed requests before giving up.
+#define AIRHIVE_FETCH_RETRY_MIN_MS (500)    // Doubled after every failed request, up to AIRHIVE_FETCH_RETRY_MAX_MS.
+#define AIRHIVE_FETCH_RETRY_MAX_MS (8000)
+
+typedef enum {
+    AIRHIVE_FETCH_IDLE = 0,     // Nothing fetched since boot.
+    AIRHIVE_FETCH_RUNNING,
+    AIRHIVE_FETCH_DONE,         // The whole file was queued and the job closed, or written to the SD card.
+    AIRHIVE_FETCH_FAILED,       // The server kept failing or sent something unusable, the job was cancelled.
+    AIRHIVE_FETCH_CANCELLED     // By airhive_fetch_cancel(), or the job was cancelled or cleared.
+} airhive_fetch_state_t;
+
+typedef struct {
+    airhive_fetch_state_t state;
+    char url[AIRHIVE_FETCH_MAX_URL_SIZE];
+    bool to_sd;                 // Copied to the SD card by airhive_fetch_start_sd() instead of queued as a job.
+    char filename[AIRHIVE_FETCH_MAX_FILENAME_SIZE];  // On the SD card, empty for a job.
+    bool print;                 // Printing from the SD card once the copy is done.
+    uint32_t job_id;            // 0 for a copy to the SD card.
+    uint64_t offset;            // Bytes of the file received so far, the next request starts there.
+    uint64_t total_size;        // From Content-Range, 0 if the server didn't say.
+    uint32_t lines;             // Lines queued in the job.
+    uint32_t requests;          // Range requests sent, retries included.
+    uint32_t retries;           // Requests that failed and were sent again from the last offset.
+    uint32_t full_waits;        // Times a line waited for room in the tx_queue.
+    int last_http_status;       // 0 if no answer was read.
+    esp_err_t last_error;       // Of the last failed request, ESP_OK if none failed.
+} airhive_fetch_status_t;
+
+/**
+ * @brief Creates the lock guarding the fetch status, called once at boot.
+ * @return ESP_ERR_NO_MEM if it couldn't be created, ESP_OK otherwise.
+ */
+esp_err_t airhive_fetch_init();
+
+/**
+ * @brief Creates a job and starts pulling its lines from url with HTTP Range requests, in the background.
+ * The file is read AIRHIVE_FETCH_CHUNK_SIZE bytes at a time, at most AIRHIVE_FETCH_BUFFER_SIZE bytes ahead of the
+ * tx_queue, so it is fetched only as fast as the machine drains it. Empty lines and ';' comments are skipped. A
+ * dropped connection is retried from the last offset received, the job is closed once the whole file is queued.
+ * @param url [IN] http:// or https:// URL of the G-code file.
+ * @param name [IN] label of the job, the last segment of the URL path if NULL.
+ * @param job_id [OUT] id of the new job.
+ * @return ESP_ERR_INVALID_ARG if the URL is malformed or too long.
+ * @return ESP_ERR_INVALID_STATE if a fetch is already running.
+ * @return error codes of cncm_job_create(), or ESP_ERR_NO_MEM if the task couldn't be created, ESP_OK otherwise.
+ */
+esp_err_t airhive_fetch_start(const char* url, const char* name, uint32_t* job_id);
+
+/**
+ * @brief Copies the file at url to the printer's SD card with cncm_sd_transfer_begin(), in the background. The file is
+ * fetched as by airhive_fetch_start() but written as is, comments included, at the speed of the USB link. The progress
+ * is in airhive_fetch_get_status(), the packet counters and throughput in cncm_sd_transfer_get_stats().
+ * @param url [IN] http:// or https:// URL of the G-code file.
+ * @param filename [IN] name of the file on the SD card.
+ * @param print [IN] start printing it once it's copied.
+ * @return ESP_ERR_INVALID_ARG if the URL is malformed or too long, or the filename empty or too long.
+ * @return ESP_ERR_INVALID_STATE if a fetch is already running.
+ * @return ESP_ERR_NO_MEM if the task couldn't be created, ESP_OK otherwise. The transfer itself starts in the task,
+ * its errors are in last_error.
+ */
+esp_err_t airhive_fetch_start_sd(const char* url, const char* filename, bool print);
+
+/**
+ * @brief Stops the running fetch and cancels its job, lines already sent to the machine aren't undone. A copy to the SD
+ * card is aborted and the partial file deleted.
+ * @return ESP_ERR_INVALID_STATE if no fetch is running, ESP_OK otherwise.
+ */
+esp_err_t airhive_fetch_cancel();
+
+/**
+ * @brief Gets the state and counters of the running fetch, or of the last one.
+ */
+esp_err_t airhive_fetch_get_status(airhive_fetch_status_t* status);
+
+bool airhive_fetch_is_running();
+
+const char* airhive_fetch_state_name(airhive_fetch_state_t state);
@@ -6,11 +6,24 @@
 #include "esp_smartconfig.h"
 #include "string.h"
 #include "nvs_flash.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "esp_mac.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 static const char* TAG = "Airhive-Networking";
 static const char* airhive_namespace = "Airhive";
 static nvs_handle_t airhive_nvs;
 static bool sc_button_pressed = false;
+static uint32_t cached_ap_failures = 0;    // Failed attempts on the cached BSSID/channel since the last success.
+static airhive_wifi_stats_t wifi_stats;
+
+// Power save policy: WIFI_PS_NONE while anything is going on, modem sleep once idle for power_save_idle_s.
+static SemaphoreHandle_t ps_lock;   // Guards the power save fields of wifi_stats and the ones below.
+static int64_t last_activity_us = 0;
+static int64_t ps_entered_at_us = 0;
+static bool (*ps_busy_check)() = NULL;
 
 ESP_EVENT_DEFINE_BASE(AIRHIVE_EVENT);
 
@@ -41,6 +54,190 @@ static wifi_config_t wifi_cfg = {
     }
 };  // TODO: take a look at the other fields in wifi_config_t, see if we need to set them.
 
+// The AP we last got an IP from, tried first so that (re)connecting doesn't need a scan.
+// The DHCP lease itself is restored by lwIP (CONFIG_LWIP_DHCP_RESTORE_LAST_IP), which asks for the last address directly.
+static void wifi_cached_ap_load()
+{
+    uint8_t channel = 0;
+    size_t bssid_len = sizeof(wifi_cfg.sta.bssid);
+    if(nvs_get_u8(airhive_nvs, "wifi_chan", &channel) == ESP_OK &&
+       nvs_get_blob(airhive_nvs, "wifi_bssid", wifi_cfg.sta.bssid, &bssid_len) == ESP_OK &&
+       bssid_len == sizeof(wifi_cfg.sta.bssid) && channel != 0)
+    {
+        ESP_LOGI(TAG, "Trying cached AP " MACSTR " on channel %u first.", MAC2STR(wifi_cfg.sta.bssid), channel);
+        wifi_cfg.sta.bssid_set = true;
+        wifi_cfg.sta.channel = channel;
+    }
+    else
+    {
+        wifi_cfg.sta.bssid_set = false;
+        wifi_cfg.sta.channel = 0;
+    }
+    cached_ap_failures = 0;
+}
+
+static void wifi_cached_ap_store(const uint8_t* bssid, uint8_t channel)
+{
+    if(wifi_cfg.sta.bssid_set && wifi_cfg.sta.channel == channel && memcmp(wifi_cfg.sta.bssid, bssid, sizeof(wifi_cfg.sta.bssid)) == 0)
+    {
+        return; // Already cached, don't wear the flash.
+    }
+    esp_err_t ret = nvs_set_blob(airhive_nvs, "wifi_bssid", bssid, sizeof(wifi_cfg.sta.bssid));
+    if(ret == ESP_OK) ret = nvs_set_u8(airhive_nvs, "wifi_chan", channel);
+    if(ret == ESP_OK) ret = nvs_commit(airhive_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error caching AP: %s", esp_err_to_name(ret));
+        return;
+    }
+    memcpy(wifi_cfg.sta.bssid, bssid, sizeof(wifi_cfg.sta.bssid));
+    wifi_cfg.sta.channel = channel;
+    wifi_cfg.sta.bssid_set = true;
+    ESP_LOGI(TAG, "Cached AP " MACSTR " on channel %u.", MAC2STR(bssid), channel);
+}
+
+// Forget the cached AP and go back to a full scan, e.g. the AP moved to another channel or was replaced.
+static void wifi_cached_ap_drop()
+{
+    ESP_LOGI(TAG, "Dropping cached AP, falling back to a full scan.");
+    wifi_cfg.sta.bssid_set = false;
+    wifi_cfg.sta.channel = 0;
+    cached_ap_failures = 0;
+    nvs_erase_key(airhive_nvs, "wifi_bssid");
+    nvs_erase_key(airhive_nvs, "wifi_chan");
+    nvs_commit(airhive_nvs);
+    esp_err_t ret = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_cfg);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error setting wifi config: %s.", esp_err_to_name(ret));
+    }
+}
+
+// Applies the static IP stored in NVS if any, otherwise makes sure DHCP is running.
+static esp_err_t wifi_ip_mode_apply()
+{
+    esp_netif_t* netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    if(netif == NULL)
+    {
+        ESP_LOGE(TAG, "WiFi station netif was not created.");
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_netif_ip_info_t ip_info;
+    size_t ip_info_len = sizeof(ip_info);
+    esp_err_t ret = nvs_get_blob(airhive_nvs, "static_ip", &ip_info, &ip_info_len);
+    if(ret == ESP_ERR_NVS_NOT_FOUND || (ret == ESP_OK && ip_info_len != sizeof(ip_info)))
+    {
+        esp_netif_dhcpc_start(netif);   // Fails harmlessly if it's already running.
+        return ESP_OK;
+    }
+    else if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error reading static IP: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    esp_netif_dhcpc_stop(netif);    // Fails harmlessly if it's already stopped.
+    ret = esp_netif_set_ip_info(netif, &ip_info);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error setting static IP: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    esp_netif_dns_info_t dns_info = {
+        .ip.u_addr.ip4.addr = ip_info.gw.addr,
+        .ip.type = ESP_IPADDR_TYPE_V4
+    };
+    esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns_info);
+    ESP_LOGI(TAG, "Using static IP " IPSTR ".", IP2STR(&ip_info.ip));
+    return ESP_OK;
+}
+
+// Must be called with ps_lock taken.
+static void wifi_ps_wake(int64_t activity_at_us)
+{
+    last_activity_us = activity_at_us;
+    if(!wifi_stats.power_save) return;
+    esp_err_t ret = esp_wifi_set_ps(WIFI_PS_NONE);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error leaving modem sleep: %s", esp_err_to_name(ret));
+        return;
+    }
+    int64_t wakeup_us = esp_timer_get_time() - activity_at_us;
+    wifi_stats.power_save = false;
+    wifi_stats.power_save_total_us += activity_at_us - ps_entered_at_us;
+    wifi_stats.wakeups++;
+    wifi_stats.last_wakeup_us = wakeup_us;
+    if(wakeup_us > wifi_stats.max_wakeup_us) wifi_stats.max_wakeup_us = wakeup_us;
+    ESP_LOGI(TAG, "Left modem sleep after %lld s in %lld us.", (activity_at_us - ps_entered_at_us) / 1000000, wakeup_us);
+}
+
+static void wifi_ps_check()
+{
+    bool busy = sc_button_pressed || (ps_busy_check != NULL && ps_busy_check());
+    xSemaphoreTake(ps_lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    if(busy) wifi_ps_wake(now);
+    else if(!wifi_stats.power_save && wifi_stats.power_save_idle_s != 0 &&
+            now - last_activity_us >= wifi_stats.power_save_idle_s * 1000000LL)
+    {
+        esp_err_t ret = esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+        if(ret == ESP_OK)
+        {
+            wifi_stats.power_save = true;
+            ps_entered_at_us = now;
+            ESP_LOGI(TAG, "Idle for %" PRIu32 " s, entering modem sleep.", wifi_stats.power_save_idle_s);
+        }
+        else ESP_LOGE(TAG, "Error entering modem sleep: %s", esp_err_to_name(ret));
+    }
+    xSemaphoreGive(ps_lock);
+}
+
+// The busy check takes CNCM's locks and esp_wifi_set_ps() can block, so the policy runs in its own task rather than
+// in an esp_timer callback, which would stall every other timer meanwhile.
+static void wifi_ps_task(void* arg)
+{
+    TickType_t last_wake = xTaskGetTickCount();
+    while(true)
+    {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(AIRHIVE_PS_CHECK_PERIOD_MS));
+        wifi_ps_check();
+    }
+}
+
+// Power save off and the idle period restarted, for (re)starting the station or SmartConfig.
+static void wifi_ps_reset()
+{
+    xSemaphoreTake(ps_lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    if(wifi_stats.power_save) wifi_stats.power_save_total_us += now - ps_entered_at_us;
+    wifi_stats.power_save = false;
+    last_activity_us = now;
+    esp_wifi_set_ps(WIFI_PS_NONE); // Otherwise very poor performance.
+    xSemaphoreGive(ps_lock);
+}
+
+static esp_err_t wifi_ps_init()
+{
+    ps_lock = xSemaphoreCreateMutex();
+    if(ps_lock == NULL) return ESP_ERR_NO_MEM;
+    wifi_stats.power_save_idle_s = AIRHIVE_PS_DEFAULT_IDLE_S;
+    nvs_get_u32(airhive_nvs, "ps_idle_s", &wifi_stats.power_save_idle_s);  // Keeps the default if not stored.
+    last_activity_us = esp_timer_get_time();
+    if(xTaskCreate(wifi_ps_task, "wifi_ps", AIRHIVE_PS_STACK_SIZE, NULL, ESP_TASK_MAIN_PRIO, NULL) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Error creating power save task.");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t wifi_connect()
+{
+    wifi_stats.connect_started_us = esp_timer_get_time();
+    wifi_stats.used_cached_ap = wifi_cfg.sta.bssid_set;
+    return esp_wifi_connect();
+}
+
 static esp_err_t airhive_wifi_sta_start()
 {
     size_t temp_len = sizeof(wifi_cfg.sta.ssid);
@@ -76,6 +273,10 @@ static esp_err_t airhive_wifi_sta_start()
     }
     ESP_LOGI(TAG, "WiFi credentials retreival ended.");
 
+    wifi_cached_ap_load();
+    ret = wifi_ip_mode_apply();
+    if(ret != ESP_OK) return ret;
+
     ret = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_cfg);
     if(ret != ESP_OK)
     {
@@ -84,7 +285,7 @@ static esp_err_t airhive_wifi_sta_start()
     }
     ESP_LOGI(TAG, "WiFi station configuration set successfully.");
 
-    esp_wifi_set_ps(WIFI_PS_NONE); // Disable power save mode, otherwise very poor performance.
+    wifi_ps_reset();
 
     ret = esp_wifi_start();
     if(ret != ESP_OK)
@@ -93,7 +294,7 @@ static esp_err_t airhive_wifi_sta_start()
         return ret;
     }
 
-    ret = esp_wifi_connect();
+    ret = wifi_connect();
     if(ret != ESP_OK)
     {
         ESP_LOGE(TAG, "Error starting connection process to AP %s: %s", wifi_cfg.sta.ssid, esp_err_to_name(ret));
@@ -112,7 +313,8 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
         {
             ESP_LOGI(TAG, "Retrying to connect to the AP with SSID: %s ...", wifi_cfg.sta.ssid);
             gpio_set_level(AIRHIVE_WIFI_CONNECTED_LED, 0); // Turn off the connected LED.
-            ret = esp_wifi_connect();
+            if(wifi_cfg.sta.bssid_set && ++cached_ap_failures >= AIRHIVE_CACHED_AP_MAX_FAILURES) wifi_cached_ap_drop();
+            ret = wifi_connect();
             if(ret != ESP_OK)
             {
                 ESP_LOGE(TAG, "Error in esp_wifi_connect() in event handlers: %s", esp_err_to_name(ret));
@@ -126,10 +328,17 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
     {
         ESP_LOGI(TAG, "WiFi station connected to AP with SSID: %s", wifi_cfg.sta.ssid);
+        wifi_event_sta_connected_t* evt = (wifi_event_sta_connected_t*)event_data;
+        cached_ap_failures = 0;
+        wifi_cached_ap_store(evt->bssid, evt->channel);
     }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
-        ESP_LOGI(TAG, "WiFi station got IP address.");
+        int64_t now = esp_timer_get_time();
+        wifi_stats.last_time_to_ip_us = now - wifi_stats.connect_started_us;
+        if(wifi_stats.first_ip_at_us == 0) wifi_stats.first_ip_at_us = now;
+        ESP_LOGI(TAG, "WiFi station got IP address in %lld ms (%s AP, %lld ms since boot).", wifi_stats.last_time_to_ip_us / 1000,
+                 wifi_stats.used_cached_ap ? "cached" : "scanned", now / 1000);
         gpio_set_level(AIRHIVE_WIFI_CONNECTED_LED, 1); // Turn on the connected LED.
     }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_LOST_IP)
@@ -156,7 +365,7 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
             .esp_touch_v2_enable_crypt = true,
             .esp_touch_v2_key = AIRHIVE_ESP_TOUCH_V2_KEY
         };
-        esp_wifi_set_ps(WIFI_PS_NONE); // Disable power save mode, otherwise very poor performance.
+        wifi_ps_reset();
         ret = esp_wifi_start();
         if(ret != ESP_OK)
         {
@@ -202,6 +411,11 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
 
         ESP_LOGI(TAG, "New WiFi credentials storage ended.");
 
+        // The cached AP belongs to the old network.
+        nvs_erase_key(airhive_nvs, "wifi_bssid");
+        nvs_erase_key(airhive_nvs, "wifi_chan");
+        nvs_commit(airhive_nvs);
+
         sc_button_pressed = false;
 
         ret = airhive_wifi_sta_start();
@@ -322,6 +536,9 @@ esp_err_t airhive_wifi_sta_init()
         return ret;
     }
 
+    ret = wifi_ps_init();
+    if(ret != ESP_OK) return ret;
+
     ret = airhive_wifi_sta_start();
     if(ret != ESP_OK)
     {
@@ -332,3 +549,60 @@ esp_err_t airhive_wifi_sta_init()
     ESP_LOGI(TAG, "WiFi station started successfully.");
     return ESP_OK;
 }
+
+esp_err_t airhive_wifi_set_static_ip(const esp_netif_ip_info_t* ip_info)
+{
+    esp_err_t ret = (ip_info == NULL) ? nvs_erase_key(airhive_nvs, "static_ip") : nvs_set_blob(airhive_nvs, "static_ip", ip_info, sizeof(*ip_info));
+    if(ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND)
+    {
+        ESP_LOGE(TAG, "Error storing static IP: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    ret = nvs_commit(airhive_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error committing static IP: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    return wifi_ip_mode_apply();
+}
+
+void airhive_wifi_note_activity()
+{
+    if(ps_lock == NULL) return;
+    xSemaphoreTake(ps_lock, portMAX_DELAY);
+    wifi_ps_wake(esp_timer_get_time());
+    xSemaphoreGive(ps_lock);
+}
+
+void airhive_wifi_set_busy_check(bool (*busy_check)())
+{
+    ps_busy_check = busy_check;
+}
+
+esp_err_t airhive_wifi_set_ps_idle_timeout(uint32_t idle_s)
+{
+    if(ps_lock == NULL) return ESP_ERR_INVALID_STATE;
+    esp_err_t ret = nvs_set_u32(airhive_nvs, "ps_idle_s", idle_s);
+    if(ret == ESP_OK) ret = nvs_commit(airhive_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error storing power save idle time: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    xSemaphoreTake(ps_lock, portMAX_DELAY);
+    wifi_stats.power_save_idle_s = idle_s;
+    if(idle_s == 0) wifi_ps_wake(esp_timer_get_time());
+    xSemaphoreGive(ps_lock);
+    return ESP_OK;
+}
+
+esp_err_t airhive_wifi_get_stats(airhive_wifi_stats_t* stats)
+{
+    if(stats == NULL) return ESP_ERR_INVALID_ARG;
+    if(ps_lock != NULL) xSemaphoreTake(ps_lock, portMAX_DELAY);
+    *stats = wifi_stats;
+    if(stats->power_save) stats->power_save_total_us += esp_timer_get_time() - ps_entered_at_us;
+    if(ps_lock != NULL) xSemaphoreGive(ps_lock);
+    return ESP_OK;
+}
@@ -1,14 +1,62 @@
 #include "esp_err.h"
+#include "esp_netif.h"
 
 #define AIRHIVE_ESP_TOUCH_V2_KEY "1ARTE67890kgit56"
 #define AIRHIVE_SMART_CONFIG_TRIG GPIO_NUM_38
 #define AIRHIVE_WIFI_CONNECTED_LED GPIO_NUM_35
 #define AIRHIVE_SMART_CONFIG_LED GPIO_NUM_36    // TODO: correct pin numbers.
+#define AIRHIVE_CACHED_AP_MAX_FAILURES (2)  // Failed connects on the cached BSSID/channel before falling back to a full scan.
+#define AIRHIVE_PS_DEFAULT_IDLE_S (300)     // Idle time before modem sleep, 0 never sleeps.
+#define AIRHIVE_PS_CHECK_PERIOD_MS (1000)
+#define AIRHIVE_PS_STACK_SIZE (3072)
 
 typedef enum {
     AIRHIVE_SC_START
 } airhive_event_t;
 
+typedef struct {
+    int64_t connect_started_us;     // When the last connection attempt started.
+    int64_t last_time_to_ip_us;     // From the start of the last connection attempt to getting an IP.
+    int64_t first_ip_at_us;         // Time since boot of the first IP, 0 if not connected yet.
+    bool used_cached_ap;            // Whether the last attempt used the cached BSSID/channel.
+    bool power_save;                // In modem sleep right now.
+    uint32_t power_save_idle_s;     // Idle time before modem sleep, 0 if it never sleeps.
+    uint32_t wakeups;               // Times activity ended a modem sleep.
+    int64_t last_wakeup_us;         // Time taken to leave modem sleep, from the activity to WIFI_PS_NONE being applied.
+    int64_t max_wakeup_us;
+    int64_t power_save_total_us;    // Time spent in modem sleep since boot.
+} airhive_wifi_stats_t;
+
 ESP_EVENT_DECLARE_BASE(AIRHIVE_EVENT);
 
 esp_err_t airhive_wifi_sta_init();
+
+/**
+ * @brief Sets a static IP for the WiFi station, stored persistently and applied immediately.
+ * @param ip_info [IN] address, netmask and gateway (also used as DNS), or NULL to go back to DHCP.
+ * @return NVS or esp_netif error codes, ESP_OK otherwise.
+ */
+esp_err_t airhive_wifi_set_static_ip(const esp_netif_ip_info_t* ip_info);
+
+/**
+ * @brief Reports activity that needs a low latency link (e.g. an HTTP request), leaves modem sleep if it was in it.
+ */
+void airhive_wifi_note_activity();
+
+/**
+ * @brief Sets a function polled every AIRHIVE_PS_CHECK_PERIOD_MS, the station doesn't sleep while it returns true.
+ */
+void airhive_wifi_set_busy_check(bool (*busy_check)());
+
+/**
+ * @brief Sets how long the station has to be idle before it goes to modem sleep, stored persistently.
+ * @param idle_s [IN] seconds, 0 keeps power save off for good.
+ * @return NVS error codes, ESP_OK otherwise.
+ */
+esp_err_t airhive_wifi_set_ps_idle_timeout(uint32_t idle_s);
+
+/**
+ * @brief Gets time-to-IP and power save measurements of the WiFi station.
+ * @return ESP_ERR_INVALID_ARG if stats is NULL, ESP_OK otherwise.
+ */
+esp_err_t airhive_wifi_get_stats(airhive_wifi_stats_t* stats);
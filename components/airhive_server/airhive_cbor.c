@@ -0,0 +1,178 @@
+#include "airhive_cbor.h"
+#include "string.h"
+#include "math.h"
+#include "esp_log.h"
+
+static const char* TAG = "Airhive-cbor";
+
+#define CBOR_MAJOR_UINT     (0 << 5)
+#define CBOR_MAJOR_NEGINT   (1 << 5)
+#define CBOR_MAJOR_BYTES    (2 << 5)
+#define CBOR_MAJOR_TEXT     (3 << 5)
+#define CBOR_MAJOR_ARRAY    (4 << 5)
+#define CBOR_MAJOR_MAP      (5 << 5)
+#define CBOR_MAJOR_SIMPLE   (7 << 5)
+#define CBOR_INDEFINITE     31
+#define CBOR_FALSE          (CBOR_MAJOR_SIMPLE | 20)
+#define CBOR_TRUE           (CBOR_MAJOR_SIMPLE | 21)
+#define CBOR_NULL           (CBOR_MAJOR_SIMPLE | 22)
+#define CBOR_FLOAT32        (CBOR_MAJOR_SIMPLE | 26)
+#define CBOR_FLOAT64        (CBOR_MAJOR_SIMPLE | 27)
+#define CBOR_BREAK          (CBOR_MAJOR_SIMPLE | CBOR_INDEFINITE)
+
+bool airhive_cbor_accepted(httpd_req_t* req)
+{
+    char accept[64];
+    esp_err_t ret = httpd_req_get_hdr_value_str(req, "Accept", accept, sizeof(accept));
+    // A truncated header still holds the start of the list, where clients put their preferred type.
+    if(ret != ESP_OK && ret != ESP_ERR_HTTPD_RESULT_TRUNC) return false;
+    return strstr(accept, AIRHIVE_CBOR_CONTENT_TYPE) != NULL;
+}
+
+void airhive_cbor_start(airhive_cbor_t* enc, httpd_req_t* req)
+{
+    enc->req = req;
+    enc->len = 0;
+    enc->err = ESP_OK;
+    httpd_resp_set_type(req, AIRHIVE_CBOR_CONTENT_TYPE);
+    httpd_resp_set_hdr(req, "Vary", "Accept");
+}
+
+static void cbor_flush(airhive_cbor_t* enc)
+{
+    if(enc->err != ESP_OK || enc->len == 0) return;
+    enc->err = httpd_resp_send_chunk(enc->req, (const char*)enc->buffer, enc->len);
+    if(enc->err != ESP_OK) ESP_LOGE(TAG, "Failed to send chunk, error: %s", esp_err_to_name(enc->err));
+    enc->len = 0;
+}
+
+static void cbor_write(airhive_cbor_t* enc, const uint8_t* data, size_t len)
+{
+    if(enc->err != ESP_OK) return;
+    if(enc->len + len > AIRHIVE_CBOR_BUFFER_SIZE) cbor_flush(enc);
+    if(len > AIRHIVE_CBOR_BUFFER_SIZE)
+    {
+        // Sent as its own chunk instead of being copied through the buffer.
+        if(enc->err == ESP_OK) enc->err = httpd_resp_send_chunk(enc->req, (const char*)data, len);
+        if(enc->err != ESP_OK) ESP_LOGE(TAG, "Failed to send chunk, error: %s", esp_err_to_name(enc->err));
+        return;
+    }
+    if(enc->err != ESP_OK) return;
+    memcpy(enc->buffer + enc->len, data, len);
+    enc->len += len;
+}
+
+// Initial byte and argument in the shortest form, big endian.
+static void cbor_head(airhive_cbor_t* enc, uint8_t major, uint64_t argument)
+{
+    uint8_t head[9];
+    size_t len;
+    if(argument < 24)
+    {
+        head[0] = major | (uint8_t)argument;
+        len = 1;
+    }
+    else
+    {
+        size_t bytes = (argument <= UINT8_MAX) ? 1 : (argument <= UINT16_MAX) ? 2 : (argument <= UINT32_MAX) ? 4 : 8;
+        head[0] = major | ((bytes == 1) ? 24 : (bytes == 2) ? 25 : (bytes == 4) ? 26 : 27);
+        for(size_t i = 0; i < bytes; i++) head[1 + i] = (uint8_t)(argument >> (8 * (bytes - 1 - i)));
+        len = 1 + bytes;
+    }
+    cbor_write(enc, head, len);
+}
+
+static void cbor_byte(airhive_cbor_t* enc, uint8_t byte)
+{
+    cbor_write(enc, &byte, 1);
+}
+
+esp_err_t airhive_cbor_finish(airhive_cbor_t* enc)
+{
+    cbor_flush(enc);
+    if(enc->err != ESP_OK) return enc->err;
+    enc->err = httpd_resp_send_chunk(enc->req, NULL, 0);
+    return enc->err;
+}
+
+void airhive_cbor_map(airhive_cbor_t* enc)
+{
+    cbor_byte(enc, CBOR_MAJOR_MAP | CBOR_INDEFINITE);
+}
+
+void airhive_cbor_array(airhive_cbor_t* enc)
+{
+    cbor_byte(enc, CBOR_MAJOR_ARRAY | CBOR_INDEFINITE);
+}
+
+void airhive_cbor_end(airhive_cbor_t* enc)
+{
+    cbor_byte(enc, CBOR_BREAK);
+}
+
+void airhive_cbor_uint(airhive_cbor_t* enc, uint64_t value)
+{
+    cbor_head(enc, CBOR_MAJOR_UINT, value);
+}
+
+void airhive_cbor_int(airhive_cbor_t* enc, int64_t value)
+{
+    if(value >= 0) cbor_head(enc, CBOR_MAJOR_UINT, (uint64_t)value);
+    else cbor_head(enc, CBOR_MAJOR_NEGINT, (uint64_t)(-1 - value));
+}
+
+void airhive_cbor_double(airhive_cbor_t* enc, double value)
+{
+    if(value == floor(value) && fabs(value) < 9007199254740992.0)  // Integral and exact, 2^53.
+    {
+        airhive_cbor_int(enc, (int64_t)value);
+        return;
+    }
+    uint8_t bytes[9];
+    size_t len;
+    float single = (float)value;
+    if((double)single == value || isnan(value))
+    {
+        uint32_t bits;
+        memcpy(&bits, &single, sizeof(bits));
+        bytes[0] = CBOR_FLOAT32;
+        for(size_t i = 0; i < 4; i++) bytes[1 + i] = (uint8_t)(bits >> (8 * (3 - i)));
+        len = 5;
+    }
+    else
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        bytes[0] = CBOR_FLOAT64;
+        for(size_t i = 0; i < 8; i++) bytes[1 + i] = (uint8_t)(bits >> (8 * (7 - i)));
+        len = 9;
+    }
+    cbor_write(enc, bytes, len);
+}
+
+void airhive_cbor_bool(airhive_cbor_t* enc, bool value)
+{
+    cbor_byte(enc, value ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void airhive_cbor_null(airhive_cbor_t* enc)
+{
+    cbor_byte(enc, CBOR_NULL);
+}
+
+void airhive_cbor_text(airhive_cbor_t* enc, const char* text)
+{
+    airhive_cbor_text_len(enc, text, strlen(text));
+}
+
+void airhive_cbor_text_len(airhive_cbor_t* enc, const char* text, size_t len)
+{
+    cbor_head(enc, CBOR_MAJOR_TEXT, len);
+    cbor_write(enc, (const uint8_t*)text, len);
+}
+
+void airhive_cbor_bytes(airhive_cbor_t* enc, const uint8_t* data, size_t len)
+{
+    cbor_head(enc, CBOR_MAJOR_BYTES, len);
+    cbor_write(enc, data, len);
+}
@@ -0,0 +1,47 @@
+// Streaming CBOR (RFC 8949) encoder writing straight into a chunked HTTP response, used by the GET handlers when the
+// client sends "Accept: application/cbor". Internal to the airhive_server component.
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#define AIRHIVE_CBOR_CONTENT_TYPE "application/cbor"
+#define AIRHIVE_CBOR_BUFFER_SIZE 512    // Bytes buffered before a chunk is sent.
+
+// Maps and arrays are indefinite length, so nothing has to be counted before it's written. Errors are sticky: once a
+// chunk fails to send every later call does nothing, and airhive_cbor_finish() returns the error.
+typedef struct {
+    httpd_req_t* req;
+    size_t len;
+    esp_err_t err;
+    uint8_t buffer[AIRHIVE_CBOR_BUFFER_SIZE];
+} airhive_cbor_t;
+
+/**
+ * @brief Checks whether the client asked for CBOR in its Accept header.
+ */
+bool airhive_cbor_accepted(httpd_req_t* req);
+
+/**
+ * @brief Sets the content type and starts encoding, the status must be set before the first chunk is sent.
+ */
+void airhive_cbor_start(airhive_cbor_t* enc, httpd_req_t* req);
+
+/**
+ * @brief Sends what's left in the buffer and ends the chunked response.
+ * @return the first error met while encoding or sending, ESP_OK otherwise.
+ */
+esp_err_t airhive_cbor_finish(airhive_cbor_t* enc);
+
+void airhive_cbor_map(airhive_cbor_t* enc);     // Starts an indefinite length map, ended by airhive_cbor_end().
+void airhive_cbor_array(airhive_cbor_t* enc);   // Starts an indefinite length array, ended by airhive_cbor_end().
+void airhive_cbor_end(airhive_cbor_t* enc);
+void airhive_cbor_uint(airhive_cbor_t* enc, uint64_t value);
+void airhive_cbor_int(airhive_cbor_t* enc, int64_t value);
+void airhive_cbor_double(airhive_cbor_t* enc, double value);    // As an integer when it's integral.
+void airhive_cbor_bool(airhive_cbor_t* enc, bool value);
+void airhive_cbor_null(airhive_cbor_t* enc);
+void airhive_cbor_text(airhive_cbor_t* enc, const char* text);
+void airhive_cbor_text_len(airhive_cbor_t* enc, const char* text, size_t len);  // Large texts bypass the buffer.
+void airhive_cbor_bytes(airhive_cbor_t* enc, const uint8_t* data, size_t len);   // Large ones bypass the buffer.
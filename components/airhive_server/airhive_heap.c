@@ -0,0 +1,120 @@
+#include "airhive_heap.h"
+#include "stdlib.h"
+#include "sdkconfig.h"
+#include "esp_heap_caps.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include "malloc.h"
+#else
+#include "esp_memory_utils.h"
+#endif
+#include "cJSON.h"
+
+// Allocations still go through malloc(), so SPIRAM_MALLOC_ALWAYSINTERNAL keeps deciding where they land; the size
+// recorded is the block's, read back from the allocator, so a free accounts for exactly what its malloc did.
+static airhive_heap_module_stats_t module_stats[AIRHIVE_HEAP_MODULE_COUNT];
+
+// On the linux target the heap is glibc's, all of it internal, and a block's size is its usable size. glibc doesn't tell
+// its largest free block (keepcost is only the top chunk, which grows and shrinks with brk), so neither it nor the
+// fragmentation is reported there.
+static size_t heap_block_size(void* ptr)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    return malloc_usable_size(ptr);
+#else
+    return heap_caps_get_allocated_size(ptr);
+#endif
+}
+
+static bool heap_is_internal(const void* ptr)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    return true;
+#else
+    return !esp_ptr_external_ram(ptr);
+#endif
+}
+
+void* airhive_heap_malloc(airhive_heap_module_t module, size_t size)
+{
+    airhive_heap_module_stats_t* stats = &module_stats[module];
+    void* ptr = malloc(size);
+    if(ptr == NULL)
+    {
+        stats->failures++;
+        return NULL;
+    }
+    size_t block_size = heap_block_size(ptr);
+    stats->allocs++;
+    stats->live_bytes += block_size;
+    if(heap_is_internal(ptr)) stats->live_internal_bytes += block_size;
+    if(stats->live_bytes > stats->peak_bytes) stats->peak_bytes = stats->live_bytes;
+    if(size > stats->largest_alloc) stats->largest_alloc = size;
+    return ptr;
+}
+
+void airhive_heap_free(airhive_heap_module_t module, void* ptr)
+{
+    if(ptr == NULL) return;
+    airhive_heap_module_stats_t* stats = &module_stats[module];
+    size_t block_size = heap_block_size(ptr);
+    stats->frees++;
+    stats->live_bytes -= block_size;
+    if(heap_is_internal(ptr)) stats->live_internal_bytes -= block_size;
+    free(ptr);
+}
+
+static void* json_malloc(size_t size)
+{
+    return airhive_heap_malloc(AIRHIVE_HEAP_JSON, size);
+}
+
+static void json_free(void* ptr)
+{
+    airhive_heap_free(AIRHIVE_HEAP_JSON, ptr);
+}
+
+void airhive_heap_init()
+{
+    // Printed JSON must be released with cJSON_free() from now on, not free().
+    cJSON_Hooks hooks = { .malloc_fn = json_malloc, .free_fn = json_free };
+    cJSON_InitHooks(&hooks);
+}
+
+const char* airhive_heap_module_name(airhive_heap_module_t module)
+{
+    static const char* names[] = {
+        [AIRHIVE_HEAP_JSON] = "json",
+        [AIRHIVE_HEAP_BUFFERS] = "buffers"
+    };
+    return (module < AIRHIVE_HEAP_MODULE_COUNT) ? names[module] : "unknown";
+}
+
+void airhive_heap_get_module_stats(airhive_heap_module_t module, airhive_heap_module_stats_t* stats)
+{
+    *stats = module_stats[module];
+}
+
+void airhive_heap_get_caps_stats(uint32_t caps, airhive_heap_caps_stats_t* stats)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    static size_t minimum_free_bytes = SIZE_MAX;
+    *stats = (airhive_heap_caps_stats_t){0};
+    if(!(caps & MALLOC_CAP_INTERNAL)) return;
+    struct mallinfo2 info = mallinfo2();
+    if(info.fordblks < minimum_free_bytes) minimum_free_bytes = info.fordblks;
+    stats->total_free_bytes = info.fordblks;
+    stats->minimum_free_bytes = minimum_free_bytes;
+    stats->free_blocks = info.ordblks;
+#else
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, caps);
+    stats->total_free_bytes = info.total_free_bytes;
+    stats->largest_free_block = info.largest_free_block;
+    stats->minimum_free_bytes = info.minimum_free_bytes;
+    stats->allocated_blocks = info.allocated_blocks;
+    stats->free_blocks = info.free_blocks;
+    stats->fragmentation = (info.total_free_bytes == 0) ? 0.0f :
+                           1.0f - (float)info.largest_free_block / (float)info.total_free_bytes;
+    stats->layout_known = true;
+#endif
+}
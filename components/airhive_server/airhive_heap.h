@@ -0,0 +1,44 @@
+// Allocation accounting of the HTTP server, per module, and heap snapshots per capability for GET /heap. Internal to
+// the airhive_server component. Only the server task allocates through it, so the counters aren't locked.
+#include "esp_err.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+typedef enum {
+    AIRHIVE_HEAP_JSON,      // cJSON trees and printed JSON, through the cJSON hooks.
+    AIRHIVE_HEAP_BUFFERS,   // Scratch buffers of the handlers.
+    AIRHIVE_HEAP_MODULE_COUNT
+} airhive_heap_module_t;
+
+typedef struct {
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+    size_t live_bytes;          // Block sizes as the allocator reports them, so overhead and rounding included.
+    size_t live_internal_bytes; // Part of live_bytes in internal RAM, the rest is in PSRAM.
+    size_t peak_bytes;
+    size_t largest_alloc;       // Largest size asked for.
+} airhive_heap_module_stats_t;
+
+typedef struct {
+    size_t total_free_bytes;
+    size_t largest_free_block;
+    size_t minimum_free_bytes;  // Low water mark since boot.
+    size_t allocated_blocks;
+    size_t free_blocks;
+    float fragmentation;        // 1 - largest_free_block / total_free_bytes, 0 when nothing is free.
+    bool layout_known;          // False where the allocator can't tell its largest free block, it and fragmentation are then 0.
+} airhive_heap_caps_stats_t;
+
+/**
+ * @brief Installs the cJSON hooks, must be called before the first cJSON call.
+ */
+void airhive_heap_init();
+
+void* airhive_heap_malloc(airhive_heap_module_t module, size_t size);
+void airhive_heap_free(airhive_heap_module_t module, void* ptr);    // NULL is ignored.
+
+const char* airhive_heap_module_name(airhive_heap_module_t module);
+void airhive_heap_get_module_stats(airhive_heap_module_t module, airhive_heap_module_stats_t* stats);
+void airhive_heap_get_caps_stats(uint32_t caps, airhive_heap_caps_stats_t* stats);
@@ -2,16 +2,40 @@
 #include "stdbool.h"
 #include "esp_log.h"
 #include "mdns.h"
+#include "sdkconfig.h"
+#if !CONFIG_IDF_TARGET_LINUX
 #include "esp_mac.h"
+#endif
 #include "cncm.h"
+#include "airhive_networking.h"
+#include "airhive_boot.h"
+#include "airhive_bridge.h"
+#include "airhive_fetch.h"
 #include "cJSON.h"
+#include "airhive_cbor.h"
+#include "airhive_heap.h"
 #include "esp_task.h"
+#include "esp_timer.h"
+#include "sys/param.h"
+#include "stddef.h"
+#include "stdlib.h"
 
 static const char* TAG = "Airhive-server";
 
 static httpd_handle_t server_hdl;
 static bool instance_created = false;
 
+//All URIs are registered through this, with the actual handler as user_ctx, so that anything common to every request
+//is done in one place.
+static esp_err_t dispatch_handler(httpd_req_t* req)
+{
+    esp_err_t (*handler)(httpd_req_t*) = req->user_ctx;
+    airhive_wifi_note_activity();   // Leave WiFi power save before answering, later requests get the fast path.
+    esp_err_t ret = handler(req);
+    airhive_boot_mark(AIRHIVE_BOOT_FIRST_REQUEST);
+    return ret;
+}
+
 //TODO: in case of errors return some infomation in the response body.
 //Note: each handler has the max size of request body defined locally.
 //TODO: see if you made logs that are supposed to be errors infos.
@@ -43,9 +67,99 @@ esp_err_t test_get_handler(httpd_req_t* req)
     return ESP_OK;
 }
 
-esp_err_t commands_post_handler(httpd_req_t* req)
+// Adds "complete" and the "results" of consecutive tracked commands to json.
+static void command_results_add_to_json(cJSON* json, const cncm_cmd_result_t* results, size_t count, bool complete)
+{
+    cJSON_AddBoolToObject(json, "complete", complete);
+    cJSON *results_json = cJSON_AddArrayToObject(json, "results");
+    for(size_t i = 0; i < count; i++)
+    {
+        cJSON *result = cJSON_CreateObject();
+        cJSON_AddNumberToObject(result, "id", results[i].id);
+        cJSON_AddStringToObject(result, "state", cncm_cmd_state_name(results[i].state));
+        cJSON_AddStringToObject(result, "response", results[i].response);
+        if(results[i].completed_us != 0 && results[i].sent_us != 0)
+        {
+            cJSON_AddNumberToObject(result, "latency_ms", (results[i].completed_us - results[i].sent_us) / 1000.0);
+        }
+        cJSON_AddItemToArray(results_json, result);
+    }
+}
+
+// POST /commands with "track": true or "wait_ms": the commands are queued all or none and tracked, the response carries their
+// ids and results, after waiting up to wait_ms for them to be acknowledged. Takes ownership of json.
+static esp_err_t commands_submit(httpd_req_t* req, cJSON* json, const cJSON* commands)
+{
+    cJSON *track_obj = cJSON_GetObjectItemCaseSensitive(json, "track");
+    cJSON *wait_obj = cJSON_GetObjectItemCaseSensitive(json, "wait_ms");
+    size_t commands_count = cJSON_GetArraySize(commands);
+    bool valid = (track_obj == NULL || cJSON_IsBool(track_obj)) &&
+                 (wait_obj == NULL || (cJSON_IsNumber(wait_obj) && wait_obj->valuedouble >= 0 &&
+                                       wait_obj->valuedouble <= MAX_COMMAND_WAIT_MS)) &&
+                 commands_count > 0 && commands_count <= CNCM_MAX_TRACKED_COMMANDS;
+    const char **command_strs = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, MAX(commands_count, 1) * sizeof(char*));
+    cncm_cmd_result_t *results = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, MAX(commands_count, 1) * sizeof(cncm_cmd_result_t));
+    cJSON *out_json = NULL;
+    size_t i = 0;
+    const cJSON *command = NULL;
+    cJSON_ArrayForEach(command, commands)
+    {
+        const char* command_str = cJSON_GetStringValue(command);
+        if(command_str == NULL || command_str[0] == '\0' || strlen(command_str) >= CNCM_MAX_COMMAND_SIZE) valid = false;
+        else if(command_strs != NULL && i < commands_count) command_strs[i++] = command_str;
+    }
+    if(!valid)
+    {
+        ESP_LOGE(TAG, "Invalid 'commands', 'track' or 'wait_ms' parameter in JSON request");
+        httpd_resp_set_status(req, "400 Bad Request");
+        goto cleanup;
+    }
+    if(command_strs == NULL || results == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate tracked commands");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    uint32_t first_id = 0;
+    esp_err_t ret = cncm_tx_submit(command_strs, commands_count, &first_id);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to submit commands, error: %s", esp_err_to_name(ret));
+        if(ret == ESP_ERR_INVALID_ARG) httpd_resp_set_status(req, "400 Bad Request");
+        else if(ret == ESP_ERR_NO_MEM) httpd_resp_set_status(req, "503 Service Unavailable");
+        else httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    uint32_t wait_ms = (wait_obj != NULL) ? (uint32_t)wait_obj->valuedouble : 0;
+    ret = cncm_tx_results(first_id, commands_count, wait_ms, results);
+
+    out_json = cJSON_CreateObject();
+    char sent_commands_str[12]; // Same as the untracked response.
+    snprintf(sent_commands_str, sizeof(sent_commands_str), "%u", (unsigned)commands_count);
+    cJSON_AddStringToObject(out_json, "sent_commands", sent_commands_str);
+    cJSON_AddNumberToObject(out_json, "first_id", first_id);
+    command_results_add_to_json(out_json, results, commands_count, ret == ESP_OK);
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    cJSON_Delete(json);
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, command_strs);
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, results);
+    char *json_str = cJSON_Print(out_json);
+    cJSON_Delete(out_json);
+    esp_err_t send_ret = httpd_resp_send(req, json_str, (json_str == NULL) ? 0 : HTTPD_RESP_USE_STRLEN);
+    cJSON_free(json_str);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Shared by POST /commands and POST /jobs/commands, the latter also takes "job_id" and an optional "close".
+static esp_err_t commands_enqueue(httpd_req_t* req, bool for_job)
 { 
-    ESP_LOGI(TAG, "Received POST request on /commands");
     httpd_resp_set_type(req, "application/json");
 
     if(req->content_len > MAX_REQUEST_BODY_SIZE)
@@ -92,8 +206,34 @@ esp_err_t commands_post_handler(httpd_req_t* req)
         httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
         return ESP_OK;
     }
+    // "track": false is the untracked path, with no limit on the number of commands. Anything else but a bool still goes
+    // to commands_submit() to be rejected there.
+    cJSON *track_obj = cJSON_GetObjectItemCaseSensitive(json, "track");
+    if(!for_job && ((track_obj != NULL && !cJSON_IsFalse(track_obj)) ||
+                    cJSON_GetObjectItemCaseSensitive(json, "wait_ms") != NULL))
+    {
+        return commands_submit(req, json, commands);
+    }
     
+    uint32_t job_id = 0;
+    cJSON *close_obj = NULL;
+    if(for_job)
+    {
+        cJSON *job_id_obj = cJSON_GetObjectItemCaseSensitive(json, "job_id");
+        close_obj = cJSON_GetObjectItemCaseSensitive(json, "close");
+        if(!cJSON_IsNumber(job_id_obj) || job_id_obj->valuedouble <= 0 || (close_obj != NULL && !cJSON_IsBool(close_obj)))
+        {
+            ESP_LOGE(TAG, "Invalid 'job_id' or 'close' parameter in JSON request");
+            cJSON_Delete(json);
+            httpd_resp_set_status(req, "400 Bad Request");
+            httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+            return ESP_OK;
+        }
+        job_id = (uint32_t)job_id_obj->valuedouble;
+    }
+
     uint32_t sent_commands = 0;
+    uint32_t coalesced_commands = 0;    // Status queries answered by an identical one, counted in sent_commands too.
     cJSON *command = commands->child;
     while(command != NULL)
     {
@@ -110,16 +250,33 @@ esp_err_t commands_post_handler(httpd_req_t* req)
             httpd_resp_set_status(req, "400 Bad Request");
             goto cleanup;
         }
-        esp_err_t ret = cncm_tx_producer(command_str);
+        bool coalesced = false;
+        esp_err_t ret = for_job ? cncm_job_append(job_id, command_str) : cncm_tx_producer_coalesce(command_str, &coalesced);
         if(ret != ESP_OK)
         {
             ESP_LOGE(TAG, "Failed to send command: %s, error: %s", command_str, esp_err_to_name(ret));
-            httpd_resp_set_status(req, "500 Internal Server Error");
+            if(ret == ESP_ERR_INVALID_ARG) httpd_resp_set_status(req, "400 Bad Request");
+            else if(ret == ESP_ERR_NOT_FOUND) httpd_resp_set_status(req, "404 Not Found");
+            else if(ret == ESP_ERR_INVALID_STATE && for_job) httpd_resp_set_status(req, "409 Conflict");
+            else httpd_resp_set_status(req, "500 Internal Server Error");
             goto cleanup;
         }
         sent_commands++;
+        if(coalesced) coalesced_commands++;
         command = command->next;    // TODO: check that there is no siblings before the first child.
     }
+    if(cJSON_IsTrue(close_obj))
+    {
+        esp_err_t ret = cncm_job_close(job_id);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to close job %" PRIu32 ", error: %s", job_id, esp_err_to_name(ret));
+            if(ret == ESP_ERR_NOT_FOUND) httpd_resp_set_status(req, "404 Not Found");
+            else if(ret == ESP_ERR_NO_MEM) httpd_resp_set_status(req, "503 Service Unavailable");
+            else httpd_resp_set_status(req, "409 Conflict");
+            goto cleanup;
+        }
+    }
     httpd_resp_set_status(req, "200 OK");   // If got out of the loop without errors.
 
 cleanup:
@@ -128,13 +285,14 @@ cleanup:
     snprintf(sent_commands_str, sizeof(sent_commands_str), "%" PRIu32, sent_commands);  // Converting it to string.
     cJSON *response_json = cJSON_CreateObject();    //TODO: what if this failed.
     cJSON_AddItemToObject(response_json, "sent_commands", cJSON_CreateString(sent_commands_str));
+    if(!for_job) cJSON_AddNumberToObject(response_json, "coalesced_commands", coalesced_commands);
     char *response_str = cJSON_Print(response_json);
     cJSON_Delete(response_json); // Freeing this should be enough as it cascades, TODO: check this.
     if(response_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
     else
     {
         esp_err_t ret = httpd_resp_send(req, response_str, HTTPD_RESP_USE_STRLEN);
-        free(response_str);
+        cJSON_free(response_str);
         if(ret != ESP_OK)
         {
             ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
@@ -144,83 +302,209 @@ cleanup:
     return ESP_OK;
 }
 
-// TODO: should we consider making all handlers allocate memory for JSONs from the SPIRAM using initHooks?
-// But keep in mind that any allocation larger than 16KB will be from the SPIRAM anyway.
-// And keep in mind that initially we have 300KB of internal RAM free.
-esp_err_t responses_get_handler(httpd_req_t* req)
+esp_err_t commands_post_handler(httpd_req_t* req)
 {
-    ESP_LOGI(TAG, "Received GET request on /responses");
-    httpd_resp_set_type(req, "application/json");
+    ESP_LOGI(TAG, "Received POST request on /commands");
+    return commands_enqueue(req, false);
+}
 
-    cJSON *out_json = cJSON_CreateObject();
-    if(out_json == NULL)
+esp_err_t job_commands_post_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received POST request on /jobs/commands");
+    return commands_enqueue(req, true);
+}
+
+// What a responses request asks for: at most max_size bytes, from the shared cursor, the client's own, or through a
+// subscription.
+typedef struct {
+    size_t max_size;
+    bool has_cursor;
+    uint64_t cursor;
+    uint32_t subscription;      // 0 if none.
+    uint64_t lost_bytes;        // Filled by responses_read().
+    uint64_t filtered_bytes;
+} responses_params_t;
+
+// Reads the optional "size", "cursor" and "subscription" of a responses request, returns false if any is invalid.
+// A subscription keeps its own cursor, so it can't come with one.
+static bool responses_params_parse(const cJSON* params, responses_params_t* out)
+{
+    *out = (responses_params_t){ .max_size = MAX_RESPONSE_SIZE };
+    cJSON *size_obj = cJSON_GetObjectItemCaseSensitive(params, "size");
+    cJSON *cursor_obj = cJSON_GetObjectItemCaseSensitive(params, "cursor");
+    cJSON *subscription_obj = cJSON_GetObjectItemCaseSensitive(params, "subscription");
+    if((size_obj != NULL && (!cJSON_IsNumber(size_obj) || size_obj->valuedouble <= 0)) ||
+       (cursor_obj != NULL && (!cJSON_IsNumber(cursor_obj) || cursor_obj->valuedouble < 0)) ||
+       (subscription_obj != NULL && (!cJSON_IsNumber(subscription_obj) || subscription_obj->valuedouble < 1 ||
+                                     subscription_obj->valuedouble > UINT32_MAX || cursor_obj != NULL)))
     {
-        ESP_LOGE(TAG, "Failed to create JSON object");
-        httpd_resp_set_status(req, "500 Internal Server Error");
-        goto cleanup;
+        return false;
+    }
+    if(size_obj != NULL && size_obj->valuedouble < MAX_RESPONSE_SIZE) out->max_size = (size_t)size_obj->valuedouble;
+    if(cursor_obj != NULL)
+    {
+        out->has_cursor = true;
+        out->cursor = (uint64_t)cursor_obj->valuedouble;   // Exact up to 2^53 bytes, far beyond the device's lifetime.
+    }
+    if(subscription_obj != NULL) out->subscription = (uint32_t)subscription_obj->valuedouble;
+    return true;
+}
+
+// Reads up to max_size bytes of responses into a NULL terminated buffer allocated here, to be freed by the caller.
+static esp_err_t responses_read(responses_params_t* params, char** responses_str, size_t* response_size)
+{
+    *responses_str = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, params->max_size + 1);
+    if(*responses_str == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate responses buffer");
+        return ESP_ERR_NO_MEM;
+    }
+    *response_size = 0;
+    esp_err_t ret;
+    uint8_t* buffer = (uint8_t*)*responses_str;
+    if(params->subscription != 0)
+    {
+        ret = cncm_rx_read_filtered(params->subscription, buffer, response_size, params->max_size, &params->cursor,
+                                    &params->lost_bytes, &params->filtered_bytes);
     }
-    char *responses_str = malloc(MAX_RESPONSE_SIZE + 1);
-    size_t response_size = 0;
-    esp_err_t ret = cncm_rx_consumer((uint8_t*)responses_str, &response_size, MAX_RESPONSE_SIZE);
+    else if(params->has_cursor) ret = cncm_rx_read(&params->cursor, buffer, response_size, params->max_size, &params->lost_bytes);
+    else ret = cncm_rx_consumer(buffer, response_size, params->max_size);
     if(ret != ESP_OK)
     {
         ESP_LOGE(TAG, "Failed to read responses, error: %s", esp_err_to_name(ret));
-        httpd_resp_set_status(req, "500 Internal Server Error");
-        goto cleanup;
+        airhive_heap_free(AIRHIVE_HEAP_BUFFERS, *responses_str);
+        *responses_str = NULL;
+        return ret;
     }
+    (*responses_str)[*response_size] = '\0';
+    return ESP_OK;
+}
+
+// Adds "responses", and "cursor" and "lost" for clients that track their own cursor, to json. Subscriptions also get
+// "filtered", the bytes of the lines their filter dropped.
+static esp_err_t responses_add_to_json(cJSON* json, responses_params_t* params)
+{
+    char *responses_str;
+    size_t response_size;
+    esp_err_t ret = responses_read(params, &responses_str, &response_size);
+    if(ret != ESP_OK) return ret;
 
-    responses_str[response_size] = '\0';
     cJSON *responses = cJSON_CreateString(responses_str);   //This creates a copy.
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, responses_str);
     if(responses == NULL)
     {
         ESP_LOGE(TAG, "Failed to create JSON string for responses");
-        httpd_resp_set_status(req, "500 Internal Server Error");
-        goto cleanup;
+        return ESP_ERR_NO_MEM;
+    }
+    cJSON_AddItemToObject(json, "responses", responses);
+    if(params->has_cursor || params->subscription != 0)
+    {
+        cJSON_AddNumberToObject(json, "cursor", (double)params->cursor);
+        cJSON_AddNumberToObject(json, "lost", (double)params->lost_bytes);
     }
-    cJSON_AddItemToObject(out_json, "responses", responses);
-    free(responses_str);
+    if(params->subscription != 0) cJSON_AddNumberToObject(json, "filtered", (double)params->filtered_bytes);
+    return ESP_OK;
+}
 
+// Same content as responses_add_to_json(), the responses are written from the read buffer without another copy.
+static esp_err_t responses_send_cbor(httpd_req_t* req, responses_params_t* params)
+{
+    char *responses_str;
+    size_t response_size;
+    esp_err_t ret = responses_read(params, &responses_str, &response_size);
+    if(ret != ESP_OK)
+    {
+        httpd_resp_set_status(req, (ret == ESP_ERR_NOT_FOUND) ? "404 Not Found" : "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with the error status.
+        return ESP_OK;
+    }
+    airhive_cbor_t enc;
     httpd_resp_set_status(req, "200 OK");
-
-cleanup:
-    char *json_str = cJSON_Print(out_json);
-    cJSON_Delete(out_json); // Freeing this should be enough as it cascades to all children, TODO: check this.
-    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
-    else
+    airhive_cbor_start(&enc, req);
+    airhive_cbor_map(&enc);
+    airhive_cbor_text(&enc, "responses");
+    airhive_cbor_bytes(&enc, (const uint8_t*)responses_str, response_size);   // Machine output, maybe not UTF-8.
+    if(params->has_cursor || params->subscription != 0)
     {
-        ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
-        free(json_str);
-        if(ret != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
-            return ESP_FAIL;
-        }
+        airhive_cbor_text(&enc, "cursor");
+        airhive_cbor_uint(&enc, params->cursor);
+        airhive_cbor_text(&enc, "lost");
+        airhive_cbor_uint(&enc, params->lost_bytes);
     }
-    return ESP_OK;
+    if(params->subscription != 0)
+    {
+        airhive_cbor_text(&enc, "filtered");
+        airhive_cbor_uint(&enc, params->filtered_bytes);
+    }
+    airhive_cbor_end(&enc);
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, responses_str);
+    return (airhive_cbor_finish(&enc) == ESP_OK) ? ESP_OK : ESP_FAIL;
 }
 
-esp_err_t machine_status_get_handler(httpd_req_t* req)
+// Clients that send a "cursor" read the rx log independently of each other, others share the default cursor.
+esp_err_t responses_get_handler(httpd_req_t* req)
 {
     ESP_LOGI(TAG, "Received GET request on /responses");
     httpd_resp_set_type(req, "application/json");
-    cJSON *json = cJSON_CreateObject();
-    if(json == NULL)
+
+    const size_t MAX_LOCAL_REQUEST_SIZE = 64;
+    if(req->content_len > MAX_LOCAL_REQUEST_SIZE)
+    {
+        ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, MAX_LOCAL_REQUEST_SIZE);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 413 status.
+        return ESP_OK;
+    }
+
+    responses_params_t params = { .max_size = MAX_RESPONSE_SIZE };
+    if(req->content_len > 0)
+    {
+        char body_buffer[MAX_LOCAL_REQUEST_SIZE];
+        int received = httpd_req_recv(req, body_buffer, req->content_len);
+        if(received != req->content_len)
+        {
+            ESP_LOGE(TAG, "Failed to receive request body, received: %d", received);
+            httpd_resp_set_status(req, "500 Internal Server Error");
+            httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+            return ESP_FAIL;
+        }
+        cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
+        if(in_json == NULL || !responses_params_parse(in_json, &params))
+        {
+            ESP_LOGE(TAG, "Invalid 'size', 'cursor' or 'subscription' parameter in JSON request");
+            cJSON_Delete(in_json);
+            httpd_resp_set_status(req, "400 Bad Request");
+            httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+            return ESP_OK;
+        }
+        cJSON_Delete(in_json);
+    }
+    if(airhive_cbor_accepted(req)) return responses_send_cbor(req, &params);
+
+    esp_err_t ret = ESP_OK;
+    cJSON *out_json = cJSON_CreateObject();
+    if(out_json == NULL)
     {
         ESP_LOGE(TAG, "Failed to create JSON object");
         httpd_resp_set_status(req, "500 Internal Server Error");
         goto cleanup;
     }
-    cJSON_AddItemToObject(json, "status", cJSON_CreateString((cncm_is_open()) ? "Connected" : "Disconnected"));
+    ret = responses_add_to_json(out_json, &params);
+    if(ret != ESP_OK)
+    {
+        httpd_resp_set_status(req, (ret == ESP_ERR_NOT_FOUND) ? "404 Not Found" : "500 Internal Server Error");
+        goto cleanup;
+    }
     httpd_resp_set_status(req, "200 OK");
 
 cleanup:
-    char *json_str = cJSON_Print(json);
-    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    char *json_str = cJSON_Print(out_json);
+    cJSON_Delete(out_json); // Freeing this should be enough as it cascades to all children, TODO: check this.
     if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
     else
     {
-        esp_err_t ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
-        free(json_str);
+        ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
         if(ret != ESP_OK)
         {
             ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
@@ -230,75 +514,62 @@ cleanup:
     return ESP_OK;
 }
 
-esp_err_t start_put_handler(httpd_req_t* req)
-{
-    ESP_LOGI(TAG, "Received PUT request on /start");
-    httpd_resp_set_type(req, "application/json");
-    esp_err_t ret = cncm_resume();
-    if(ret != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to start machine, error: %s", esp_err_to_name(ret));
-        httpd_resp_set_status(req, "500 Internal Server Error");
-    }
-    else httpd_resp_set_status(req, "200 OK");
-
-    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
-    if(send_ret != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
-        return ESP_FAIL;
-    }
-    return ESP_OK;
-}
-
-esp_err_t stop_put_handler(httpd_req_t* req)
+// Copies a JSON array of prefixes into a filter list, returns false if it isn't one or a prefix doesn't fit.
+static bool rx_filter_prefixes_parse(const cJSON* array, char prefixes[][CNCM_RX_FILTER_PREFIX_SIZE + 1])
 {
-    ESP_LOGI(TAG, "Received PUT request on /stop");
-    httpd_resp_set_type(req, "application/json");
-    esp_err_t ret = cncm_pause();
-    if(ret != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to stop machine, error: %s", esp_err_to_name(ret));
-        httpd_resp_set_status(req, "500 Internal Server Error");
-    }
-    else httpd_resp_set_status(req, "200 OK");
-
-    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
-    if(send_ret != ESP_OK)
+    if(array == NULL) return true;
+    if(!cJSON_IsArray(array) || cJSON_GetArraySize(array) > CNCM_RX_FILTER_MAX_PREFIXES) return false;
+    size_t i = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, array)
     {
-        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
-        return ESP_FAIL;
+        const char* prefix = cJSON_GetStringValue(item);
+        if(prefix == NULL || prefix[0] == '\0' || strlen(prefix) > CNCM_RX_FILTER_PREFIX_SIZE) return false;
+        strcpy(prefixes[i++], prefix);
     }
-    return ESP_OK;
+    return true;
 }
 
-esp_err_t clear_put_handler(httpd_req_t* req)
+// Reads "classes", "include", "exclude" and "status_interval_ms" of a subscription request, all optional.
+static bool rx_filter_parse(const cJSON* json, cncm_rx_filter_t* filter)
 {
-    ESP_LOGI(TAG, "Received PUT request on /clear");
-    httpd_resp_set_type(req, "application/json");
-    esp_err_t ret = cncm_clear_tx_buffer();
-    if(ret != ESP_OK)
+    static const char* class_names[] = { "ack", "status", "error", "busy", "other" };
+    *filter = (cncm_rx_filter_t){ .classes = CNCM_RX_CLASS_ALL };
+    cJSON *classes = cJSON_GetObjectItemCaseSensitive(json, "classes");
+    if(classes != NULL)
     {
-        ESP_LOGE(TAG, "Failed to clear machine state, error: %s", esp_err_to_name(ret));
-        httpd_resp_set_status(req, "500 Internal Server Error");
+        if(!cJSON_IsArray(classes)) return false;
+        filter->classes = 0;
+        const cJSON *item;
+        cJSON_ArrayForEach(item, classes)
+        {
+            const char* name = cJSON_GetStringValue(item);
+            size_t i = 0;
+            while(i < sizeof(class_names) / sizeof(class_names[0]) && (name == NULL || strcmp(name, class_names[i]) != 0)) i++;
+            if(i == sizeof(class_names) / sizeof(class_names[0])) return false;
+            filter->classes |= (1 << i);
+        }
     }
-    else httpd_resp_set_status(req, "200 OK");
-
-    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
-    if(send_ret != ESP_OK)
+    cJSON *interval = cJSON_GetObjectItemCaseSensitive(json, "status_interval_ms");
+    if(interval != NULL)
     {
-        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
-        return ESP_FAIL;
+        if(!cJSON_IsNumber(interval) || interval->valuedouble < 0 || interval->valuedouble > UINT32_MAX) return false;
+        filter->status_interval_ms = (uint32_t)interval->valuedouble;
     }
-    return ESP_OK;
+    return rx_filter_prefixes_parse(cJSON_GetObjectItemCaseSensitive(json, "include"), filter->include) &&
+           rx_filter_prefixes_parse(cJSON_GetObjectItemCaseSensitive(json, "exclude"), filter->exclude);
 }
 
-esp_err_t machine_config_put_handler(httpd_req_t* req)
+// Handles both POST (body is the filter, returns the "subscription" id) and DELETE (body has "subscription") on
+// /responses/subscriptions.
+esp_err_t responses_subscriptions_handler(httpd_req_t* req)
 {
-    ESP_LOGI(TAG, "Received PUT request on /machine-config");
+    bool is_post = (req->method == HTTP_POST);
+    ESP_LOGI(TAG, "Received %s request on /responses/subscriptions", is_post ? "POST" : "DELETE");
     httpd_resp_set_type(req, "application/json");
 
-    const size_t MAX_LOCAL_REQUEST_SIZE = 32;
+    // Two full prefix lists, escaped, and the classes.
+    const size_t MAX_LOCAL_REQUEST_SIZE = 512;
     if(req->content_len > MAX_LOCAL_REQUEST_SIZE)
     {
         ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, MAX_LOCAL_REQUEST_SIZE);
@@ -308,73 +579,1879 @@ esp_err_t machine_config_put_handler(httpd_req_t* req)
     }
 
     char body_buffer[MAX_LOCAL_REQUEST_SIZE];
-    size_t received = httpd_req_recv(req, body_buffer, MAX_LOCAL_REQUEST_SIZE);
-    if(received != req->content_len)
-    {
-        ESP_LOGE(TAG, "Failed to receive request body, received: %d", received);
-        httpd_resp_set_status(req, "500 Internal Server Error");
-        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
-        return ESP_FAIL;
+    size_t received = 0;
+    while (received < req->content_len) {
+        int ret = httpd_req_recv(req, body_buffer + received, req->content_len - received);
+        if (ret <= 0) {
+            ESP_LOGE(TAG, "Error receiving request body: ret=%d", ret);
+            httpd_resp_set_status(req, "500 Internal Server Error");
+            httpd_resp_send(req, NULL, 0);
+            return ESP_FAIL;
+        }
+        received += ret;
     }
 
-    cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
-    if(received == 0 || in_json == NULL)
+    // An empty POST subscribes to everything.
+    cJSON *in_json = (received > 0) ? cJSON_ParseWithLength(body_buffer, received) : cJSON_CreateObject();
+    cncm_rx_filter_t filter;
+    uint32_t subscription = 0;
+    bool valid = (in_json != NULL);
+    if(valid && is_post) valid = rx_filter_parse(in_json, &filter);
+    else if(valid)
     {
-        ESP_LOGE(TAG, "Failed to parse JSON request body");
-        httpd_resp_set_status(req, "400 Bad Request");
-        httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
-        return ESP_OK;
+        cJSON *subscription_obj = cJSON_GetObjectItemCaseSensitive(in_json, "subscription");
+        valid = cJSON_IsNumber(subscription_obj) && subscription_obj->valuedouble >= 1 &&
+                subscription_obj->valuedouble <= UINT32_MAX;
+        if(valid) subscription = (uint32_t)subscription_obj->valuedouble;
     }
-
-    cJSON *baudrate_obj = cJSON_GetObjectItemCaseSensitive(in_json, "baudrate");
-    if(!cJSON_IsNumber(baudrate_obj) || baudrate_obj->valueint <= 0)
+    cJSON_Delete(in_json);
+    if(!valid)
     {
-        ESP_LOGE(TAG, "Invalid 'baudrate' parameter in JSON request");
-        cJSON_Delete(in_json);
+        ESP_LOGE(TAG, "Invalid subscription parameters in JSON request");
         httpd_resp_set_status(req, "400 Bad Request");
         httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
         return ESP_OK;
     }
-    uint32_t baudrate = (uint32_t)baudrate_obj->valueint;
-    cJSON_Delete(in_json);
 
-    esp_err_t ret = cncm_reset_machine_config(baudrate);
-    if(ret != ESP_OK)
+    esp_err_t ret = is_post ? cncm_rx_subscribe(&filter, &subscription) : cncm_rx_unsubscribe(subscription);
+    cJSON *out_json = NULL;
+    if(ret == ESP_ERR_INVALID_ARG) httpd_resp_set_status(req, "400 Bad Request");
+    else if(ret == ESP_ERR_NOT_FOUND) httpd_resp_set_status(req, "404 Not Found");
+    else if(ret == ESP_ERR_NO_MEM) httpd_resp_set_status(req, "503 Service Unavailable");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else
     {
-        ESP_LOGE(TAG, "Error resetting machine config: %s", esp_err_to_name(ret));
-        httpd_resp_set_status(req, "500 Internal Server Error");
-        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
-    } else{
-        //respond with ok
-        httpd_resp_set_status(req, "200 OK");
-        esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
-        if(send_ret != ESP_OK)
+        if(is_post)
         {
-            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
-            return ESP_FAIL;
+            out_json = cJSON_CreateObject();
+            cJSON_AddNumberToObject(out_json, "subscription", subscription);
         }
+        httpd_resp_set_status(req, "200 OK");
     }
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to update subscription, error: %s", esp_err_to_name(ret));
 
+    char *json_str = cJSON_Print(out_json);
+    cJSON_Delete(out_json);
+    ret = httpd_resp_send(req, json_str, (json_str == NULL) ? 0 : HTTPD_RESP_USE_STRLEN);
+    cJSON_free(json_str);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+        return ESP_FAIL;
+    }
     return ESP_OK;
 }
 
-
-esp_err_t airhive_start_server()
+// Parses a single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range of the log, which runs from start to end.
+// The range is clamped to what is still readable, returns false if it's malformed or nothing of it is.
+static bool log_range_parse(const char* range, uint64_t start, uint64_t end, uint64_t* first, uint64_t* last)
 {
-    if(instance_created)
+    if(strncmp(range, "bytes=", 6) != 0) return false;
+    const char* spec = range + 6;
+    char* dash = strchr(spec, '-');
+    if(dash == NULL || strchr(spec, ',') != NULL) return false;    // No multipart ranges.
+    char* spec_end;
+    if(dash == spec)
     {
-        ESP_LOGI(TAG, "Server instance already exists.");
-        return ESP_ERR_INVALID_STATE;
+        uint64_t suffix = strtoull(dash + 1, &spec_end, 10);
+        if(spec_end == dash + 1 || *spec_end != '\0' || suffix == 0) return false;
+        *first = (suffix < end - start) ? end - suffix : start;
+        *last = end - 1;
+    }
+    else
+    {
+        *first = strtoull(spec, &spec_end, 10);
+        if(spec_end != dash) return false;
+        *last = end - 1;
+        if(dash[1] != '\0')
+        {
+            *last = strtoull(dash + 1, &spec_end, 10);
+            if(*spec_end != '\0' || *last < *first) return false;
+            if(*last >= end) *last = end - 1;
+        }
+        if(*first < start) *first = start;     // Already overwritten.
+    }
+    return end > start && *first <= *last && *first < end;
+}
+
+// Streams the flash log of the machine output as text. Offsets count every byte logged since the partition was first
+// used, X-Log-Start and X-Log-End give what is readable, so a client can fetch only what it hasn't seen yet.
+esp_err_t log_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /log");
+    cncm_log_stats_t stats;
+    esp_err_t ret = cncm_log_get_stats(&stats);
+    if(ret != ESP_OK || !stats.available)
+    {
+        httpd_resp_set_status(req, (ret == ESP_OK) ? "404 Not Found" : "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with the error status.
+        return ESP_OK;
+    }
+    // Header values must stay valid until the response is sent.
+    char start_str[24], end_str[24], content_range[72];
+    snprintf(start_str, sizeof(start_str), "%" PRIu64, stats.start);
+    snprintf(end_str, sizeof(end_str), "%" PRIu64, stats.end);
+    httpd_resp_set_hdr(req, "X-Log-Start", start_str);
+    httpd_resp_set_hdr(req, "X-Log-End", end_str);
+    httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+
+    uint64_t first = stats.start;
+    uint64_t last = stats.end - 1;
+    char range[64];
+    if(httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) == ESP_OK)
+    {
+        if(!log_range_parse(range, stats.start, stats.end, &first, &last))
+        {
+            ESP_LOGW(TAG, "Unsatisfiable log range: %s", range);
+            snprintf(content_range, sizeof(content_range), "bytes */%" PRIu64, stats.end);
+            httpd_resp_set_hdr(req, "Content-Range", content_range);
+            httpd_resp_set_status(req, "416 Range Not Satisfiable");
+            httpd_resp_send(req, NULL, 0); // Send empty response with 416 status.
+            return ESP_OK;
+        }
+        snprintf(content_range, sizeof(content_range), "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64, first, last, stats.end);
+        httpd_resp_set_hdr(req, "Content-Range", content_range);
+        httpd_resp_set_status(req, "206 Partial Content");
+    }
+    else httpd_resp_set_status(req, "200 OK");
+    httpd_resp_set_type(req, "text/plain");
+
+    uint8_t* buffer = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, LOG_READ_CHUNK_SIZE);
+    if(buffer == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate log buffer");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        return ESP_OK;
+    }
+    uint64_t offset = first;
+    ret = ESP_OK;
+    while(stats.end > stats.start && offset <= last)
+    {
+        size_t read_size = 0;
+        uint64_t read_from = offset;
+        ret = cncm_log_read(&offset, buffer, &read_size, MIN(LOG_READ_CHUNK_SIZE, last + 1 - offset));
+        // The log wrapped over the rest of the range while it was sent, it can't be sent as one piece anymore.
+        if(ret != ESP_OK || read_size == 0 || offset - read_size != read_from) break;
+        ret = httpd_resp_send_chunk(req, (const char*)buffer, read_size);
+        if(ret != ESP_OK) break;
+    }
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, buffer);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send the log, error: %s", esp_err_to_name(ret));
+        return ESP_FAIL;   // Closes the connection, the client sees a short body.
+    }
+    if(stats.end > stats.start && offset <= last) ESP_LOGW(TAG, "Log overwritten while it was sent, stopped at %" PRIu64 ".", offset);
+    ret = httpd_resp_send_chunk(req, NULL, 0);
+    return (ret == ESP_OK) ? ESP_OK : ESP_FAIL;
+}
+
+// Status documents are written once against status_out_t and come out either as a cJSON tree or as CBOR, so both
+// encodings always carry the same fields. Inside arrays keys are NULL.
+#define STATUS_MAX_DEPTH 4
+typedef struct {
+    airhive_cbor_t* cbor;               // Encodes to CBOR if set, adds to containers otherwise.
+    cJSON* containers[STATUS_MAX_DEPTH];
+    size_t depth;
+} status_out_t;
+
+static void status_json_add(status_out_t* out, const char* key, cJSON* item)
+{
+    cJSON* parent = out->containers[out->depth - 1];
+    bool added = cJSON_IsArray(parent) ? cJSON_AddItemToArray(parent, item) : cJSON_AddItemToObject(parent, key, item);
+    if(!added) cJSON_Delete(item);
+}
+
+static void status_number(status_out_t* out, const char* key, double value)
+{
+    if(out->cbor == NULL)
+    {
+        status_json_add(out, key, cJSON_CreateNumber(value));
+        return;
+    }
+    if(key != NULL) airhive_cbor_text(out->cbor, key);
+    airhive_cbor_double(out->cbor, value);
+}
+
+static void status_bool(status_out_t* out, const char* key, bool value)
+{
+    if(out->cbor == NULL)
+    {
+        status_json_add(out, key, cJSON_CreateBool(value));
+        return;
+    }
+    if(key != NULL) airhive_cbor_text(out->cbor, key);
+    airhive_cbor_bool(out->cbor, value);
+}
+
+static void status_null(status_out_t* out, const char* key)
+{
+    if(out->cbor == NULL)
+    {
+        status_json_add(out, key, cJSON_CreateNull());
+        return;
+    }
+    if(key != NULL) airhive_cbor_text(out->cbor, key);
+    airhive_cbor_null(out->cbor);
+}
+
+static void status_text(status_out_t* out, const char* key, const char* text)
+{
+    if(out->cbor == NULL)
+    {
+        status_json_add(out, key, cJSON_CreateString(text));
+        return;
+    }
+    if(key != NULL) airhive_cbor_text(out->cbor, key);
+    airhive_cbor_text(out->cbor, text);
+}
+
+// Machine output isn't necessarily valid UTF-8, so it's a byte string in CBOR.
+static void status_output(status_out_t* out, const char* key, const char* output)
+{
+    if(out->cbor == NULL)
+    {
+        status_json_add(out, key, cJSON_CreateString(output));
+        return;
+    }
+    if(key != NULL) airhive_cbor_text(out->cbor, key);
+    airhive_cbor_bytes(out->cbor, (const uint8_t*)output, strlen(output));
+}
+
+static void status_container(status_out_t* out, const char* key, bool is_array)
+{
+    if(out->cbor != NULL)
+    {
+        if(key != NULL) airhive_cbor_text(out->cbor, key);
+        if(is_array) airhive_cbor_array(out->cbor);
+        else airhive_cbor_map(out->cbor);
+        return;
+    }
+    cJSON* container = is_array ? cJSON_CreateArray() : cJSON_CreateObject();
+    status_json_add(out, key, container);
+    // If it couldn't be created, what goes into it is dropped by status_json_add().
+    if(out->depth < STATUS_MAX_DEPTH) out->containers[out->depth++] = container;
+}
+
+static void status_map(status_out_t* out, const char* key)
+{
+    status_container(out, key, false);
+}
+
+static void status_array(status_out_t* out, const char* key)
+{
+    status_container(out, key, true);
+}
+
+static void status_end(status_out_t* out)
+{
+    if(out->cbor != NULL) airhive_cbor_end(out->cbor);
+    else if(out->depth > 1) out->depth--;
+}
+
+// Fields of the stats structs, by type and offset, numbers are divided by divisor (e.g. 1000 for microseconds shown
+// in milliseconds).
+typedef enum {
+    STATUS_FIELD_BOOL,
+    STATUS_FIELD_U32,
+    STATUS_FIELD_U64,
+    STATUS_FIELD_I64,
+    STATUS_FIELD_FLOAT
+} status_field_type_t;
+
+typedef struct {
+    const char* name;
+    status_field_type_t type;
+    size_t offset;
+    double divisor;
+} status_field_t;
+
+#define STATUS_FIELD(struct_type, member, name, type, divisor) { name, type, offsetof(struct_type, member), divisor }
+#define STATUS_FIELDS_COUNT(fields) (sizeof(fields) / sizeof(fields[0]))
+
+static const status_field_t link_fields[] = {
+    STATUS_FIELD(cncm_link_stats_t, baudrate, "baudrate", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_link_stats_t, reconnects, "reconnects", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_link_stats_t, failed_opens, "failed_opens", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_link_stats_t, last_reconnect_us, "last_reconnect_ms", STATUS_FIELD_I64, 1000),
+    STATUS_FIELD(cncm_link_stats_t, max_reconnect_us, "max_reconnect_ms", STATUS_FIELD_I64, 1000),
+    STATUS_FIELD(cncm_link_stats_t, last_attach_to_open_us, "last_attach_to_open_ms", STATUS_FIELD_I64, 1000)
+};
+
+static const status_field_t arc_fields[] = {
+    STATUS_FIELD(cncm_arc_stats_t, enabled, "enabled", STATUS_FIELD_BOOL, 1),
+    STATUS_FIELD(cncm_arc_stats_t, tolerance_mm, "tolerance_mm", STATUS_FIELD_FLOAT, 1),
+    STATUS_FIELD(cncm_arc_stats_t, lines_in, "lines_in", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_arc_stats_t, lines_out, "lines_out", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_arc_stats_t, arcs, "arcs", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_arc_stats_t, arc_segments, "arc_segments", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_arc_stats_t, lines_held, "lines_held", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_arc_stats_t, compression_ratio, "compression_ratio", STATUS_FIELD_FLOAT, 1)
+};
+
+static const status_field_t log_fields[] = {
+    STATUS_FIELD(cncm_log_stats_t, available, "available", STATUS_FIELD_BOOL, 1),
+    STATUS_FIELD(cncm_log_stats_t, enabled, "enabled", STATUS_FIELD_BOOL, 1),
+    STATUS_FIELD(cncm_log_stats_t, capacity, "capacity", STATUS_FIELD_U64, 1),
+    STATUS_FIELD(cncm_log_stats_t, start, "start", STATUS_FIELD_U64, 1),
+    STATUS_FIELD(cncm_log_stats_t, end, "end", STATUS_FIELD_U64, 1),
+    STATUS_FIELD(cncm_log_stats_t, staged, "staged", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_log_stats_t, dropped_bytes, "dropped", STATUS_FIELD_U64, 1),
+    STATUS_FIELD(cncm_log_stats_t, pages_written, "pages_written", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(cncm_log_stats_t, sectors_erased, "sectors_erased", STATUS_FIELD_U32, 1)
+};
+
+static const status_field_t wifi_fields[] = {
+    STATUS_FIELD(airhive_wifi_stats_t, last_time_to_ip_us, "last_time_to_ip_ms", STATUS_FIELD_I64, 1000),
+    STATUS_FIELD(airhive_wifi_stats_t, used_cached_ap, "used_cached_ap", STATUS_FIELD_BOOL, 1)
+};
+
+static const status_field_t power_save_fields[] = {
+    STATUS_FIELD(airhive_wifi_stats_t, power_save, "active", STATUS_FIELD_BOOL, 1),
+    STATUS_FIELD(airhive_wifi_stats_t, power_save_idle_s, "idle_s", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(airhive_wifi_stats_t, wakeups, "wakeups", STATUS_FIELD_U32, 1),
+    STATUS_FIELD(airhive_wifi_stats_t, last_wakeup_us, "last_wakeup_us", STATUS_FIELD_I64, 1),
+    STATUS_FIELD(airhive_wifi_stats_t, max_wakeup_us, "max_wakeup_us", STATUS_FIELD_I64, 1),
+    STATUS_FIELD(airhive_wifi_stats_t, power_save_total_us, "total_s", STATUS_FIELD_I64, 1000000)
+};
+
+static void status_fields(status_out_t* out, const status_field_t* fields, size_t count, const void* stats)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        const uint8_t* member = (const uint8_t*)stats + fields[i].offset;
+        double value = 0;
+        switch(fields[i].type)
+        {
+            case STATUS_FIELD_BOOL:
+                status_bool(out, fields[i].name, *(const bool*)member);
+                continue;
+            case STATUS_FIELD_U32: value = *(const uint32_t*)member; break;
+            case STATUS_FIELD_U64: value = (double)*(const uint64_t*)member; break;
+            case STATUS_FIELD_I64: value = (double)*(const int64_t*)member; break;
+            case STATUS_FIELD_FLOAT: value = *(const float*)member; break;
+        }
+        status_number(out, fields[i].name, value / fields[i].divisor);
+    }
+}
+
+static void machine_status_write(status_out_t* out)
+{
+    status_text(out, "status", (cncm_is_open()) ? "Connected" : "Disconnected");
+    status_text(out, "dialect", cncm_dialect_name(cncm_get_dialect()));
+    cncm_link_stats_t link_stats;
+    if(cncm_get_link_stats(&link_stats) == ESP_OK)
+    {
+        status_map(out, "link");
+        status_fields(out, link_fields, STATUS_FIELDS_COUNT(link_fields), &link_stats);
+        status_end(out);
+    }
+    cncm_query_info_t *infos = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, CNCM_MAX_STATUS_QUERIES * sizeof(cncm_query_info_t));
+    size_t infos_count = 0;
+    if(infos != NULL && cncm_query_list(infos, &infos_count) == ESP_OK)
+    {
+        int64_t now = esp_timer_get_time();
+        status_number(out, "query_freshness_ms", cncm_query_get_freshness());
+        status_array(out, "queries");
+        for(size_t i = 0; i < infos_count; i++)
+        {
+            status_map(out, NULL);
+            status_text(out, "query", infos[i].query);
+            status_bool(out, "pending", infos[i].pending);
+            if(infos[i].answered_us == 0)
+            {
+                status_null(out, "answer");
+                status_null(out, "age_ms");
+            }
+            else
+            {
+                status_output(out, "answer", infos[i].answer);
+                status_number(out, "age_ms", (now - infos[i].answered_us) / 1000);
+            }
+            status_number(out, "sent", infos[i].sent);
+            status_number(out, "coalesced", infos[i].coalesced);
+            status_end(out);
+        }
+        status_end(out);
+    }
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, infos);
+    cncm_arc_stats_t arc_stats;
+    if(cncm_arc_get_stats(&arc_stats) == ESP_OK)
+    {
+        status_map(out, "arc_fitting");
+        status_fields(out, arc_fields, STATUS_FIELDS_COUNT(arc_fields), &arc_stats);
+        status_end(out);
+    }
+    cncm_log_stats_t log_stats;
+    if(cncm_log_get_stats(&log_stats) == ESP_OK)
+    {
+        status_map(out, "log");
+        status_fields(out, log_fields, STATUS_FIELDS_COUNT(log_fields), &log_stats);
+        status_end(out);
+    }
+}
+
+static void machine_status_add_to_json(cJSON* json)
+{
+    status_out_t out = { .containers = { json }, .depth = 1 };
+    machine_status_write(&out);
+}
+
+static esp_err_t machine_status_send_cbor(httpd_req_t* req)
+{
+    airhive_cbor_t enc;
+    httpd_resp_set_status(req, "200 OK");
+    airhive_cbor_start(&enc, req);
+    airhive_cbor_map(&enc);
+    status_out_t out = { .cbor = &enc };
+    machine_status_write(&out);
+    airhive_cbor_end(&enc);
+    return (airhive_cbor_finish(&enc) == ESP_OK) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t machine_status_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /machine-status");
+    if(airhive_cbor_accepted(req)) return machine_status_send_cbor(req);
+    httpd_resp_set_type(req, "application/json");
+    cJSON *json = cJSON_CreateObject();
+    if(json == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create JSON object");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    machine_status_add_to_json(json);
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    char *json_str = cJSON_Print(json);
+    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        esp_err_t ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t start_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /start");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = cncm_resume();
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start machine, error: %s", esp_err_to_name(ret));
+        httpd_resp_set_status(req, "500 Internal Server Error");
+    }
+    else httpd_resp_set_status(req, "200 OK");
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t stop_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /stop");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = cncm_pause();
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to stop machine, error: %s", esp_err_to_name(ret));
+        httpd_resp_set_status(req, "500 Internal Server Error");
+    }
+    else httpd_resp_set_status(req, "200 OK");
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t clear_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /clear");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = cncm_clear_tx_buffer();
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to clear machine state, error: %s", esp_err_to_name(ret));
+        httpd_resp_set_status(req, "500 Internal Server Error");
+    }
+    else httpd_resp_set_status(req, "200 OK");
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t emergency_stop_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /emergency-stop");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = cncm_emergency_stop();
+    if(ret == ESP_ERR_INVALID_STATE)
+    {
+        ESP_LOGE(TAG, "Can't send emergency stop, machine not connected");
+        httpd_resp_set_status(req, "409 Conflict");
+    }
+    else if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send emergency stop, error: %s", esp_err_to_name(ret));
+        httpd_resp_set_status(req, "500 Internal Server Error");
+    }
+    else httpd_resp_set_status(req, "200 OK");
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t status_query_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /status-query");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = cncm_status_query();
+    if(ret == ESP_ERR_NO_MEM)
+    {
+        ESP_LOGE(TAG, "Can't queue status query, tx_queue full");
+        httpd_resp_set_status(req, "503 Service Unavailable");
+    }
+    else if(ret == ESP_ERR_INVALID_STATE)
+    {
+        ESP_LOGE(TAG, "Can't send status query, machine not connected");
+        httpd_resp_set_status(req, "409 Conflict");
+    }
+    else if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send status query, error: %s", esp_err_to_name(ret));
+        httpd_resp_set_status(req, "500 Internal Server Error");
+    }
+    else httpd_resp_set_status(req, "200 OK");
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t machine_config_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /machine-config");
+    httpd_resp_set_type(req, "application/json");
+
+    const size_t MAX_LOCAL_REQUEST_SIZE = 192;
+    if(req->content_len > MAX_LOCAL_REQUEST_SIZE)
+    {
+        ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, MAX_LOCAL_REQUEST_SIZE);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 413 status.
+        return ESP_OK;
+    }
+
+    char body_buffer[MAX_LOCAL_REQUEST_SIZE];
+    size_t received = httpd_req_recv(req, body_buffer, MAX_LOCAL_REQUEST_SIZE);
+    if(received != req->content_len)
+    {
+        ESP_LOGE(TAG, "Failed to receive request body, received: %d", received);
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        return ESP_FAIL;
+    }
+
+    cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
+    if(received == 0 || in_json == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to parse JSON request body");
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+        return ESP_OK;
+    }
+
+    // All are optional, at least one is required. The dialect and the baudrate are applied together, with one reopen.
+    cJSON *baudrate_obj = cJSON_GetObjectItemCaseSensitive(in_json, "baudrate");
+    cJSON *dialect_obj = cJSON_GetObjectItemCaseSensitive(in_json, "dialect");
+    cJSON *freshness_obj = cJSON_GetObjectItemCaseSensitive(in_json, "query_freshness_ms");
+    cJSON *arcs_obj = cJSON_GetObjectItemCaseSensitive(in_json, "arc_fitting");
+    // Either field of arc_fitting may be left out, it keeps its current value.
+    cJSON *arcs_enabled_obj = cJSON_GetObjectItemCaseSensitive(arcs_obj, "enabled");
+    cJSON *arcs_tolerance_obj = cJSON_GetObjectItemCaseSensitive(arcs_obj, "tolerance_mm");
+    cJSON *log_obj = cJSON_GetObjectItemCaseSensitive(in_json, "log");
+    cJSON *log_enabled_obj = cJSON_GetObjectItemCaseSensitive(log_obj, "enabled");
+    cncm_dialect_t dialect;
+    if((baudrate_obj == NULL && dialect_obj == NULL && freshness_obj == NULL && arcs_obj == NULL && log_obj == NULL)
+        || (baudrate_obj != NULL && (!cJSON_IsNumber(baudrate_obj) || baudrate_obj->valueint < 0))   // 0 is CNCM_BAUDRATE_AUTO.
+        || (dialect_obj != NULL && (!cJSON_IsString(dialect_obj) || cncm_dialect_from_name(dialect_obj->valuestring, &dialect) != ESP_OK))
+        || (freshness_obj != NULL && (!cJSON_IsNumber(freshness_obj) || freshness_obj->valuedouble < 0
+                                      || freshness_obj->valuedouble > CNCM_MAX_QUERY_FRESHNESS_MS))
+        || (arcs_obj != NULL && (!cJSON_IsObject(arcs_obj) || (arcs_enabled_obj == NULL && arcs_tolerance_obj == NULL)
+                                 || (arcs_enabled_obj != NULL && !cJSON_IsBool(arcs_enabled_obj))
+                                 || (arcs_tolerance_obj != NULL && (!cJSON_IsNumber(arcs_tolerance_obj)
+                                                                    || arcs_tolerance_obj->valuedouble < CNCM_ARC_MIN_TOLERANCE_MM
+                                                                    || arcs_tolerance_obj->valuedouble > CNCM_ARC_MAX_TOLERANCE_MM))))
+        || (log_obj != NULL && !cJSON_IsBool(log_enabled_obj)))
+    {
+        ESP_LOGE(TAG, "Invalid 'baudrate', 'dialect', 'query_freshness_ms', 'arc_fitting' or 'log' parameter in JSON request");
+        cJSON_Delete(in_json);
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+        return ESP_OK;
+    }
+    bool has_baudrate = baudrate_obj != NULL;
+    uint32_t baudrate = has_baudrate ? (uint32_t)baudrate_obj->valueint : 0;
+    bool has_dialect = dialect_obj != NULL;
+    bool has_freshness = freshness_obj != NULL;
+    uint32_t freshness_ms = has_freshness ? (uint32_t)freshness_obj->valuedouble : 0;
+    bool has_arcs = arcs_obj != NULL;
+    cncm_arc_stats_t arc_stats = { .enabled = false };
+    esp_err_t ret = has_arcs ? cncm_arc_get_stats(&arc_stats) : ESP_OK;
+    if(arcs_enabled_obj != NULL) arc_stats.enabled = cJSON_IsTrue(arcs_enabled_obj);
+    if(arcs_tolerance_obj != NULL) arc_stats.tolerance_mm = (float)arcs_tolerance_obj->valuedouble;
+    bool has_log = log_obj != NULL;
+    bool log_enabled = cJSON_IsTrue(log_enabled_obj);
+    cJSON_Delete(in_json);
+
+    // None of these reopens the machine.
+    if(ret == ESP_OK && has_freshness) ret = cncm_query_set_freshness(freshness_ms);
+    if(ret == ESP_OK && has_arcs) ret = cncm_arc_set_config(arc_stats.enabled, arc_stats.tolerance_mm);
+    if(ret == ESP_OK && has_log) ret = cncm_log_set_enabled(log_enabled);
+    if(ret == ESP_OK && (has_dialect || has_baudrate))
+    {
+        ret = cncm_set_machine_config(has_dialect ? &dialect : NULL, has_baudrate ? &baudrate : NULL);
+    }
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error resetting machine config: %s", esp_err_to_name(ret));
+        // Enabling the log without its partition can't succeed on this device, arc fitting can once the tx_queue drains.
+        if(ret == ESP_ERR_NOT_SUPPORTED) httpd_resp_set_status(req, "409 Conflict");
+        else if(ret == ESP_ERR_NO_MEM) httpd_resp_set_status(req, "503 Service Unavailable");
+        else httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with the error status.
+    } else{
+        //respond with ok
+        httpd_resp_set_status(req, "200 OK");
+        esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+        if(send_ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+
+esp_err_t network_config_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /network-config");
+    httpd_resp_set_type(req, "application/json");
+
+    const size_t MAX_LOCAL_REQUEST_SIZE = 128;
+    if(req->content_len > MAX_LOCAL_REQUEST_SIZE)
+    {
+        ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, MAX_LOCAL_REQUEST_SIZE);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 413 status.
+        return ESP_OK;
+    }
+
+    char body_buffer[MAX_LOCAL_REQUEST_SIZE];
+    int received = httpd_req_recv(req, body_buffer, req->content_len);
+    if(received != req->content_len)
+    {
+        ESP_LOGE(TAG, "Failed to receive request body, received: %d", received);
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        return ESP_FAIL;
+    }
+
+    cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
+    cJSON *static_ip_obj = cJSON_GetObjectItemCaseSensitive(in_json, "static_ip");
+    cJSON *ps_idle_obj = cJSON_GetObjectItemCaseSensitive(in_json, "power_save_idle_s");
+    if(received == 0 || in_json == NULL || (static_ip_obj == NULL && ps_idle_obj == NULL) ||
+       (ps_idle_obj != NULL && (!cJSON_IsNumber(ps_idle_obj) || ps_idle_obj->valuedouble < 0 || ps_idle_obj->valuedouble > UINT32_MAX)))
+    {
+        ESP_LOGE(TAG, "Failed to parse JSON request body");
+        cJSON_Delete(in_json);
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+        return ESP_OK;
+    }
+
+    esp_netif_ip_info_t ip_info;
+    bool use_static = static_ip_obj != NULL && !cJSON_IsNull(static_ip_obj);
+    if(use_static)
+    {
+        char* netmask = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "netmask"));
+        char* gateway = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "gateway"));
+        if(!cJSON_IsString(static_ip_obj) || netmask == NULL || gateway == NULL ||
+           esp_netif_str_to_ip4(cJSON_GetStringValue(static_ip_obj), &ip_info.ip) != ESP_OK ||
+           esp_netif_str_to_ip4(netmask, &ip_info.netmask) != ESP_OK ||
+           esp_netif_str_to_ip4(gateway, &ip_info.gw) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Invalid 'static_ip', 'netmask' or 'gateway' parameter in JSON request");
+            cJSON_Delete(in_json);
+            httpd_resp_set_status(req, "400 Bad Request");
+            httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+            return ESP_OK;
+        }
+    }
+    bool set_ip = static_ip_obj != NULL;
+    bool set_ps_idle = ps_idle_obj != NULL;
+    uint32_t ps_idle_s = set_ps_idle ? (uint32_t)ps_idle_obj->valuedouble : 0;
+    cJSON_Delete(in_json);
+
+    esp_err_t ret = set_ps_idle ? airhive_wifi_set_ps_idle_timeout(ps_idle_s) : ESP_OK;
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error setting power save idle time: %s", esp_err_to_name(ret));
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        return ESP_OK;
+    }
+
+    // Respond first, the connection is likely to drop if the address changes.
+    httpd_resp_set_status(req, "200 OK");
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(set_ip) ret = airhive_wifi_set_static_ip(use_static ? &ip_info : NULL);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error setting network config: %s", esp_err_to_name(ret));
+    }
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static void network_status_write(status_out_t* out, const airhive_wifi_stats_t* stats)
+{
+    status_fields(out, wifi_fields, STATUS_FIELDS_COUNT(wifi_fields), stats);
+    status_map(out, "power_save");
+    status_fields(out, power_save_fields, STATUS_FIELDS_COUNT(power_save_fields), stats);
+    status_end(out);
+}
+
+static esp_err_t network_status_send_cbor(httpd_req_t* req)
+{
+    airhive_wifi_stats_t stats;
+    if(airhive_wifi_get_stats(&stats) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to get network status");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        return ESP_OK;
+    }
+    airhive_cbor_t enc;
+    httpd_resp_set_status(req, "200 OK");
+    airhive_cbor_start(&enc, req);
+    airhive_cbor_map(&enc);
+    status_out_t out = { .cbor = &enc };
+    network_status_write(&out, &stats);
+    airhive_cbor_end(&enc);
+    return (airhive_cbor_finish(&enc) == ESP_OK) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t network_status_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /network-status");
+    if(airhive_cbor_accepted(req)) return network_status_send_cbor(req);
+    httpd_resp_set_type(req, "application/json");
+    airhive_wifi_stats_t stats;
+    cJSON *json = cJSON_CreateObject();
+    if(json == NULL || airhive_wifi_get_stats(&stats) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to get network status");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    status_out_t out = { .containers = { json }, .depth = 1 };
+    network_status_write(&out, &stats);
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    char *json_str = cJSON_Print(json);
+    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        esp_err_t ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t boot_status_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /boot-status");
+    httpd_resp_set_type(req, "application/json");
+    cJSON *json = cJSON_CreateObject();
+    if(json == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create JSON object");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    // Time since boot in ms of every phase, null if not reached, and the error of failed phases.
+    for(airhive_boot_phase_t phase = 0; phase < AIRHIVE_BOOT_PHASE_COUNT; phase++)
+    {
+        cJSON *phase_json = cJSON_AddObjectToObject(json, airhive_boot_phase_name(phase));
+        int64_t timestamp_us = airhive_boot_timestamp_us(phase);
+        if(timestamp_us != 0) cJSON_AddNumberToObject(phase_json, "ms", timestamp_us / 1000.0);
+        else cJSON_AddNullToObject(phase_json, "ms");
+        esp_err_t error = airhive_boot_error(phase);
+        if(error != ESP_OK) cJSON_AddStringToObject(phase_json, "error", esp_err_to_name(error));
+    }
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    char *json_str = cJSON_Print(json);
+    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        esp_err_t ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+// Heap state per capability and the allocations of the server per module. Everything is read before the answer is
+// built, so the snapshot doesn't include the request's own allocations.
+esp_err_t heap_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /heap");
+    static const struct {
+        const char* name;
+        uint32_t caps;
+    } heaps[] = {
+        { "internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT },
+        { "dma", MALLOC_CAP_DMA },
+        { "spiram", MALLOC_CAP_SPIRAM }
+    };
+    airhive_heap_caps_stats_t caps_stats[sizeof(heaps) / sizeof(heaps[0])];
+    for(size_t i = 0; i < sizeof(heaps) / sizeof(heaps[0]); i++) airhive_heap_get_caps_stats(heaps[i].caps, &caps_stats[i]);
+    airhive_heap_module_stats_t module_stats[AIRHIVE_HEAP_MODULE_COUNT];
+    for(airhive_heap_module_t module = 0; module < AIRHIVE_HEAP_MODULE_COUNT; module++)
+    {
+        airhive_heap_get_module_stats(module, &module_stats[module]);
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    cJSON *json = cJSON_CreateObject();
+    if(json == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create JSON object");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    cJSON_AddNumberToObject(json, "uptime_ms", esp_timer_get_time() / 1000);
+    cJSON *caps_json = cJSON_AddObjectToObject(json, "capabilities");
+    for(size_t i = 0; i < sizeof(heaps) / sizeof(heaps[0]); i++)
+    {
+        cJSON *heap = cJSON_AddObjectToObject(caps_json, heaps[i].name);
+        cJSON_AddNumberToObject(heap, "free", caps_stats[i].total_free_bytes);
+        // null where the allocator can't tell, i.e. on the linux target.
+        if(caps_stats[i].layout_known) cJSON_AddNumberToObject(heap, "largest_free_block", caps_stats[i].largest_free_block);
+        else cJSON_AddNullToObject(heap, "largest_free_block");
+        cJSON_AddNumberToObject(heap, "minimum_free", caps_stats[i].minimum_free_bytes);
+        cJSON_AddNumberToObject(heap, "allocated_blocks", caps_stats[i].allocated_blocks);
+        cJSON_AddNumberToObject(heap, "free_blocks", caps_stats[i].free_blocks);
+        if(caps_stats[i].layout_known) cJSON_AddNumberToObject(heap, "fragmentation", caps_stats[i].fragmentation);
+        else cJSON_AddNullToObject(heap, "fragmentation");
+    }
+    cJSON *modules_json = cJSON_AddObjectToObject(json, "modules");
+    for(airhive_heap_module_t module = 0; module < AIRHIVE_HEAP_MODULE_COUNT; module++)
+    {
+        const airhive_heap_module_stats_t* stats = &module_stats[module];
+        cJSON *module_json = cJSON_AddObjectToObject(modules_json, airhive_heap_module_name(module));
+        cJSON_AddNumberToObject(module_json, "allocs", stats->allocs);
+        cJSON_AddNumberToObject(module_json, "frees", stats->frees);
+        cJSON_AddNumberToObject(module_json, "failures", stats->failures);
+        cJSON_AddNumberToObject(module_json, "live_bytes", stats->live_bytes);
+        cJSON_AddNumberToObject(module_json, "live_internal_bytes", stats->live_internal_bytes);
+        cJSON_AddNumberToObject(module_json, "peak_bytes", stats->peak_bytes);
+        cJSON_AddNumberToObject(module_json, "largest_alloc", stats->largest_alloc);
+    }
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    char *json_str = cJSON_Print(json);
+    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        esp_err_t ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t macros_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /macros");
+    httpd_resp_set_type(req, "application/json");
+    char (*names)[CNCM_MAX_MACRO_NAME_SIZE + 1] = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, MAX_LISTED_MACROS * sizeof(*names));
+    char *body = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, CNCM_MAX_MACRO_SIZE + 1);
+    cJSON *json = cJSON_CreateObject();
+    cJSON *macros = cJSON_AddObjectToObject(json, "macros");
+    size_t names_count = 0;
+    if(names == NULL || body == NULL || macros == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate macros listing");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    esp_err_t ret = cncm_macro_list(names, MAX_LISTED_MACROS, &names_count);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to list macros, error: %s", esp_err_to_name(ret));
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    for(size_t i = 0; i < names_count; i++)
+    {
+        if(cncm_macro_get(names[i], body, CNCM_MAX_MACRO_SIZE + 1) == ESP_OK) cJSON_AddStringToObject(macros, names[i], body);
+    }
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, names);
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, body);
+    char *json_str = cJSON_Print(json);
+    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+// Handles both PUT (store, body has "name" and "body") and DELETE (body has "name") on /macros.
+esp_err_t macros_put_delete_handler(httpd_req_t* req)
+{
+    bool is_put = (req->method == HTTP_PUT);
+    ESP_LOGI(TAG, "Received %s request on /macros", is_put ? "PUT" : "DELETE");
+    httpd_resp_set_type(req, "application/json");
+
+    // Every byte of the body might be escaped in JSON.
+    const size_t MAX_LOCAL_REQUEST_SIZE = 2 * CNCM_MAX_MACRO_SIZE + 64;
+    if(req->content_len > MAX_LOCAL_REQUEST_SIZE)
+    {
+        ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, MAX_LOCAL_REQUEST_SIZE);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 413 status.
+        return ESP_OK;
+    }
+
+    char body_buffer[MAX_LOCAL_REQUEST_SIZE];
+    size_t received = 0;
+    while (received < req->content_len) {
+        int ret = httpd_req_recv(req, body_buffer + received, req->content_len - received);
+        if (ret <= 0) {
+            ESP_LOGE(TAG, "Error receiving request body: ret=%d", ret);
+            httpd_resp_set_status(req, "500 Internal Server Error");
+            httpd_resp_send(req, NULL, 0);
+            return ESP_FAIL;
+        }
+        received += ret;
+    }
+
+    cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
+    const char* name = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "name"));
+    const char* macro_body = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "body"));
+    if(in_json == NULL || name == NULL || (is_put && macro_body == NULL))
+    {
+        ESP_LOGE(TAG, "Invalid 'name' or 'body' parameter in JSON request");
+        cJSON_Delete(in_json);
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+        return ESP_OK;
+    }
+
+    esp_err_t ret = is_put ? cncm_macro_set(name, macro_body) : cncm_macro_delete(name);
+    cJSON_Delete(in_json);
+    if(ret == ESP_ERR_INVALID_ARG || ret == ESP_ERR_INVALID_SIZE) httpd_resp_set_status(req, "400 Bad Request");
+    else if(ret == ESP_ERR_NOT_FOUND) httpd_resp_set_status(req, "404 Not Found");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else httpd_resp_set_status(req, "200 OK");
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to update macro, error: %s", esp_err_to_name(ret));
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Reads a small JSON request body into in_json, on failure the error response is already sent and NULL is returned.
+// An empty body reads as {}, so requests whose fields are all optional can be sent without one.
+static cJSON* small_json_body_recv(httpd_req_t* req, size_t max_size)
+{
+    if(req->content_len > max_size)
+    {
+        ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, max_size);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 413 status.
+        return NULL;
+    }
+    if(req->content_len == 0)
+    {
+        cJSON *empty_json = cJSON_CreateObject();
+        if(empty_json == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to create JSON object");
+            httpd_resp_set_status(req, "500 Internal Server Error");
+            httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        }
+        return empty_json;
+    }
+    char body_buffer[MAX_SMALL_REQUEST_SIZE];
+    int received = httpd_req_recv(req, body_buffer, MIN(req->content_len, sizeof(body_buffer)));
+    if(received != req->content_len)
+    {
+        ESP_LOGE(TAG, "Failed to receive request body, received: %d", received);
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        return NULL;
+    }
+    cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
+    if(in_json == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to parse JSON request body");
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+    }
+    return in_json;
+}
+
+esp_err_t commands_results_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /commands/results");
+    httpd_resp_set_type(req, "application/json");
+    cJSON *in_json = small_json_body_recv(req, MAX_SMALL_REQUEST_SIZE);
+    if(in_json == NULL) return ESP_OK;
+    cJSON *first_id_obj = cJSON_GetObjectItemCaseSensitive(in_json, "first_id");
+    cJSON *count_obj = cJSON_GetObjectItemCaseSensitive(in_json, "count");
+    cJSON *wait_obj = cJSON_GetObjectItemCaseSensitive(in_json, "wait_ms");
+    bool valid = cJSON_IsNumber(first_id_obj) && first_id_obj->valuedouble >= 1 && first_id_obj->valuedouble <= UINT32_MAX &&
+                 (count_obj == NULL || (cJSON_IsNumber(count_obj) && count_obj->valuedouble >= 1 &&
+                                        count_obj->valuedouble <= CNCM_MAX_TRACKED_COMMANDS)) &&
+                 (wait_obj == NULL || (cJSON_IsNumber(wait_obj) && wait_obj->valuedouble >= 0 &&
+                                       wait_obj->valuedouble <= MAX_COMMAND_WAIT_MS));
+    uint32_t first_id = valid ? (uint32_t)first_id_obj->valuedouble : 0;
+    size_t count = (count_obj != NULL) ? (size_t)count_obj->valuedouble : 1;
+    uint32_t wait_ms = (wait_obj != NULL) ? (uint32_t)wait_obj->valuedouble : 0;
+    cJSON_Delete(in_json);
+    if(!valid)
+    {
+        ESP_LOGE(TAG, "Invalid 'first_id', 'count' or 'wait_ms' parameter in JSON request");
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+        return ESP_OK;
+    }
+
+    cJSON *out_json = NULL;
+    cncm_cmd_result_t *results = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, count * sizeof(cncm_cmd_result_t));
+    esp_err_t ret = (results == NULL) ? ESP_ERR_NO_MEM : cncm_tx_results(first_id, count, wait_ms, results);
+    if(ret == ESP_ERR_NOT_FOUND) httpd_resp_set_status(req, "404 Not Found");
+    else if(ret != ESP_OK && ret != ESP_ERR_TIMEOUT) httpd_resp_set_status(req, "500 Internal Server Error");
+    else
+    {
+        out_json = cJSON_CreateObject();
+        command_results_add_to_json(out_json, results, count, ret == ESP_OK);
+        httpd_resp_set_status(req, "200 OK");
+    }
+    if(ret != ESP_OK && ret != ESP_ERR_TIMEOUT) ESP_LOGE(TAG, "Failed to get command results, error: %s", esp_err_to_name(ret));
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, results);
+
+    char *json_str = cJSON_Print(out_json);
+    cJSON_Delete(out_json);
+    ret = httpd_resp_send(req, json_str, (json_str == NULL) ? 0 : HTTPD_RESP_USE_STRLEN);
+    cJSON_free(json_str);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static cJSON* job_info_to_json(const cncm_job_info_t* info)
+{
+    static const char* state_names[] = {
+        [CNCM_JOB_QUEUED] = "queued",
+        [CNCM_JOB_RUNNING] = "running",
+        [CNCM_JOB_FINISHED] = "finished",
+        [CNCM_JOB_CANCELLED] = "cancelled"
+    };
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "job_id", info->id);
+    cJSON_AddStringToObject(json, "name", info->name);
+    cJSON_AddStringToObject(json, "state", state_names[info->state]);
+    cJSON_AddBoolToObject(json, "closed", info->closed);
+    cJSON_AddNumberToObject(json, "total_lines", info->total_lines);
+    cJSON_AddNumberToObject(json, "total_bytes", info->total_bytes);
+    cJSON_AddNumberToObject(json, "lines_sent", info->lines_sent);
+    cJSON_AddNumberToObject(json, "bytes_sent", info->bytes_sent);
+    cJSON_AddNumberToObject(json, "lines_acked", info->lines_acked);
+    cJSON_AddNumberToObject(json, "lines_lost", info->lines_lost);
+    cJSON_AddNumberToObject(json, "ack_rate", info->ack_rate);
+    if(info->eta_us >= 0) cJSON_AddNumberToObject(json, "eta_s", info->eta_us / 1000000.0);
+    else cJSON_AddNullToObject(json, "eta_s");
+    if(info->started_us != 0 && info->finished_us != 0)
+    {
+        cJSON_AddNumberToObject(json, "duration_s", (info->finished_us - info->started_us) / 1000000.0);
+    }
+    return json;
+}
+
+esp_err_t jobs_post_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received POST request on /jobs");
+    httpd_resp_set_type(req, "application/json");
+    cJSON *in_json = small_json_body_recv(req, MAX_SMALL_REQUEST_SIZE);
+    if(in_json == NULL) return ESP_OK;
+    const char* name = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "name"));
+    uint32_t job_id = 0;
+    esp_err_t ret = cncm_job_create((name != NULL) ? name : "", &job_id);
+    cJSON_Delete(in_json);
+
+    cJSON *out_json = NULL;
+    if(ret == ESP_ERR_NO_MEM) httpd_resp_set_status(req, "503 Service Unavailable");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else
+    {
+        out_json = cJSON_CreateObject();
+        cJSON_AddNumberToObject(out_json, "job_id", job_id);
+        httpd_resp_set_status(req, "200 OK");
+    }
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to create job, error: %s", esp_err_to_name(ret));
+
+    char *json_str = cJSON_Print(out_json);
+    cJSON_Delete(out_json);
+    ret = httpd_resp_send(req, json_str, (json_str == NULL) ? 0 : HTTPD_RESP_USE_STRLEN);
+    cJSON_free(json_str);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t jobs_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /jobs");
+    httpd_resp_set_type(req, "application/json");
+    cncm_job_info_t *infos = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, CNCM_MAX_JOBS * sizeof(cncm_job_info_t));
+    cJSON *json = cJSON_CreateObject();
+    cJSON *jobs = cJSON_AddArrayToObject(json, "jobs");
+    size_t infos_count = 0;
+    if(infos == NULL || jobs == NULL || cncm_job_list(infos, CNCM_MAX_JOBS, &infos_count) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to list jobs");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    for(size_t i = 0; i < infos_count; i++) cJSON_AddItemToArray(jobs, job_info_to_json(&infos[i]));
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, infos);
+    char *json_str = cJSON_Print(json);
+    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        esp_err_t ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t jobs_cancel_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /jobs/cancel");
+    httpd_resp_set_type(req, "application/json");
+    cJSON *in_json = small_json_body_recv(req, MAX_SMALL_REQUEST_SIZE);
+    if(in_json == NULL) return ESP_OK;
+    cJSON *job_id_obj = cJSON_GetObjectItemCaseSensitive(in_json, "job_id");
+    esp_err_t ret = cJSON_IsNumber(job_id_obj) ? cncm_job_cancel((uint32_t)job_id_obj->valuedouble) : ESP_ERR_INVALID_ARG;
+    cJSON_Delete(in_json);
+    if(ret == ESP_ERR_INVALID_ARG) httpd_resp_set_status(req, "400 Bad Request");
+    else if(ret == ESP_ERR_NOT_FOUND) httpd_resp_set_status(req, "404 Not Found");
+    else if(ret == ESP_ERR_INVALID_STATE) httpd_resp_set_status(req, "409 Conflict");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else httpd_resp_set_status(req, "200 OK");
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to cancel job, error: %s", esp_err_to_name(ret));
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t bridge_config_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /bridge-config");
+    httpd_resp_set_type(req, "application/json");
+    cJSON *in_json = small_json_body_recv(req, MAX_SMALL_REQUEST_SIZE);
+    if(in_json == NULL) return ESP_OK;
+    cJSON *enabled_obj = cJSON_GetObjectItemCaseSensitive(in_json, "enabled");
+    esp_err_t ret = cJSON_IsBool(enabled_obj) ? airhive_bridge_set_enabled(cJSON_IsTrue(enabled_obj)) : ESP_ERR_INVALID_ARG;
+    cJSON_Delete(in_json);
+    if(ret == ESP_ERR_INVALID_ARG) httpd_resp_set_status(req, "400 Bad Request");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else httpd_resp_set_status(req, "200 OK");
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to configure bridge, error: %s", esp_err_to_name(ret));
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static cJSON* modal_state_to_json(const cncm_modal_state_t* state)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON *position = cJSON_AddObjectToObject(json, "position");
+    cJSON_AddNumberToObject(position, "x", state->x);
+    cJSON_AddNumberToObject(position, "y", state->y);
+    cJSON_AddNumberToObject(position, "z", state->z);
+    cJSON_AddNumberToObject(position, "e", state->e);
+    cJSON_AddNumberToObject(json, "feedrate", state->feedrate);
+    cJSON_AddNumberToObject(json, "hotend_target", state->hotend_target);
+    cJSON_AddNumberToObject(json, "bed_target", state->bed_target);
+    cJSON_AddNumberToObject(json, "fan", state->fan);
+    cJSON_AddNumberToObject(json, "tool", state->tool);
+    cJSON_AddNumberToObject(json, "spindle", state->spindle);
+    cJSON_AddNumberToObject(json, "spindle_speed", state->spindle_speed);
+    cJSON_AddBoolToObject(json, "absolute", state->absolute);
+    cJSON_AddBoolToObject(json, "absolute_e", state->absolute_e);
+    cJSON_AddBoolToObject(json, "inches", state->inches);
+    return json;
+}
+
+esp_err_t checkpoint_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /checkpoint");
+    httpd_resp_set_type(req, "application/json");
+    cJSON *json = cJSON_CreateObject();
+    cncm_checkpoint_t checkpoint;
+    cncm_checkpoint_stats_t stats;
+    esp_err_t ret = cncm_checkpoint_get(&checkpoint);
+    if(json == NULL || (ret != ESP_OK && ret != ESP_ERR_NOT_FOUND) || cncm_checkpoint_get_stats(&stats) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to get checkpoint");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    if(ret == ESP_ERR_NOT_FOUND) cJSON_AddNullToObject(json, "checkpoint");
+    else
+    {
+        cJSON *checkpoint_json = cJSON_AddObjectToObject(json, "checkpoint");
+        cJSON_AddStringToObject(checkpoint_json, "name", checkpoint.name);
+        cJSON_AddNumberToObject(checkpoint_json, "line", checkpoint.line);
+        cJSON_AddItemToObject(checkpoint_json, "state", modal_state_to_json(&checkpoint.state));
+    }
+    cJSON *stats_json = cJSON_AddObjectToObject(json, "stats");
+    cJSON_AddNumberToObject(stats_json, "interval_s", stats.interval_s);
+    cJSON_AddNumberToObject(stats_json, "writes", stats.writes);
+    cJSON_AddNumberToObject(stats_json, "last_write_us", stats.last_write_us);
+    cJSON_AddNumberToObject(stats_json, "max_write_us", stats.max_write_us);
+    cJSON_AddNumberToObject(stats_json, "avg_write_us", (stats.writes > 0) ? stats.total_write_us / stats.writes : 0);
+    cJSON_AddNumberToObject(stats_json, "lag_lines", stats.lag_lines);
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    char *json_str = cJSON_Print(json);
+    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        esp_err_t send_ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(send_ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t checkpoint_delete_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received DELETE request on /checkpoint");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = cncm_checkpoint_discard();
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to discard checkpoint, error: %s", esp_err_to_name(ret));
+        httpd_resp_set_status(req, "500 Internal Server Error");
+    }
+    else httpd_resp_set_status(req, "200 OK");
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t checkpoint_config_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /checkpoint-config");
+    httpd_resp_set_type(req, "application/json");
+    cJSON *in_json = small_json_body_recv(req, MAX_SMALL_REQUEST_SIZE);
+    if(in_json == NULL) return ESP_OK;
+    cJSON *interval_obj = cJSON_GetObjectItemCaseSensitive(in_json, "interval_s");
+    esp_err_t ret = (cJSON_IsNumber(interval_obj) && interval_obj->valuedouble >= 1)
+        ? cncm_checkpoint_set_interval((uint32_t)interval_obj->valuedouble) : ESP_ERR_INVALID_ARG;
+    cJSON_Delete(in_json);
+    if(ret == ESP_ERR_INVALID_ARG) httpd_resp_set_status(req, "400 Bad Request");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else httpd_resp_set_status(req, "200 OK");
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to configure checkpoints, error: %s", esp_err_to_name(ret));
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t jobs_resume_post_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received POST request on /jobs/resume");
+    httpd_resp_set_type(req, "application/json");
+    uint32_t job_id = 0;
+    uint32_t resume_line = 0;
+    esp_err_t ret = cncm_job_resume(&job_id, &resume_line);
+
+    cJSON *out_json = NULL;
+    if(ret == ESP_ERR_NOT_FOUND) httpd_resp_set_status(req, "404 Not Found");
+    else if(ret == ESP_ERR_NO_MEM) httpd_resp_set_status(req, "503 Service Unavailable");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else
+    {
+        out_json = cJSON_CreateObject();
+        cJSON_AddNumberToObject(out_json, "job_id", job_id);
+        cJSON_AddNumberToObject(out_json, "resume_line", resume_line);
+        httpd_resp_set_status(req, "200 OK");
+    }
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to resume job, error: %s", esp_err_to_name(ret));
+
+    char *json_str = cJSON_Print(out_json);
+    cJSON_Delete(out_json);
+    ret = httpd_resp_send(req, json_str, (json_str == NULL) ? 0 : HTTPD_RESP_USE_STRLEN);
+    cJSON_free(json_str);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Starts pulling a job from a URL, see airhive_fetch_start().
+esp_err_t jobs_fetch_post_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received POST request on /jobs/fetch");
+    httpd_resp_set_type(req, "application/json");
+    const size_t MAX_LOCAL_REQUEST_SIZE = AIRHIVE_FETCH_MAX_URL_SIZE + 64;
+    if(req->content_len > MAX_LOCAL_REQUEST_SIZE)
+    {
+        ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, MAX_LOCAL_REQUEST_SIZE);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 413 status.
+        return ESP_OK;
+    }
+    char body_buffer[MAX_LOCAL_REQUEST_SIZE];
+    int received = httpd_req_recv(req, body_buffer, req->content_len);
+    if(received != req->content_len)
+    {
+        ESP_LOGE(TAG, "Failed to receive request body, received: %d", received);
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        return ESP_FAIL;
+    }
+    cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
+    const char* url = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "url"));
+    const char* name = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "name"));
+    uint32_t job_id = 0;
+    esp_err_t ret = (url != NULL) ? airhive_fetch_start(url, name, &job_id) : ESP_ERR_INVALID_ARG;
+    cJSON_Delete(in_json);
+
+    cJSON *out_json = NULL;
+    if(ret == ESP_ERR_INVALID_ARG) httpd_resp_set_status(req, "400 Bad Request");
+    else if(ret == ESP_ERR_INVALID_STATE) httpd_resp_set_status(req, "409 Conflict");
+    else if(ret == ESP_ERR_NO_MEM) httpd_resp_set_status(req, "503 Service Unavailable");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else
+    {
+        out_json = cJSON_CreateObject();
+        cJSON_AddNumberToObject(out_json, "job_id", job_id);
+        httpd_resp_set_status(req, "200 OK");
+    }
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to start fetch, error: %s", esp_err_to_name(ret));
+
+    char *json_str = cJSON_Print(out_json);
+    cJSON_Delete(out_json);
+    ret = httpd_resp_send(req, json_str, (json_str == NULL) ? 0 : HTTPD_RESP_USE_STRLEN);
+    cJSON_free(json_str);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t jobs_fetch_get_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received GET request on /jobs/fetch");
+    httpd_resp_set_type(req, "application/json");
+    airhive_fetch_status_t *status = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, sizeof(airhive_fetch_status_t));
+    cJSON *json = cJSON_CreateObject();
+    if(status == NULL || json == NULL || airhive_fetch_get_status(status) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to get fetch status");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    cJSON_AddStringToObject(json, "state", airhive_fetch_state_name(status->state));
+    cJSON_AddStringToObject(json, "url", status->url);
+    cJSON_AddNumberToObject(json, "job_id", status->job_id);
+    cJSON_AddBoolToObject(json, "to_sd", status->to_sd);
+    cJSON_AddNumberToObject(json, "offset", (double)status->offset);
+    if(status->total_size > 0) cJSON_AddNumberToObject(json, "total_size", (double)status->total_size);
+    else cJSON_AddNullToObject(json, "total_size");
+    cJSON_AddNumberToObject(json, "lines", status->lines);
+    cJSON_AddNumberToObject(json, "requests", status->requests);
+    cJSON_AddNumberToObject(json, "retries", status->retries);
+    cJSON_AddNumberToObject(json, "full_waits", status->full_waits);
+    cJSON_AddNumberToObject(json, "last_http_status", status->last_http_status);
+    if(status->last_error != ESP_OK) cJSON_AddStringToObject(json, "last_error", esp_err_to_name(status->last_error));
+    else cJSON_AddNullToObject(json, "last_error");
+    cncm_sd_stats_t sd_stats;
+    if(status->to_sd && cncm_sd_transfer_get_stats(&sd_stats) == ESP_OK)
+    {
+        cJSON *sd_json = cJSON_AddObjectToObject(json, "sd");
+        cJSON_AddStringToObject(sd_json, "state", cncm_sd_state_name(sd_stats.state));
+        cJSON_AddStringToObject(sd_json, "filename", sd_stats.filename);
+        cJSON_AddBoolToObject(sd_json, "print", status->print);
+        cJSON_AddNumberToObject(sd_json, "bytes", (double)sd_stats.bytes);
+        cJSON_AddNumberToObject(sd_json, "bytes_per_s", sd_stats.bytes_per_s);
+        cJSON_AddNumberToObject(sd_json, "block_size", sd_stats.block_size);
+        cJSON_AddNumberToObject(sd_json, "packets", sd_stats.packets);
+        cJSON_AddNumberToObject(sd_json, "resends", sd_stats.resends);
+        cJSON_AddNumberToObject(sd_json, "timeouts", sd_stats.timeouts);
+        cJSON_AddBoolToObject(sd_json, "compression_available", sd_stats.compression_available);
+        int64_t end_us = (sd_stats.finished_us != 0) ? sd_stats.finished_us : esp_timer_get_time();
+        cJSON_AddNumberToObject(sd_json, "elapsed_ms", (double)((end_us - sd_stats.started_us) / 1000));
+        if(sd_stats.error != ESP_OK) cJSON_AddStringToObject(sd_json, "error", esp_err_to_name(sd_stats.error));
+        else cJSON_AddNullToObject(sd_json, "error");
+    }
+    httpd_resp_set_status(req, "200 OK");
+
+cleanup:
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, status);
+    char *json_str = cJSON_Print(json);
+    cJSON_Delete(json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        esp_err_t ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+// Starts copying a file from a URL to the printer's SD card, see airhive_fetch_start_sd().
+esp_err_t sd_upload_post_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received POST request on /sd-upload");
+    const size_t MAX_LOCAL_REQUEST_SIZE = AIRHIVE_FETCH_MAX_URL_SIZE + CNCM_SD_MAX_FILENAME_SIZE + 64;
+    if(req->content_len > MAX_LOCAL_REQUEST_SIZE)
+    {
+        ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, MAX_LOCAL_REQUEST_SIZE);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 413 status.
+        return ESP_OK;
+    }
+    char body_buffer[MAX_LOCAL_REQUEST_SIZE];
+    int received = httpd_req_recv(req, body_buffer, req->content_len);
+    if(received != req->content_len)
+    {
+        ESP_LOGE(TAG, "Failed to receive request body, received: %d", received);
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 500 status.
+        return ESP_FAIL;
+    }
+    cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
+    const char* url = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "url"));
+    const char* filename = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(in_json, "filename"));
+    bool print = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(in_json, "print"));
+    esp_err_t ret = ESP_ERR_INVALID_ARG;
+    if(url != NULL && filename != NULL)
+    {
+        if(cncm_get_dialect() != CNCM_DIALECT_MARLIN) ret = ESP_ERR_NOT_SUPPORTED;
+        else ret = airhive_fetch_start_sd(url, filename, print);
+    }
+    cJSON_Delete(in_json);
+
+    if(ret == ESP_ERR_INVALID_ARG) httpd_resp_set_status(req, "400 Bad Request");
+    else if(ret == ESP_ERR_NOT_SUPPORTED) httpd_resp_set_status(req, "501 Not Implemented");
+    else if(ret == ESP_ERR_INVALID_STATE) httpd_resp_set_status(req, "409 Conflict");
+    else if(ret == ESP_ERR_NO_MEM) httpd_resp_set_status(req, "503 Service Unavailable");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else httpd_resp_set_status(req, "202 Accepted");
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to start SD upload, error: %s", esp_err_to_name(ret));
+
+    ret = httpd_resp_send(req, NULL, 0);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t jobs_fetch_cancel_put_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received PUT request on /jobs/fetch/cancel");
+    esp_err_t ret = airhive_fetch_cancel();
+    if(ret == ESP_ERR_INVALID_STATE) httpd_resp_set_status(req, "409 Conflict");
+    else if(ret != ESP_OK) httpd_resp_set_status(req, "500 Internal Server Error");
+    else httpd_resp_set_status(req, "200 OK");
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to cancel fetch, error: %s", esp_err_to_name(ret));
+
+    esp_err_t send_ret = httpd_resp_send(req, NULL, 0);
+    if(send_ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(send_ret));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+typedef enum {
+    BATCH_OP_COMMANDS,
+    BATCH_OP_RESPONSES,
+    BATCH_OP_STATUS,
+    BATCH_OP_START,
+    BATCH_OP_STOP,
+    BATCH_OP_CLEAR,
+    BATCH_OP_COUNT
+} batch_op_t;
+
+static const char* batch_op_names[BATCH_OP_COUNT] = {
+    [BATCH_OP_COMMANDS] = "commands",
+    [BATCH_OP_RESPONSES] = "responses",
+    [BATCH_OP_STATUS] = "status",
+    [BATCH_OP_START] = "start",
+    [BATCH_OP_STOP] = "stop",
+    [BATCH_OP_CLEAR] = "clear"
+};
+
+// Returns BATCH_OP_COUNT if the operation is malformed.
+static batch_op_t batch_op_validate(const cJSON* operation)
+{
+    const char* name = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(operation, "op"));
+    if(name == NULL) return BATCH_OP_COUNT;
+    batch_op_t op = 0;
+    while(op < BATCH_OP_COUNT && strcmp(name, batch_op_names[op]) != 0) op++;
+    if(op == BATCH_OP_COMMANDS)
+    {
+        cJSON *commands = cJSON_GetObjectItemCaseSensitive(operation, "commands");
+        if(!cJSON_IsArray(commands)) return BATCH_OP_COUNT;
+        const cJSON *command = NULL;
+        cJSON_ArrayForEach(command, commands)
+        {
+            const char* command_str = cJSON_GetStringValue(command);
+            if(command_str == NULL || command_str[0] == '\0' || strlen(command_str) >= CNCM_MAX_COMMAND_SIZE) return BATCH_OP_COUNT;
+        }
+    }
+    else if(op == BATCH_OP_RESPONSES)
+    {
+        responses_params_t params;
+        if(!responses_params_parse(operation, &params)) return BATCH_OP_COUNT;
+    }
+    return op;
+}
+
+static esp_err_t batch_commands_enqueue(const cJSON* operation, cJSON* result)
+{
+    cJSON *commands = cJSON_GetObjectItemCaseSensitive(operation, "commands");
+    size_t commands_count = cJSON_GetArraySize(commands);
+    const char **command_strs = airhive_heap_malloc(AIRHIVE_HEAP_BUFFERS, MAX(commands_count, 1) * sizeof(char*));
+    if(command_strs == NULL) return ESP_ERR_NO_MEM;
+    size_t i = 0;
+    const cJSON *command = NULL;
+    cJSON_ArrayForEach(command, commands) command_strs[i++] = cJSON_GetStringValue(command);
+    size_t coalesced_count = 0;
+    esp_err_t ret = cncm_tx_producer_batch_coalesce(command_strs, commands_count, &coalesced_count);
+    airhive_heap_free(AIRHIVE_HEAP_BUFFERS, command_strs);
+    cJSON_AddNumberToObject(result, "sent_commands", (ret == ESP_OK) ? commands_count : 0);
+    cJSON_AddNumberToObject(result, "coalesced_commands", (ret == ESP_OK) ? coalesced_count : 0);
+    return ret;
+}
+
+static esp_err_t batch_op_run(batch_op_t op, const cJSON* operation, cJSON* result)
+{
+    switch(op)
+    {
+        case BATCH_OP_COMMANDS:
+            return batch_commands_enqueue(operation, result);
+        case BATCH_OP_RESPONSES:
+        {
+            responses_params_t params;
+            responses_params_parse(operation, &params);   // Already validated.
+            return responses_add_to_json(result, &params);
+        }
+        case BATCH_OP_STATUS:
+            machine_status_add_to_json(result);
+            return ESP_OK;
+        case BATCH_OP_START:
+            return cncm_resume();
+        case BATCH_OP_STOP:
+            return cncm_pause();
+        case BATCH_OP_CLEAR:
+            return cncm_clear_tx_buffer();
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+}
+
+// Runs several operations in one round trip, e.g. a host tick of commands, responses and status.
+// Every operation is validated before any of them runs, so a malformed batch changes nothing. They then run in order
+// until one fails, the ones after it are reported as skipped. A "commands" operation queues all of its lines or none.
+esp_err_t batch_post_handler(httpd_req_t* req)
+{
+    ESP_LOGI(TAG, "Received POST request on /batch");
+    httpd_resp_set_type(req, "application/json");
+
+    if(req->content_len > MAX_REQUEST_BODY_SIZE)
+    {
+        ESP_LOGE(TAG, "Request body too large: %d bytes, max allowed: %d bytes", req->content_len, MAX_REQUEST_BODY_SIZE);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 413 status.
+        return ESP_OK;
+    }
+
+    char body_buffer[MAX_REQUEST_BODY_SIZE];    // Shares the stack budget of /commands, only one request runs at a time.
+    size_t received = 0;
+    while (received < req->content_len) {
+        int ret = httpd_req_recv(req, body_buffer + received, req->content_len - received);
+        if (ret <= 0) {
+            ESP_LOGE(TAG, "Error receiving request body: ret=%d", ret);
+            httpd_resp_set_status(req, "500 Internal Server Error");
+            httpd_resp_send(req, NULL, 0);
+            return ESP_FAIL;
+        }
+        received += ret;
+    }
+
+    cJSON *in_json = cJSON_ParseWithLength(body_buffer, received);
+    cJSON *operations = cJSON_GetObjectItemCaseSensitive(in_json, "operations");
+    bool valid = cJSON_IsArray(operations) && cJSON_GetArraySize(operations) <= MAX_BATCH_OPERATIONS;
+    batch_op_t ops[MAX_BATCH_OPERATIONS];
+    size_t ops_count = 0;
+    const cJSON *operation = NULL;
+    if(valid)
+    {
+        cJSON_ArrayForEach(operation, operations)
+        {
+            ops[ops_count] = batch_op_validate(operation);
+            if(ops[ops_count++] == BATCH_OP_COUNT) valid = false;
+        }
+    }
+    if(!valid)
+    {
+        ESP_LOGE(TAG, "Invalid 'operations' parameter in JSON request");
+        cJSON_Delete(in_json);
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, NULL, 0); // Send empty response with 400 status.
+        return ESP_OK;
+    }
+
+    cJSON *out_json = cJSON_CreateObject();
+    cJSON *results = cJSON_AddArrayToObject(out_json, "results");
+    if(results == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create JSON object");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+        goto cleanup;
+    }
+    bool failed = false;
+    size_t i = 0;
+    cJSON_ArrayForEach(operation, operations)
+    {
+        cJSON *result = cJSON_CreateObject();
+        cJSON_AddStringToObject(result, "op", batch_op_names[ops[i]]);
+        if(failed) cJSON_AddBoolToObject(result, "skipped", true);
+        else
+        {
+            esp_err_t ret = batch_op_run(ops[i], operation, result);
+            cJSON_AddBoolToObject(result, "ok", ret == ESP_OK);
+            if(ret != ESP_OK)
+            {
+                ESP_LOGE(TAG, "Batch operation %s failed, error: %s", batch_op_names[ops[i]], esp_err_to_name(ret));
+                cJSON_AddStringToObject(result, "error", esp_err_to_name(ret));
+                failed = true;
+            }
+        }
+        cJSON_AddItemToArray(results, result);
+        i++;
+    }
+    httpd_resp_set_status(req, "200 OK");   // Failures are reported per operation.
+
+cleanup:
+    cJSON_Delete(in_json);
+    char *json_str = cJSON_Print(out_json);
+    cJSON_Delete(out_json); // Calling this with json == NULL is safe, it does nothing.
+    if(json_str == NULL) ESP_LOGE(TAG, "Failed to print JSON object");
+    else
+    {
+        esp_err_t ret = httpd_resp_send(req, json_str, HTTPD_RESP_USE_STRLEN);
+        cJSON_free(json_str);
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send response, error: %s", esp_err_to_name(ret));
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+// A handler that can't be registered only takes its endpoint down, the error is recorded on the http_ready phase
+// and the remaining ones are still registered.
+static void register_uri_handler(const httpd_uri_t* uri)
+{
+    esp_err_t ret = httpd_register_uri_handler(server_hdl, uri);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to register %s, error: %s", uri->uri, esp_err_to_name(ret));
+        airhive_boot_fail(AIRHIVE_BOOT_HTTP_READY, ret);
+    }
+}
+
+// The host build (host_test/airhive_host) runs several instances side by side, each is given its port and mDNS name in
+// AIRHIVE_PORT and AIRHIVE_NAME.
+static uint16_t server_port()
+{
+#if CONFIG_IDF_TARGET_LINUX
+    const char* port = getenv("AIRHIVE_PORT");
+    if(port != NULL && atoi(port) > 0 && atoi(port) <= UINT16_MAX) return atoi(port);
+#endif
+    return AIRHIVE_HTTP_PORT;
+}
+
+static void server_hostname(char* hostname, size_t hostname_size)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    const char* name = getenv("AIRHIVE_NAME");
+    snprintf(hostname, hostname_size, "%s", (name != NULL && name[0] != '\0') ? name : "Airhive-host");
+#else
+    // Get unique chip ID for hostname
+    uint8_t mac[6];
+    esp_efuse_mac_get_default(mac);
+    snprintf(hostname, hostname_size, "Airhive-%02X%02X%02X%02X%02X%02X", MAC2STR(mac));
+#endif
+}
+
+esp_err_t airhive_start_server()
+{
+    if(instance_created)
+    {
+        ESP_LOGI(TAG, "Server instance already exists.");
+        return ESP_ERR_INVALID_STATE;
     }
     
     httpd_config_t airhive_server_config = HTTPD_DEFAULT_CONFIG();
     airhive_server_config.task_priority          = ESP_TASK_MAIN_PRIO;
     airhive_server_config.stack_size             = SERVER_TASK_STACK_SIZE; // Stack size for the server task, TODO: review this, as we test call the test request.
-    airhive_server_config.server_port            = 80;
+    airhive_server_config.server_port            = server_port();
     airhive_server_config.max_resp_headers       = 8;    //TODO: review this.
     airhive_server_config.max_open_sockets       = 1;
     airhive_server_config.backlog_conn           = 5;
-    airhive_server_config.max_uri_handlers       = 11;
+    airhive_server_config.max_uri_handlers       = 40;
     airhive_server_config.send_wait_timeout      = 5;   // Timeout for send function (in seconds).
     airhive_server_config.recv_wait_timeout      = 5;   // Timeout for recv function (in seconds).
     airhive_server_config.enable_so_linger       = false;
@@ -387,6 +2464,7 @@ esp_err_t airhive_start_server()
     airhive_server_config.keep_alive_interval    = 5;   // Time between subsequent keep-alive probes, if client didn't respond.
     airhive_server_config.keep_alive_count       = 3;   // Number of keep-alive probes to send before closing the connection.
 
+    airhive_heap_init();    // Before any handler builds JSON.
     ESP_LOGI(TAG, "Creating server instance...");
     esp_err_t ret = httpd_start(&server_hdl, &airhive_server_config);
     if(ret != ESP_OK)
@@ -400,66 +2478,273 @@ esp_err_t airhive_start_server()
     httpd_uri_t test_get = {
         .uri = "/test",
         .method = HTTP_GET,
-        .handler = test_get_handler,
-        .user_ctx = NULL
+        .handler = dispatch_handler,
+        .user_ctx = test_get_handler
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_hdl, &test_get));
+    register_uri_handler(&test_get);
 
     httpd_uri_t machine_config_put = {
         .uri = "/machine-config",
         .method = HTTP_PUT,
-        .handler = machine_config_put_handler,
-        .user_ctx = NULL
+        .handler = dispatch_handler,
+        .user_ctx = machine_config_put_handler
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_hdl, &machine_config_put));
+    register_uri_handler(&machine_config_put);
 
     httpd_uri_t machine_status_get = {
         .uri = "/machine-status",
         .method = HTTP_GET,
-        .handler = machine_status_get_handler,
-        .user_ctx = NULL
+        .handler = dispatch_handler,
+        .user_ctx = machine_status_get_handler
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_hdl, &machine_status_get));
+    register_uri_handler(&machine_status_get);
 
     httpd_uri_t responses_get = {
         .uri = "/responses",
         .method = HTTP_GET,
-        .handler = responses_get_handler,
-        .user_ctx = NULL
+        .handler = dispatch_handler,
+        .user_ctx = responses_get_handler
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_hdl, &responses_get));
+    register_uri_handler(&responses_get);
+    httpd_uri_t responses_subscriptions_post = {
+        .uri = "/responses/subscriptions",
+        .method = HTTP_POST,
+        .handler = dispatch_handler,
+        .user_ctx = responses_subscriptions_handler
+    };
+    register_uri_handler(&responses_subscriptions_post);
+    httpd_uri_t responses_subscriptions_delete = {
+        .uri = "/responses/subscriptions",
+        .method = HTTP_DELETE,
+        .handler = dispatch_handler,
+        .user_ctx = responses_subscriptions_handler
+    };
+    register_uri_handler(&responses_subscriptions_delete);
+    httpd_uri_t log_get = {
+        .uri = "/log",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = log_get_handler
+    };
+    register_uri_handler(&log_get);
 
     httpd_uri_t commands_post = {
         .uri = "/commands",
         .method = HTTP_POST,
-        .handler = commands_post_handler,
-        .user_ctx = NULL
+        .handler = dispatch_handler,
+        .user_ctx = commands_post_handler
+    };
+    register_uri_handler(&commands_post);
+    httpd_uri_t commands_results_get = {
+        .uri = "/commands/results",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = commands_results_get_handler
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_hdl, &commands_post));
+    register_uri_handler(&commands_results_get);
 
     httpd_uri_t start_put = {
         .uri = "/start",
         .method = HTTP_PUT,
-        .handler = start_put_handler,
-        .user_ctx = NULL
+        .handler = dispatch_handler,
+        .user_ctx = start_put_handler
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_hdl, &start_put));
+    register_uri_handler(&start_put);
 
     httpd_uri_t stop_put = {
         .uri = "/stop",
         .method = HTTP_PUT,
-        .handler = stop_put_handler,
-        .user_ctx = NULL
+        .handler = dispatch_handler,
+        .user_ctx = stop_put_handler
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_hdl, &stop_put));
+    register_uri_handler(&stop_put);
 
     httpd_uri_t clear_put = {
         .uri = "/clear",
         .method = HTTP_PUT,
-        .handler = clear_put_handler,
-        .user_ctx = NULL
+        .handler = dispatch_handler,
+        .user_ctx = clear_put_handler
+    };
+    register_uri_handler(&clear_put);
+
+    httpd_uri_t network_config_put = {
+        .uri = "/network-config",
+        .method = HTTP_PUT,
+        .handler = dispatch_handler,
+        .user_ctx = network_config_put_handler
+    };
+    register_uri_handler(&network_config_put);
+
+    httpd_uri_t network_status_get = {
+        .uri = "/network-status",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = network_status_get_handler
+    };
+    register_uri_handler(&network_status_get);
+
+    httpd_uri_t boot_status_get = {
+        .uri = "/boot-status",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = boot_status_get_handler
+    };
+    register_uri_handler(&boot_status_get);
+    httpd_uri_t heap_get = {
+        .uri = "/heap",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = heap_get_handler
+    };
+    register_uri_handler(&heap_get);
+
+    httpd_uri_t macros_get = {
+        .uri = "/macros",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = macros_get_handler
+    };
+    register_uri_handler(&macros_get);
+
+    httpd_uri_t macros_put = {
+        .uri = "/macros",
+        .method = HTTP_PUT,
+        .handler = dispatch_handler,
+        .user_ctx = macros_put_delete_handler
+    };
+    register_uri_handler(&macros_put);
+
+    httpd_uri_t macros_delete = {
+        .uri = "/macros",
+        .method = HTTP_DELETE,
+        .handler = dispatch_handler,
+        .user_ctx = macros_put_delete_handler
+    };
+    register_uri_handler(&macros_delete);
+
+    httpd_uri_t jobs_post = {
+        .uri = "/jobs",
+        .method = HTTP_POST,
+        .handler = dispatch_handler,
+        .user_ctx = jobs_post_handler
+    };
+    register_uri_handler(&jobs_post);
+
+    httpd_uri_t jobs_get = {
+        .uri = "/jobs",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = jobs_get_handler
+    };
+    register_uri_handler(&jobs_get);
+
+    httpd_uri_t job_commands_post = {
+        .uri = "/jobs/commands",
+        .method = HTTP_POST,
+        .handler = dispatch_handler,
+        .user_ctx = job_commands_post_handler
+    };
+    register_uri_handler(&job_commands_post);
+
+    httpd_uri_t jobs_cancel_put = {
+        .uri = "/jobs/cancel",
+        .method = HTTP_PUT,
+        .handler = dispatch_handler,
+        .user_ctx = jobs_cancel_put_handler
+    };
+    register_uri_handler(&jobs_cancel_put);
+
+    httpd_uri_t batch_post = {
+        .uri = "/batch",
+        .method = HTTP_POST,
+        .handler = dispatch_handler,
+        .user_ctx = batch_post_handler
+    };
+    register_uri_handler(&batch_post);
+
+    httpd_uri_t bridge_config_put = {
+        .uri = "/bridge-config",
+        .method = HTTP_PUT,
+        .handler = dispatch_handler,
+        .user_ctx = bridge_config_put_handler
+    };
+    register_uri_handler(&bridge_config_put);
+
+    httpd_uri_t emergency_stop_put = {
+        .uri = "/emergency-stop",
+        .method = HTTP_PUT,
+        .handler = dispatch_handler,
+        .user_ctx = emergency_stop_put_handler
+    };
+    register_uri_handler(&emergency_stop_put);
+
+    httpd_uri_t status_query_put = {
+        .uri = "/status-query",
+        .method = HTTP_PUT,
+        .handler = dispatch_handler,
+        .user_ctx = status_query_put_handler
+    };
+    register_uri_handler(&status_query_put);
+
+    httpd_uri_t checkpoint_get = {
+        .uri = "/checkpoint",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = checkpoint_get_handler
+    };
+    register_uri_handler(&checkpoint_get);
+
+    httpd_uri_t checkpoint_delete = {
+        .uri = "/checkpoint",
+        .method = HTTP_DELETE,
+        .handler = dispatch_handler,
+        .user_ctx = checkpoint_delete_handler
+    };
+    register_uri_handler(&checkpoint_delete);
+
+    httpd_uri_t checkpoint_config_put = {
+        .uri = "/checkpoint-config",
+        .method = HTTP_PUT,
+        .handler = dispatch_handler,
+        .user_ctx = checkpoint_config_put_handler
+    };
+    register_uri_handler(&checkpoint_config_put);
+
+    httpd_uri_t jobs_resume_post = {
+        .uri = "/jobs/resume",
+        .method = HTTP_POST,
+        .handler = dispatch_handler,
+        .user_ctx = jobs_resume_post_handler
+    };
+    register_uri_handler(&jobs_resume_post);
+    httpd_uri_t jobs_fetch_post = {
+        .uri = "/jobs/fetch",
+        .method = HTTP_POST,
+        .handler = dispatch_handler,
+        .user_ctx = jobs_fetch_post_handler
+    };
+    register_uri_handler(&jobs_fetch_post);
+    httpd_uri_t jobs_fetch_get = {
+        .uri = "/jobs/fetch",
+        .method = HTTP_GET,
+        .handler = dispatch_handler,
+        .user_ctx = jobs_fetch_get_handler
+    };
+    register_uri_handler(&jobs_fetch_get);
+    httpd_uri_t jobs_fetch_cancel_put = {
+        .uri = "/jobs/fetch/cancel",
+        .method = HTTP_PUT,
+        .handler = dispatch_handler,
+        .user_ctx = jobs_fetch_cancel_put_handler
+    };
+    register_uri_handler(&jobs_fetch_cancel_put);
+    httpd_uri_t sd_upload_post = {
+        .uri = "/sd-upload",
+        .method = HTTP_POST,
+        .handler = dispatch_handler,
+        .user_ctx = sd_upload_post_handler
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_hdl, &clear_put));
+    register_uri_handler(&sd_upload_post);
 
     instance_created = true;
     return ESP_OK;
@@ -475,11 +2760,8 @@ esp_err_t airhive_start_mdns()
     }
     ESP_LOGI(TAG, "mDNS initialized successfully");
 
-    // Get unique chip ID for hostname
-    uint8_t mac[6];
-    esp_efuse_mac_get_default(mac);
-    char hostname[21];
-    snprintf(hostname, sizeof(hostname), "Airhive-%02X%02X%02X%02X%02X%02X", MAC2STR(mac));
+    char hostname[AIRHIVE_HOSTNAME_SIZE];
+    server_hostname(hostname, sizeof(hostname));
 
     ret = mdns_hostname_set(hostname);
     if (ret != ESP_OK) {
@@ -487,7 +2769,7 @@ esp_err_t airhive_start_mdns()
         return ret;
     }
 
-    ret = mdns_service_add(NULL, "_http", "_tcp", 80, NULL, 0); //TODO: check adding txt.
+    ret = mdns_service_add(NULL, "_http", "_tcp", server_port(), NULL, 0); //TODO: check adding txt.
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "mDNS service add failed: %s", esp_err_to_name(ret));
         return ret;
@@ -8,6 +8,13 @@
 // The stack size depends on the maximum request body size, as we need to allocate a buffer for it on the stack.
 #define SERVER_TASK_STACK_SIZE (MAX_REQUEST_BODY_SIZE + 4098)
 #define MAX_RESPONSE_SIZE 5000
+#define MAX_LISTED_MACROS 32
+#define MAX_SMALL_REQUEST_SIZE 128  // For requests that only carry a few parameters.
+#define MAX_BATCH_OPERATIONS 8
+#define MAX_COMMAND_WAIT_MS 10000  // The server answers nothing else while a request waits for its commands.
+#define LOG_READ_CHUNK_SIZE 2048  // The flash log is streamed in chunks of this size.
+#define AIRHIVE_HTTP_PORT 80
+#define AIRHIVE_HOSTNAME_SIZE 32  // mDNS hostname and its terminator, "Airhive-" and the MAC on a device.
 
 esp_err_t airhive_start_server();
 
@@ -4,19 +4,34 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
-#include "freertos/message_buffer.h"
-#include "freertos/stream_buffer.h"
+#include "freertos/event_groups.h"
 #include "esp_task.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "sys/param.h"
 #include "nvs_flash.h"
 
 #include "usb/usb_host.h"
 #include "usb/cdc_acm_host.h"
 
 #include "cncm.h"
-
-
-static MessageBufferHandle_t tx_buffer;
-static StreamBufferHandle_t rx_buffer;
+#include "cncm_private.h"
+
+
+// Records of the tx_queue are lines with their separator, tagged with their job slot (CNCM_NO_JOB_SLOT if none).
+static cncm_ring_t tx_ring;
+static SemaphoreHandle_t tx_lock;   //Serializes the producers, recursive since macros and batches go through cncm_tx_enqueue().
+// The rx side is an append-only ring, bytes are addressed by their offset since boot (rx_head is the total ever written),
+// so any number of readers can follow it with their own cursors and nothing is consumed by reading. The USB callback is
+// the only writer and never waits for readers: it bumps rx_seq to odd, publishes rx_head, and bumps it back to even,
+// readers retry until they read it at the same even rx_seq.
+static uint8_t* rx_buffer;
+static uint64_t rx_head = 0;
+static uint32_t rx_seq = 0;
+#define RX_SEQ_SPINS (32)   //Odd rx_seq reads before a reader backs off.
+static char ack_output_text[CNCM_ACK_OUTPUT_SIZE];  //Only touched by the rx callback, like ack_output.
+static cncm_ack_output_t ack_output = { .text = ack_output_text, .len = 0, .error = false };
+static uint64_t rx_default_cursor = 0;  // Cursor used by cncm_rx_consumer() for clients that don't track their own.
 static SemaphoreHandle_t paused;
 static bool cncm_initialized = false;
 static nvs_handle_t cncm_nvs;
@@ -25,41 +40,115 @@ static char* cncm_namespace = "CNCM";
 static const char *TAG = "CNCM";
 //right now, checking that device is open is assumed to be equivalent to checking if this is null.
 static cdc_acm_dev_hdl_t cdc_dev = NULL;
+//Guards cdc_dev and the open in progress. The driver reports a disconnect from its own task, while machine_manager opens
+//the device and a reopen closes it from the HTTP task: whoever takes a handle back under the lock is the one to close it.
+static SemaphoreHandle_t dev_lock;
+static bool dev_opening = false;        //machine_open holds a handle it hasn't published yet.
+static bool dev_opening_lost = false;   //That handle was disconnected meanwhile, machine_open closes it.
+
+//Link events, CONNECTED is held while cdc_dev is usable, ATTACH asks machine_manager to (re)open the device.
+static EventGroupHandle_t link_events;
+#define LINK_CONNECTED_BIT BIT0
+#define LINK_ATTACH_BIT BIT1
+static cncm_link_stats_t link_stats;
+static int64_t disconnected_at_us = 0;  //0 while connected or before the first connection.
+static int64_t attached_at_us = 0;
 
 //May be extended afterwards.
 typedef struct {
-    uint32_t baudrate;
+    uint32_t baudrate;          //CNCM_BAUDRATE_AUTO to probe at every connect.
+    uint32_t detected_baudrate; //Last rate that passed probing, tried first on the next connect, 0 if none.
+    cncm_dialect_t dialect;
 } machine_config_t;
 
+//Probed fastest first when the baudrate is CNCM_BAUDRATE_AUTO.
+static const uint32_t baud_candidates[] = {1000000, 500000, 250000, 230400, 115200, 57600};
+
 static machine_config_t machine_config;
+static const cncm_dialect_def_t* dialect;  //Of machine_config.dialect, swapped as a whole so the rx callback never sees half of it.
 
 static void tx_consumer();
 static bool rx_producer(const uint8_t *data, size_t data_len, void *arg);
 static void handle_event(const cdc_acm_host_dev_event_data_t *event, void *user_ctx);
 static void usb_event_handling_task(void *arg);
-static void machine_open();
-
+static void new_device_cb(usb_device_handle_t usb_dev);
+static void machine_manager();
+static esp_err_t machine_open();
+static void machine_close(cdc_acm_dev_hdl_t dev);
+static esp_err_t line_coding_apply(cdc_acm_dev_hdl_t dev, uint32_t baudrate);
+static esp_err_t baud_autodetect(cdc_acm_dev_hdl_t dev, uint32_t* baudrate);
+
+//The line is sent from the ring in place. It's released, i.e. taken off the tx_queue, before it's sent so that a clear
+//doesn't drop a line already on its way, and held until it's sent so that producers don't write over it meanwhile.
 static void tx_consumer()
 {
-    char sentence[CNCM_MAX_COMMAND_MESSAGE_SIZE];
     while (true)
     {
-        size_t message_len = xMessageBufferReceive(tx_buffer, sentence, CNCM_MAX_COMMAND_SIZE, portMAX_DELAY);
-        sentence[message_len] = CNCM_COMMAND_SEPARATOR;
+        cncm_ring_wait(&tx_ring);
+        cncm_ring_span_t record;
+        if(!cncm_ring_peek(&tx_ring, &record)) continue;
+        const char* sentence = (const char*)record.data;
+        uint8_t job_slot = record.tag;
+        size_t sentence_len = record.len - 1;   //The separator is stored with the line.
+        //Dropped if it was cleared since it was peeked at, or if its job was cancelled.
+        if(!cncm_ring_release(&tx_ring, &record) || !cncm_jobs_on_dequeued(job_slot, record.weight))
+        {
+            cncm_ring_finish(&tx_ring);
+            continue;
+        }
         xSemaphoreTake(paused, portMAX_DELAY); //wait for the semaphore to be given.
         xSemaphoreGive(paused); //If it was paused then we woudn't have reached this, else we should give the semaphore back.
-        while
-        (
-            cdc_dev == NULL ||                  //include the command separators in the message length by adding two.
-            cdc_acm_host_data_tx_blocking(cdc_dev, (const uint8_t*) sentence, message_len + 1, CNCM_TX_TIMEOUT_MS) != ESP_OK
-        );
+        while(true)
+        {
+            //Sleep while the machine is unplugged instead of spinning, machine_manager wakes us up once it's reopened.
+            xEventGroupWaitBits(link_events, LINK_CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+            cdc_acm_dev_hdl_t dev = cdc_dev;
+            //include the command separator in the message length by adding one.
+            if(dev != NULL && cdc_acm_host_data_tx_blocking(dev, (const uint8_t*) sentence, sentence_len + 1, CNCM_TX_TIMEOUT_MS) == ESP_OK) break;
+        }
+        cncm_jobs_on_sent(job_slot, sentence, sentence_len, record.weight, record.ticket);
+        cncm_ring_finish(&tx_ring);
         ESP_LOGD(TAG, "Tx consumer high water mark:\t%d", uxTaskGetStackHighWaterMark(NULL));
     }
 }
 
+//Called for every complete line the machine sends, without the line terminator. end is the rx_queue offset right after
+//it, terminator included. The output up to an ack, ack included, answers the oldest line in flight: jobs, queries and
+//tracked commands all read it from ack_output.
+static void rx_line_handle(const char* line, size_t line_len, uint64_t end)
+{
+    uint8_t kind = dialect->line_classify(line, line_len);
+    cncm_subscriptions_on_line(line, line_len, kind, end);
+    if(cncm_sd_on_line(line, line_len)) return;     //Binary transfer replies, "ok<sync>" isn't a line's ack.
+    if(kind & CNCM_LINE_ERROR) ack_output.error = true;
+    size_t to_copy = MIN(line_len, sizeof(ack_output_text) - ack_output.len);
+    memcpy(ack_output_text + ack_output.len, line, to_copy);
+    ack_output.len += to_copy;
+    if(ack_output.len < sizeof(ack_output_text)) ack_output_text[ack_output.len++] = '\n';
+    if(kind & CNCM_LINE_ACK)
+    {
+        cncm_jobs_on_ack(&ack_output);
+        ack_output.len = 0;
+        ack_output.error = false;
+    }
+}
+
+static cncm_lines_t rx_lines = { .on_line = rx_line_handle, .line_len = 0 };  //Only fed by the rx callback.
+
+//data_len is bounded by CNCM_MAX_BULK_IN_TRANSFER which is much smaller than the ring, so a single write never laps itself.
+//The bytes are written before rx_head moves past them, readers account for a write in progress, see cncm_rx_read().
 static bool rx_producer(const uint8_t *data, size_t data_len, void *arg)
 {
-    xStreamBufferSend(rx_buffer, (void*) data, data_len, 0);
+    size_t offset = rx_head % CNCM_RX_BUFFER_CAPACITY;
+    size_t first_part = MIN(data_len, CNCM_RX_BUFFER_CAPACITY - offset);
+    memcpy(rx_buffer + offset, data, first_part);
+    memcpy(rx_buffer, data + first_part, data_len - first_part);    //Wrap around.
+    __atomic_store_n(&rx_seq, rx_seq + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    rx_head += data_len;
+    __atomic_store_n(&rx_seq, rx_seq + 1, __ATOMIC_RELEASE);
+    cncm_lines_feed(&rx_lines, data, data_len, rx_head - data_len);
+    cncm_log_append(data, data_len);
     return true;
 }
 
@@ -68,11 +157,16 @@ static void handle_event(const cdc_acm_host_dev_event_data_t *event, void *user_
     switch (event->type)
     {
         case CDC_ACM_HOST_DEVICE_DISCONNECTED:
+        {
             ESP_LOGI(TAG, "Device disconnected");
-            ESP_ERROR_CHECK(cdc_acm_host_close(event->data.cdc_hdl));
-            cdc_dev = NULL;
-            assert(xTaskCreate(machine_open, "machine_open", CNCM_MACHINE_OPEN_STACK_SIZE, NULL, ESP_TASK_MAIN_PRIO, NULL) == pdPASS);
+            //Only one device is open at a time, a handle that isn't published yet is the one being opened.
+            xSemaphoreTake(dev_lock, portMAX_DELAY);
+            bool opening = dev_opening && event->data.cdc_hdl != cdc_dev;
+            if(opening) dev_opening_lost = true;
+            xSemaphoreGive(dev_lock);
+            if(!opening) machine_close(event->data.cdc_hdl);    //machine_manager reopens it when it's enumerated again.
             break;
+        }
         case CDC_ACM_HOST_ERROR:
             ESP_LOGE(TAG, "CDC-ACM error occurred, err_no = %i", event->data.error);
             break;
@@ -96,45 +190,257 @@ static void usb_event_handling_task(void *arg)
     }
 }
 
-//maybe need to make sure no two instances of this task will be created.
-static void machine_open()
+//Called by the CDC-ACM driver task whenever a USB device is enumerated, must not block, so only wake machine_manager.
+static void new_device_cb(usb_device_handle_t usb_dev)
+{
+    attached_at_us = esp_timer_get_time();
+    xEventGroupSetBits(link_events, LINK_ATTACH_BIT);
+}
+
+//The only task that opens the device, so there is never more than one open in progress.
+//It sleeps until a device is attached (or a reopen is requested), and probes every CNCM_LINK_PROBE_PERIOD_MS in case an
+//attach happened before the driver was installed.
+static void machine_manager()
+{
+    while (true)
+    {
+        if(cdc_dev == NULL) machine_open();
+        xEventGroupWaitBits(link_events, LINK_ATTACH_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(CNCM_LINK_PROBE_PERIOD_MS));
+        ESP_LOGD(TAG, "Machine manager high water mark:\t%d", uxTaskGetStackHighWaterMark(NULL));
+    }
+}
+
+//Tries at most CNCM_OPEN_MAX_ATTEMPTS times with exponential backoff, then gives up until the next attach or probe.
+static esp_err_t machine_open()
 {
     gpio_set_level(CNCM_PRINTER_CONNECTED_LED, 0); // Turn off the connected LED.
+    link_stats.state = CNCM_LINK_OPENING;
     ESP_LOGI(TAG, "Attempting to open CDC ACM device ...");
     cdc_acm_host_device_config_t dev_config = {
-        .connection_timeout_ms = portMAX_DELAY,
-        .out_buffer_size = CNCM_MAX_COMMAND_MESSAGE_SIZE,
+        .connection_timeout_ms = CNCM_OPEN_TIMEOUT_MS,
+        .out_buffer_size = MAX(CNCM_MAX_COMMAND_MESSAGE_SIZE, CNCM_SD_MAX_PACKET_SIZE),
         .in_buffer_size = CNCM_MAX_BULK_IN_TRANSFER,
         .user_arg = NULL,
         .event_cb = handle_event,
         .data_cb = rx_producer
     };
-    while(cdc_acm_host_open(CNCM_USB_DEVICE_VID, CNCM_USB_DEVICE_PID, 0, &dev_config, &cdc_dev) != ESP_OK)
+    cdc_acm_dev_hdl_t dev = NULL;
+    esp_err_t ret = ESP_FAIL;
+    xSemaphoreTake(dev_lock, portMAX_DELAY);
+    dev_opening = true;
+    dev_opening_lost = false;
+    xSemaphoreGive(dev_lock);
+    for(uint32_t attempt = 0; attempt < CNCM_OPEN_MAX_ATTEMPTS; attempt++)
     {
-        ESP_LOGI(TAG, "Failed to open CDC ACM device, retrying...");
+        if(attempt > 0) vTaskDelay(pdMS_TO_TICKS(CNCM_OPEN_RETRY_DELAY_MS << (attempt - 1)));
+        ret = cdc_acm_host_open(CNCM_USB_DEVICE_VID, CNCM_USB_DEVICE_PID, 0, &dev_config, &dev);
+        if(ret == ESP_OK) break;
+        link_stats.failed_opens++;
+    }
+    if(ret != ESP_OK)
+    {
+        ESP_LOGI(TAG, "No CDC ACM device could be opened, waiting for the next attach.");
+        xSemaphoreTake(dev_lock, portMAX_DELAY);
+        dev_opening = false;
+        xSemaphoreGive(dev_lock);
+        link_stats.state = CNCM_LINK_DISCONNECTED;
+        return ret;
     }
     ESP_LOGI(TAG, "CDC ACM device opened.");
-    gpio_set_level(CNCM_PRINTER_CONNECTED_LED, 1); // Turn on the connected LED.
-
 
-    //cdc_acm_host_desc_print(cdc_dev);
-    
-    cdc_acm_line_coding_t line_coding = {
-        .dwDTERate = machine_config.baudrate,
-        .bDataBits = 7,
-        .bParityType = 1,
-        .bCharFormat = 0
-    };
+    //cdc_acm_host_desc_print(dev);
 
+    bool autodetect = (machine_config.baudrate == CNCM_BAUDRATE_AUTO);
+    uint32_t baudrate = autodetect ? dialect->default_baudrate : machine_config.baudrate;
     //Have a look on how flow control is done.
-    ESP_ERROR_CHECK(cdc_acm_host_line_coding_set(cdc_dev, &line_coding));
-    ESP_ERROR_CHECK(cdc_acm_host_set_control_line_state(cdc_dev, true, false));
-    //cdc_acm_host_desc_print(cdc_dev);
+    ret = line_coding_apply(dev, baudrate);
+    if(ret == ESP_OK) ret = cdc_acm_host_set_control_line_state(dev, true, false);
+    if(ret == ESP_OK && autodetect) ret = baud_autodetect(dev, &baudrate);
+
+    //Published with the CONNECTED bit under dev_lock, so a disconnect right after finds both and clears both.
+    xSemaphoreTake(dev_lock, portMAX_DELAY);
+    if(ret == ESP_OK && dev_opening_lost) ret = ESP_ERR_INVALID_STATE;
+    dev_opening = false;
+    if(ret == ESP_OK)
+    {
+        cdc_dev = dev;
+        link_stats.state = CNCM_LINK_CONNECTED;
+        xEventGroupSetBits(link_events, LINK_CONNECTED_BIT);
+        gpio_set_level(CNCM_PRINTER_CONNECTED_LED, 1); // Turn on the connected LED.
+    }
+    xSemaphoreGive(dev_lock);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to configure CDC ACM device: %s", esp_err_to_name(ret));
+        cdc_acm_host_close(dev);
+        link_stats.failed_opens++;
+        link_stats.state = CNCM_LINK_DISCONNECTED;
+        return ret;
+    }
+    //cdc_acm_host_desc_print(dev);
+
+    int64_t now = esp_timer_get_time();
+    if(disconnected_at_us != 0)
+    {
+        link_stats.last_reconnect_us = now - disconnected_at_us;
+        if(link_stats.last_reconnect_us > link_stats.max_reconnect_us) link_stats.max_reconnect_us = link_stats.last_reconnect_us;
+        link_stats.reconnects++;
+        disconnected_at_us = 0;
+    }
+    if(attached_at_us != 0) link_stats.last_attach_to_open_us = now - attached_at_us;
+    attached_at_us = 0;
+
+    link_stats.baudrate = baudrate;
+    cncm_log_event("machine connected at %" PRIu32 " baud, %s dialect", baudrate, dialect->name);
 
     ESP_LOGD(TAG, "Machine open high water mark:\t%d", uxTaskGetStackHighWaterMark(NULL));
 
     xSemaphoreGive(paused);
-    vTaskDelete(NULL);
+    return ESP_OK;
+}
+
+static esp_err_t line_coding_apply(cdc_acm_dev_hdl_t dev, uint32_t baudrate)
+{
+    cdc_acm_line_coding_t line_coding = {
+        .dwDTERate = baudrate,
+        .bDataBits = dialect->data_bits,
+        .bParityType = dialect->parity,
+        .bCharFormat = dialect->stop_bits
+    };
+    return cdc_acm_host_line_coding_set(dev, &line_coding);
+}
+
+//rx_head is 64 bits and can't be loaded atomically. A write being published takes a few instructions, but the writer
+//may be preempted in the middle by a reader of higher priority, which then sleeps a tick instead of spinning on.
+static uint64_t rx_get_head()
+{
+    uint32_t spins = 0;
+    while(true)
+    {
+        uint32_t seq = __atomic_load_n(&rx_seq, __ATOMIC_ACQUIRE);
+        if(seq & 1)
+        {
+            if(++spins % RX_SEQ_SPINS == 0) vTaskDelay(1);
+            continue;
+        }
+        uint64_t head = rx_head;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&rx_seq, __ATOMIC_RELAXED) != seq) continue;
+        return head;
+    }
+}
+
+//Boards that reset on DTR print a banner first, wait for it to end so that it isn't mistaken for a probe reply.
+static void rx_wait_quiet()
+{
+    int64_t start = esp_timer_get_time();
+    int64_t quiet_since = start;
+    uint64_t last_head = rx_get_head();
+    while(esp_timer_get_time() - start < CNCM_BAUD_PROBE_SETTLE_MAX_MS * 1000LL)
+    {
+        vTaskDelay(pdMS_TO_TICKS(CNCM_BAUD_PROBE_POLL_MS));
+        uint64_t head = rx_get_head();
+        int64_t now = esp_timer_get_time();
+        if(head != last_head)
+        {
+            last_head = head;
+            quiet_since = now;
+        }
+        else if(now - quiet_since >= CNCM_BAUD_PROBE_QUIET_MS * 1000LL) return;
+    }
+}
+
+//Sends the dialect's probe query (e.g. a numbered, checksummed "N0 M110 N0" that only resets the line number) and waits
+//for a clean ack. At a wrong rate the reply is garbled, or the machine complains about the checksum, both fail.
+static bool baud_probe_round_trip(cdc_acm_dev_hdl_t dev)
+{
+    char query[32];
+    size_t query_len = dialect->probe_query(query, sizeof(query));
+
+    uint64_t cursor = rx_get_head();
+    if(cdc_acm_host_data_tx_blocking(dev, (const uint8_t*)query, query_len, CNCM_TX_TIMEOUT_MS) != ESP_OK) return false;
+
+    char line[CNCM_BAUD_PROBE_LINE_SIZE];
+    size_t line_len = 0;
+    int64_t deadline = esp_timer_get_time() + CNCM_BAUD_PROBE_TIMEOUT_MS * 1000LL;
+    while(esp_timer_get_time() < deadline)
+    {
+        uint8_t chunk[64];
+        size_t chunk_len = 0;
+        cncm_rx_read(&cursor, chunk, &chunk_len, sizeof(chunk), NULL);
+        for(size_t i = 0; i < chunk_len; i++)
+        {
+            uint8_t c = chunk[i];
+            if(c == '\n')
+            {
+                uint8_t kind = dialect->line_classify(line, line_len);
+                if(kind & CNCM_LINE_ERROR) return false;
+                if(kind & CNCM_LINE_ACK) return true;
+                line_len = 0;   //Anything else (echo:, busy, ...) is ignored.
+            }
+            else if(c == '\r') continue;
+            else if(c < 0x20 || c > 0x7E) return false;  //Garbled, the rate doesn't match.
+            else if(line_len < sizeof(line) - 1) line[line_len++] = (char)c;
+        }
+        if(chunk_len == 0) vTaskDelay(pdMS_TO_TICKS(CNCM_BAUD_PROBE_POLL_MS));
+    }
+    return false;
+}
+
+//Tries the last detected rate first, then every candidate from fastest to slowest, and keeps the first one that passes
+//CNCM_BAUD_PROBE_ROUNDS round trips in a row. Falls back to the dialect's default baudrate if none passes, since the machine
+//might just not answer the probe, this isn't treated as an error.
+static esp_err_t baud_autodetect(cdc_acm_dev_hdl_t dev, uint32_t* baudrate)
+{
+    rx_wait_quiet();
+    size_t candidates_count = sizeof(baud_candidates) / sizeof(baud_candidates[0]);
+    for(int i = -1; i < (int)candidates_count; i++)
+    {
+        uint32_t candidate = (i < 0) ? machine_config.detected_baudrate : baud_candidates[i];
+        if(candidate == 0 || (i >= 0 && candidate == machine_config.detected_baudrate)) continue;
+        esp_err_t ret = line_coding_apply(dev, candidate);
+        if(ret != ESP_OK) return ret;
+        vTaskDelay(pdMS_TO_TICKS(CNCM_BAUD_PROBE_POLL_MS));   //Let the adapter settle on the new rate.
+        uint32_t rounds = 0;
+        while(rounds < CNCM_BAUD_PROBE_ROUNDS && baud_probe_round_trip(dev)) rounds++;
+        ESP_LOGI(TAG, "Baudrate %" PRIu32 ": %" PRIu32 "/%d probe round trips passed.", candidate, rounds, CNCM_BAUD_PROBE_ROUNDS);
+        if(rounds < CNCM_BAUD_PROBE_ROUNDS) continue;
+        *baudrate = candidate;
+        if(candidate != machine_config.detected_baudrate)
+        {
+            machine_config.detected_baudrate = candidate;
+            if(nvs_set_u32(cncm_nvs, "baud_detected", candidate) != ESP_OK || nvs_commit(cncm_nvs) != ESP_OK)
+            {
+                ESP_LOGW(TAG, "Couldn't store the detected baudrate.");
+            }
+        }
+        return ESP_OK;
+    }
+    ESP_LOGW(TAG, "No baudrate passed probing, falling back to default.");
+    *baudrate = dialect->default_baudrate;
+    return line_coding_apply(dev, dialect->default_baudrate);
+}
+
+//Closes dev if it's still the published device, NULL closes whichever is. A disconnect and a reopen can both get here
+//for the same handle, only the first one takes it back and closes it.
+static void machine_close(cdc_acm_dev_hdl_t dev)
+{
+    xSemaphoreTake(dev_lock, portMAX_DELAY);
+    if(dev == NULL) dev = cdc_dev;
+    bool published = (dev != NULL && dev == cdc_dev);
+    if(published)
+    {
+        cdc_dev = NULL;
+        xEventGroupClearBits(link_events, LINK_CONNECTED_BIT);
+        gpio_set_level(CNCM_PRINTER_CONNECTED_LED, 0); // Turn off the connected LED.
+        link_stats.state = CNCM_LINK_DISCONNECTED;
+    }
+    xSemaphoreGive(dev_lock);
+    if(!published) return;
+    cncm_jobs_on_link_lost();   //Whatever was in flight won't be acknowledged.
+    ESP_ERROR_CHECK(cdc_acm_host_close(dev));
+    cncm_log_event("machine disconnected");
+    disconnected_at_us = esp_timer_get_time();
 }
 
 esp_err_t cncm_init()
@@ -154,18 +460,56 @@ esp_err_t cncm_init()
         return ret;
     }
 
+    uint8_t stored_dialect = CNCM_DIALECT_MARLIN;
+    ret = nvs_get_u8(cncm_nvs, "dialect", &stored_dialect);
+    if(ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND)
+    {
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    machine_config.dialect = (stored_dialect < CNCM_DIALECT_COUNT) ? stored_dialect : CNCM_DIALECT_MARLIN;
+    dialect = cncm_dialect_def(machine_config.dialect);
+    ESP_LOGI(TAG, "Machine dialect: %s.", dialect->name);
+
     ret = nvs_get_u32(cncm_nvs, "baudrate", &machine_config.baudrate);
     if(ret == ESP_ERR_NVS_NOT_FOUND)
     {
-        ESP_LOGI(TAG, "No stored value found for baudrate, falling back to default.");
-        machine_config.baudrate = CNCM_DEFAULT_BAUDRATE;
+        ESP_LOGI(TAG, "No stored value found for baudrate, falling back to the dialect's default.");
+        machine_config.baudrate = dialect->default_baudrate;
+    }
+    else if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
     }
+
+    ret = nvs_get_u32(cncm_nvs, "baud_detected", &machine_config.detected_baudrate);
+    if(ret == ESP_ERR_NVS_NOT_FOUND) machine_config.detected_baudrate = 0;
     else if(ret != ESP_OK)
     {
         ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
         return ret;
     }
 
+    ret = cncm_macros_init();
+    if(ret != ESP_OK) return ret;
+    ret = cncm_jobs_init();
+    if(ret != ESP_OK) return ret;
+    ret = cncm_checkpoint_init();
+    if(ret != ESP_OK) return ret;
+    ret = cncm_queries_init(cncm_nvs);
+    if(ret != ESP_OK) return ret;
+    ret = cncm_sd_init();
+    if(ret != ESP_OK) return ret;
+    ret = cncm_arcs_init(cncm_nvs);
+    if(ret != ESP_OK) return ret;
+    ret = cncm_subscriptions_init();
+    if(ret != ESP_OK) return ret;
+    ret = cncm_results_init();
+    if(ret != ESP_OK) return ret;
+    ret = cncm_log_init(cncm_nvs);
+    if(ret != ESP_OK) return ret;
+
     ESP_LOGI(TAG, "Initializing the CNCM singleton.");
     ESP_LOGI(TAG, "Installing USB Host.");
     usb_host_config_t host_config = {
@@ -183,14 +527,21 @@ esp_err_t cncm_init()
 
     ESP_LOGI(TAG, "USB host installation complete.");
 
-    rx_buffer = xStreamBufferCreateWithCaps(CNCM_RX_BUFFER_CAPACITY, CNCM_RX_BUFFER_TRIGGER_LEVEL, MALLOC_CAP_SPIRAM);
-    tx_buffer = xMessageBufferCreateWithCaps(CNCM_TX_BUFFER_CAPACITY, MALLOC_CAP_SPIRAM);
-    if(rx_buffer == NULL || tx_buffer == NULL)
+    rx_buffer = heap_caps_malloc(CNCM_RX_BUFFER_CAPACITY, MALLOC_CAP_SPIRAM);
+    if(rx_buffer == NULL || cncm_ring_init(&tx_ring, CNCM_TX_BUFFER_CAPACITY, CNCM_MAX_COMMAND_MESSAGE_SIZE, MALLOC_CAP_SPIRAM) != ESP_OK)
     {
         ESP_LOGE(TAG, "No enough memory for both rx and tx buffers.");
         return ESP_ERR_NO_MEM;
     }
     paused = xSemaphoreCreateBinary();
+    tx_lock = xSemaphoreCreateRecursiveMutex();
+    dev_lock = xSemaphoreCreateMutex();
+    link_events = xEventGroupCreate();
+    if(paused == NULL || tx_lock == NULL || dev_lock == NULL || link_events == NULL)
+    {
+        ESP_LOGE(TAG, "No enough memory for CNCM semaphores.");
+        return ESP_ERR_NO_MEM;
+    }
 
     ESP_LOGI(TAG, "FreeRTOS elements initialized.");
 
@@ -214,7 +565,7 @@ esp_err_t cncm_init()
         .driver_task_priority = CNCM_USB_HOST_PRIORITY,
         .driver_task_stack_size = CNCM_CDC_DRIVER_STACK_SIZE,
         .xCoreID = tskNO_AFFINITY,
-        .new_dev_cb = NULL
+        .new_dev_cb = new_device_cb
     };
     ret = cdc_acm_host_install(&driver_config);
     if(ret != ESP_OK)
@@ -225,10 +576,10 @@ esp_err_t cncm_init()
 
     cncm_initialized = true;
 
-    task_created = xTaskCreate(machine_open, "machine_open", CNCM_MACHINE_OPEN_STACK_SIZE, NULL, ESP_TASK_MAIN_PRIO, NULL);
+    task_created = xTaskCreate(machine_manager, "machine_manager", CNCM_MACHINE_MANAGER_STACK_SIZE, NULL, ESP_TASK_MAIN_PRIO, NULL);
     if(task_created != pdPASS)
     {
-        ESP_LOGE(TAG, "Couldn't create machine open task.");
+        ESP_LOGE(TAG, "Couldn't create machine manager task.");
         return ESP_FAIL;
     }
 
@@ -236,22 +587,300 @@ esp_err_t cncm_init()
     return ESP_OK;
 }
 
-esp_err_t cncm_tx_producer(const char* command)
+void cncm_tx_lock()
+{
+    xSemaphoreTakeRecursive(tx_lock, portMAX_DELAY);
+}
+
+void cncm_tx_unlock()
+{
+    xSemaphoreGiveRecursive(tx_lock);
+}
+
+//The lines held by the arc fitter are as good as queued, nobody else may take their space.
+size_t cncm_tx_space()
+{
+    size_t space = cncm_ring_space(&tx_ring);
+    size_t reserved = cncm_arcs_reserved();
+    return (space > reserved) ? space - reserved : 0;
+}
+
+//Written in place in the ring, with the separator tx_consumer sends after it. Called with tx_lock held.
+static bool tx_send_message(uint8_t job_slot, uint16_t ticket, const char* command, size_t command_length, uint16_t weight)
+{
+    uint8_t* record = cncm_ring_reserve(&tx_ring, command_length + 1);
+    if(record == NULL) return false;
+    memcpy(record, command, command_length);
+    record[command_length] = CNCM_COMMAND_SEPARATOR;
+    cncm_ring_commit(&tx_ring, job_slot, weight, ticket, command_length + 1);
+    return true;
+}
+
+esp_err_t cncm_tx_emit(uint8_t job_slot, const char* line, size_t line_len, uint16_t weight)
+{
+    cncm_jobs_on_queued(job_slot, weight, line_len + 1);
+    if(tx_send_message(job_slot, CNCM_NO_TICKET, line, line_len, weight)) return ESP_OK;
+    cncm_jobs_on_unqueued(job_slot, weight, line_len + 1);
+    ESP_LOGW(TAG, "No room for a line the arc fitter holds, kept until there is.");
+    return ESP_ERR_NO_MEM;
+}
+
+//Validates the lines of a macro expansion and adds up the ring space they need, header and padding of each record
+//included.
+static esp_err_t macro_lines_measure(const char* expanded, size_t* needed_space, size_t* lines_count, size_t* bytes_count)
+{
+    for(const char* line = expanded; *line != '\0'; )
+    {
+        size_t line_length = strcspn(line, "\r\n");
+        if(line_length > CNCM_MAX_COMMAND_SIZE) return ESP_ERR_INVALID_ARG;
+        if(line_length > 0)
+        {
+            *needed_space += CNCM_RING_RECORD_SIZE(line_length + 1);
+            *lines_count += 1;
+            *bytes_count += line_length + 1;
+        }
+        line += line_length;
+        line += strspn(line, "\r\n");
+    }
+    return ESP_OK;
+}
+
+static esp_err_t macro_expand_logged(const char* invocation, char* expanded)
+{
+    esp_err_t ret = cncm_macro_expand(invocation, expanded, CNCM_MAX_MACRO_EXPANSION_SIZE);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to expand macro %s: %s", invocation, esp_err_to_name(ret));
+        return (ret == ESP_ERR_NO_MEM) ? ret : ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t tx_enqueue_lines(uint8_t job_slot, uint16_t ticket, const char* lines)
+{
+    size_t needed_space = 0;
+    size_t lines_count = 0;
+    size_t bytes_count = 0;
+    if(macro_lines_measure(lines, &needed_space, &lines_count, &bytes_count) != ESP_OK) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTakeRecursive(tx_lock, portMAX_DELAY);
+    if(cncm_tx_space() < needed_space)
+    {
+        xSemaphoreGiveRecursive(tx_lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    //Space only grows while tx_lock is held, so every line fits.
+    cncm_jobs_on_queued(job_slot, lines_count, bytes_count);
+    cncm_results_on_queued(ticket, lines_count);
+    for(const char* line = lines; *line != '\0'; )
+    {
+        size_t line_length = strcspn(line, "\r\n");
+        if(line_length > 0) tx_send_message(job_slot, ticket, line, line_length, 1);
+        line += line_length;
+        line += strspn(line, "\r\n");
+    }
+    xSemaphoreGiveRecursive(tx_lock);
+    return ESP_OK;
+}
+
+esp_err_t cncm_tx_enqueue_lines(uint8_t job_slot, const char* lines)
+{
+    return tx_enqueue_lines(job_slot, CNCM_NO_TICKET, lines);
+}
+
+//Queues all the lines of a macro expansion or none of them, so a macro never runs half way because the queue was full.
+static esp_err_t tx_produce_macro(uint8_t job_slot, uint16_t ticket, const char* invocation)
+{
+    char* expanded = malloc(CNCM_MAX_MACRO_EXPANSION_SIZE);
+    if(expanded == NULL) return ESP_ERR_NO_MEM;
+    esp_err_t ret = macro_expand_logged(invocation, expanded);
+    if(ret == ESP_OK) ret = tx_enqueue_lines(job_slot, ticket, expanded);
+    if(ret == ESP_OK) ESP_LOGI(TAG, "Macro %s expanded.", invocation);
+    free(expanded);
+    return ret;
+}
+
+static esp_err_t tx_enqueue(uint8_t job_slot, uint16_t ticket, const char* command)
 {
     size_t command_length = strlen(command);
     if (command_length == 0 || command_length > CNCM_MAX_COMMAND_SIZE) return ESP_ERR_INVALID_ARG;
-    if (xMessageBufferSend(tx_buffer, command, command_length, 0) != command_length) return ESP_ERR_NO_MEM;
-    return ESP_OK;
+    if (command[0] == CNCM_MACRO_PREFIX) return tx_produce_macro(job_slot, ticket, command);
+    //Counted before sending, so tx_consumer never sees a line its job doesn't know about yet.
+    uint8_t query = (job_slot == CNCM_NO_JOB_SLOT) ? cncm_queries_match(command, command_length) : CNCM_NO_QUERY;
+    xSemaphoreTakeRecursive(tx_lock, portMAX_DELAY);
+    if(cncm_tx_space() < CNCM_RING_RECORD_SIZE(command_length + 1))
+    {
+        xSemaphoreGiveRecursive(tx_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    cncm_jobs_on_queued(job_slot, 1, command_length + 1);
+    cncm_queries_on_queued(query);
+    esp_err_t ret = ESP_OK;
+    if (!tx_send_message(job_slot, ticket, command, command_length, 1))
+    {
+        cncm_jobs_on_unqueued(job_slot, 1, command_length + 1);
+        cncm_queries_on_unqueued(query);
+        ret = ESP_ERR_NO_MEM;
+    }
+    else cncm_results_on_queued(ticket, 1);     //Under tx_lock, tx_consumer can't send it before this.
+    xSemaphoreGiveRecursive(tx_lock);
+    return ret;
+}
+
+esp_err_t cncm_tx_enqueue(uint8_t job_slot, const char* command)
+{
+    return tx_enqueue(job_slot, CNCM_NO_TICKET, command);
+}
+
+esp_err_t cncm_tx_producer(const char* command)
+{
+    if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
+    return cncm_tx_enqueue(CNCM_NO_JOB_SLOT, command);
+}
+
+esp_err_t cncm_tx_producer_coalesce(const char* command, bool* coalesced)
+{
+    if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
+    if(command == NULL) return ESP_ERR_INVALID_ARG;
+    if(coalesced != NULL) *coalesced = false;
+    //Held from the check to the enqueue, so two requesters can't both find the query idle and both queue it.
+    xSemaphoreTakeRecursive(tx_lock, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    if(cncm_queries_coalesce(cncm_queries_match(command, strlen(command))))
+    {
+        if(coalesced != NULL) *coalesced = true;
+    }
+    else ret = cncm_tx_enqueue(CNCM_NO_JOB_SLOT, command);
+    xSemaphoreGiveRecursive(tx_lock);
+    return ret;
+}
+
+//first_id is NULL for an untracked batch, coalesced_count NULL for one that is never coalesced.
+static esp_err_t tx_batch(const char* const* commands, size_t commands_count, uint32_t* first_id,
+                          size_t* coalesced_count)
+{
+    //First pass validates everything and sizes it, macros included, so nothing is queued unless everything fits.
+    char* expanded = NULL;
+    size_t needed_space = 0;
+    size_t lines_count = 0;
+    size_t bytes_count = 0;
+    esp_err_t ret = ESP_OK;
+    for(size_t i = 0; i < commands_count && ret == ESP_OK; i++)
+    {
+        size_t command_length = strlen(commands[i]);
+        if(command_length == 0 || command_length > CNCM_MAX_COMMAND_SIZE) ret = ESP_ERR_INVALID_ARG;
+        else if(commands[i][0] != CNCM_MACRO_PREFIX)
+        {
+            needed_space += CNCM_RING_RECORD_SIZE(command_length + 1);
+        }
+        else if(expanded == NULL && (expanded = malloc(CNCM_MAX_MACRO_EXPANSION_SIZE)) == NULL) ret = ESP_ERR_NO_MEM;
+        else if((ret = macro_expand_logged(commands[i], expanded)) == ESP_OK)
+        {
+            ret = macro_lines_measure(expanded, &needed_space, &lines_count, &bytes_count);
+        }
+    }
+    free(expanded);
+    if(ret != ESP_OK) return ret;
+    xSemaphoreTakeRecursive(tx_lock, portMAX_DELAY);
+    if(cncm_tx_space() < needed_space) ret = ESP_ERR_NO_MEM;
+    if(ret == ESP_OK && first_id != NULL) ret = cncm_results_begin(commands_count, first_id);
+
+    //Held across the whole batch, so no other producer takes the space that was measured.
+    size_t i = 0;
+    for(; i < commands_count && ret == ESP_OK; i++)
+    {
+        uint16_t ticket = (first_id != NULL) ? cncm_results_ticket(*first_id + i) : CNCM_NO_TICKET;
+        if(coalesced_count != NULL && cncm_queries_coalesce(cncm_queries_match(commands[i], strlen(commands[i]))))
+        {
+            (*coalesced_count)++;
+        }
+        else ret = tx_enqueue(CNCM_NO_JOB_SLOT, ticket, commands[i]);
+    }
+    //Only a failed allocation gets here with a result slot given, the command that failed and those after it are dropped.
+    if(ret != ESP_OK && first_id != NULL && i > 0) cncm_results_abandon(*first_id + i - 1, commands_count - i + 1);
+    xSemaphoreGiveRecursive(tx_lock);
+    return ret;
+}
+
+esp_err_t cncm_tx_producer_batch(const char* const* commands, size_t commands_count)
+{
+    if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
+    if(commands == NULL && commands_count > 0) return ESP_ERR_INVALID_ARG;
+    return tx_batch(commands, commands_count, NULL, NULL);
+}
+
+esp_err_t cncm_tx_producer_batch_coalesce(const char* const* commands, size_t commands_count, size_t* coalesced_count)
+{
+    if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
+    if((commands == NULL && commands_count > 0) || coalesced_count == NULL) return ESP_ERR_INVALID_ARG;
+    *coalesced_count = 0;
+    return tx_batch(commands, commands_count, NULL, coalesced_count);
+}
+
+esp_err_t cncm_tx_submit(const char* const* commands, size_t commands_count, uint32_t* first_id)
+{
+    if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
+    if(commands == NULL || first_id == NULL || commands_count == 0 || commands_count > CNCM_MAX_TRACKED_COMMANDS)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return tx_batch(commands, commands_count, first_id, NULL);
 }
 
 esp_err_t cncm_rx_consumer(uint8_t* to_receive, size_t* response_size, size_t max_response_size)
+{
+    return cncm_rx_read(&rx_default_cursor, to_receive, response_size, max_response_size, NULL);
+}
+
+esp_err_t cncm_rx_read(uint64_t* cursor, uint8_t* to_receive, size_t* response_size, size_t max_response_size, uint64_t* lost_bytes)
 {
     if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
-    if(to_receive == NULL || response_size == NULL) return ESP_ERR_INVALID_ARG;
-    *response_size = xStreamBufferReceive(rx_buffer, to_receive, max_response_size, 0);
+    if(cursor == NULL || to_receive == NULL || response_size == NULL) return ESP_ERR_INVALID_ARG;
+    uint64_t start = *cursor;
+    uint64_t lost = 0;
+    size_t to_copy = 0;
+    while(true)
+    {
+        //The writer may be overwriting the next CNCM_MAX_BULK_IN_TRANSFER bytes past the head, which hold the oldest
+        //ones, so those don't count as readable.
+        uint64_t head = rx_get_head();
+        uint64_t oldest = (head + CNCM_MAX_BULK_IN_TRANSFER > CNCM_RX_BUFFER_CAPACITY) ?
+                          head + CNCM_MAX_BULK_IN_TRANSFER - CNCM_RX_BUFFER_CAPACITY : 0;
+        if(start < oldest)
+        {
+            lost += oldest - start;
+            start = oldest;
+        }
+        else if(start > head) start = oldest;   //Cursor from a previous boot, start over from what we still have.
+        to_copy = MIN((size_t)(head - start), max_response_size);
+        size_t offset = start % CNCM_RX_BUFFER_CAPACITY;
+        size_t first_part = MIN(to_copy, CNCM_RX_BUFFER_CAPACITY - offset);
+        memcpy(to_receive, rx_buffer + offset, first_part);
+        memcpy(to_receive + first_part, rx_buffer, to_copy - first_part);    //Wrap around.
+        //The copy is good if the writer didn't get to its start meanwhile, otherwise retry from what's still there.
+        uint64_t new_head = rx_get_head();
+        if(new_head + CNCM_MAX_BULK_IN_TRANSFER <= start + CNCM_RX_BUFFER_CAPACITY) break;
+    }
+    *cursor = start + to_copy;
+    *response_size = to_copy;
+    if(lost_bytes != NULL) *lost_bytes = lost;
+    if(lost > 0) ESP_LOGW(TAG, "Reader lost %" PRIu64 " bytes to rx buffer overwrite.", lost);
     return ESP_OK;
 }
 
+uint64_t cncm_rx_head()
+{
+    if(!cncm_initialized) return 0;
+    return rx_get_head();
+}
+
+//Machine output doesn't count, automatic temperature reports would keep an idle printer busy forever.
+bool cncm_is_busy()
+{
+    if(!cncm_initialized) return false;
+    return !cncm_ring_is_empty(&tx_ring) || cncm_jobs_in_flight_count() > 0;
+}
+
 bool cncm_is_open()
 {
     return cdc_dev != NULL ? true : false;
@@ -260,7 +889,16 @@ bool cncm_is_open()
 esp_err_t cncm_clear_tx_buffer()
 {
     if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
-    return (xMessageBufferReset(tx_buffer) == pdPASS || xMessageBufferIsEmpty(tx_buffer)) ? ESP_OK : ESP_FAIL;
+    //A line tx_consumer is copying out is dropped too, its release fails.
+    xSemaphoreTakeRecursive(tx_lock, portMAX_DELAY);
+    cncm_ring_clear(&tx_ring);
+    cncm_arcs_discard(CNCM_NO_JOB_SLOT);
+    cncm_jobs_on_cleared();
+    cncm_queries_on_cleared();
+    cncm_results_on_cleared();
+    xSemaphoreGiveRecursive(tx_lock);
+    cncm_log_event("tx_queue cleared");
+    return ESP_OK;
 }
 
 esp_err_t cncm_pause()
@@ -277,24 +915,107 @@ esp_err_t cncm_resume()
     return ESP_OK;
 }
 
-esp_err_t cncm_reset_machine_config(uint32_t baudrate)
+//While unplugged there is nothing to close, and the pause is only released by a successful open, so it isn't taken:
+//the next open uses the new configuration anyway.
+static esp_err_t machine_reopen()
+{
+    if(cdc_dev != NULL)
+    {
+        esp_err_t ret = cncm_pause();
+        if(ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to reset machine configuration, Error: %s", esp_err_to_name(ret));
+            return ret;
+        }
+        machine_close(NULL);
+    }
+    xEventGroupSetBits(link_events, LINK_ATTACH_BIT);   //Ask machine_manager to reopen it with the new configuration.
+    return ESP_OK;
+}
+
+esp_err_t cncm_set_machine_config(const cncm_dialect_t* new_dialect, const uint32_t* baudrate)
 {
     if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
-    esp_err_t ret = nvs_set_u32(cncm_nvs, "baudrate", baudrate);
+    if(new_dialect != NULL && *new_dialect >= CNCM_DIALECT_COUNT) return ESP_ERR_INVALID_ARG;
+    if(new_dialect == NULL && baudrate == NULL) return ESP_OK;
+    esp_err_t ret = ESP_OK;
+    if(new_dialect != NULL) ret = nvs_set_u8(cncm_nvs, "dialect", *new_dialect);
+    if(ret == ESP_OK && baudrate != NULL) ret = nvs_set_u32(cncm_nvs, "baudrate", *baudrate);
+    if(ret == ESP_OK) ret = nvs_commit(cncm_nvs);
     if(ret != ESP_OK)
     {
         ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
         return ret;
     }
-    machine_config.baudrate = baudrate;
-    ret = cncm_pause();
+    if(baudrate != NULL) machine_config.baudrate = *baudrate;
+    if(new_dialect != NULL)
+    {
+        machine_config.dialect = *new_dialect;
+        dialect = cncm_dialect_def(*new_dialect);
+        ESP_LOGI(TAG, "Machine dialect set to %s.", dialect->name);
+        cncm_log_event("dialect set to %s", dialect->name);
+    }
+    ret = machine_reopen();
+    if(new_dialect != NULL) cncm_queries_reset();   //Indexed by the dialect's queries.
+    return ret;
+}
+
+esp_err_t cncm_reset_machine_config(uint32_t baudrate)
+{
+    return cncm_set_machine_config(NULL, &baudrate);
+}
+
+esp_err_t cncm_get_link_stats(cncm_link_stats_t* stats)
+{
+    if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
+    if(stats == NULL) return ESP_ERR_INVALID_ARG;
+    *stats = link_stats;
+    return ESP_OK;
+}
+
+esp_err_t cncm_set_dialect(cncm_dialect_t new_dialect)
+{
+    return cncm_set_machine_config(&new_dialect, NULL);
+}
+
+cncm_dialect_t cncm_get_dialect()
+{
+    return machine_config.dialect;
+}
+
+esp_err_t cncm_machine_write(const uint8_t* data, size_t data_len)
+{
+    cdc_acm_dev_hdl_t dev = cdc_dev;
+    if(dev == NULL) return ESP_ERR_INVALID_STATE;
+    return cdc_acm_host_data_tx_blocking(dev, data, data_len, CNCM_TX_TIMEOUT_MS);
+}
+
+//Bypasses the tx_queue and the pause, for what the firmware handles on arrival.
+static esp_err_t machine_write_direct(const char* data)
+{
+    return cncm_machine_write((const uint8_t*)data, strlen(data));
+}
+
+esp_err_t cncm_status_query()
+{
+    if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
+    const cncm_dialect_def_t* current = dialect;
+    if(current->status_query_realtime) return machine_write_direct(current->status_query);
+    return cncm_tx_producer_coalesce(current->status_query, NULL);
+}
+
+esp_err_t cncm_emergency_stop()
+{
+    if(!cncm_initialized) return ESP_ERR_INVALID_STATE;
+    cncm_clear_tx_buffer();
+    esp_err_t ret = machine_write_direct(dialect->emergency_stop);
     if(ret != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to reset machine configuration, Error: %s", esp_err_to_name(ret));
+        ESP_LOGE(TAG, "Failed to send emergency stop: %s", esp_err_to_name(ret));
         return ret;
     }
-    ESP_ERROR_CHECK(cdc_acm_host_close(cdc_dev));
-    cdc_dev = NULL;
-    assert(xTaskCreate(machine_open, "machine_open", CNCM_MACHINE_OPEN_STACK_SIZE, NULL, ESP_TASK_MAIN_PRIO, NULL) == pdPASS);
+    cncm_jobs_on_link_lost();   //The machine halts or resets, what was in flight won't be acknowledged.
+    ESP_LOGW(TAG, "Emergency stop sent.");
+    cncm_log_event("emergency stop sent");
     return ESP_OK;
 }
@@ -0,0 +1,443 @@
+#include <math.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-Arcs";
+
+//Slicers flatten curves into runs of tiny G1 segments, each costing a line on the link and a planner slot in the
+//firmware. Job lines go through here on their way to the tx_queue: consecutive extruding (or travel) G1 moves in the XY
+//plane are held while they stay within the tolerance of one circle, and queued as a single G2/G3 when the run breaks.
+//Lines that don't fit are queued as they came, in order. An arc stands for the lines it replaced (the ring record's
+//weight), so job progress and checkpoints still count the original lines.
+//Everything here runs with tx_lock held, one run is held at a time and it belongs to a single job.
+#define ARC_NUMBER_SIZE (16)
+#define ARC_LINE_SIZE (96)
+
+typedef struct {
+    char line[CNCM_ARC_MAX_LINE_SIZE + 1];  //As received, queued as is if the segment isn't fitted.
+    size_t line_len;
+    float x, y;             //End point.
+    float e;                //Extruded along the segment, 0 for a travel.
+    char x_text[ARC_NUMBER_SIZE];   //Words as written, empty if absent.
+    char y_text[ARC_NUMBER_SIZE];
+    char e_text[ARC_NUMBER_SIZE];
+    char f_text[ARC_NUMBER_SIZE];
+} arc_segment_t;
+
+typedef struct {
+    float i, j;             //Center, relative to the start of the run.
+    bool clockwise;
+} arc_fit_t;
+
+static nvs_handle_t arcs_nvs;
+static bool arcs_initialized = false;
+static bool enabled = false;
+static float tolerance_mm = CNCM_ARC_DEFAULT_TOLERANCE_MM;
+static cncm_arc_stats_t stats;
+
+static arc_segment_t run[CNCM_ARC_MAX_SEGMENTS];
+static size_t run_count = 0;
+static size_t run_bytes = 0;        //tx_queue space the held lines take if queued as they are.
+static float run_x, run_y;          //Start of the run.
+static uint8_t run_slot = CNCM_NO_JOB_SLOT;
+//State of the job as of the last line fed, the position is unknown until a line sets it.
+static cncm_modal_state_t state;
+static bool x_known = false;
+static bool y_known = false;
+
+static bool word_copy(const cncm_gcode_words_t* words, char letter, char* text)
+{
+    text[0] = '\0';
+    if((words->present & CNCM_WORD_BIT(letter)) == 0) return true;
+    size_t len = words->text_len[letter - 'A'];
+    if(len == 0 || len >= ARC_NUMBER_SIZE) return false;
+    memcpy(text, words->text[letter - 'A'], len);
+    text[len] = '\0';
+    return true;
+}
+
+//A G1 in the XY plane, in millimeters and absolute coordinates, from a known position. F may only start a run.
+static bool segment_parse(const char* line, size_t line_len, arc_segment_t* segment)
+{
+    if(line_len > CNCM_ARC_MAX_LINE_SIZE || !state.absolute || state.inches || !x_known || !y_known) return false;
+    cncm_gcode_words_t words;
+    cncm_gcode_words_parse(line, line_len, &words);
+    uint32_t allowed = CNCM_WORD_BIT('X') | CNCM_WORD_BIT('Y') | CNCM_WORD_BIT('E') | CNCM_WORD_BIT('F');
+    if(words.other || words.units >= 0 || words.distance >= 0 || words.g != 1 || words.m >= 0 || (words.present & ~allowed) != 0) return false;
+    if((words.present & (CNCM_WORD_BIT('X') | CNCM_WORD_BIT('Y'))) == 0) return false;
+    if(!word_copy(&words, 'X', segment->x_text) || !word_copy(&words, 'Y', segment->y_text) ||
+       !word_copy(&words, 'E', segment->e_text) || !word_copy(&words, 'F', segment->f_text)) return false;
+    segment->x = segment->x_text[0] ? CNCM_WORD_VALUE(&words, 'X') : state.x;
+    segment->y = segment->y_text[0] ? CNCM_WORD_VALUE(&words, 'Y') : state.y;
+    segment->e = 0;
+    if(segment->e_text[0])
+    {
+        segment->e = state.absolute_e ? CNCM_WORD_VALUE(&words, 'E') - state.e : CNCM_WORD_VALUE(&words, 'E');
+        if(segment->e <= 0) return false;   //Retractions and wipes stay as they are.
+    }
+    if(hypotf(segment->x - state.x, segment->y - state.y) < 1e-4f) return false;
+    memcpy(segment->line, line, line_len);
+    segment->line[line_len] = '\0';
+    segment->line_len = line_len;
+    return true;
+}
+
+//What a line does to the position, on top of cncm_modal_update(). Homing leaves it unknown, the firmware decides
+//where home is.
+static void position_track(const char* line, size_t line_len)
+{
+    cncm_gcode_words_t words;
+    cncm_gcode_words_parse(line, line_len, &words);
+    cncm_modal_apply(&state, &words);
+    bool has_x = (words.present & CNCM_WORD_BIT('X')) != 0;
+    bool has_y = (words.present & CNCM_WORD_BIT('Y')) != 0;
+    if(words.g == 28)
+    {
+        bool all = (words.present & (CNCM_WORD_BIT('X') | CNCM_WORD_BIT('Y') | CNCM_WORD_BIT('Z'))) == 0;
+        if(all || has_x) x_known = false;
+        if(all || has_y) y_known = false;
+    }
+    else if(words.g == 92)
+    {
+        bool bare = (words.present & (CNCM_WORD_BIT('X') | CNCM_WORD_BIT('Y') | CNCM_WORD_BIT('Z') | CNCM_WORD_BIT('E'))) == 0;
+        if(bare || has_x) x_known = true;
+        if(bare || has_y) y_known = true;
+    }
+    else if((words.g >= 0 && words.g <= 3) || (words.g < 0 && words.m < 0))
+    {
+        //The mode is already updated, so "G91 G1 X1" counts as relative.
+        if(has_x && state.absolute) x_known = true;
+        if(has_y && state.absolute) y_known = true;
+    }
+}
+
+static float run_point_x(size_t index)
+{
+    return ((index == 0) ? run_x : run[index - 1].x) - run_x;
+}
+
+static float run_point_y(size_t index)
+{
+    return ((index == 0) ? run_y : run[index - 1].y) - run_y;
+}
+
+//Checks the first count segments of the run against the circle through its start, middle and end points: every point
+//within the tolerance of it, every segment turning the same way, not sagging more than the tolerance from the arc, and
+//less than a full turn in total. Coordinates are relative to the start of the run, floats keep plenty of precision there.
+static bool run_fit(size_t count, arc_fit_t* fit)
+{
+    if(count < 2) return false;
+    float ax = run_point_x(count / 2), ay = run_point_y(count / 2);
+    float bx = run_point_x(count), by = run_point_y(count);
+    float d = 2 * (ax * by - ay * bx);
+    if(fabsf(d) < 1e-6f) return false;     //Straight.
+    float a2 = ax * ax + ay * ay;
+    float b2 = bx * bx + by * by;
+    float cx = (by * a2 - ay * b2) / d;
+    float cy = (ax * b2 - bx * a2) / d;
+    float r = hypotf(cx, cy);
+    if(r > CNCM_ARC_MAX_RADIUS_MM) return false;
+    float sweep = 0;
+    float direction = 0;
+    for(size_t i = 1; i <= count; i++)
+    {
+        float v0x = run_point_x(i - 1) - cx, v0y = run_point_y(i - 1) - cy;
+        float v1x = run_point_x(i) - cx, v1y = run_point_y(i) - cy;
+        if(fabsf(hypotf(v1x, v1y) - r) > tolerance_mm) return false;
+        float cross = v0x * v1y - v0y * v1x;
+        if(i == 1) direction = cross;
+        if(cross * direction <= 0) return false;
+        float angle = atan2f(fabsf(cross), v0x * v1x + v0y * v1y);
+        if(r * (1 - cosf(angle / 2)) > tolerance_mm) return false;
+        sweep += angle;
+    }
+    if(sweep >= 2 * (float)M_PI) return false;
+    fit->i = cx;
+    fit->j = cy;
+    fit->clockwise = direction < 0;
+    return true;
+}
+
+//Segments of one arc share its feedrate and must all extrude, at about the same rate per millimeter, or all travel.
+static bool run_joinable(const arc_segment_t* segment)
+{
+    if(segment->f_text[0]) return false;
+    const arc_segment_t* first = &run[0];
+    if((first->e_text[0] != '\0') != (segment->e_text[0] != '\0')) return false;
+    if(!first->e_text[0]) return true;
+    float first_rate = first->e / hypotf(first->x - run_x, first->y - run_y);
+    const arc_segment_t* last = &run[run_count - 1];
+    float rate = segment->e / hypotf(segment->x - last->x, segment->y - last->y);
+    return fabsf(rate - first_rate) <= first_rate * CNCM_ARC_EXTRUSION_TOLERANCE;
+}
+
+static void run_drop(size_t count)
+{
+    for(size_t i = 0; i < count; i++) run_bytes -= CNCM_RING_RECORD_SIZE(run[i].line_len + 1);
+    run_x = run[count - 1].x;
+    run_y = run[count - 1].y;
+    run_count -= count;
+    memmove(run, run + count, run_count * sizeof(arc_segment_t));
+}
+
+//Trailing zeros dropped, like slicers write them.
+static void number_format(char* text, float value, int decimals)
+{
+    snprintf(text, ARC_NUMBER_SIZE, "%.*f", decimals, value);
+    if(strchr(text, '.') != NULL)
+    {
+        size_t len = strlen(text);
+        while(text[len - 1] == '0') text[--len] = '\0';
+        if(text[len - 1] == '.') text[--len] = '\0';
+    }
+    if(strcmp(text, "-0") == 0) strcpy(text, "0");
+}
+
+//The run is only shortened once its lines are queued, so a line that doesn't fit stays held rather than being lost.
+static esp_err_t run_emit_line()
+{
+    arc_segment_t* segment = &run[0];
+    esp_err_t ret = cncm_tx_emit(run_slot, segment->line, segment->line_len, 1);
+    if(ret != ESP_OK) return ret;
+    stats.lines_out++;
+    run_drop(1);
+    return ESP_OK;
+}
+
+//The end point keeps the words of the last segments as written, so the firmware ends exactly where the lines would have.
+static esp_err_t run_emit_arc(size_t count, const arc_fit_t* fit)
+{
+    const char* x_text = NULL;
+    const char* y_text = NULL;
+    for(size_t i = count; i-- > 0 && (x_text == NULL || y_text == NULL); )
+    {
+        if(x_text == NULL && run[i].x_text[0]) x_text = run[i].x_text;
+        if(y_text == NULL && run[i].y_text[0]) y_text = run[i].y_text;
+    }
+    char x_buffer[ARC_NUMBER_SIZE], y_buffer[ARC_NUMBER_SIZE], i_text[ARC_NUMBER_SIZE], j_text[ARC_NUMBER_SIZE];
+    if(x_text == NULL) number_format(x_buffer, run_x, 4), x_text = x_buffer;
+    if(y_text == NULL) number_format(y_buffer, run_y, 4), y_text = y_buffer;
+    number_format(i_text, fit->i, 4);
+    number_format(j_text, fit->j, 4);
+    char line[ARC_LINE_SIZE];
+    int len = snprintf(line, sizeof(line), "G%d X%s Y%s I%s J%s", fit->clockwise ? 2 : 3, x_text, y_text, i_text, j_text);
+    if(run[0].e_text[0])
+    {
+        //Absolute E ends where the last segment did, relative E adds up the segments'.
+        char e_buffer[ARC_NUMBER_SIZE];
+        const char* e_text = run[count - 1].e_text;
+        if(!state.absolute_e)
+        {
+            float e = 0;
+            for(size_t i = 0; i < count; i++) e += run[i].e;
+            number_format(e_buffer, e, 5);
+            e_text = e_buffer;
+        }
+        len += snprintf(line + len, sizeof(line) - len, " E%s", e_text);
+    }
+    if(run[0].f_text[0]) len += snprintf(line + len, sizeof(line) - len, " F%s", run[0].f_text);
+    esp_err_t ret = cncm_tx_emit(run_slot, line, len, count);
+    if(ret != ESP_OK) return ret;
+    stats.lines_out++;
+    stats.arcs++;
+    stats.arc_segments += count;
+    run_drop(count);
+    return ESP_OK;
+}
+
+//A run of three segments or more always fits, it's checked as it grows. Stops at the first line that isn't queued, what
+//is left of the run stays held.
+static esp_err_t run_flush()
+{
+    arc_fit_t fit;
+    esp_err_t ret = ESP_OK;
+    if(run_count >= CNCM_ARC_MIN_SEGMENTS && run_fit(run_count, &fit)) ret = run_emit_arc(run_count, &fit);
+    while(ret == ESP_OK && run_count > 0) ret = run_emit_line();
+    return ret;
+}
+
+//Greedy: the run grows while it fits one arc. When a segment breaks it, what fitted so far becomes an arc if it's long
+//enough, otherwise its oldest line is queued as is and the rest is tried again. If a line can't be queued the segment is
+//taken back off the end of the run, and the run keeps what it still holds.
+static esp_err_t run_add(const arc_segment_t* segment)
+{
+    esp_err_t ret = ESP_OK;
+    if(run_count > 0 && !run_joinable(segment)) ret = run_flush();
+    if(ret == ESP_OK && run_count == CNCM_ARC_MAX_SEGMENTS) ret = run_flush();
+    if(ret != ESP_OK) return ret;
+    if(run_count == 0)
+    {
+        run_x = state.x;
+        run_y = state.y;
+    }
+    run[run_count++] = *segment;
+    run_bytes += CNCM_RING_RECORD_SIZE(segment->line_len + 1);
+    arc_fit_t fit;
+    while(ret == ESP_OK && run_count > 2 && !run_fit(run_count, &fit))
+    {
+        if(run_count - 1 >= CNCM_ARC_MIN_SEGMENTS && run_fit(run_count - 1, &fit)) ret = run_emit_arc(run_count - 1, &fit);
+        else ret = run_emit_line();
+    }
+    if(ret != ESP_OK)
+    {
+        run_count--;
+        run_bytes -= CNCM_RING_RECORD_SIZE(segment->line_len + 1);
+    }
+    return ret;
+}
+
+esp_err_t cncm_arcs_init(nvs_handle_t nvs)
+{
+    arcs_nvs = nvs;
+    cncm_modal_reset(&state);
+    arcs_initialized = true;
+    uint8_t stored_enabled = 0;
+    uint32_t tolerance_um = 0;
+    esp_err_t ret = nvs_get_u8(arcs_nvs, "arc_enabled", &stored_enabled);
+    if(ret == ESP_OK) ret = nvs_get_u32(arcs_nvs, "arc_tol_um", &tolerance_um);
+    if(ret == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    enabled = stored_enabled != 0;
+    tolerance_mm = tolerance_um / 1000.0f;
+    if(enabled) ESP_LOGI(TAG, "Arc fitting enabled, tolerance %.3f mm.", tolerance_mm);
+    return ESP_OK;
+}
+
+size_t cncm_arcs_reserved()
+{
+    //An arc may be longer than the lines it replaces.
+    return (run_count > 0) ? run_bytes + CNCM_RING_RECORD_SIZE(ARC_LINE_SIZE) : 0;
+}
+
+esp_err_t cncm_arcs_feed(uint8_t job_slot, const char* command)
+{
+    size_t command_length = strlen(command);
+    if(command_length == 0 || command_length > CNCM_MAX_COMMAND_SIZE) return ESP_ERR_INVALID_ARG;
+    cncm_tx_lock();
+    if(!enabled && run_count == 0)
+    {
+        esp_err_t ret = cncm_tx_enqueue(job_slot, command);
+        cncm_tx_unlock();
+        return ret;
+    }
+    if(job_slot != run_slot)
+    {
+        //Another job's lines may have moved the machine anywhere.
+        esp_err_t ret = run_flush();
+        if(ret != ESP_OK)
+        {
+            cncm_tx_unlock();
+            return ret;
+        }
+        run_slot = job_slot;
+        x_known = y_known = false;
+    }
+    arc_segment_t segment;
+    esp_err_t ret = ESP_OK;
+    if(!enabled || !segment_parse(command, command_length, &segment))
+    {
+        ret = run_flush();
+        if(ret == ESP_OK) ret = cncm_tx_enqueue(job_slot, command);
+        if(ret == ESP_OK && enabled)
+        {
+            stats.lines_in++;
+            stats.lines_out++;
+            if(command[0] == CNCM_MACRO_PREFIX) x_known = y_known = false;
+            else position_track(command, command_length);
+        }
+    }
+    else if(cncm_tx_space() < CNCM_RING_RECORD_SIZE(command_length + 1) + CNCM_RING_RECORD_SIZE(ARC_LINE_SIZE))
+    {
+        ret = ESP_ERR_NO_MEM;
+    }
+    else
+    {
+        ret = run_add(&segment);
+        if(ret == ESP_OK)
+        {
+            stats.lines_in++;
+            position_track(command, command_length);
+        }
+    }
+    cncm_tx_unlock();
+    return ret;
+}
+
+esp_err_t cncm_arcs_flush(uint8_t job_slot)
+{
+    cncm_tx_lock();
+    esp_err_t ret = (job_slot == run_slot) ? run_flush() : ESP_OK;
+    cncm_tx_unlock();
+    return ret;
+}
+
+void cncm_arcs_discard(uint8_t job_slot)
+{
+    cncm_tx_lock();
+    if(job_slot == CNCM_NO_JOB_SLOT || job_slot == run_slot)
+    {
+        run_count = 0;
+        run_bytes = 0;
+        run_slot = CNCM_NO_JOB_SLOT;
+    }
+    cncm_tx_unlock();
+}
+
+esp_err_t cncm_arc_set_config(bool new_enabled, float new_tolerance_mm)
+{
+    if(!arcs_initialized) return ESP_ERR_INVALID_STATE;
+    if(!(new_tolerance_mm >= CNCM_ARC_MIN_TOLERANCE_MM && new_tolerance_mm <= CNCM_ARC_MAX_TOLERANCE_MM)) return ESP_ERR_INVALID_ARG;
+    cncm_tx_lock();
+    //The held run was checked against the old tolerance, and must not wait for a job that may never send another line.
+    //Flushed first, so nothing is stored if it can't be queued yet.
+    esp_err_t ret = run_flush();
+    if(ret != ESP_OK)
+    {
+        cncm_tx_unlock();
+        return ret;
+    }
+    ret = nvs_set_u8(arcs_nvs, "arc_enabled", new_enabled ? 1 : 0);
+    if(ret == ESP_OK) ret = nvs_set_u32(arcs_nvs, "arc_tol_um", (uint32_t)lroundf(new_tolerance_mm * 1000));
+    if(ret == ESP_OK) ret = nvs_commit(arcs_nvs);
+    if(ret != ESP_OK)
+    {
+        cncm_tx_unlock();
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    if(new_enabled && !enabled)
+    {
+        run_slot = CNCM_NO_JOB_SLOT;    //Nothing was tracked while disabled.
+        cncm_modal_reset(&state);
+        x_known = y_known = false;
+    }
+    enabled = new_enabled;
+    tolerance_mm = roundf(new_tolerance_mm * 1000) / 1000;
+    cncm_tx_unlock();
+    ESP_LOGI(TAG, "Arc fitting %s, tolerance %.3f mm.", enabled ? "enabled" : "disabled", tolerance_mm);
+    return ESP_OK;
+}
+
+esp_err_t cncm_arc_get_stats(cncm_arc_stats_t* arc_stats)
+{
+    if(!arcs_initialized) return ESP_ERR_INVALID_STATE;
+    if(arc_stats == NULL) return ESP_ERR_INVALID_ARG;
+    cncm_tx_lock();
+    *arc_stats = stats;
+    arc_stats->enabled = enabled;
+    arc_stats->tolerance_mm = tolerance_mm;
+    arc_stats->lines_held = run_count;
+    arc_stats->compression_ratio = (stats.lines_out > 0) ? (float)(stats.lines_in - run_count) / stats.lines_out : 1.0f;
+    cncm_tx_unlock();
+    return ESP_OK;
+}
@@ -0,0 +1,338 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "nvs_flash.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-Checkpoint";
+static const char* checkpoint_namespace = "CNCM_CKPT";
+
+//The checkpoint follows acks in RAM (live) and is copied to flash by a writer task, woken up by a periodic timer, only
+//if it changed, so the write rate is bounded by the interval whatever the line rate, and nothing is written while no job
+//runs. The timer callback only wakes the task: flash writes and the locks would stall the esp_timer task otherwise.
+//NVS spreads the writes over its pages, one write is a few entries of 32 bytes.
+static SemaphoreHandle_t checkpoint_lock;   //live, stored, live_dirty and stats.
+static SemaphoreHandle_t write_lock;        //Serializes flash writes, held without checkpoint_lock so acks never wait on flash.
+static nvs_handle_t checkpoint_nvs;
+static esp_timer_handle_t checkpoint_timer;
+static TaskHandle_t writer;
+static cncm_checkpoint_t live;      //job_id 0 if there is nothing to checkpoint.
+static cncm_checkpoint_t stored;    //What's in flash, job_id 0 if nothing.
+static bool live_dirty = false;
+static cncm_checkpoint_stats_t stats;
+
+static float axis_target(float current, float value, bool absolute)
+{
+    return absolute ? value : current + value;
+}
+
+void cncm_modal_reset(cncm_modal_state_t* state)
+{
+    memset(state, 0, sizeof(*state));
+    state->absolute = true;
+    state->absolute_e = true;
+}
+
+void cncm_modal_update(cncm_modal_state_t* state, const char* line, size_t line_len)
+{
+    cncm_gcode_words_t words;
+    cncm_gcode_words_parse(line, line_len, &words);
+    cncm_modal_apply(state, &words);
+}
+
+//Applies the words of a line that change the modal state. Mode words (G20/G21, G90/G91) take effect first, so
+//"G91 G0 X1" is relative, the other G and M codes once the whole line is read.
+void cncm_modal_apply(cncm_modal_state_t* state, const cncm_gcode_words_t* words)
+{
+    if(words->units >= 0) state->inches = (words->units == 20);
+    if(words->distance >= 0) state->absolute = state->absolute_e = (words->distance == 90);
+    int g = words->g;
+    int m = words->m;
+
+    bool has_axis = words->present & (CNCM_WORD_BIT('X') | CNCM_WORD_BIT('Y') | CNCM_WORD_BIT('Z') | CNCM_WORD_BIT('E'));
+    //Axis words without a G code continue the last motion, as GRBL does.
+    if((g >= 0 && g <= 3) || (g < 0 && m < 0 && has_axis))
+    {
+        if(CNCM_WORD_HAS(words, 'X')) state->x = axis_target(state->x, CNCM_WORD_VALUE(words, 'X'), state->absolute);
+        if(CNCM_WORD_HAS(words, 'Y')) state->y = axis_target(state->y, CNCM_WORD_VALUE(words, 'Y'), state->absolute);
+        if(CNCM_WORD_HAS(words, 'Z')) state->z = axis_target(state->z, CNCM_WORD_VALUE(words, 'Z'), state->absolute);
+        if(CNCM_WORD_HAS(words, 'E')) state->e = axis_target(state->e, CNCM_WORD_VALUE(words, 'E'), state->absolute_e);
+    }
+    else if(g == 28)
+    {
+        bool all = !(words->present & (CNCM_WORD_BIT('X') | CNCM_WORD_BIT('Y') | CNCM_WORD_BIT('Z')));
+        if(all || CNCM_WORD_HAS(words, 'X')) state->x = 0;
+        if(all || CNCM_WORD_HAS(words, 'Y')) state->y = 0;
+        if(all || CNCM_WORD_HAS(words, 'Z')) state->z = 0;
+    }
+    else if(g == 92)
+    {
+        state->x = CNCM_WORD_HAS(words, 'X') ? CNCM_WORD_VALUE(words, 'X') : (has_axis ? state->x : 0);
+        state->y = CNCM_WORD_HAS(words, 'Y') ? CNCM_WORD_VALUE(words, 'Y') : (has_axis ? state->y : 0);
+        state->z = CNCM_WORD_HAS(words, 'Z') ? CNCM_WORD_VALUE(words, 'Z') : (has_axis ? state->z : 0);
+        state->e = CNCM_WORD_HAS(words, 'E') ? CNCM_WORD_VALUE(words, 'E') : (has_axis ? state->e : 0);
+    }
+    if(CNCM_WORD_HAS(words, 'F') && m < 0) state->feedrate = CNCM_WORD_VALUE(words, 'F');
+
+    float s = CNCM_WORD_VALUE(words, 'S');
+    bool has_s = CNCM_WORD_HAS(words, 'S');
+    switch(m)
+    {
+        case 3:
+        case 4:
+            state->spindle = m;
+            if(has_s) state->spindle_speed = (uint16_t)s;
+            break;
+        case 5:
+            state->spindle = 0;
+            break;
+        case 82:
+        case 83:
+            state->absolute_e = (m == 82);
+            break;
+        case 104:
+        case 109:
+            if(has_s) state->hotend_target = (int16_t)s;
+            break;
+        case 140:
+        case 190:
+            if(has_s) state->bed_target = (int16_t)s;
+            break;
+        case 106:
+            state->fan = has_s ? (uint8_t)((s < 0) ? 0 : (s > 255) ? 255 : s) : 255;
+            break;
+        case 107:
+            state->fan = 0;
+            break;
+        case -1:
+            if(g < 0 && CNCM_WORD_HAS(words, 'T')) state->tool = (uint8_t)CNCM_WORD_VALUE(words, 'T');
+            break;
+        default:
+            break;
+    }
+}
+
+void cncm_checkpoint_on_completed(uint32_t job_id, const char* name, uint32_t line, const cncm_modal_state_t* state)
+{
+    xSemaphoreTake(checkpoint_lock, portMAX_DELAY);
+    if(live.job_id != job_id)
+    {
+        live.job_id = job_id;
+        strlcpy(live.name, name, sizeof(live.name));
+    }
+    live.line = line;
+    live.state = *state;
+    live_dirty = true;
+    xSemaphoreGive(checkpoint_lock);
+}
+
+void cncm_checkpoint_on_job_over(uint32_t job_id)
+{
+    xSemaphoreTake(checkpoint_lock, portMAX_DELAY);
+    if(live.job_id == job_id)
+    {
+        memset(&live, 0, sizeof(live));
+        live_dirty = true;  //Erased by the next write.
+    }
+    xSemaphoreGive(checkpoint_lock);
+}
+
+//Writes (or erases, if there is no job) the checkpoint if it changed since the last write.
+static void checkpoint_write()
+{
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    xSemaphoreTake(checkpoint_lock, portMAX_DELAY);
+    bool dirty = live_dirty;
+    cncm_checkpoint_t to_write = live;
+    live_dirty = false;
+    xSemaphoreGive(checkpoint_lock);
+    if(!dirty)
+    {
+        xSemaphoreGive(write_lock);
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret;
+    if(to_write.job_id == 0)
+    {
+        ret = nvs_erase_key(checkpoint_nvs, "checkpoint");
+        if(ret == ESP_ERR_NVS_NOT_FOUND) ret = ESP_OK;
+    }
+    else ret = nvs_set_blob(checkpoint_nvs, "checkpoint", &to_write, sizeof(to_write));
+    if(ret == ESP_OK) ret = nvs_commit(checkpoint_nvs);
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    xSemaphoreTake(checkpoint_lock, portMAX_DELAY);
+    if(ret == ESP_OK)
+    {
+        stored = to_write;
+        stats.writes++;
+        stats.last_write_us = elapsed;
+        if(elapsed > stats.max_write_us) stats.max_write_us = elapsed;
+        stats.total_write_us += elapsed;
+    }
+    else live_dirty = true; //Retried on the next tick.
+    xSemaphoreGive(checkpoint_lock);
+    xSemaphoreGive(write_lock);
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to write checkpoint: %s", esp_err_to_name(ret));
+}
+
+static void checkpoint_writer()
+{
+    while(true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        checkpoint_write();
+        ESP_LOGD(TAG, "Checkpoint writer high water mark:\t%d", uxTaskGetStackHighWaterMark(NULL));
+    }
+}
+
+static void checkpoint_tick(void* arg)
+{
+    xTaskNotifyGive(writer);
+}
+
+esp_err_t cncm_checkpoint_init()
+{
+    checkpoint_lock = xSemaphoreCreateMutex();
+    write_lock = xSemaphoreCreateMutex();
+    if(checkpoint_lock == NULL || write_lock == NULL) return ESP_ERR_NO_MEM;
+    esp_err_t ret = nvs_open(checkpoint_namespace, NVS_READWRITE, &checkpoint_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS: %s.", esp_err_to_name(ret));
+        return ret;
+    }
+
+    stats.interval_s = CNCM_CHECKPOINT_DEFAULT_INTERVAL_S;
+    ret = nvs_get_u32(checkpoint_nvs, "interval_s", &stats.interval_s);
+    if(ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND)
+    {
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    size_t stored_size = sizeof(stored);
+    ret = nvs_get_blob(checkpoint_nvs, "checkpoint", &stored, &stored_size);
+    if(ret == ESP_OK && stored_size == sizeof(stored))
+    {
+        stored.name[sizeof(stored.name) - 1] = '\0';
+        ESP_LOGW(TAG, "Found a checkpoint of job %s at line %" PRIu32 ", it can be resumed.", stored.name, stored.line);
+    }
+    else memset(&stored, 0, sizeof(stored));   //None, or from a firmware with another layout.
+
+    if(xTaskCreate(checkpoint_writer, "checkpoint_writer", CNCM_CHECKPOINT_WRITER_STACK_SIZE, NULL,
+                   CNCM_CHECKPOINT_WRITER_PRIORITY, &writer) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Couldn't create checkpoint writer task.");
+        return ESP_FAIL;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = checkpoint_tick,
+        .name = "cncm_checkpoint"
+    };
+    ret = esp_timer_create(&timer_args, &checkpoint_timer);
+    if(ret == ESP_OK) ret = esp_timer_start_periodic(checkpoint_timer, stats.interval_s * 1000000ULL);
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to start checkpoint timer: %s", esp_err_to_name(ret));
+    return ret;
+}
+
+esp_err_t cncm_checkpoint_get(cncm_checkpoint_t* checkpoint)
+{
+    if(checkpoint_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(checkpoint == NULL) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(checkpoint_lock, portMAX_DELAY);
+    *checkpoint = stored;
+    xSemaphoreGive(checkpoint_lock);
+    return (checkpoint->job_id == 0) ? ESP_ERR_NOT_FOUND : ESP_OK;
+}
+
+esp_err_t cncm_checkpoint_get_stats(cncm_checkpoint_stats_t* out)
+{
+    if(checkpoint_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(out == NULL) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(checkpoint_lock, portMAX_DELAY);
+    *out = stats;
+    if(live.job_id == 0) out->lag_lines = 0;
+    else if(live.job_id == stored.job_id && live.line >= stored.line) out->lag_lines = live.line - stored.line;
+    else out->lag_lines = live.line;
+    xSemaphoreGive(checkpoint_lock);
+    return ESP_OK;
+}
+
+esp_err_t cncm_checkpoint_set_interval(uint32_t interval_s)
+{
+    if(checkpoint_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(interval_s == 0 || interval_s > CNCM_CHECKPOINT_MAX_INTERVAL_S) return ESP_ERR_INVALID_ARG;
+    esp_err_t ret = nvs_set_u32(checkpoint_nvs, "interval_s", interval_s);
+    if(ret == ESP_OK) ret = nvs_commit(checkpoint_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    xSemaphoreTake(checkpoint_lock, portMAX_DELAY);
+    stats.interval_s = interval_s;
+    xSemaphoreGive(checkpoint_lock);
+    esp_timer_stop(checkpoint_timer);
+    return esp_timer_start_periodic(checkpoint_timer, interval_s * 1000000ULL);
+}
+
+esp_err_t cncm_checkpoint_discard()
+{
+    if(checkpoint_lock == NULL) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    xSemaphoreTake(checkpoint_lock, portMAX_DELAY);
+    memset(&live, 0, sizeof(live));
+    memset(&stored, 0, sizeof(stored));
+    live_dirty = false;
+    xSemaphoreGive(checkpoint_lock);
+    esp_err_t ret = nvs_erase_key(checkpoint_nvs, "checkpoint");
+    if(ret == ESP_ERR_NVS_NOT_FOUND) ret = ESP_OK;
+    if(ret == ESP_OK) ret = nvs_commit(checkpoint_nvs);
+    xSemaphoreGive(write_lock);
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+    return ret;
+}
+
+esp_err_t cncm_job_resume(uint32_t* job_id, uint32_t* resume_line)
+{
+    if(checkpoint_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(job_id == NULL || resume_line == NULL) return ESP_ERR_INVALID_ARG;
+    cncm_checkpoint_t checkpoint;
+    esp_err_t ret = cncm_checkpoint_get(&checkpoint);
+    if(ret != ESP_OK) return ret;
+
+    char* preamble = malloc(CNCM_RESUME_PREAMBLE_SIZE);
+    if(preamble == NULL) return ESP_ERR_NO_MEM;
+    cncm_dialect_def(cncm_get_dialect())->resume_preamble(&checkpoint, preamble, CNCM_RESUME_PREAMBLE_SIZE);
+    uint32_t preamble_lines = 0;
+    for(const char* c = preamble; *c != '\0'; c++) if(*c == CNCM_COMMAND_SEPARATOR) preamble_lines++;
+
+    *job_id = 0;
+    uint8_t slot;
+    ret = cncm_job_create(checkpoint.name, job_id);
+    if(ret == ESP_OK) ret = cncm_jobs_slot(*job_id, &slot);
+    if(ret == ESP_OK)
+    {
+        cncm_jobs_set_resume(slot, checkpoint.line, preamble_lines);
+        ret = cncm_tx_enqueue_lines(slot, preamble);
+    }
+    free(preamble);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to resume job %s: %s", checkpoint.name, esp_err_to_name(ret));
+        if(*job_id != 0) cncm_job_cancel(*job_id);
+        return ret;
+    }
+    *resume_line = checkpoint.line;
+    ESP_LOGI(TAG, "Job %s resumed as job %" PRIu32 " after line %" PRIu32 ".", checkpoint.name, *job_id, checkpoint.line);
+    return ESP_OK;
+}
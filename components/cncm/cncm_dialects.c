@@ -0,0 +1,252 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+//Each scanner only looks at the first bytes of a line and switches on the first one, since it runs on every line the
+//machine sends from the USB callback.
+
+static bool starts_with(const char* line, size_t line_len, const char* prefix, size_t prefix_len)
+{
+    return line_len >= prefix_len && memcmp(line, prefix, prefix_len) == 0;
+}
+
+//"ok" alone or followed by a space, e.g. "ok T:20.0 /0.0" (M105) or "ok N12 P15 B3" (ADVANCED_OK).
+static bool is_ok(const char* line, size_t line_len)
+{
+    return line_len >= 2 && line[0] == 'o' && line[1] == 'k' && (line_len == 2 || line[2] == ' ');
+}
+
+//Temperature report, alone (auto reports) or after "ok".
+static bool is_temperature_report(const char* line, size_t line_len)
+{
+    if(line_len >= 2 && line[0] == 'T' && line[1] == ':') return true;
+    return line_len >= 5 && line[0] == 'o' && memcmp(line + 2, " T:", 3) == 0;
+}
+
+//Marlin: every line gets exactly one "ok". "Error:" and "Resend:" come before the "ok" of the same line, so they
+//don't complete it.
+static uint8_t marlin_line_classify(const char* line, size_t line_len)
+{
+    if(line_len < 2) return CNCM_LINE_OTHER;
+    switch(line[0])
+    {
+        case 'o':
+            if(!is_ok(line, line_len)) return CNCM_LINE_OTHER;
+            return CNCM_LINE_ACK | (is_temperature_report(line, line_len) ? CNCM_LINE_STATUS : 0);
+        case 'T':
+        case ' ':
+            return (is_temperature_report(line, line_len) || starts_with(line, line_len, " T:", 3)) ? CNCM_LINE_STATUS : CNCM_LINE_OTHER;
+        case 'E':
+            return starts_with(line, line_len, "Error:", 6) ? CNCM_LINE_ERROR : CNCM_LINE_OTHER;
+        case 'R':
+            return starts_with(line, line_len, "Resend:", 7) ? CNCM_LINE_ERROR : CNCM_LINE_OTHER;
+        case '!':
+            return (line[1] == '!') ? CNCM_LINE_ERROR : CNCM_LINE_OTHER;   //Killed.
+        default:
+            return CNCM_LINE_OTHER;
+    }
+}
+
+//GRBL: every line gets exactly one "ok" or "error:<code>", status reports are "<...>" and answer the realtime '?'.
+static uint8_t grbl_line_classify(const char* line, size_t line_len)
+{
+    if(line_len < 2) return CNCM_LINE_OTHER;
+    switch(line[0])
+    {
+        case 'o':
+            return is_ok(line, line_len) ? CNCM_LINE_ACK : CNCM_LINE_OTHER;
+        case 'e':
+            return starts_with(line, line_len, "error:", 6) ? (CNCM_LINE_ACK | CNCM_LINE_ERROR) : CNCM_LINE_OTHER;
+        case 'A':
+            return starts_with(line, line_len, "ALARM:", 6) ? CNCM_LINE_ERROR : CNCM_LINE_OTHER;
+        case '<':
+            return CNCM_LINE_STATUS;
+        default:
+            return CNCM_LINE_OTHER;
+    }
+}
+
+//RepRapFirmware: like Marlin, status is the JSON answer of M408.
+static uint8_t reprap_line_classify(const char* line, size_t line_len)
+{
+    if(line_len < 2) return CNCM_LINE_OTHER;
+    switch(line[0])
+    {
+        case 'o':
+            if(!is_ok(line, line_len)) return CNCM_LINE_OTHER;
+            return CNCM_LINE_ACK | (is_temperature_report(line, line_len) ? CNCM_LINE_STATUS : 0);
+        case '{':
+            return CNCM_LINE_STATUS;
+        case 'T':
+            return is_temperature_report(line, line_len) ? CNCM_LINE_STATUS : CNCM_LINE_OTHER;
+        case 'E':
+            return starts_with(line, line_len, "Error:", 6) ? CNCM_LINE_ERROR : CNCM_LINE_OTHER;
+        default:
+            return CNCM_LINE_OTHER;
+    }
+}
+
+//Klipper's G-code terminal: "ok" per line, errors are "!! ..." and informational lines "// ...".
+static uint8_t klipper_line_classify(const char* line, size_t line_len)
+{
+    if(line_len < 2) return CNCM_LINE_OTHER;
+    switch(line[0])
+    {
+        case 'o':
+            if(!is_ok(line, line_len)) return CNCM_LINE_OTHER;
+            return CNCM_LINE_ACK | (is_temperature_report(line, line_len) ? CNCM_LINE_STATUS : 0);
+        case 'T':
+        case 'B':
+            return (line[1] == ':') ? CNCM_LINE_STATUS : CNCM_LINE_OTHER;
+        case '!':
+            return (line[1] == '!') ? CNCM_LINE_ERROR : CNCM_LINE_OTHER;
+        default:
+            return CNCM_LINE_OTHER;
+    }
+}
+
+//"N0 M110 N0*<checksum>", only resets the line number, answered by a single "ok".
+static size_t numbered_probe_query(char* query, size_t query_size)
+{
+    int query_len = snprintf(query, query_size, "N0 M110 N0");
+    uint8_t checksum = 0;
+    for(int i = 0; i < query_len; i++) checksum ^= (uint8_t)query[i];
+    query_len += snprintf(query + query_len, query_size - query_len, "*%u%c", checksum, CNCM_COMMAND_SEPARATOR);
+    return query_len;
+}
+
+//"$I", build info followed by "ok".
+static size_t grbl_probe_query(char* query, size_t query_size)
+{
+    return snprintf(query, query_size, "$I%c", CNCM_COMMAND_SEPARATOR);
+}
+
+static void preamble_append(char* preamble, size_t preamble_size, size_t* len, const char* format, ...)
+{
+    if(*len >= preamble_size) return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(preamble + *len, preamble_size - *len, format, args);
+    va_end(args);
+    if(written > 0) *len += written;
+}
+
+//Heats up first, then homes X and Y only since the part is in the way of Z, and takes the Z height on trust: the
+//machine must not have moved Z while it was off.
+static size_t printer_resume_preamble(const cncm_checkpoint_t* checkpoint, char* preamble, size_t preamble_size)
+{
+    const cncm_modal_state_t* state = &checkpoint->state;
+    size_t len = 0;
+    preamble[0] = '\0';
+    if(state->bed_target > 0) preamble_append(preamble, preamble_size, &len, "M140 S%d\n", state->bed_target);
+    if(state->tool > 0) preamble_append(preamble, preamble_size, &len, "T%u\n", state->tool);
+    if(state->hotend_target > 0) preamble_append(preamble, preamble_size, &len, "M109 S%d\n", state->hotend_target);
+    if(state->bed_target > 0) preamble_append(preamble, preamble_size, &len, "M190 S%d\n", state->bed_target);
+    preamble_append(preamble, preamble_size, &len, "%s\nG28 X Y\n", state->inches ? "G20" : "G21");
+    preamble_append(preamble, preamble_size, &len, "G92 Z%.3f E%.5f\n", state->z, state->absolute_e ? state->e : 0.0f);
+    preamble_append(preamble, preamble_size, &len, "G90\nG0 X%.3f Y%.3f\n", state->x, state->y);
+    if(state->feedrate > 0) preamble_append(preamble, preamble_size, &len, "G1 F%.0f\n", state->feedrate);
+    if(state->fan > 0) preamble_append(preamble, preamble_size, &len, "M106 S%u\n", state->fan);
+    else preamble_append(preamble, preamble_size, &len, "M107\n");
+    if(!state->absolute) preamble_append(preamble, preamble_size, &len, "G91\n");
+    preamble_append(preamble, preamble_size, &len, "%s\n", state->absolute_e ? "M82" : "M83");
+    return len;
+}
+
+//Homing restores the machine coordinates, work offsets are kept by GRBL. The spindle is started before plunging.
+static size_t grbl_resume_preamble(const cncm_checkpoint_t* checkpoint, char* preamble, size_t preamble_size)
+{
+    const cncm_modal_state_t* state = &checkpoint->state;
+    size_t len = 0;
+    preamble[0] = '\0';
+    preamble_append(preamble, preamble_size, &len, "$H\n%s\nG90\n", state->inches ? "G20" : "G21");
+    preamble_append(preamble, preamble_size, &len, "G0 X%.3f Y%.3f\n", state->x, state->y);
+    if(state->spindle != 0) preamble_append(preamble, preamble_size, &len, "M%u S%u\n", state->spindle, state->spindle_speed);
+    preamble_append(preamble, preamble_size, &len, "G1 Z%.3f F%.0f\n", state->z, (state->feedrate > 0) ? state->feedrate : 100.0f);
+    if(!state->absolute) preamble_append(preamble, preamble_size, &len, "G91\n");
+    return len;
+}
+
+//Queries that only report and can be answered once for several requesters.
+static const char* const marlin_queries[] = {"M105", "M114", "M27", "M31", "M119", "M115", NULL};
+static const char* const grbl_queries[] = {"$G", "$#", "$I", NULL};
+static const char* const reprap_queries[] = {"M105", "M114", "M27", "M119", "M115", "M408 S0", NULL};
+static const char* const klipper_queries[] = {"M105", "M114", "M27", "M115", NULL};
+
+static const cncm_dialect_def_t dialects[CNCM_DIALECT_COUNT] = {
+    [CNCM_DIALECT_MARLIN] = {
+        .name = "marlin",
+        .default_baudrate = 115200,
+        .data_bits = 8, .parity = 0, .stop_bits = 0,
+        .line_classify = marlin_line_classify,
+        .probe_query = numbered_probe_query,
+        .status_query = "M105",
+        .idempotent_queries = marlin_queries,
+        .status_query_realtime = false,
+        .emergency_stop = "M112\n",     //Handled on arrival by EMERGENCY_PARSER builds.
+        .resume_preamble = printer_resume_preamble,
+    },
+    [CNCM_DIALECT_GRBL] = {
+        .name = "grbl",
+        .default_baudrate = 115200,
+        .data_bits = 8, .parity = 0, .stop_bits = 0,
+        .line_classify = grbl_line_classify,
+        .probe_query = grbl_probe_query,
+        .status_query = "?",
+        .idempotent_queries = grbl_queries,
+        .status_query_realtime = true,
+        .emergency_stop = "\x18",       //Ctrl-X soft reset, stops motion immediately.
+        .resume_preamble = grbl_resume_preamble,
+    },
+    [CNCM_DIALECT_REPRAP] = {
+        .name = "reprap",
+        .default_baudrate = 115200,     //Ignored by native USB boards.
+        .data_bits = 8, .parity = 0, .stop_bits = 0,
+        .line_classify = reprap_line_classify,
+        .probe_query = numbered_probe_query,
+        .status_query = "M408 S0",
+        .idempotent_queries = reprap_queries,
+        .status_query_realtime = false,
+        .emergency_stop = "M112\n",
+        .resume_preamble = printer_resume_preamble,
+    },
+    [CNCM_DIALECT_KLIPPER] = {
+        .name = "klipper",
+        .default_baudrate = 250000,
+        .data_bits = 8, .parity = 0, .stop_bits = 0,
+        .line_classify = klipper_line_classify,
+        .probe_query = numbered_probe_query,
+        .status_query = "M105",
+        .idempotent_queries = klipper_queries,
+        .status_query_realtime = false,
+        .emergency_stop = "M112\n",
+        .resume_preamble = printer_resume_preamble,
+    }
+};
+
+const cncm_dialect_def_t* cncm_dialect_def(cncm_dialect_t dialect)
+{
+    return (dialect < CNCM_DIALECT_COUNT) ? &dialects[dialect] : &dialects[CNCM_DIALECT_MARLIN];
+}
+
+const char* cncm_dialect_name(cncm_dialect_t dialect)
+{
+    return cncm_dialect_def(dialect)->name;
+}
+
+esp_err_t cncm_dialect_from_name(const char* name, cncm_dialect_t* dialect)
+{
+    if(name == NULL || dialect == NULL) return ESP_ERR_INVALID_ARG;
+    for(cncm_dialect_t i = 0; i < CNCM_DIALECT_COUNT; i++)
+    {
+        if(strcmp(name, dialects[i].name) == 0)
+        {
+            *dialect = i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
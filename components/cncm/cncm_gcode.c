@@ -0,0 +1,81 @@
+#include <ctype.h>
+#include <string.h>
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+//No exponent, since 'E' is an axis and "X1.5E2" is two words.
+static const char* number_parse(const char* p, const char* end, float* value)
+{
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+    float result = 0;
+    while(p < end && isdigit((unsigned char)*p)) result = result * 10 + (*p++ - '0');
+    if(p < end && *p == '.')
+    {
+        float scale = 0.1f;
+        for(p++; p < end && isdigit((unsigned char)*p); p++, scale *= 0.1f) result += (*p - '0') * scale;
+    }
+    *value = negative ? -result : result;
+    return p;
+}
+
+//Parenthesized comments are skipped, ';' and '*' end the line. Whatever the line holds besides plain words sets other,
+//the words are read on anyway.
+void cncm_gcode_words_parse(const char* line, size_t line_len, cncm_gcode_words_t* words)
+{
+    memset(words, 0, sizeof(*words));
+    words->g = -1;
+    words->m = -1;
+    words->units = -1;
+    words->distance = -1;
+    const char* end = line + line_len;
+    for(const char* p = line; p < end; )
+    {
+        char letter = (char)toupper((unsigned char)*p);
+        if(letter == ' ' || letter == '\t')
+        {
+            p++;
+            continue;
+        }
+        if(letter == ';' || letter == '*')     //Comment or checksum.
+        {
+            words->other = true;
+            break;
+        }
+        if(letter == '(')
+        {
+            while(p < end && *p != ')') p++;
+            p++;
+            words->other = true;
+            continue;
+        }
+        if(letter < 'A' || letter > 'Z')
+        {
+            p++;
+            words->other = true;
+            continue;
+        }
+        const char* number = p + 1;
+        float value = 0;
+        p = number_parse(number, end, &value);
+        int code = (int)value;
+        if((letter == 'G' || letter == 'M') && value != code) words->other = true;
+        if(letter == 'G' && (code == 20 || code == 21)) words->units = code;
+        else if(letter == 'G' && (code == 90 || code == 91)) words->distance = code;
+        else if(letter == 'G' || letter == 'M')
+        {
+            int* last = (letter == 'G') ? &words->g : &words->m;
+            if(*last >= 0) words->other = true;
+            *last = code;
+        }
+        else
+        {
+            if(letter == 'N') words->other = true;
+            words->present |= CNCM_WORD_BIT(letter);
+            CNCM_WORD_VALUE(words, letter) = value;
+            words->text[letter - 'A'] = number;
+            words->text_len[letter - 'A'] = p - number;     //Lines are shorter than CNCM_MAX_COMMAND_SIZE.
+        }
+    }
+}
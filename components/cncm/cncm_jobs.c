@@ -0,0 +1,384 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sys/param.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-Jobs";
+
+//A job is the set of lines tagged with its slot in the tx_queue. Lines are counted when queued, sent and acknowledged,
+//acks are matched to jobs in order through the in-flight FIFO since the machine answers every line with exactly one "ok".
+//Counts are in lines of the job: a fitted arc is one line on the link but counts for the lines it replaced.
+typedef struct {
+    cncm_job_info_t info;
+    uint32_t lines_queued;  //In the tx_queue, not yet taken by tx_consumer.
+    uint32_t lines_in_flight;
+    uint32_t resume_line;       //Line of the original job a resume starts after, 0 for a new job.
+    uint32_t preamble_lines;    //Lines queued by the resume before the original job's.
+} job_slot_t;
+
+static job_slot_t jobs[CNCM_MAX_JOBS];
+static uint32_t next_job_id = 1;
+static SemaphoreHandle_t jobs_lock;
+
+//The rx callback never takes jobs_lock, which HTTP handlers hold, nor the locks of the completion hooks: it writes each
+//ack with its output to ack_ring, and ack_consumer matches them to the lines in flight. The error flag is the record's
+//tag, and its weight the acks dropped just before it because the ring was full, which are counted as lost lines.
+static cncm_ring_t ack_ring;
+static uint16_t acks_dropped = 0;   //Counted by the rx callback, reset on a link loss.
+
+static uint8_t in_flight[CNCM_MAX_IN_FLIGHT_LINES];
+static uint16_t in_flight_weight[CNCM_MAX_IN_FLIGHT_LINES];
+static uint8_t in_flight_query[CNCM_MAX_IN_FLIGHT_LINES];    //Status query of each line in flight, or CNCM_NO_QUERY.
+static uint16_t in_flight_ticket[CNCM_MAX_IN_FLIGHT_LINES];  //Submitted command of each line in flight, or CNCM_NO_TICKET.
+static cncm_modal_state_t* in_flight_states;  //Modal state as of each line in flight, in PSRAM.
+static size_t in_flight_head = 0;   //Oldest.
+static size_t in_flight_count = 0;
+static cncm_modal_state_t sent_state;   //Only touched by tx_consumer.
+
+static job_slot_t* job_find(uint32_t job_id)
+{
+    if(job_id == 0) return NULL;
+    job_slot_t* job = &jobs[job_id % CNCM_MAX_JOBS];
+    return (job->info.id == job_id) ? job : NULL;
+}
+
+static bool job_terminal(const job_slot_t* job)
+{
+    return job->info.state == CNCM_JOB_FINISHED || job->info.state == CNCM_JOB_CANCELLED;
+}
+
+static void job_check_finished(job_slot_t* job)
+{
+    if(job->info.state != CNCM_JOB_RUNNING || !job->info.closed) return;
+    if(job->info.lines_acked + job->info.lines_lost < job->info.total_lines) return;
+    job->info.state = CNCM_JOB_FINISHED;
+    job->info.finished_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "Job %" PRIu32 " finished, %" PRIu32 " lines in %lld ms.", job->info.id, job->info.total_lines,
+             (job->info.finished_us - job->info.started_us) / 1000);
+    cncm_log_event("job %" PRIu32 " finished, %" PRIu32 " lines lost", job->info.id, job->info.lines_lost);
+    if(job->info.lines_lost == 0) cncm_checkpoint_on_job_over(job->info.id);   //Otherwise it may still be resumed.
+}
+
+//Lines are completed in order, so the one just completed is the job's acked + lost-th, in the original job's numbering.
+static uint32_t job_checkpoint_line(const job_slot_t* job)
+{
+    uint32_t done = job->info.lines_acked + job->info.lines_lost;
+    if(done <= job->preamble_lines) return job->resume_line;
+    return job->resume_line + done - job->preamble_lines;
+}
+
+//output is what the machine answered the line with, NULL if it was lost.
+static void in_flight_pop(const cncm_ack_output_t* output)
+{
+    bool acked = (output != NULL);
+    uint8_t slot = in_flight[in_flight_head];
+    uint16_t weight = in_flight_weight[in_flight_head];
+    const cncm_modal_state_t* state = &in_flight_states[in_flight_head];
+    cncm_queries_on_completed(in_flight_query[in_flight_head], output);
+    cncm_results_on_completed(in_flight_ticket[in_flight_head], output);
+    in_flight_head = (in_flight_head + 1) % CNCM_MAX_IN_FLIGHT_LINES;
+    in_flight_count--;
+    if(slot == CNCM_NO_JOB_SLOT) return;    //Its effect on the modal state is carried by the next job line.
+    job_slot_t* job = &jobs[slot];
+    job->lines_in_flight--;
+    if(acked) job->info.lines_acked += weight;
+    else job->info.lines_lost += weight;
+    //A lost line may or may not have been applied, so only acked ones move the checkpoint.
+    if(acked) cncm_checkpoint_on_completed(job->info.id, job->info.name, job_checkpoint_line(job), state);
+    job_check_finished(job);
+}
+
+//A record released under jobs_lock wasn't cleared by a link loss, which already counted its line as lost.
+static void ack_consumer()
+{
+    while(true)
+    {
+        cncm_ring_wait(&ack_ring);
+        cncm_ring_span_t record;
+        if(!cncm_ring_peek(&ack_ring, &record)) continue;
+        cncm_ack_output_t output = { .text = (const char*)record.data, .len = record.len, .error = record.tag != 0 };
+        xSemaphoreTake(jobs_lock, portMAX_DELAY);
+        if(cncm_ring_release(&ack_ring, &record))
+        {
+            for(uint16_t i = 0; i < record.weight && in_flight_count > 0; i++) in_flight_pop(NULL);
+            if(in_flight_count > 0) in_flight_pop(&output);   //Acks with nothing in flight answer lines we didn't track, e.g. probes.
+        }
+        xSemaphoreGive(jobs_lock);
+        cncm_ring_finish(&ack_ring);
+        ESP_LOGD(TAG, "Ack consumer high water mark:\t%d", uxTaskGetStackHighWaterMark(NULL));
+    }
+}
+
+esp_err_t cncm_jobs_init()
+{
+    jobs_lock = xSemaphoreCreateMutex();
+    in_flight_states = heap_caps_malloc(CNCM_MAX_IN_FLIGHT_LINES * sizeof(cncm_modal_state_t), MALLOC_CAP_SPIRAM);
+    if(jobs_lock == NULL || in_flight_states == NULL) return ESP_ERR_NO_MEM;
+    esp_err_t ret = cncm_ring_init(&ack_ring, CNCM_ACK_RING_CAPACITY, CNCM_ACK_OUTPUT_SIZE, MALLOC_CAP_SPIRAM);
+    if(ret != ESP_OK) return ret;
+    cncm_modal_reset(&sent_state);
+    if(xTaskCreate(ack_consumer, "ack_consumer", CNCM_ACK_CONSUMER_STACK_SIZE, NULL, CNCM_ACK_CONSUMER_PRIORITY, NULL) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t cncm_jobs_slot(uint32_t job_id, uint8_t* slot)
+{
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    job_slot_t* job = job_find(job_id);
+    esp_err_t ret = ESP_OK;
+    if(job == NULL) ret = ESP_ERR_NOT_FOUND;
+    else if(job->info.closed || job_terminal(job)) ret = ESP_ERR_INVALID_STATE;
+    else *slot = job - jobs;
+    xSemaphoreGive(jobs_lock);
+    return ret;
+}
+
+void cncm_jobs_on_queued(uint8_t slot, uint32_t lines, size_t bytes)
+{
+    if(slot == CNCM_NO_JOB_SLOT) return;
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    jobs[slot].lines_queued += lines;
+    jobs[slot].info.total_lines += lines;
+    jobs[slot].info.total_bytes += bytes;
+    xSemaphoreGive(jobs_lock);
+}
+
+void cncm_jobs_on_unqueued(uint8_t slot, uint32_t lines, size_t bytes)
+{
+    if(slot == CNCM_NO_JOB_SLOT) return;
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    jobs[slot].lines_queued -= MIN(lines, jobs[slot].lines_queued);
+    jobs[slot].info.total_lines -= MIN(lines, jobs[slot].info.total_lines);
+    jobs[slot].info.total_bytes -= MIN(bytes, jobs[slot].info.total_bytes);
+    xSemaphoreGive(jobs_lock);
+}
+
+bool cncm_jobs_on_dequeued(uint8_t slot, uint16_t weight)
+{
+    if(slot == CNCM_NO_JOB_SLOT) return true;
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    job_slot_t* job = &jobs[slot];
+    job->lines_queued -= MIN(weight, job->lines_queued);
+    bool send = !job_terminal(job);
+    if(send && job->info.state == CNCM_JOB_QUEUED)
+    {
+        job->info.state = CNCM_JOB_RUNNING;
+        job->info.started_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "Job %" PRIu32 " (%s) started.", job->info.id, job->info.name);
+        cncm_log_event("job %" PRIu32 " (%s) started", job->info.id, job->info.name);
+    }
+    xSemaphoreGive(jobs_lock);
+    return send;
+}
+
+void cncm_jobs_on_sent(uint8_t slot, const char* line, size_t line_len, uint16_t weight, uint16_t ticket)
+{
+    cncm_modal_update(&sent_state, line, line_len);
+    uint8_t query = (slot == CNCM_NO_JOB_SLOT) ? cncm_queries_match(line, line_len) : CNCM_NO_QUERY;
+    cncm_queries_on_sent(query);
+    cncm_results_on_sent(ticket);
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    if(in_flight_count == CNCM_MAX_IN_FLIGHT_LINES) in_flight_pop(NULL);  //The machine isn't acking, forget the oldest.
+    size_t tail = (in_flight_head + in_flight_count) % CNCM_MAX_IN_FLIGHT_LINES;
+    in_flight[tail] = slot;
+    in_flight_weight[tail] = weight;
+    in_flight_states[tail] = sent_state;
+    in_flight_query[tail] = query;
+    in_flight_ticket[tail] = ticket;
+    in_flight_count++;
+    if(slot != CNCM_NO_JOB_SLOT)
+    {
+        jobs[slot].lines_in_flight++;
+        jobs[slot].info.lines_sent += weight;
+        jobs[slot].info.bytes_sent += line_len + 1;
+    }
+    xSemaphoreGive(jobs_lock);
+}
+
+void cncm_jobs_on_ack(const cncm_ack_output_t* output)
+{
+    uint16_t dropped = __atomic_load_n(&acks_dropped, __ATOMIC_RELAXED);
+    if(cncm_ring_write(&ack_ring, output->error ? 1 : 0, dropped, 0, output->text, output->len)) dropped = 0;
+    else if(dropped < UINT16_MAX) dropped++;
+    __atomic_store_n(&acks_dropped, dropped, __ATOMIC_RELAXED);
+}
+
+//Acks still in ack_ring answer lines counted as lost here, they are dropped so that they don't answer the next ones.
+void cncm_jobs_on_link_lost()
+{
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    cncm_ring_clear(&ack_ring);
+    __atomic_store_n(&acks_dropped, 0, __ATOMIC_RELAXED);
+    while(in_flight_count > 0) in_flight_pop(NULL);
+    xSemaphoreGive(jobs_lock);
+}
+
+void cncm_jobs_on_cleared()
+{
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    for(size_t i = 0; i < CNCM_MAX_JOBS; i++)
+    {
+        job_slot_t* job = &jobs[i];
+        if(job->info.id == 0) continue;
+        bool had_queued = job->lines_queued > 0;
+        job->lines_queued = 0;
+        if(!job_terminal(job) && (had_queued || !job->info.closed))
+        {
+            job->info.state = CNCM_JOB_CANCELLED;
+            cncm_checkpoint_on_job_over(job->info.id);
+        }
+    }
+    xSemaphoreGive(jobs_lock);
+}
+
+//Fills the ack rate and ETA from the job's lines acknowledged since it started.
+static void job_info_snapshot(const job_slot_t* job, cncm_job_info_t* info)
+{
+    *info = job->info;
+    info->ack_rate = 0;
+    info->eta_us = -1;
+    if(info->state != CNCM_JOB_RUNNING || info->lines_acked == 0) return;
+    int64_t elapsed_us = esp_timer_get_time() - info->started_us;
+    if(elapsed_us <= 0) return;
+    info->ack_rate = info->lines_acked * 1000000.0f / elapsed_us;
+    if(info->closed) info->eta_us = (int64_t)((info->total_lines - info->lines_acked - info->lines_lost) * 1000000.0f / info->ack_rate);
+}
+
+esp_err_t cncm_job_create(const char* name, uint32_t* job_id)
+{
+    if(jobs_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(name == NULL || job_id == NULL) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    //Slots are reused in order, a slot is free once its job is over and none of its lines are left anywhere.
+    job_slot_t* job = &jobs[next_job_id % CNCM_MAX_JOBS];
+    if(job->info.id != 0 && (!job_terminal(job) || job->lines_queued > 0 || job->lines_in_flight > 0))
+    {
+        xSemaphoreGive(jobs_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    memset(job, 0, sizeof(*job));
+    job->info.id = next_job_id++;
+    if(next_job_id == 0) next_job_id = 1;
+    strlcpy(job->info.name, name, sizeof(job->info.name));
+    job->info.state = CNCM_JOB_QUEUED;
+    job->info.created_us = esp_timer_get_time();
+    *job_id = job->info.id;
+    xSemaphoreGive(jobs_lock);
+    return ESP_OK;
+}
+
+esp_err_t cncm_job_append(uint32_t job_id, const char* command)
+{
+    uint8_t slot;
+    esp_err_t ret = cncm_jobs_slot(job_id, &slot);
+    if(ret != ESP_OK) return ret;
+    return cncm_arcs_feed(slot, command);
+}
+
+esp_err_t cncm_job_close(uint32_t job_id)
+{
+    if(jobs_lock == NULL) return ESP_ERR_INVALID_STATE;
+    //Lines the arc fitter still holds are queued and counted first, with the tx lock kept until the job is closed so
+    //no append slips in between.
+    //The job stays open if they don't all fit the tx_queue yet.
+    cncm_tx_lock();
+    uint8_t slot;
+    esp_err_t ret = (cncm_jobs_slot(job_id, &slot) == ESP_OK) ? cncm_arcs_flush(slot) : ESP_OK;
+    if(ret != ESP_OK)
+    {
+        cncm_tx_unlock();
+        return ret;
+    }
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    job_slot_t* job = job_find(job_id);
+    if(job == NULL) ret = ESP_ERR_NOT_FOUND;
+    else if(job_terminal(job)) ret = ESP_ERR_INVALID_STATE;
+    else
+    {
+        job->info.closed = true;
+        if(job->info.total_lines == 0)
+        {
+            job->info.state = CNCM_JOB_FINISHED;
+            job->info.finished_us = esp_timer_get_time();
+        }
+        else job_check_finished(job);
+    }
+    xSemaphoreGive(jobs_lock);
+    cncm_tx_unlock();
+    return ret;
+}
+
+esp_err_t cncm_job_cancel(uint32_t job_id)
+{
+    if(jobs_lock == NULL) return ESP_ERR_INVALID_STATE;
+    cncm_tx_lock();     //Taken before jobs_lock, like the producers do.
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    job_slot_t* job = job_find(job_id);
+    esp_err_t ret = ESP_OK;
+    if(job == NULL) ret = ESP_ERR_NOT_FOUND;
+    else if(job_terminal(job)) ret = ESP_ERR_INVALID_STATE;
+    else
+    {
+        cncm_arcs_discard(job - jobs);
+        job->info.state = CNCM_JOB_CANCELLED;   //tx_consumer drops its remaining lines.
+        job->info.finished_us = esp_timer_get_time();
+        cncm_checkpoint_on_job_over(job_id);
+        ESP_LOGI(TAG, "Job %" PRIu32 " cancelled.", job_id);
+        cncm_log_event("job %" PRIu32 " cancelled", job_id);
+    }
+    xSemaphoreGive(jobs_lock);
+    cncm_tx_unlock();
+    return ret;
+}
+
+esp_err_t cncm_job_get(uint32_t job_id, cncm_job_info_t* info)
+{
+    if(jobs_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(info == NULL) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    job_slot_t* job = job_find(job_id);
+    if(job != NULL) job_info_snapshot(job, info);
+    xSemaphoreGive(jobs_lock);
+    return (job == NULL) ? ESP_ERR_NOT_FOUND : ESP_OK;
+}
+
+esp_err_t cncm_job_list(cncm_job_info_t* infos, size_t max_infos, size_t* infos_count)
+{
+    if(jobs_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(infos == NULL || infos_count == NULL) return ESP_ERR_INVALID_ARG;
+    *infos_count = 0;
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    //Oldest first, slots are assigned in id order.
+    for(uint32_t i = 0; i < CNCM_MAX_JOBS && *infos_count < max_infos; i++)
+    {
+        job_slot_t* job = &jobs[(next_job_id + i) % CNCM_MAX_JOBS];
+        if(job->info.id != 0) job_info_snapshot(job, &infos[(*infos_count)++]);
+    }
+    xSemaphoreGive(jobs_lock);
+    return ESP_OK;
+}
+
+size_t cncm_jobs_in_flight_count()
+{
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    size_t count = in_flight_count;
+    xSemaphoreGive(jobs_lock);
+    return count;
+}
+
+void cncm_jobs_set_resume(uint8_t slot, uint32_t resume_line, uint32_t preamble_lines)
+{
+    xSemaphoreTake(jobs_lock, portMAX_DELAY);
+    jobs[slot].resume_line = resume_line;
+    jobs[slot].preamble_lines = preamble_lines;
+    xSemaphoreGive(jobs_lock);
+}
@@ -0,0 +1,329 @@
+#include <stdarg.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "sys/param.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-Log";
+
+//The machine's output, and what CNCM did around it, kept in a partition of its own so it survives a reboot. The
+//partition is a circle of sectors, each starting with a header that numbers it: the sector with sequence s sits at
+//s % sectors and holds log bytes s * LOG_SECTOR_PAYLOAD on, so a log offset never changes while it's readable.
+//The rx callback only copies into a staging ring in PSRAM, the writer task programs it whole flash pages at a time (a
+//partial page after CNCM_LOG_FLUSH_MS of quiet) and erases a sector when it moves to it, so every sector is erased once
+//per trip around the partition whatever the output rate.
+//After a reboot the write position is found again from the headers and the last programmed byte of the newest sector.
+#define LOG_SECTOR_SIZE (4096)
+#define LOG_PAGE_SIZE (256)
+#define LOG_MAGIC (0x474F4C43)  //"CLOG".
+#define LOG_SECTOR_PAYLOAD (LOG_SECTOR_SIZE - sizeof(sector_header_t))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+} sector_header_t;
+
+static const esp_partition_t* partition;
+static uint32_t sectors;
+static nvs_handle_t log_nvs;
+static bool enabled = false;
+static TaskHandle_t writer;
+
+//Staging ring, indices run free over a power of two.
+static uint8_t* staging;
+static uint32_t staging_head = 0;
+static uint32_t staging_tail = 0;
+static bool ends_line = true;       //Of the last byte staged, so events start on a line of their own.
+static uint64_t staging_dropped_bytes = 0;  //That didn't fit in the staging ring.
+static SemaphoreHandle_t staging_lock;
+
+//Write position, only moved by the writer task, read by readers under log_lock.
+static uint32_t head_seq = 0;       //Sector being written.
+static uint32_t oldest_seq = 0;     //Oldest sector still readable.
+static uint32_t sector_pos = 0;     //Payload bytes programmed in the head sector.
+static uint64_t write_dropped_bytes = 0;    //Staged but not programmed, the flash write failed.
+static uint32_t pages_written = 0;
+static uint32_t sectors_erased = 0;
+static SemaphoreHandle_t log_lock;
+
+static size_t sector_address(uint32_t seq)
+{
+    return (size_t)(seq % sectors) * LOG_SECTOR_SIZE;
+}
+
+static bool sector_header_read(uint32_t seq)
+{
+    sector_header_t header;
+    if(esp_partition_read(partition, sector_address(seq), &header, sizeof(header)) != ESP_OK) return false;
+    return header.magic == LOG_MAGIC && header.seq == seq;
+}
+
+static esp_err_t sector_open(uint32_t seq)
+{
+    //The sector about to be erased stops being readable first.
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    if(seq - oldest_seq >= sectors) oldest_seq = seq - sectors + 1;
+    xSemaphoreGive(log_lock);
+    esp_err_t ret = esp_partition_erase_range(partition, sector_address(seq), LOG_SECTOR_SIZE);
+    sector_header_t header = { .magic = LOG_MAGIC, .seq = seq };
+    if(ret == ESP_OK) ret = esp_partition_write(partition, sector_address(seq), &header, sizeof(header));
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open log sector %" PRIu32 ": %s", seq, esp_err_to_name(ret));
+        return ret;
+    }
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    head_seq = seq;
+    sector_pos = 0;
+    sectors_erased++;
+    xSemaphoreGive(log_lock);
+    return ESP_OK;
+}
+
+//Finds the newest sector and its last programmed byte. Bytes 0xFF at the very end of the previous boot's output can't
+//be told from erased flash, they are written over.
+static esp_err_t log_recover()
+{
+    bool found = false;
+    uint32_t newest = 0;
+    for(uint32_t i = 0; i < sectors; i++)
+    {
+        sector_header_t header;
+        esp_err_t ret = esp_partition_read(partition, i * LOG_SECTOR_SIZE, &header, sizeof(header));
+        if(ret != ESP_OK) return ret;
+        if(header.magic != LOG_MAGIC || header.seq % sectors != i) continue;    //Erased, or cut by a power loss.
+        if(!found || (int32_t)(header.seq - newest) > 0) newest = header.seq;
+        found = true;
+    }
+    if(!found) return sector_open(0);
+    uint32_t oldest = newest;
+    while(oldest > 0 && newest - (oldest - 1) < sectors && sector_header_read(oldest - 1)) oldest--;
+
+    uint8_t* payload = heap_caps_malloc(LOG_SECTOR_PAYLOAD, MALLOC_CAP_SPIRAM);
+    if(payload == NULL) return ESP_ERR_NO_MEM;
+    esp_err_t ret = esp_partition_read(partition, sector_address(newest) + sizeof(sector_header_t), payload, LOG_SECTOR_PAYLOAD);
+    size_t pos = LOG_SECTOR_PAYLOAD;
+    while(pos > 0 && payload[pos - 1] == 0xFF) pos--;
+    free(payload);
+    if(ret != ESP_OK) return ret;
+    head_seq = newest;
+    oldest_seq = oldest;
+    sector_pos = pos;
+    ESP_LOGI(TAG, "Log recovered, %" PRIu64 " bytes held.",
+             (uint64_t)head_seq * LOG_SECTOR_PAYLOAD + sector_pos - (uint64_t)oldest_seq * LOG_SECTOR_PAYLOAD);
+    return ESP_OK;
+}
+
+//Programs what is staged, up to whole pages only unless partial. Only called by the writer task.
+static void log_write_staged(bool partial)
+{
+    static uint8_t page[LOG_PAGE_SIZE];     //Internal RAM, flash is programmed from it with the cache disabled.
+    while(true)
+    {
+        if(sector_pos == LOG_SECTOR_PAYLOAD && sector_open(head_seq + 1) != ESP_OK) return;
+        size_t at = sizeof(sector_header_t) + sector_pos;
+        size_t room = LOG_PAGE_SIZE - at % LOG_PAGE_SIZE;
+        xSemaphoreTake(staging_lock, portMAX_DELAY);
+        uint32_t tail = staging_tail;
+        size_t staged = staging_head - tail;
+        xSemaphoreGive(staging_lock);
+        if(staged == 0 || (staged < room && !partial)) return;
+        size_t len = MIN(staged, room);
+        size_t offset = tail % CNCM_LOG_STAGING_SIZE;
+        size_t first_part = MIN(len, CNCM_LOG_STAGING_SIZE - offset);
+        memcpy(page, staging + offset, first_part);
+        memcpy(page + first_part, staging, len - first_part);   //Wrap around.
+        esp_err_t ret = esp_partition_write(partition, sector_address(head_seq) + at, page, len);
+        if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to write the log: %s", esp_err_to_name(ret));
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        if(ret == ESP_OK) sector_pos += len;
+        else write_dropped_bytes += len;
+        if(len == room) pages_written++;
+        xSemaphoreGive(log_lock);
+        xSemaphoreTake(staging_lock, portMAX_DELAY);
+        staging_tail = tail + len;
+        xSemaphoreGive(staging_lock);
+    }
+}
+
+static void log_writer()
+{
+    while(true)
+    {
+        //Woken up when a page is staged, a timeout means the output went quiet and the rest is written as it is.
+        bool notified = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CNCM_LOG_FLUSH_MS)) > 0;
+        log_write_staged(!notified);
+        ESP_LOGD(TAG, "Log writer high water mark:\t%d", uxTaskGetStackHighWaterMark(NULL));
+    }
+}
+
+static void staging_append(const char* data, size_t len, bool is_event)
+{
+    if(!enabled || staging == NULL) return;
+    xSemaphoreTake(staging_lock, portMAX_DELAY);
+    if(is_event && ends_line)
+    {
+        data++;     //Events start with a line break, not needed here.
+        len--;
+    }
+    size_t free_space = CNCM_LOG_STAGING_SIZE - (staging_head - staging_tail);
+    if(len > free_space)
+    {
+        staging_dropped_bytes += len - free_space;   //The writer fell behind, e.g. while erasing: keep what came first.
+        len = free_space;
+    }
+    size_t offset = staging_head % CNCM_LOG_STAGING_SIZE;
+    size_t first_part = MIN(len, CNCM_LOG_STAGING_SIZE - offset);
+    memcpy(staging + offset, data, first_part);
+    memcpy(staging, data + first_part, len - first_part);   //Wrap around.
+    staging_head += len;
+    if(len > 0) ends_line = (data[len - 1] == '\n');
+    size_t staged = staging_head - staging_tail;
+    xSemaphoreGive(staging_lock);
+    if(staged >= LOG_PAGE_SIZE) xTaskNotifyGive(writer);
+}
+
+void cncm_log_append(const uint8_t* data, size_t data_len)
+{
+    staging_append((const char*)data, data_len, false);
+}
+
+void cncm_log_event(const char* format, ...)
+{
+    if(!enabled) return;
+    char event[CNCM_LOG_EVENT_SIZE];
+    int len = snprintf(event, sizeof(event), "\n[cncm %lld ms] ", esp_timer_get_time() / 1000);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(event + len, sizeof(event) - len - 1, format, args);
+    va_end(args);
+    len = strlen(event);
+    event[len++] = '\n';
+    staging_append(event, len, true);
+}
+
+esp_err_t cncm_log_init(nvs_handle_t nvs)
+{
+    log_nvs = nvs;
+    staging_lock = xSemaphoreCreateMutex();
+    log_lock = xSemaphoreCreateMutex();
+    if(staging_lock == NULL || log_lock == NULL) return ESP_ERR_NO_MEM;
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CNCM_LOG_PARTITION_LABEL);
+    if(partition == NULL)
+    {
+        ESP_LOGW(TAG, "No \"%s\" partition, the output log is unavailable.", CNCM_LOG_PARTITION_LABEL);
+        return ESP_OK;
+    }
+    sectors = partition->size / LOG_SECTOR_SIZE;
+    staging = heap_caps_malloc(CNCM_LOG_STAGING_SIZE, MALLOC_CAP_SPIRAM);
+    if(staging == NULL || sectors < 2) return ESP_ERR_NO_MEM;
+    esp_err_t ret = log_recover();
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to recover the log: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    if(xTaskCreate(log_writer, "log_writer", CNCM_LOG_WRITER_STACK_SIZE, NULL, CNCM_LOG_WRITER_PRIORITY, &writer) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Couldn't create log writer task.");
+        return ESP_FAIL;
+    }
+    uint8_t stored_enabled = 0;
+    ret = nvs_get_u8(log_nvs, "log_enabled", &stored_enabled);
+    if(ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND)
+    {
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    enabled = (stored_enabled != 0);
+    cncm_log_event("boot, log %s", enabled ? "enabled" : "disabled");
+    return ESP_OK;
+}
+
+esp_err_t cncm_log_set_enabled(bool new_enabled)
+{
+    if(log_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(partition == NULL) return ESP_ERR_NOT_SUPPORTED;
+    esp_err_t ret = nvs_set_u8(log_nvs, "log_enabled", new_enabled ? 1 : 0);
+    if(ret == ESP_OK) ret = nvs_commit(log_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    if(!new_enabled) cncm_log_event("log disabled");
+    enabled = new_enabled;
+    if(new_enabled) cncm_log_event("log enabled");
+    return ESP_OK;
+}
+
+esp_err_t cncm_log_read(uint64_t* offset, uint8_t* to_receive, size_t* read_size, size_t max_read_size)
+{
+    if(log_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(partition == NULL) return ESP_ERR_NOT_SUPPORTED;
+    if(offset == NULL || to_receive == NULL || read_size == NULL) return ESP_ERR_INVALID_ARG;
+    uint64_t at = *offset;
+    size_t done = 0;
+    while(done < max_read_size)
+    {
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        uint64_t start = (uint64_t)oldest_seq * LOG_SECTOR_PAYLOAD;
+        uint64_t end = (uint64_t)head_seq * LOG_SECTOR_PAYLOAD + sector_pos;
+        xSemaphoreGive(log_lock);
+        if(at < start)
+        {
+            if(done > 0) break;     //Overwritten under our feet, the caller sees the gap in the next offset.
+            at = start;
+        }
+        if(at > end && done == 0) at = start;   //Offset from a log that was erased, start over.
+        if(at >= end) break;
+        uint32_t seq = at / LOG_SECTOR_PAYLOAD;
+        size_t in_sector = at % LOG_SECTOR_PAYLOAD;
+        size_t len = MIN(MIN(LOG_SECTOR_PAYLOAD - in_sector, end - at), max_read_size - done);
+        esp_err_t ret = esp_partition_read(partition, sector_address(seq) + sizeof(sector_header_t) + in_sector,
+                                           to_receive + done, len);
+        if(ret != ESP_OK) return ret;
+        //The sector may have been erased while it was read, then the copy is thrown away.
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        bool still_there = (seq >= oldest_seq);
+        xSemaphoreGive(log_lock);
+        if(!still_there) continue;
+        done += len;
+        at += len;
+    }
+    *offset = at;
+    *read_size = done;
+    return ESP_OK;
+}
+
+esp_err_t cncm_log_get_stats(cncm_log_stats_t* stats)
+{
+    if(log_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(stats == NULL) return ESP_ERR_INVALID_ARG;
+    memset(stats, 0, sizeof(*stats));
+    stats->available = (partition != NULL);
+    stats->enabled = enabled;
+    if(partition == NULL) return ESP_OK;
+    stats->capacity = (uint64_t)(sectors - 1) * LOG_SECTOR_PAYLOAD;    //The sector being erased next doesn't count.
+    xSemaphoreTake(staging_lock, portMAX_DELAY);
+    stats->staged = staging_head - staging_tail;
+    stats->dropped_bytes = staging_dropped_bytes;
+    xSemaphoreGive(staging_lock);
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    stats->start = (uint64_t)oldest_seq * LOG_SECTOR_PAYLOAD;
+    stats->end = (uint64_t)head_seq * LOG_SECTOR_PAYLOAD + sector_pos;
+    stats->dropped_bytes += write_dropped_bytes;
+    stats->pages_written = pages_written;
+    stats->sectors_erased = sectors_erased;
+    xSemaphoreGive(log_lock);
+    return ESP_OK;
+}
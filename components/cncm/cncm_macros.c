@@ -0,0 +1,145 @@
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "ctype.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-Macros";
+static const char* macros_namespace = "CNCM_MACROS";
+static nvs_handle_t macros_nvs;
+static bool macros_initialized = false;
+
+//Names are used as NVS keys, so they are limited by the NVS key length.
+static bool macro_name_valid(const char* name)
+{
+    size_t name_length = strlen(name);
+    if(name_length == 0 || name_length > CNCM_MAX_MACRO_NAME_SIZE) return false;
+    for(size_t i = 0; i < name_length; i++)
+    {
+        if(!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-') return false;
+    }
+    return true;
+}
+
+esp_err_t cncm_macros_init()
+{
+    esp_err_t ret = nvs_open(macros_namespace, NVS_READWRITE, &macros_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS: %s.", esp_err_to_name(ret));
+        return ret;
+    }
+    macros_initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t cncm_macro_set(const char* name, const char* body)
+{
+    if(!macros_initialized) return ESP_ERR_INVALID_STATE;
+    if(name == NULL || body == NULL || !macro_name_valid(name)) return ESP_ERR_INVALID_ARG;
+    if(strlen(body) == 0 || strlen(body) > CNCM_MAX_MACRO_SIZE) return ESP_ERR_INVALID_SIZE;
+    esp_err_t ret = nvs_set_str(macros_nvs, name, body);
+    if(ret == ESP_OK) ret = nvs_commit(macros_nvs);
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Error storing macro %s: %s", name, esp_err_to_name(ret));
+    return ret;
+}
+
+esp_err_t cncm_macro_get(const char* name, char* body, size_t body_size)
+{
+    if(!macros_initialized) return ESP_ERR_INVALID_STATE;
+    if(name == NULL || body == NULL || !macro_name_valid(name)) return ESP_ERR_INVALID_ARG;
+    size_t length = body_size;
+    esp_err_t ret = nvs_get_str(macros_nvs, name, body, &length);
+    if(ret == ESP_ERR_NVS_NOT_FOUND) return ESP_ERR_NOT_FOUND;
+    if(ret == ESP_ERR_NVS_INVALID_LENGTH) return ESP_ERR_INVALID_SIZE;
+    return ret;
+}
+
+esp_err_t cncm_macro_delete(const char* name)
+{
+    if(!macros_initialized) return ESP_ERR_INVALID_STATE;
+    if(name == NULL || !macro_name_valid(name)) return ESP_ERR_INVALID_ARG;
+    esp_err_t ret = nvs_erase_key(macros_nvs, name);
+    if(ret == ESP_ERR_NVS_NOT_FOUND) return ESP_ERR_NOT_FOUND;
+    if(ret == ESP_OK) ret = nvs_commit(macros_nvs);
+    return ret;
+}
+
+esp_err_t cncm_macro_list(char names[][CNCM_MAX_MACRO_NAME_SIZE + 1], size_t max_names, size_t* names_count)
+{
+    if(!macros_initialized) return ESP_ERR_INVALID_STATE;
+    if(names == NULL || names_count == NULL) return ESP_ERR_INVALID_ARG;
+    *names_count = 0;
+    nvs_iterator_t it = NULL;
+    esp_err_t ret = nvs_entry_find(NVS_DEFAULT_PART_NAME, macros_namespace, NVS_TYPE_STR, &it);
+    while(ret == ESP_OK && *names_count < max_names)
+    {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        strlcpy(names[*names_count], info.key, CNCM_MAX_MACRO_NAME_SIZE + 1);
+        (*names_count)++;
+        ret = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+    return (ret == ESP_OK || ret == ESP_ERR_NVS_NOT_FOUND) ? ESP_OK : ret;
+}
+
+//Arguments are whitespace separated and referenced in the body as $1 ... $9, "$$" is a literal '$'.
+esp_err_t cncm_macro_expand(const char* invocation, char* expanded, size_t expanded_size)
+{
+    if(!macros_initialized) return ESP_ERR_INVALID_STATE;
+    if(invocation[0] != CNCM_MACRO_PREFIX) return ESP_ERR_INVALID_ARG;
+
+    //Split "@name arg1 arg2" in place on a copy.
+    char args_buffer[CNCM_MAX_COMMAND_MESSAGE_SIZE];
+    strlcpy(args_buffer, invocation + 1, sizeof(args_buffer));
+    const char* args[CNCM_MAX_MACRO_ARGS + 1] = {0}; //args[0] is the name.
+    size_t args_count = 0;
+    char* save_ptr = NULL;
+    for(char* token = strtok_r(args_buffer, " \t", &save_ptr); token != NULL; token = strtok_r(NULL, " \t", &save_ptr))
+    {
+        if(args_count > CNCM_MAX_MACRO_ARGS) return ESP_ERR_INVALID_ARG;
+        args[args_count++] = token;
+    }
+    if(args_count == 0 || !macro_name_valid(args[0])) return ESP_ERR_INVALID_ARG;
+
+    char* body = malloc(CNCM_MAX_MACRO_SIZE + 1);
+    if(body == NULL) return ESP_ERR_NO_MEM;
+    esp_err_t ret = cncm_macro_get(args[0], body, CNCM_MAX_MACRO_SIZE + 1);
+    if(ret != ESP_OK)
+    {
+        free(body);
+        return ret;
+    }
+
+    size_t out = 0;
+    for(const char* c = body; *c != '\0' && ret == ESP_OK; c++)
+    {
+        const char* piece = c;
+        size_t piece_length = 1;
+        if(c[0] == '$' && c[1] == '$') c++;
+        else if(c[0] == '$' && c[1] >= '1' && c[1] <= '9')
+        {
+            size_t index = c[1] - '0';
+            if(index >= args_count)
+            {
+                ESP_LOGE(TAG, "Macro %s references missing argument $%u.", args[0], index);
+                ret = ESP_ERR_INVALID_ARG;
+                break;
+            }
+            piece = args[index];
+            piece_length = strlen(piece);
+            c++;
+        }
+        if(out + piece_length >= expanded_size) ret = ESP_ERR_INVALID_SIZE;
+        else
+        {
+            memcpy(expanded + out, piece, piece_length);
+            out += piece_length;
+        }
+    }
+    free(body);
+    expanded[out] = '\0';
+    return ret;
+}
@@ -0,0 +1,226 @@
+// Internal interfaces shared between the source files of the cncm component, not part of its public API.
+#include "esp_err.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "nvs.h"
+
+/**
+ * @brief Opens the macros NVS namespace, called by cncm_init().
+ */
+esp_err_t cncm_macros_init();
+
+/**
+ * @brief Expands a macro invocation ("@name arg1 arg2 ...") into its lines, separated by CNCM_COMMAND_SEPARATOR.
+ * @param invocation [IN] the command, starting with CNCM_MACRO_PREFIX.
+ * @param expanded [OUT] destination buffer, NULL terminated.
+ * @param expanded_size [IN] size of the destination buffer.
+ * @return ESP_ERR_NOT_FOUND if there is no such macro.
+ * @return ESP_ERR_INVALID_ARG if the invocation is malformed or references a missing argument.
+ * @return ESP_ERR_INVALID_SIZE if the expansion doesn't fit in expanded.
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_macro_expand(const char* invocation, char* expanded, size_t expanded_size);
+
+/**
+ * @brief Adds a line (or a macro invocation) to the tx_queue, tagged with a job slot.
+ * @param job_slot [IN] slot of the job the line belongs to, CNCM_NO_JOB_SLOT if none.
+ * @return same as cncm_tx_producer().
+ */
+esp_err_t cncm_tx_enqueue(uint8_t job_slot, const char* command);
+
+/**
+ * @brief Adds lines separated by CNCM_COMMAND_SEPARATOR to the tx_queue, all of them or none of them.
+ * @return ESP_ERR_INVALID_ARG if a line is oversized, ESP_ERR_NO_MEM if they don't fit, ESP_OK otherwise.
+ */
+esp_err_t cncm_tx_enqueue_lines(uint8_t job_slot, const char* lines);
+
+/**
+ * @brief Adds a single line to the tx_queue in space the caller set aside through cncm_arcs_reserved(), called with
+ * the tx lock held.
+ * @param weight [IN] lines of the job the line stands for.
+ * @return ESP_ERR_NO_MEM if it doesn't fit, ESP_OK otherwise.
+ */
+esp_err_t cncm_tx_emit(uint8_t job_slot, const char* line, size_t line_len, uint16_t weight);
+
+//Serializes the tx_queue producers, recursive. cncm_tx_space() is what they may still use, called with it held.
+void cncm_tx_lock();
+void cncm_tx_unlock();
+size_t cncm_tx_space();
+
+//What a firmware dialect supplies, see cncm_dialects.c.
+typedef struct {
+    const char* name;
+    uint32_t default_baudrate;  //Used when no baudrate was configured, or none passed probing.
+    uint8_t data_bits;
+    uint8_t parity;             //CDC bParityType: 0 none, 1 odd, 2 even.
+    uint8_t stop_bits;          //CDC bCharFormat: 0 one, 1 one and a half, 2 two.
+    uint8_t (*line_classify)(const char* line, size_t line_len);    //Returns CNCM_LINE_* flags.
+    size_t (*probe_query)(char* query, size_t query_size);  //Writes a query answered by an ack, terminator included.
+    const char* status_query;
+    const char* const* idempotent_queries;  //NULL terminated, at most CNCM_MAX_STATUS_QUERIES, upper case.
+    bool status_query_realtime; //Written straight to the machine as is, otherwise queued as a line.
+    const char* emergency_stop; //Always written straight to the machine as is.
+    //Writes the lines restoring a checkpoint's state, separated by CNCM_COMMAND_SEPARATOR.
+    size_t (*resume_preamble)(const cncm_checkpoint_t* checkpoint, char* preamble, size_t preamble_size);
+} cncm_dialect_def_t;
+
+/**
+ * @brief Gets the definition of a dialect, Marlin's if it's out of range.
+ */
+const cncm_dialect_def_t* cncm_dialect_def(cncm_dialect_t dialect);
+
+//Machine output since the last ack, it answers the line acked next. Kept by the rx callback in cncm.c, each line followed
+//by '\n' and cut at CNCM_ACK_OUTPUT_SIZE, and handed through cncm_jobs_on_ack() to the completion hooks of that line,
+//which run in the ack_consumer task.
+#define CNCM_ACK_OUTPUT_SIZE (CNCM_QUERY_ANSWER_SIZE)    //The largest copy taken from it.
+typedef struct {
+    const char* text;           //Not NULL terminated.
+    size_t len;
+    bool error;                 //An error line was among them.
+} cncm_ack_output_t;
+
+//Job bookkeeping, called from cncm.c as lines move through the tx_queue and the machine acknowledges them.
+esp_err_t cncm_jobs_init();
+esp_err_t cncm_jobs_slot(uint32_t job_id, uint8_t* slot);
+//A line's weight is the number of lines of the job it stands for, more than one for a fitted arc.
+void cncm_jobs_on_queued(uint8_t slot, uint32_t lines, size_t bytes);
+void cncm_jobs_on_unqueued(uint8_t slot, uint32_t lines, size_t bytes);
+bool cncm_jobs_on_dequeued(uint8_t slot, uint16_t weight);    //Returns false if the line must be dropped.
+void cncm_jobs_on_sent(uint8_t slot, const char* line, size_t line_len, uint16_t weight, uint16_t ticket);    //line_len without the separator.
+void cncm_jobs_on_ack(const cncm_ack_output_t* output);     //From the rx callback, never blocks.
+void cncm_jobs_on_link_lost();
+void cncm_jobs_on_cleared();
+size_t cncm_jobs_in_flight_count();     //Lines sent and not acknowledged yet, job or not.
+void cncm_jobs_set_resume(uint8_t slot, uint32_t resume_line, uint32_t preamble_lines);
+
+//Words of a G-code line, see cncm_gcode.c. Letters are upper cased, G and M codes and the mode words are kept apart.
+#define CNCM_WORD_BIT(letter) (1UL << ((letter) - 'A'))
+#define CNCM_WORD_HAS(words, letter) (((words)->present & CNCM_WORD_BIT(letter)) != 0)
+#define CNCM_WORD_VALUE(words, letter) ((words)->values[(letter) - 'A'])
+typedef struct {
+    uint32_t present;           //Bit of each other letter present.
+    float values[26];
+    const char* text[26];       //Number of each word, in the line.
+    uint16_t text_len[26];
+    int g;                      //Other than modes, -1 if none.
+    int m;
+    int units;                  //20 or 21 if G20/G21 is present, -1 if not.
+    int distance;               //90 or 91 if G90/G91 is present, -1 if not.
+    bool other;                 //Line numbers, checksums, comments, several G or M codes, fractional codes.
+} cncm_gcode_words_t;
+void cncm_gcode_words_parse(const char* line, size_t line_len, cncm_gcode_words_t* words);
+
+//Checkpointing, see cncm_checkpoint.c. The hooks are called from cncm_jobs.c with the jobs lock held.
+esp_err_t cncm_checkpoint_init();
+void cncm_modal_update(cncm_modal_state_t* state, const char* line, size_t line_len);
+void cncm_modal_apply(cncm_modal_state_t* state, const cncm_gcode_words_t* words);    //Of a line already parsed.
+void cncm_modal_reset(cncm_modal_state_t* state);
+void cncm_checkpoint_on_completed(uint32_t job_id, const char* name, uint32_t line, const cncm_modal_state_t* state);
+void cncm_checkpoint_on_job_over(uint32_t job_id);
+
+//Status query coalescing, see cncm_queries.c. Queries are matched on the lines outside jobs, the index of a query is
+//CNCM_NO_QUERY for any other line.
+#define CNCM_NO_QUERY (0xFF)
+esp_err_t cncm_queries_init(nvs_handle_t nvs);
+void cncm_queries_reset();
+uint8_t cncm_queries_match(const char* line, size_t line_len);
+void cncm_queries_on_queued(uint8_t query);
+void cncm_queries_on_unqueued(uint8_t query);
+void cncm_queries_on_sent(uint8_t query);
+void cncm_queries_on_completed(uint8_t query, const cncm_ack_output_t* output);     //output NULL if the line was lost.
+void cncm_queries_on_cleared();
+bool cncm_queries_coalesce(uint8_t query);      //Called with the tx lock held, true (and counted) if pending or fresh.
+
+//Arc fitting of job lines, see cncm_arcs.c. Everything but init takes the tx lock.
+esp_err_t cncm_arcs_init(nvs_handle_t nvs);
+esp_err_t cncm_arcs_feed(uint8_t job_slot, const char* command);   //Same returns as cncm_tx_enqueue().
+esp_err_t cncm_arcs_flush(uint8_t job_slot);    //Queues the lines held for the job, ESP_ERR_NO_MEM keeps those that don't fit.
+void cncm_arcs_discard(uint8_t job_slot);   //Drops them, CNCM_NO_JOB_SLOT for any job.
+size_t cncm_arcs_reserved();                //tx_queue space the held lines may need, called with the tx lock held.
+
+//Response subscriptions, see cncm_subscriptions.c. Every line the machine sends is indexed from the rx callback, end
+//is its rx_queue offset past the terminator.
+esp_err_t cncm_subscriptions_init();
+void cncm_subscriptions_on_line(const char* line, size_t line_len, uint8_t kind, uint64_t end);
+
+//Results of submitted commands, see cncm_results.c. A ticket tags the lines of a submitted command through the
+//tx_queue and the in-flight FIFO, CNCM_NO_TICKET for any other line.
+#define CNCM_NO_TICKET (0)
+esp_err_t cncm_results_init();
+esp_err_t cncm_results_begin(size_t count, uint32_t* first_id);     //Called with the tx lock held.
+uint16_t cncm_results_ticket(uint32_t id);
+void cncm_results_on_queued(uint16_t ticket, uint32_t lines);
+void cncm_results_abandon(uint32_t first_id, size_t count);     //Those that got no lines are dropped.
+void cncm_results_on_sent(uint16_t ticket);
+void cncm_results_on_completed(uint16_t ticket, const cncm_ack_output_t* output);   //output NULL if the line was lost.
+void cncm_results_on_cleared();
+
+//Line break search in the machine output, see cncm_scan.c. Both return the offset of the first '\n' or '\r', data_len
+//if there is none, cncm_scan_line_break() a word at a time unless CNCM_RX_SCAN_WORDS is 0.
+size_t cncm_scan_line_break(const uint8_t* data, size_t data_len);
+size_t cncm_scan_line_break_bytes(const uint8_t* data, size_t data_len);
+
+//Splits a byte stream fed in chunks of any size into lines, without their terminator. A line longer than
+//CNCM_RX_LINE_SIZE is cut and its tail handled as another line, '\r' is dropped. end is the stream offset right after
+//the line, terminator included.
+typedef void (*cncm_line_cb_t)(const char* line, size_t line_len, uint64_t end);
+typedef struct {
+    cncm_line_cb_t on_line;
+    char line[CNCM_RX_LINE_SIZE];
+    size_t line_len;
+} cncm_lines_t;
+void cncm_lines_feed(cncm_lines_t* lines, const uint8_t* data, size_t data_len, uint64_t data_offset);
+
+//Flash log of the machine output, see cncm_log.c. Appending only copies, and does nothing while the log is disabled.
+esp_err_t cncm_log_init(nvs_handle_t nvs);
+void cncm_log_append(const uint8_t* data, size_t data_len);
+void cncm_log_event(const char* format, ...);
+
+//Binary file transfer to the SD card, see cncm_sd.c.
+#define CNCM_SD_MAX_PACKET_SIZE (8 + CNCM_SD_MAX_BLOCK_SIZE + 2)  //Header, payload and packet checksum.
+esp_err_t cncm_sd_init();
+bool cncm_sd_on_line(const char* line, size_t line_len);    //Returns true if the line belongs to the transfer.
+esp_err_t cncm_machine_write(const uint8_t* data, size_t data_len);     //Bypasses the tx_queue and the pause.
+
+//Ring of variable size records between one producer and one consumer, see cncm_ring.c. The indices run free and each
+//is stored by one side only, so neither side locks or enters a critical section; several producers must serialize
+//among themselves. The consumer blocks in cncm_ring_wait(), and is only notified when it actually sleeps.
+#define CNCM_RING_RECORD_SIZE(len) ((8 + (uint32_t)(len) + 7) & ~(uint32_t)7)     //Header, payload, padding.
+typedef struct {
+    uint8_t* buffer;
+    uint32_t capacity;          //Power of two.
+    uint32_t max_len;           //Of a record's payload.
+    uint32_t head;              //Bytes ever written, stored by the producer.
+    uint32_t tail;              //Bytes ever consumed, stored by the consumer and cncm_ring_clear().
+    uint32_t held;              //Index of the record the consumer holds, stored by the consumer.
+    void* consumer;             //TaskHandle_t of the consumer while it waits.
+    uint32_t consumer_waiting;
+} cncm_ring_t;
+
+typedef struct {
+    const uint8_t* data;        //Payload, contiguous, valid until cncm_ring_finish().
+    size_t len;
+    uint8_t tag;
+    uint16_t weight;            //Opaque to the ring, lines of the job a tx_queue record stands for.
+    uint16_t ticket;            //Opaque to the ring, command the record belongs to.
+    uint32_t at;                //Index of the record, checked on release.
+    uint32_t size;
+} cncm_ring_span_t;
+
+esp_err_t cncm_ring_init(cncm_ring_t* ring, size_t capacity, size_t max_len, uint32_t caps);
+size_t cncm_ring_space(cncm_ring_t* ring);     //Free bytes, less the worst padding, compare with CNCM_RING_RECORD_SIZE().
+bool cncm_ring_is_empty(cncm_ring_t* ring);
+//Producer: reserve a contiguous span for a payload of len bytes (NULL if it doesn't fit), fill it, then commit it.
+uint8_t* cncm_ring_reserve(cncm_ring_t* ring, size_t len);
+void cncm_ring_commit(cncm_ring_t* ring, uint8_t tag, uint16_t weight, uint16_t ticket, size_t len);
+bool cncm_ring_write(cncm_ring_t* ring, uint8_t tag, uint16_t weight, uint16_t ticket, const void* data, size_t len);
+//Consumer: wait for a record, peek at it in place, release it, and finish with it once its payload isn't used anymore.
+//Release returns false if the ring was cleared in between, the record is then dropped. The payload stays intact until
+//cncm_ring_finish() either way.
+void cncm_ring_wait(cncm_ring_t* ring);
+bool cncm_ring_peek(cncm_ring_t* ring, cncm_ring_span_t* span);
+bool cncm_ring_release(cncm_ring_t* ring, const cncm_ring_span_t* span);
+void cncm_ring_finish(cncm_ring_t* ring);
+//Drops every record, called by the producer side.
+void cncm_ring_clear(cncm_ring_t* ring);
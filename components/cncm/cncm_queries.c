@@ -0,0 +1,182 @@
+#include <ctype.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sys/param.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-Queries";
+
+//Dashboards polling the same idempotent query (M105, M114, M27, ...) would each cost a line on the link, between the
+//motion lines. A query already pending, or answered within the freshness window, isn't queued again: every reader of
+//the responses sees the one answer, which is also kept here for clients that weren't reading when it came.
+//Queries are indexed like the idempotent_queries of the current dialect.
+typedef struct {
+    uint32_t queued;        //In the tx_queue.
+    uint32_t in_flight;     //Sent, waiting for the ack.
+    int64_t answered_us;
+    char answer[CNCM_QUERY_ANSWER_SIZE];
+    uint32_t sent;
+    uint32_t coalesced;
+} query_slot_t;
+
+static query_slot_t queries[CNCM_MAX_STATUS_QUERIES];
+static SemaphoreHandle_t queries_lock;
+static nvs_handle_t queries_nvs;
+static uint32_t freshness_ms = CNCM_DEFAULT_QUERY_FRESHNESS_MS;
+
+static const char* const* queries_list()
+{
+    return cncm_dialect_def(cncm_get_dialect())->idempotent_queries;
+}
+
+esp_err_t cncm_queries_init(nvs_handle_t nvs)
+{
+    queries_lock = xSemaphoreCreateMutex();
+    if(queries_lock == NULL) return ESP_ERR_NO_MEM;
+    queries_nvs = nvs;
+    esp_err_t ret = nvs_get_u32(queries_nvs, "query_fresh_ms", &freshness_ms);
+    if(ret == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+    return ret;
+}
+
+void cncm_queries_reset()
+{
+    xSemaphoreTake(queries_lock, portMAX_DELAY);
+    memset(queries, 0, sizeof(queries));
+    xSemaphoreGive(queries_lock);
+}
+
+//Case insensitive and ignoring surrounding spaces, the lists are upper case.
+uint8_t cncm_queries_match(const char* line, size_t line_len)
+{
+    while(line_len > 0 && line[0] == ' ')
+    {
+        line++;
+        line_len--;
+    }
+    while(line_len > 0 && line[line_len - 1] == ' ') line_len--;
+    if(line_len == 0) return CNCM_NO_QUERY;
+    const char* const* list = queries_list();
+    for(uint8_t i = 0; list != NULL && list[i] != NULL && i < CNCM_MAX_STATUS_QUERIES; i++)
+    {
+        const char* query = list[i];
+        if(toupper((unsigned char)line[0]) != query[0] || strlen(query) != line_len) continue;
+        size_t j = 1;
+        while(j < line_len && toupper((unsigned char)line[j]) == query[j]) j++;
+        if(j == line_len) return i;
+    }
+    return CNCM_NO_QUERY;
+}
+
+void cncm_queries_on_queued(uint8_t query)
+{
+    if(query == CNCM_NO_QUERY) return;
+    xSemaphoreTake(queries_lock, portMAX_DELAY);
+    queries[query].queued++;
+    xSemaphoreGive(queries_lock);
+}
+
+void cncm_queries_on_unqueued(uint8_t query)
+{
+    if(query == CNCM_NO_QUERY) return;
+    xSemaphoreTake(queries_lock, portMAX_DELAY);
+    if(queries[query].queued > 0) queries[query].queued--;
+    xSemaphoreGive(queries_lock);
+}
+
+void cncm_queries_on_sent(uint8_t query)
+{
+    if(query == CNCM_NO_QUERY) return;
+    xSemaphoreTake(queries_lock, portMAX_DELAY);
+    query_slot_t* slot = &queries[query];
+    if(slot->queued > 0) slot->queued--;    //Macro lines are only matched here.
+    slot->in_flight++;
+    slot->sent++;
+    xSemaphoreGive(queries_lock);
+}
+
+void cncm_queries_on_completed(uint8_t query, const cncm_ack_output_t* output)
+{
+    if(query == CNCM_NO_QUERY) return;
+    xSemaphoreTake(queries_lock, portMAX_DELAY);
+    query_slot_t* slot = &queries[query];
+    if(slot->in_flight > 0) slot->in_flight--;
+    if(output != NULL)
+    {
+        //The answer's lines are separated, not terminated.
+        size_t answer_len = output->len;
+        if(answer_len > 0 && output->text[answer_len - 1] == '\n') answer_len--;
+        answer_len = MIN(answer_len, sizeof(slot->answer) - 1);
+        memcpy(slot->answer, output->text, answer_len);
+        slot->answer[answer_len] = '\0';
+        slot->answered_us = esp_timer_get_time();
+    }
+    xSemaphoreGive(queries_lock);
+}
+
+void cncm_queries_on_cleared()
+{
+    xSemaphoreTake(queries_lock, portMAX_DELAY);
+    for(size_t i = 0; i < CNCM_MAX_STATUS_QUERIES; i++) queries[i].queued = 0;
+    xSemaphoreGive(queries_lock);
+}
+
+bool cncm_queries_coalesce(uint8_t query)
+{
+    if(query == CNCM_NO_QUERY) return false;
+    xSemaphoreTake(queries_lock, portMAX_DELAY);
+    query_slot_t* slot = &queries[query];
+    bool pending = slot->queued > 0 || slot->in_flight > 0;
+    bool fresh = slot->answered_us != 0 && esp_timer_get_time() - slot->answered_us < freshness_ms * 1000LL;
+    if(pending || fresh) slot->coalesced++;
+    xSemaphoreGive(queries_lock);
+    return pending || fresh;
+}
+
+esp_err_t cncm_query_set_freshness(uint32_t new_freshness_ms)
+{
+    if(queries_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(new_freshness_ms > CNCM_MAX_QUERY_FRESHNESS_MS) return ESP_ERR_INVALID_ARG;
+    esp_err_t ret = nvs_set_u32(queries_nvs, "query_fresh_ms", new_freshness_ms);
+    if(ret == ESP_OK) ret = nvs_commit(queries_nvs);
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error accessing NVS: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    freshness_ms = new_freshness_ms;
+    return ESP_OK;
+}
+
+uint32_t cncm_query_get_freshness()
+{
+    return freshness_ms;
+}
+
+esp_err_t cncm_query_list(cncm_query_info_t* infos, size_t* infos_count)
+{
+    if(queries_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(infos == NULL || infos_count == NULL) return ESP_ERR_INVALID_ARG;
+    const char* const* list = queries_list();
+    *infos_count = 0;
+    xSemaphoreTake(queries_lock, portMAX_DELAY);
+    for(size_t i = 0; list != NULL && list[i] != NULL && i < CNCM_MAX_STATUS_QUERIES; i++)
+    {
+        cncm_query_info_t* info = &infos[(*infos_count)++];
+        info->query = list[i];
+        info->pending = queries[i].queued > 0 || queries[i].in_flight > 0;
+        info->answered_us = queries[i].answered_us;
+        strlcpy(info->answer, queries[i].answer, sizeof(info->answer));
+        info->sent = queries[i].sent;
+        info->coalesced = queries[i].coalesced;
+    }
+    xSemaphoreGive(queries_lock);
+    return ESP_OK;
+}
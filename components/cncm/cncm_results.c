@@ -0,0 +1,252 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "sys/param.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-Results";
+
+//A submitted command gets an id, and its lines carry the ticket of its slot through the tx_queue and the in-flight FIFO.
+//The machine answers every line with exactly one ack, in order, so when the oldest line in flight is acked the lines
+//received since the previous ack are its output, and an error among them is its error. A command is complete when all
+//of its lines are (a macro has several), the result stays in its slot until the slot is given to a later command.
+typedef struct {
+    cncm_cmd_result_t result;   //id 0 if the slot was never used.
+    uint32_t lines_queued;      //In the tx_queue.
+    uint32_t lines_in_flight;
+    bool error;
+    bool lost;
+    bool dropped;
+} command_slot_t;
+
+static command_slot_t* commands;    //In PSRAM.
+static uint32_t next_command_id = 1;
+static SemaphoreHandle_t results_lock;
+//One bit per waiter slot, set on every completion: each waiter clears and waits for its own bit, so none of them can
+//eat another's wake up.
+static EventGroupHandle_t results_events;
+static bool waiters[CNCM_CMD_MAX_WAITERS];
+
+static bool command_pending(const command_slot_t* command)
+{
+    return command->result.id != 0 &&
+           (command->result.state == CNCM_CMD_QUEUED || command->result.state == CNCM_CMD_SENT);
+}
+
+static command_slot_t* command_from_ticket(uint16_t ticket)
+{
+    if(ticket == CNCM_NO_TICKET || ticket > CNCM_MAX_TRACKED_COMMANDS) return NULL;
+    command_slot_t* command = &commands[ticket - 1];
+    return command_pending(command) ? command : NULL;   //A line dropped by a clear may still show up once.
+}
+
+//Called with the results lock held, once the last line of the command is accounted for.
+static void command_check_completed(command_slot_t* command)
+{
+    if(command->lines_queued > 0 || command->lines_in_flight > 0) return;
+    if(command->error) command->result.state = CNCM_CMD_ERROR;
+    else if(command->lost) command->result.state = CNCM_CMD_LOST;
+    else if(command->dropped) command->result.state = CNCM_CMD_DROPPED;
+    else command->result.state = CNCM_CMD_OK;
+    command->result.completed_us = esp_timer_get_time();
+    EventBits_t bits = 0;
+    for(size_t i = 0; i < CNCM_CMD_MAX_WAITERS; i++) if(waiters[i]) bits |= 1 << i;
+    if(bits != 0) xEventGroupSetBits(results_events, bits);
+}
+
+esp_err_t cncm_results_init()
+{
+    results_lock = xSemaphoreCreateMutex();
+    results_events = xEventGroupCreate();
+    commands = heap_caps_calloc(CNCM_MAX_TRACKED_COMMANDS, sizeof(command_slot_t), MALLOC_CAP_SPIRAM);
+    if(results_lock == NULL || results_events == NULL || commands == NULL) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+esp_err_t cncm_results_begin(size_t count, uint32_t* first_id)
+{
+    if(count == 0 || count > CNCM_MAX_TRACKED_COMMANDS) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(results_lock, portMAX_DELAY);
+    //Slots are given in id order, a command still waiting for its ack keeps its slot.
+    for(size_t i = 0; i < count; i++)
+    {
+        if(command_pending(&commands[(next_command_id + i) % CNCM_MAX_TRACKED_COMMANDS]))
+        {
+            xSemaphoreGive(results_lock);
+            ESP_LOGW(TAG, "No room to track %u more commands, %d are kept.", (unsigned)count, CNCM_MAX_TRACKED_COMMANDS);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    int64_t now = esp_timer_get_time();
+    for(size_t i = 0; i < count; i++)
+    {
+        command_slot_t* command = &commands[(next_command_id + i) % CNCM_MAX_TRACKED_COMMANDS];
+        memset(command, 0, sizeof(*command));
+        command->result.id = next_command_id + i;
+        command->result.state = CNCM_CMD_QUEUED;
+        command->result.queued_us = now;
+    }
+    *first_id = next_command_id;
+    next_command_id += count;
+    if(next_command_id < count) next_command_id = 1;   //Wrapped around, 0 is never an id.
+    xSemaphoreGive(results_lock);
+    return ESP_OK;
+}
+
+uint16_t cncm_results_ticket(uint32_t id)
+{
+    return (id % CNCM_MAX_TRACKED_COMMANDS) + 1;
+}
+
+void cncm_results_on_queued(uint16_t ticket, uint32_t lines)
+{
+    if(ticket == CNCM_NO_TICKET) return;
+    xSemaphoreTake(results_lock, portMAX_DELAY);
+    command_slot_t* command = command_from_ticket(ticket);
+    if(command != NULL)
+    {
+        command->lines_queued += lines;
+        command_check_completed(command);     //A macro may expand to nothing.
+    }
+    xSemaphoreGive(results_lock);
+}
+
+void cncm_results_abandon(uint32_t first_id, size_t count)
+{
+    xSemaphoreTake(results_lock, portMAX_DELAY);
+    for(size_t i = 0; i < count; i++)
+    {
+        command_slot_t* command = command_from_ticket(cncm_results_ticket(first_id + i));
+        if(command == NULL || command->result.id != first_id + i) continue;
+        command->dropped = true;
+        command_check_completed(command);
+    }
+    xSemaphoreGive(results_lock);
+}
+
+void cncm_results_on_sent(uint16_t ticket)
+{
+    if(ticket == CNCM_NO_TICKET) return;
+    xSemaphoreTake(results_lock, portMAX_DELAY);
+    command_slot_t* command = command_from_ticket(ticket);
+    if(command != NULL)
+    {
+        if(command->result.state == CNCM_CMD_QUEUED) command->result.sent_us = esp_timer_get_time();
+        command->result.state = CNCM_CMD_SENT;
+        command->lines_queued -= MIN(1, command->lines_queued);
+        command->lines_in_flight++;
+    }
+    xSemaphoreGive(results_lock);
+}
+
+void cncm_results_on_completed(uint16_t ticket, const cncm_ack_output_t* output)
+{
+    if(ticket == CNCM_NO_TICKET) return;
+    xSemaphoreTake(results_lock, portMAX_DELAY);
+    command_slot_t* command = command_from_ticket(ticket);
+    if(command != NULL && command->lines_in_flight > 0)
+    {
+        command->lines_in_flight--;
+        if(output == NULL) command->lost = true;
+        else
+        {
+            command->error |= output->error;
+            char* response = command->result.response;
+            size_t response_len = strlen(response);
+            size_t to_copy = MIN(output->len, CNCM_CMD_RESPONSE_SIZE - response_len);
+            memcpy(response + response_len, output->text, to_copy);
+            response[response_len + to_copy] = '\0';
+        }
+        command_check_completed(command);
+    }
+    xSemaphoreGive(results_lock);
+}
+
+void cncm_results_on_cleared()
+{
+    xSemaphoreTake(results_lock, portMAX_DELAY);
+    for(size_t i = 0; i < CNCM_MAX_TRACKED_COMMANDS; i++)
+    {
+        command_slot_t* command = &commands[i];
+        if(!command_pending(command) || command->lines_queued == 0) continue;
+        command->lines_queued = 0;
+        command->dropped = true;
+        command_check_completed(command);
+    }
+    xSemaphoreGive(results_lock);
+}
+
+//Copies the results, returns the number of them still pending, and sets unknown if an id isn't tracked.
+static size_t results_snapshot(uint32_t first_id, size_t count, cncm_cmd_result_t* results, bool* unknown)
+{
+    size_t pending = 0;
+    *unknown = false;
+    xSemaphoreTake(results_lock, portMAX_DELAY);
+    for(size_t i = 0; i < count; i++)
+    {
+        const command_slot_t* command = &commands[(first_id + i) % CNCM_MAX_TRACKED_COMMANDS];
+        if(first_id + i == 0 || command->result.id != first_id + i)
+        {
+            memset(&results[i], 0, sizeof(results[i]));
+            *unknown = true;
+            continue;
+        }
+        results[i] = command->result;
+        if(command_pending(command)) pending++;
+    }
+    xSemaphoreGive(results_lock);
+    return pending;
+}
+
+esp_err_t cncm_tx_results(uint32_t first_id, size_t count, uint32_t timeout_ms, cncm_cmd_result_t* results)
+{
+    if(results_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(results == NULL || count == 0 || count > CNCM_MAX_TRACKED_COMMANDS) return ESP_ERR_INVALID_ARG;
+    int64_t deadline = esp_timer_get_time() + timeout_ms * 1000LL;
+    xSemaphoreTake(results_lock, portMAX_DELAY);
+    size_t waiter = 0;
+    while(waiter < CNCM_CMD_MAX_WAITERS && waiters[waiter]) waiter++;
+    if(waiter < CNCM_CMD_MAX_WAITERS) waiters[waiter] = true;
+    xSemaphoreGive(results_lock);
+    bool unknown;
+    size_t pending;
+    while(true)
+    {
+        //Cleared before reading, a completion in between sets it again and the wait returns right away.
+        if(waiter < CNCM_CMD_MAX_WAITERS) xEventGroupClearBits(results_events, 1 << waiter);
+        pending = results_snapshot(first_id, count, results, &unknown);
+        int64_t remaining_us = deadline - esp_timer_get_time();
+        if(pending == 0 || remaining_us <= 0) break;
+        TickType_t wait = pdMS_TO_TICKS(remaining_us / 1000) + 1;
+        if(waiter < CNCM_CMD_MAX_WAITERS) xEventGroupWaitBits(results_events, 1 << waiter, pdTRUE, pdFALSE, wait);
+        else vTaskDelay(MIN(wait, pdMS_TO_TICKS(CNCM_CMD_WAIT_POLL_MS) + 1));  //All waiter slots taken, poll.
+    }
+    if(waiter < CNCM_CMD_MAX_WAITERS)
+    {
+        xSemaphoreTake(results_lock, portMAX_DELAY);
+        waiters[waiter] = false;
+        xSemaphoreGive(results_lock);
+    }
+    if(unknown) return ESP_ERR_NOT_FOUND;
+    return (pending > 0) ? ESP_ERR_TIMEOUT : ESP_OK;
+}
+
+const char* cncm_cmd_state_name(cncm_cmd_state_t state)
+{
+    static const char* names[] = {
+        [CNCM_CMD_QUEUED] = "queued",
+        [CNCM_CMD_SENT] = "sent",
+        [CNCM_CMD_OK] = "ok",
+        [CNCM_CMD_ERROR] = "error",
+        [CNCM_CMD_LOST] = "lost",
+        [CNCM_CMD_DROPPED] = "dropped"
+    };
+    return (state < sizeof(names) / sizeof(names[0])) ? names[state] : "unknown";
+}
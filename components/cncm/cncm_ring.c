@@ -0,0 +1,175 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+//Records are an 8 byte header (length, tag, kind, weight, ticket) and the payload, padded to 8 bytes so headers stay
+//aligned and any gap left at the end of the buffer can hold a header. A record never wraps: when it doesn't fit before
+//the end, the rest of the buffer is filled with a pad record the consumer skips.
+//The record the consumer peeked at is held until cncm_ring_finish(), even if it was released or the ring cleared, so
+//its payload can be used in place: producers count free space from the held record rather than from the tail.
+#define RING_KIND_DATA (0)
+#define RING_KIND_PAD (1)
+#define RING_NOT_HELD (UINT32_MAX)  //Records are 8 byte aligned, no record starts there.
+
+typedef struct {
+    uint16_t len;
+    uint8_t tag;
+    uint8_t kind;
+    uint16_t weight;
+    uint16_t ticket;
+} ring_header_t;
+
+static inline uint32_t ring_load(const uint32_t* index)
+{
+    return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+//Oldest byte producers must not overwrite. The tail is loaded first: a clear that moved it past a held record was
+//ordered after the hold, which is then seen too.
+static inline uint32_t ring_floor(cncm_ring_t* ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    uint32_t held = __atomic_load_n(&ring->held, __ATOMIC_SEQ_CST);
+    return (held != RING_NOT_HELD && (int32_t)(tail - held) > 0) ? held : tail;
+}
+
+esp_err_t cncm_ring_init(cncm_ring_t* ring, size_t capacity, size_t max_len, uint32_t caps)
+{
+    //A power of two keeps index % capacity continuous when the free running indices wrap around.
+    if(capacity == 0 || (capacity & (capacity - 1)) != 0 || max_len > UINT16_MAX ||
+       CNCM_RING_RECORD_SIZE(max_len) > capacity / 2) return ESP_ERR_INVALID_ARG;
+    ring->buffer = heap_caps_malloc(capacity, caps);
+    if(ring->buffer == NULL) return ESP_ERR_NO_MEM;
+    ring->capacity = capacity;
+    ring->max_len = max_len;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->held = RING_NOT_HELD;
+    ring->consumer = NULL;
+    ring->consumer_waiting = 0;
+    return ESP_OK;
+}
+
+size_t cncm_ring_space(cncm_ring_t* ring)
+{
+    uint32_t used = ring_load(&ring->head) - ring_floor(ring);
+    size_t free_bytes = ring->capacity - used;
+    //Records written back to back wrap at most once, wasting less than a record at the end.
+    size_t slack = CNCM_RING_RECORD_SIZE(ring->max_len);
+    return (free_bytes > slack) ? free_bytes - slack : 0;
+}
+
+bool cncm_ring_is_empty(cncm_ring_t* ring)
+{
+    return ring_load(&ring->head) == ring_load(&ring->tail);
+}
+
+uint8_t* cncm_ring_reserve(cncm_ring_t* ring, size_t len)
+{
+    if(len > ring->max_len) return NULL;
+    uint32_t head = ring->head;     //Only producers write it, and they are serialized.
+    uint32_t size = CNCM_RING_RECORD_SIZE(len);
+    uint32_t offset = head % ring->capacity;
+    uint32_t to_end = ring->capacity - offset;
+    uint32_t needed = (to_end < size) ? to_end + size : size;
+    if(ring->capacity - (head - ring_floor(ring)) < needed) return NULL;
+    if(to_end < size)
+    {
+        //Published right away, the consumer drops it and the record starts at the beginning of the buffer.
+        ring_header_t pad = { .len = to_end - sizeof(ring_header_t), .tag = 0, .kind = RING_KIND_PAD, .weight = 0, .ticket = 0 };
+        memcpy(ring->buffer + offset, &pad, sizeof(pad));
+        __atomic_store_n(&ring->head, head + to_end, __ATOMIC_RELEASE);
+        offset = 0;
+    }
+    return ring->buffer + offset + sizeof(ring_header_t);
+}
+
+void cncm_ring_commit(cncm_ring_t* ring, uint8_t tag, uint16_t weight, uint16_t ticket, size_t len)
+{
+    uint32_t head = ring->head;
+    ring_header_t header = { .len = len, .tag = tag, .kind = RING_KIND_DATA, .weight = weight, .ticket = ticket };
+    memcpy(ring->buffer + head % ring->capacity, &header, sizeof(header));
+    //Sequentially consistent with the load of consumer_waiting, so either the consumer sees the record before it
+    //sleeps or we see it waiting and wake it up.
+    __atomic_store_n(&ring->head, head + CNCM_RING_RECORD_SIZE(len), __ATOMIC_SEQ_CST);
+    if(__atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST)) xTaskNotifyGive((TaskHandle_t)ring->consumer);
+}
+
+bool cncm_ring_write(cncm_ring_t* ring, uint8_t tag, uint16_t weight, uint16_t ticket, const void* data, size_t len)
+{
+    uint8_t* span = cncm_ring_reserve(ring, len);
+    if(span == NULL) return false;
+    memcpy(span, data, len);
+    cncm_ring_commit(ring, tag, weight, ticket, len);
+    return true;
+}
+
+void cncm_ring_wait(cncm_ring_t* ring)
+{
+    while(cncm_ring_is_empty(ring))
+    {
+        ring->consumer = xTaskGetCurrentTaskHandle();
+        __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if(!cncm_ring_is_empty(ring))
+        {
+            __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+            return;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+bool cncm_ring_peek(cncm_ring_t* ring, cncm_ring_span_t* span)
+{
+    while(true)
+    {
+        uint32_t tail = ring_load(&ring->tail);
+        if(tail == ring_load(&ring->head)) return false;
+        //Held first, then used only if no clear moved the tail meanwhile: from then on producers leave it alone.
+        __atomic_store_n(&ring->held, tail, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != tail)
+        {
+            cncm_ring_finish(ring);
+            continue;
+        }
+        uint32_t offset = tail % ring->capacity;
+        ring_header_t header;
+        memcpy(&header, ring->buffer + offset, sizeof(header));
+        uint32_t size = CNCM_RING_RECORD_SIZE(header.len);
+        if(header.kind == RING_KIND_PAD)
+        {
+            __atomic_compare_exchange_n(&ring->tail, &tail, tail + size, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            cncm_ring_finish(ring);
+            continue;
+        }
+        span->data = ring->buffer + offset + sizeof(ring_header_t);
+        span->len = header.len;
+        span->tag = header.tag;
+        span->weight = header.weight;
+        span->ticket = header.ticket;
+        span->at = tail;
+        span->size = size;
+        return true;
+    }
+}
+
+bool cncm_ring_release(cncm_ring_t* ring, const cncm_ring_span_t* span)
+{
+    uint32_t expected = span->at;
+    return __atomic_compare_exchange_n(&ring->tail, &expected, span->at + span->size, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+void cncm_ring_finish(cncm_ring_t* ring)
+{
+    __atomic_store_n(&ring->held, RING_NOT_HELD, __ATOMIC_RELEASE);
+}
+
+void cncm_ring_clear(cncm_ring_t* ring)
+{
+    __atomic_store_n(&ring->tail, ring_load(&ring->head), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "sys/param.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+//Finding the line breaks is the only work done on every byte the machine sends, the rest is done once per line. Four
+//bytes are checked at once: x ^ 0x0A0A0A0A has a zero byte where x has a '\n', and (v - 0x01010101) & ~v & 0x80808080
+//flags the zero bytes of v. Bytes above a zero one may be flagged too through the borrow, never below it, so the
+//lowest flag is always the first break. Words are read aligned, the bytes before the first word one at a time.
+#define SCAN_ONES (0x01010101u)
+#define SCAN_HIGHS (0x80808080u)
+
+static inline bool scan_is_break(uint8_t c)
+{
+    return c == '\n' || c == '\r';
+}
+
+size_t cncm_scan_line_break_bytes(const uint8_t* data, size_t data_len)
+{
+    for(size_t i = 0; i < data_len; i++) if(scan_is_break(data[i])) return i;
+    return data_len;
+}
+
+#if CNCM_RX_SCAN_WORDS
+static inline uint32_t scan_zero_bytes(uint32_t v)
+{
+    return (v - SCAN_ONES) & ~v & SCAN_HIGHS;
+}
+
+size_t cncm_scan_line_break(const uint8_t* data, size_t data_len)
+{
+    size_t i = 0;
+    while(i < data_len && ((uintptr_t)(data + i) & 3) != 0)
+    {
+        if(scan_is_break(data[i])) return i;
+        i++;
+    }
+    for(; i + 4 <= data_len; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, data + i, 4);     //Aligned, compiles to one load.
+        uint32_t flags = scan_zero_bytes(word ^ (SCAN_ONES * '\n')) | scan_zero_bytes(word ^ (SCAN_ONES * '\r'));
+        if(flags != 0) return i + (__builtin_ctz(flags) >> 3);     //Little endian, the first byte is the lowest.
+    }
+    return i + cncm_scan_line_break_bytes(data + i, data_len - i);
+}
+#else
+size_t cncm_scan_line_break(const uint8_t* data, size_t data_len)
+{
+    return cncm_scan_line_break_bytes(data, data_len);
+}
+#endif
+
+//The bytes between two line breaks are copied as one run.
+void cncm_lines_feed(cncm_lines_t* lines, const uint8_t* data, size_t data_len, uint64_t data_offset)
+{
+    size_t i = 0;
+    while(i < data_len)
+    {
+        size_t run = cncm_scan_line_break(data + i, data_len - i);
+        while(run > 0)
+        {
+            if(lines->line_len == sizeof(lines->line))
+            {
+                lines->on_line(lines->line, lines->line_len, data_offset + i);
+                lines->line_len = 0;
+            }
+            size_t to_copy = MIN(run, sizeof(lines->line) - lines->line_len);
+            memcpy(lines->line + lines->line_len, data + i, to_copy);
+            lines->line_len += to_copy;
+            i += to_copy;
+            run -= to_copy;
+        }
+        if(i == data_len) break;
+        bool is_newline = (data[i] == '\n');
+        if(is_newline || lines->line_len == sizeof(lines->line))
+        {
+            lines->on_line(lines->line, lines->line_len, data_offset + i + (is_newline ? 1 : 0));
+            lines->line_len = 0;
+        }
+        i++;
+    }
+}
@@ -0,0 +1,475 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "sys/param.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-SD";
+
+//Marlin's binary file transfer (BINARY_FILE_TRANSFER): after "M28 B1" the firmware reads packets instead of lines,
+//  token (0xB5AD) | sync | protocol << 4 | type | payload length | header checksum | payload | packet checksum
+//little endian, and answers each one with a text line: "ok<sync>" once it's processed, "rs<sync>" to have it sent
+//again, "fe<sync>" on a fatal error, and "PFT:..." for the results of file operations. Packets are sent one at a time,
+//the next one only after the previous one was acknowledged.
+#define SD_PACKET_TOKEN (0xB5AD)
+#define SD_HEADER_SIZE (8)
+#define SD_PROTOCOL_CONNECTION (0)
+#define SD_CONNECTION_SYNC (1)
+#define SD_CONNECTION_CLOSE (2)
+#define SD_PROTOCOL_FILE (1)
+#define SD_FILE_QUERY (0)
+#define SD_FILE_OPEN (1)
+#define SD_FILE_CLOSE (2)
+#define SD_FILE_WRITE (3)
+#define SD_FILE_ABORT (4)
+#define SD_PFT_SIZE (64)
+
+//Set by the rx callback for each kind of reply, the values are written before the bit.
+#define SD_EVT_OK BIT0          //Plain "ok", acknowledges a text line.
+#define SD_EVT_ACK BIT1         //"ok<sync>".
+#define SD_EVT_RESEND BIT2
+#define SD_EVT_FATAL BIT3
+#define SD_EVT_SYNC BIT4        //"ss<sync>,<max block size>,<version>".
+#define SD_EVT_PFT BIT5
+#define SD_EVT_ALL (SD_EVT_OK | SD_EVT_ACK | SD_EVT_RESEND | SD_EVT_FATAL | SD_EVT_SYNC | SD_EVT_PFT)
+
+static SemaphoreHandle_t sd_api_lock;   //Serializes transfers, held for the whole of each call.
+static SemaphoreHandle_t sd_stats_lock;
+static EventGroupHandle_t sd_events;
+static volatile bool sd_capturing = false;  //While set the machine's lines go to the transfer.
+static cncm_sd_stats_t sd_stats;
+static bool sd_active = false;
+static bool sd_resume_tx = false;   //tx_consumer was running before the transfer.
+static uint8_t sd_sync = 0;
+static uint8_t sd_packet[CNCM_SD_MAX_PACKET_SIZE];
+//Written by the rx callback.
+static volatile uint8_t reply_sync = 0;
+static volatile uint16_t reply_block_size = 0;
+static volatile int binary_cap = -1;    //Cap:BINARY_FILE_TRANSFER from M115, -1 if not seen.
+static char reply_pft[SD_PFT_SIZE];
+
+//Fletcher-16 as Marlin computes it.
+static uint16_t sd_checksum(uint16_t checksum, const uint8_t* data, size_t data_len)
+{
+    for(size_t i = 0; i < data_len; i++)
+    {
+        uint16_t low = ((checksum & 0xFF) + data[i]) % 255;
+        checksum = ((((checksum >> 8) + low) % 255) << 8) | low;
+    }
+    return checksum;
+}
+
+static size_t sd_packet_build(uint8_t protocol, uint8_t type, const uint8_t* payload, size_t payload_len)
+{
+    sd_packet[0] = SD_PACKET_TOKEN & 0xFF;
+    sd_packet[1] = SD_PACKET_TOKEN >> 8;
+    sd_packet[2] = sd_sync;
+    sd_packet[3] = (protocol << 4) | (type & 0x0F);
+    sd_packet[4] = payload_len & 0xFF;
+    sd_packet[5] = payload_len >> 8;
+    uint16_t checksum = sd_checksum(0, sd_packet, 6);
+    sd_packet[6] = checksum & 0xFF;
+    sd_packet[7] = checksum >> 8;
+    if(payload_len == 0) return SD_HEADER_SIZE;
+    memcpy(sd_packet + SD_HEADER_SIZE, payload, payload_len);
+    checksum = sd_checksum(0, sd_packet, SD_HEADER_SIZE + payload_len);    //The whole packet, header included.
+    sd_packet[SD_HEADER_SIZE + payload_len] = checksum & 0xFF;
+    sd_packet[SD_HEADER_SIZE + payload_len + 1] = checksum >> 8;
+    return SD_HEADER_SIZE + payload_len + 2;
+}
+
+//Parses the digits after a two letter reply, returns false if there are none.
+static bool sd_reply_number(const char* line, size_t line_len, uint32_t* number, size_t* end)
+{
+    size_t i = 2;
+    *number = 0;
+    while(i < line_len && isdigit((unsigned char)line[i])) *number = *number * 10 + (line[i++] - '0');
+    *end = i;
+    return i > 2;
+}
+
+bool cncm_sd_on_line(const char* line, size_t line_len)
+{
+    if(!sd_capturing) return false;
+    uint32_t number;
+    size_t end;
+    if(line_len >= 2 && strncmp(line, "ok", 2) == 0)
+    {
+        if(sd_reply_number(line, line_len, &number, &end))
+        {
+            reply_sync = (uint8_t)number;
+            xEventGroupSetBits(sd_events, SD_EVT_ACK);
+        }
+        else xEventGroupSetBits(sd_events, SD_EVT_OK);
+    }
+    else if(line_len >= 2 && strncmp(line, "rs", 2) == 0 && sd_reply_number(line, line_len, &number, &end))
+    {
+        xEventGroupSetBits(sd_events, SD_EVT_RESEND);
+    }
+    else if(line_len >= 2 && strncmp(line, "fe", 2) == 0 && sd_reply_number(line, line_len, &number, &end))
+    {
+        xEventGroupSetBits(sd_events, SD_EVT_FATAL);
+    }
+    else if(line_len >= 2 && strncmp(line, "ss", 2) == 0 && sd_reply_number(line, line_len, &number, &end))
+    {
+        reply_sync = (uint8_t)number;
+        reply_block_size = (end < line_len && line[end] == ',') ? (uint16_t)atoi(line + end + 1) : 0;
+        xEventGroupSetBits(sd_events, SD_EVT_SYNC);
+    }
+    else if(line_len >= 4 && strncmp(line, "PFT:", 4) == 0)
+    {
+        size_t copied = MIN(line_len, sizeof(reply_pft) - 1);
+        memcpy(reply_pft, line, copied);
+        reply_pft[copied] = '\0';
+        xEventGroupSetBits(sd_events, SD_EVT_PFT);
+    }
+    else if(line_len > 25 && strncmp(line, "Cap:BINARY_FILE_TRANSFER:", 25) == 0)
+    {
+        binary_cap = line[25] - '0';
+    }
+    return true;    //Anything else (echo:, busy:, ...) is dropped.
+}
+
+static void sd_fail(esp_err_t error)
+{
+    xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+    if(sd_stats.error == ESP_OK) sd_stats.error = error;
+    xSemaphoreGive(sd_stats_lock);
+}
+
+//Sends a text line and waits for its plain "ok".
+static esp_err_t sd_line_exchange(const char* line)
+{
+    xEventGroupClearBits(sd_events, SD_EVT_ALL);
+    esp_err_t ret = cncm_machine_write((const uint8_t*)line, strlen(line));
+    if(ret != ESP_OK) return ret;
+    EventBits_t bits = xEventGroupWaitBits(sd_events, SD_EVT_OK, pdTRUE, pdFALSE, pdMS_TO_TICKS(CNCM_SD_REPLY_TIMEOUT_MS * 2));
+    return (bits & SD_EVT_OK) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+//Sends a packet with the current sync until it's acknowledged, and if pft isn't NULL until its "PFT:" result came too.
+static esp_err_t sd_packet_exchange(uint8_t protocol, uint8_t type, const uint8_t* payload, size_t payload_len, char* pft)
+{
+    size_t packet_len = sd_packet_build(protocol, type, payload, payload_len);
+    for(uint32_t attempt = 0; attempt <= CNCM_SD_MAX_RETRIES; attempt++)
+    {
+        xEventGroupClearBits(sd_events, SD_EVT_ALL);
+        esp_err_t ret = cncm_machine_write(sd_packet, packet_len);
+        if(ret != ESP_OK) return ret;
+        bool acked = false;
+        bool answered = (pft == NULL);
+        bool resend = false;
+        int64_t deadline = esp_timer_get_time() + CNCM_SD_REPLY_TIMEOUT_MS * 1000LL;
+        while(!(acked && answered) && !resend)
+        {
+            int64_t left_us = deadline - esp_timer_get_time();
+            if(left_us <= 0) break;
+            EventBits_t bits = xEventGroupWaitBits(sd_events, SD_EVT_ACK | SD_EVT_RESEND | SD_EVT_FATAL | SD_EVT_PFT,
+                                                   pdTRUE, pdFALSE, pdMS_TO_TICKS(left_us / 1000) + 1);
+            if(bits & SD_EVT_FATAL) return ESP_FAIL;
+            if(bits & SD_EVT_PFT)
+            {
+                if(pft != NULL) strcpy(pft, reply_pft);
+                else if(strstr(reply_pft, "ioerror") != NULL) return ESP_FAIL;
+                answered = true;
+            }
+            if((bits & SD_EVT_ACK) && reply_sync == sd_sync) acked = true;   //A late ack of the previous packet is ignored.
+            if(bits & SD_EVT_RESEND) resend = true;
+        }
+        if(acked && answered)
+        {
+            sd_sync++;
+            xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+            sd_stats.packets++;
+            xSemaphoreGive(sd_stats_lock);
+            return ESP_OK;
+        }
+        //Sending it again once it was acknowledged would only get another ack, the result would still be missing.
+        if(acked) return ESP_ERR_TIMEOUT;
+        xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+        if(resend) sd_stats.resends++;
+        else sd_stats.timeouts++;
+        xSemaphoreGive(sd_stats_lock);
+    }
+    return ESP_ERR_TIMEOUT;
+}
+
+//Asks the firmware for its sync and packet size, sent until it answers since the first packets may be lost while it
+//switches to binary mode.
+static esp_err_t sd_connect()
+{
+    size_t packet_len = sd_packet_build(SD_PROTOCOL_CONNECTION, SD_CONNECTION_SYNC, NULL, 0);
+    for(uint32_t attempt = 0; attempt <= CNCM_SD_MAX_RETRIES; attempt++)
+    {
+        xEventGroupClearBits(sd_events, SD_EVT_ALL);
+        esp_err_t ret = cncm_machine_write(sd_packet, packet_len);
+        if(ret != ESP_OK) return ret;
+        EventBits_t bits = xEventGroupWaitBits(sd_events, SD_EVT_SYNC | SD_EVT_FATAL, pdTRUE, pdFALSE,
+                                               pdMS_TO_TICKS(CNCM_SD_REPLY_TIMEOUT_MS));
+        if(bits & SD_EVT_SYNC)
+        {
+            sd_sync = reply_sync;
+            uint16_t block_size = (reply_block_size > 0) ? MIN(reply_block_size, CNCM_SD_MAX_BLOCK_SIZE) : CNCM_SD_MAX_BLOCK_SIZE;
+            xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+            sd_stats.block_size = block_size;
+            xSemaphoreGive(sd_stats_lock);
+            return ESP_OK;
+        }
+        if(bits & SD_EVT_FATAL) return ESP_FAIL;
+    }
+    return ESP_ERR_TIMEOUT;
+}
+
+//Goes back to the text protocol. The firmware may leave binary mode before acknowledging, so no answer is fine.
+static void sd_disconnect()
+{
+    sd_packet_exchange(SD_PROTOCOL_CONNECTION, SD_CONNECTION_CLOSE, NULL, 0, NULL);
+    sd_capturing = false;
+}
+
+//Ends the transfer whatever happened, tx_consumer gets going again if the transfer paused it.
+static void sd_finish(cncm_sd_state_t state, esp_err_t error)
+{
+    sd_capturing = false;
+    sd_active = false;
+    if(sd_resume_tx) cncm_resume();
+    sd_resume_tx = false;
+    if(error != ESP_OK) sd_fail(error);
+    xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+    sd_stats.state = state;
+    sd_stats.finished_us = esp_timer_get_time();
+    xSemaphoreGive(sd_stats_lock);
+}
+
+//Lines already sent must be acknowledged before the firmware switches to binary mode. tx_consumer may be between the
+//pause check and counting its line as sent, so the count must stay at zero for a while.
+static esp_err_t sd_drain()
+{
+    int64_t start = esp_timer_get_time();
+    int64_t quiet_since = start;
+    while(esp_timer_get_time() - start < CNCM_SD_DRAIN_TIMEOUT_MS * 1000LL)
+    {
+        int64_t now = esp_timer_get_time();
+        if(cncm_jobs_in_flight_count() > 0) quiet_since = now;
+        else if(now - quiet_since >= CNCM_SD_DRAIN_QUIET_MS * 1000LL) return ESP_OK;
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return ESP_ERR_TIMEOUT;
+}
+
+static esp_err_t sd_open(const char* filename)
+{
+    uint8_t payload[2 + CNCM_SD_MAX_FILENAME_SIZE + 1];
+    payload[0] = 0;     //Not a dummy transfer, the data is written.
+    payload[1] = 0;     //Not compressed.
+    size_t filename_len = strlen(filename);
+    memcpy(payload + 2, filename, filename_len + 1);
+    char pft[SD_PFT_SIZE];
+    for(int attempt = 0; attempt < 2; attempt++)
+    {
+        esp_err_t ret = sd_packet_exchange(SD_PROTOCOL_FILE, SD_FILE_OPEN, payload, 2 + filename_len + 1, pft);
+        if(ret != ESP_OK) return ret;
+        if(strcmp(pft, "PFT:success") == 0) return ESP_OK;
+        if(strcmp(pft, "PFT:busy") != 0) break;
+        //A previous transfer was left open, abort it and try again.
+        ESP_LOGW(TAG, "Firmware busy with another transfer, aborting it.");
+        ret = sd_packet_exchange(SD_PROTOCOL_FILE, SD_FILE_ABORT, NULL, 0, pft);
+        if(ret != ESP_OK) return ret;
+    }
+    ESP_LOGE(TAG, "Firmware refused to open %s: %s", filename, pft);
+    return ESP_FAIL;
+}
+
+esp_err_t cncm_sd_init()
+{
+    sd_api_lock = xSemaphoreCreateMutex();
+    sd_stats_lock = xSemaphoreCreateMutex();
+    sd_events = xEventGroupCreate();
+    if(sd_api_lock == NULL || sd_stats_lock == NULL || sd_events == NULL) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+esp_err_t cncm_sd_transfer_begin(const char* filename)
+{
+    if(sd_api_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(filename == NULL) return ESP_ERR_INVALID_ARG;
+    size_t filename_len = strlen(filename);
+    if(filename_len == 0 || filename_len > CNCM_SD_MAX_FILENAME_SIZE || strpbrk(filename, "\r\n") != NULL) return ESP_ERR_INVALID_ARG;
+    if(cncm_get_dialect() != CNCM_DIALECT_MARLIN) return ESP_ERR_NOT_SUPPORTED;
+    if(!cncm_is_open()) return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(sd_api_lock, portMAX_DELAY);
+    if(sd_active)
+    {
+        xSemaphoreGive(sd_api_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    sd_active = true;
+    xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+    memset(&sd_stats, 0, sizeof(sd_stats));
+    sd_stats.state = CNCM_SD_TRANSFERRING;
+    strcpy(sd_stats.filename, filename);
+    sd_stats.started_us = esp_timer_get_time();
+    xSemaphoreGive(sd_stats_lock);
+
+    //If it times out tx_consumer was paused already (PUT /stop), and stays paused afterwards.
+    sd_resume_tx = (cncm_pause() == ESP_OK);
+    esp_err_t ret = sd_drain();
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Lines in flight weren't acknowledged, not starting the transfer.");
+    if(ret == ESP_OK)
+    {
+        binary_cap = -1;
+        sd_capturing = true;
+        ret = sd_line_exchange("M115\n");
+        if(ret == ESP_OK && binary_cap != 1)
+        {
+            ESP_LOGE(TAG, "Firmware doesn't support binary file transfer (BINARY_FILE_TRANSFER).");
+            ret = ESP_ERR_NOT_SUPPORTED;
+        }
+    }
+    bool binary = false;
+    if(ret == ESP_OK) ret = sd_line_exchange("M28 B1\n");
+    if(ret == ESP_OK)
+    {
+        binary = true;
+        ret = sd_connect();
+    }
+    char pft[SD_PFT_SIZE];
+    if(ret == ESP_OK) ret = sd_packet_exchange(SD_PROTOCOL_FILE, SD_FILE_QUERY, NULL, 0, pft);
+    if(ret == ESP_OK)
+    {
+        xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+        sd_stats.compression_available = strstr(pft, "heatshrink") != NULL;
+        xSemaphoreGive(sd_stats_lock);
+        ret = sd_open(filename);
+    }
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start the transfer of %s: %s", filename, esp_err_to_name(ret));
+        if(binary) sd_disconnect();
+        sd_finish(CNCM_SD_FAILED, ret);
+    }
+    else
+    {
+        xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+        sd_stats.started_us = esp_timer_get_time();     //Throughput of the file data only.
+        xSemaphoreGive(sd_stats_lock);
+        ESP_LOGI(TAG, "Transferring %s in %u byte packets.", filename, sd_stats.block_size);
+    }
+    xSemaphoreGive(sd_api_lock);
+    return ret;
+}
+
+esp_err_t cncm_sd_transfer_write(const uint8_t* data, size_t data_len)
+{
+    if(sd_api_lock == NULL) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(sd_api_lock, portMAX_DELAY);
+    if(!sd_active)
+    {
+        xSemaphoreGive(sd_api_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t ret = ESP_OK;
+    size_t written = 0;
+    while(written < data_len && ret == ESP_OK)
+    {
+        size_t block_len = MIN(data_len - written, sd_stats.block_size);
+        ret = sd_packet_exchange(SD_PROTOCOL_FILE, SD_FILE_WRITE, data + written, block_len, NULL);
+        if(ret != ESP_OK) break;
+        written += block_len;
+        xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+        sd_stats.bytes += block_len;
+        int64_t elapsed_us = esp_timer_get_time() - sd_stats.started_us;
+        if(elapsed_us > 0) sd_stats.bytes_per_s = sd_stats.bytes * 1000000.0f / elapsed_us;
+        xSemaphoreGive(sd_stats_lock);
+    }
+    if(ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Transfer failed after %llu bytes: %s", sd_stats.bytes, esp_err_to_name(ret));
+        //The firmware deletes the partial file on abort, if it still answers.
+        if(cncm_is_open()) sd_packet_exchange(SD_PROTOCOL_FILE, SD_FILE_ABORT, NULL, 0, NULL);
+        sd_disconnect();
+        sd_finish(CNCM_SD_FAILED, ret);
+    }
+    xSemaphoreGive(sd_api_lock);
+    return ret;
+}
+
+esp_err_t cncm_sd_transfer_end(bool start_print)
+{
+    if(sd_api_lock == NULL) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(sd_api_lock, portMAX_DELAY);
+    if(!sd_active)
+    {
+        xSemaphoreGive(sd_api_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    char pft[SD_PFT_SIZE];
+    esp_err_t ret = sd_packet_exchange(SD_PROTOCOL_FILE, SD_FILE_CLOSE, NULL, 0, pft);
+    if(ret == ESP_OK && strcmp(pft, "PFT:success") != 0)
+    {
+        ESP_LOGE(TAG, "Firmware failed to close the file: %s", pft);
+        ret = ESP_FAIL;
+    }
+    sd_disconnect();
+    sd_finish((ret == ESP_OK) ? CNCM_SD_DONE : CNCM_SD_FAILED, ret);
+    ESP_LOGI(TAG, "Transferred %llu bytes at %.0f B/s.", sd_stats.bytes, sd_stats.bytes_per_s);
+    if(ret == ESP_OK && start_print)
+    {
+        char command[4 + CNCM_SD_MAX_FILENAME_SIZE + 1];
+        snprintf(command, sizeof(command), "M23 %s", sd_stats.filename);
+        ret = cncm_tx_producer(command);
+        if(ret == ESP_OK) ret = cncm_tx_producer("M24");
+        if(ret != ESP_OK) ESP_LOGE(TAG, "Failed to start printing: %s", esp_err_to_name(ret));
+    }
+    xSemaphoreGive(sd_api_lock);
+    return ret;
+}
+
+esp_err_t cncm_sd_transfer_abort()
+{
+    if(sd_api_lock == NULL) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(sd_api_lock, portMAX_DELAY);
+    if(!sd_active)
+    {
+        xSemaphoreGive(sd_api_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    sd_packet_exchange(SD_PROTOCOL_FILE, SD_FILE_ABORT, NULL, 0, NULL);
+    sd_disconnect();
+    sd_finish(CNCM_SD_ABORTED, ESP_OK);
+    ESP_LOGW(TAG, "Transfer of %s aborted.", sd_stats.filename);
+    xSemaphoreGive(sd_api_lock);
+    return ESP_OK;
+}
+
+esp_err_t cncm_sd_transfer_get_stats(cncm_sd_stats_t* stats)
+{
+    if(sd_stats_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(stats == NULL) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(sd_stats_lock, portMAX_DELAY);
+    *stats = sd_stats;
+    xSemaphoreGive(sd_stats_lock);
+    return ESP_OK;
+}
+
+const char* cncm_sd_state_name(cncm_sd_state_t state)
+{
+    switch(state)
+    {
+        case CNCM_SD_IDLE: return "idle";
+        case CNCM_SD_TRANSFERRING: return "transferring";
+        case CNCM_SD_DONE: return "done";
+        case CNCM_SD_FAILED: return "failed";
+        case CNCM_SD_ABORTED: return "aborted";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,354 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sys/param.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+static const char *TAG = "CNCM-Subscriptions";
+
+//Most of what a machine prints is noise to any one client: busy keepalives, acks, temperature reports every second.
+//A subscription is a filter decided on every line as the rx callback splits it, with the line's class from the dialect's
+//classifier and the time it arrived, so "one status per second" means a second of machine time, not of polling.
+//Decisions go into an index of line ends, one bit per subscription, next to the rx_queue: readers copy the lines their
+//bit passes straight from the rx_queue, without classifying or scanning anything again.
+//Index entries are the line's end offset in the low 56 bits and the subscription mask in the high 8. The rx callback is
+//the only writer, readers check after reading an entry that it wasn't overwritten meanwhile.
+//The rx callback never takes subscriptions_lock, a client holding it may have been preempted by the USB tasks. Subscribe
+//and unsubscribe change a slot between two increments of its seq; the callback decides the line with what it read and
+//drops the decision if seq was odd or moved meanwhile, so a line arriving right then isn't passed to that subscription.
+//What the callback counts is its own, in a tally next to the slot.
+#define INDEX_END_MASK ((1ULL << 56) - 1)
+#define INDEX_ENTRY_END(entry) ((entry) & INDEX_END_MASK)
+#define INDEX_ENTRY_PASSES(entry, slot) ((((entry) >> 56) & (1U << (slot))) != 0)
+#define INDEX_READ_ATTEMPTS (4)     //Passes over an index moving under the reader, before it skips to the newest line.
+
+typedef struct {
+    uint32_t seq;               //Odd while the slot is being changed.
+    uint32_t id;                //0 if the slot is free.
+    cncm_rx_filter_t filter;
+    uint64_t created_at;        //rx_queue offset, lines starting before it were decided without this subscription.
+    uint64_t cursor;            //Next byte to read, at a line start. Only used by clients, like last_read_us.
+    int64_t last_read_us;
+} subscription_t;
+
+//Stored by the rx callback only, reset when it first sees a new id in the slot.
+typedef struct {
+    uint32_t id;
+    int64_t last_status_us;     //Arrival of the last status line passed, for status_interval_ms.
+    uint32_t lines_passed;
+    uint32_t lines_filtered;
+} subscription_tally_t;
+
+static subscription_t subscriptions[CNCM_RX_MAX_SUBSCRIPTIONS];
+static subscription_tally_t tallies[CNCM_RX_MAX_SUBSCRIPTIONS];
+static uint32_t next_subscription_id = 1;
+static SemaphoreHandle_t subscriptions_lock;
+static uint64_t* line_index;
+static uint32_t index_head = 0;     //Lines ever indexed, stored by the rx callback only.
+static uint64_t line_start = 0;     //Of the line being indexed, only touched by the rx callback.
+
+static subscription_t* subscription_find(uint32_t id)
+{
+    if(id == 0) return NULL;
+    subscription_t* subscription = &subscriptions[id % CNCM_RX_MAX_SUBSCRIPTIONS];
+    return (subscription->id == id) ? subscription : NULL;
+}
+
+static bool prefix_match(const char (*prefixes)[CNCM_RX_FILTER_PREFIX_SIZE + 1], const char* line, size_t line_len)
+{
+    for(size_t i = 0; i < CNCM_RX_FILTER_MAX_PREFIXES && prefixes[i][0] != '\0'; i++)
+    {
+        size_t prefix_len = strlen(prefixes[i]);
+        if(prefix_len <= line_len && memcmp(prefixes[i], line, prefix_len) == 0) return true;
+    }
+    return false;
+}
+
+//Busy keepalives aren't told apart by the dialects, Marlin and RepRapFirmware both print them this way.
+static uint8_t line_class(const char* line, size_t line_len, uint8_t kind)
+{
+    if(kind & CNCM_LINE_ERROR) return CNCM_RX_CLASS_ERROR;
+    if(kind & CNCM_LINE_STATUS) return CNCM_RX_CLASS_STATUS;
+    if(kind & CNCM_LINE_ACK) return CNCM_RX_CLASS_ACK;
+    if((line_len >= 9 && memcmp(line, "echo:busy", 9) == 0) || (line_len >= 5 && memcmp(line, "busy:", 5) == 0))
+    {
+        return CNCM_RX_CLASS_BUSY;
+    }
+    return CNCM_RX_CLASS_OTHER;
+}
+
+//Excluded prefixes win over included ones, which win over the classes. Empty lines never pass. The filter may be torn
+//by a concurrent subscribe, its prefixes are still NULL terminated within their arrays.
+static bool filter_passes(const cncm_rx_filter_t* filter, uint8_t class, const char* line, size_t line_len, int64_t now,
+                          int64_t* last_status_us)
+{
+    if(line_len == 0 || prefix_match(filter->exclude, line, line_len)) return false;
+    if(prefix_match(filter->include, line, line_len)) return true;
+    if((filter->classes & class) == 0) return false;
+    if(class != CNCM_RX_CLASS_STATUS || filter->status_interval_ms == 0) return true;
+    if(*last_status_us != 0 && now - *last_status_us < filter->status_interval_ms * 1000LL) return false;
+    *last_status_us = now;
+    return true;
+}
+
+//Called by clients with subscriptions_lock held, around any change of id, filter or created_at.
+static void slot_write_begin(subscription_t* subscription)
+{
+    __atomic_store_n(&subscription->seq, subscription->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void slot_write_end(subscription_t* subscription)
+{
+    __atomic_store_n(&subscription->seq, subscription->seq + 1, __ATOMIC_RELEASE);
+}
+
+esp_err_t cncm_subscriptions_init()
+{
+    subscriptions_lock = xSemaphoreCreateMutex();
+    line_index = heap_caps_calloc(CNCM_RX_LINE_INDEX_SIZE, sizeof(uint64_t), MALLOC_CAP_SPIRAM);
+    if(subscriptions_lock == NULL || line_index == NULL) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+void cncm_subscriptions_on_line(const char* line, size_t line_len, uint8_t kind, uint64_t end)
+{
+    uint8_t mask = 0;
+    uint8_t class = line_class(line, line_len, kind);
+    int64_t now = esp_timer_get_time();
+    for(size_t slot = 0; slot < CNCM_RX_MAX_SUBSCRIPTIONS; slot++)
+    {
+        subscription_t* subscription = &subscriptions[slot];
+        uint32_t seq = __atomic_load_n(&subscription->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) continue;
+        uint32_t id = subscription->id;
+        if(id == 0 || line_start < subscription->created_at) continue;
+        subscription_tally_t* tally = &tallies[slot];
+        int64_t last_status_us = (tally->id == id) ? tally->last_status_us : 0;
+        bool passes = filter_passes(&subscription->filter, class, line, line_len, now, &last_status_us);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&subscription->seq, __ATOMIC_RELAXED) != seq) continue;
+        if(tally->id != id)
+        {
+            __atomic_store_n(&tally->lines_passed, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&tally->lines_filtered, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&tally->id, id, __ATOMIC_RELEASE);
+        }
+        tally->last_status_us = last_status_us;
+        if(passes)
+        {
+            mask |= 1U << slot;
+            __atomic_store_n(&tally->lines_passed, tally->lines_passed + 1, __ATOMIC_RELAXED);
+        }
+        else __atomic_store_n(&tally->lines_filtered, tally->lines_filtered + 1, __ATOMIC_RELAXED);
+    }
+    uint32_t head = index_head;
+    line_index[head % CNCM_RX_LINE_INDEX_SIZE] = ((uint64_t)mask << 56) | (end & INDEX_END_MASK);
+    __atomic_store_n(&index_head, head + 1, __ATOMIC_RELEASE);
+    line_start = end;
+}
+
+//Reads entry i, false if the rx callback reused it meanwhile.
+static bool index_read(uint32_t i, uint64_t* entry)
+{
+    *entry = line_index[i % CNCM_RX_LINE_INDEX_SIZE];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&index_head, __ATOMIC_ACQUIRE) - i < CNCM_RX_LINE_INDEX_SIZE;
+}
+
+//First entry in [first, head) of a line ending after cursor, ends only grow. head if none, UINT32_MAX if the index
+//moved under the search.
+static uint32_t index_find(uint32_t first, uint32_t head, uint64_t cursor)
+{
+    uint32_t low = first, high = head;
+    while(low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        uint64_t entry;
+        if(!index_read(middle, &entry)) return UINT32_MAX;
+        if(INDEX_ENTRY_END(entry) <= cursor) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+//Copies the lines in [start, end) that passed, false if the rx_queue already overwrote them.
+static bool span_copy(uint64_t start, uint64_t end, uint8_t* to_receive, size_t* response_size)
+{
+    if(end == start) return true;
+    size_t copied = 0;
+    uint64_t lost = 0;
+    uint64_t cursor = start;
+    cncm_rx_read(&cursor, to_receive + *response_size, &copied, end - start, &lost);
+    if(lost > 0 || copied != end - start) return false;
+    *response_size += copied;
+    return true;
+}
+
+esp_err_t cncm_rx_read_filtered(uint32_t subscription_id, uint8_t* to_receive, size_t* response_size,
+                                size_t max_response_size, uint64_t* cursor, uint64_t* lost_bytes, uint64_t* filtered_bytes)
+{
+    if(subscriptions_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(to_receive == NULL || response_size == NULL || cursor == NULL) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    subscription_t* subscription = subscription_find(subscription_id);
+    if(subscription == NULL)
+    {
+        xSemaphoreGive(subscriptions_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint8_t slot = subscription - subscriptions;
+    uint64_t start = subscription->cursor;
+    subscription->last_read_us = esp_timer_get_time();
+    xSemaphoreGive(subscriptions_lock);
+
+    uint64_t lost = 0;
+    uint64_t filtered = 0;
+    *response_size = 0;
+    for(uint32_t attempt = 0; ; attempt++)
+    {
+        uint32_t head = __atomic_load_n(&index_head, __ATOMIC_ACQUIRE);
+        if(attempt == INDEX_READ_ATTEMPTS)
+        {
+            //The machine prints faster than this reader gets through the index, the lines up to the newest are lost.
+            uint64_t entry;
+            if(head > 0 && index_read(head - 1, &entry) && INDEX_ENTRY_END(entry) > start)
+            {
+                lost += INDEX_ENTRY_END(entry) - start;
+                start = INDEX_ENTRY_END(entry);
+            }
+            break;
+        }
+        //The entry at head - CNCM_RX_LINE_INDEX_SIZE shares its place with the one being written, it's never readable.
+        uint32_t first = (head >= CNCM_RX_LINE_INDEX_SIZE) ? head - CNCM_RX_LINE_INDEX_SIZE + 1 : 0;
+        uint32_t i = index_find(first, head, start);
+        if(i == UINT32_MAX) continue;
+        uint64_t entry;
+        //The line the cursor falls in starts before the oldest entry: its start is gone with the entry before it.
+        if(i == first && first > 0 && i < head)
+        {
+            if(!index_read(i, &entry)) continue;
+            lost += INDEX_ENTRY_END(entry) - start;
+            start = INDEX_ENTRY_END(entry);
+            i++;
+        }
+        //Consecutive lines that pass are copied in one go.
+        uint64_t span_start = start;
+        bool moved = false;
+        for(; i < head; i++)
+        {
+            if(!index_read(i, &entry))
+            {
+                moved = true;
+                break;
+            }
+            uint64_t end = INDEX_ENTRY_END(entry);
+            if(!INDEX_ENTRY_PASSES(entry, slot))
+            {
+                if(!span_copy(span_start, start, to_receive, response_size)) lost += start - span_start;
+                filtered += end - start;
+                span_start = end;
+            }
+            else if(*response_size + (end - span_start) > max_response_size)
+            {
+                if(*response_size > 0 || span_start != start) break;
+                //A line longer than the whole response is cut, or nothing would ever be read past it.
+                if(!span_copy(start, start + max_response_size, to_receive, response_size)) lost += max_response_size;
+                filtered += end - start - max_response_size;
+                span_start = start = end;
+                i++;
+                break;
+            }
+            start = end;
+        }
+        if(!span_copy(span_start, start, to_receive, response_size)) lost += start - span_start;
+        if(!moved) break;
+    }
+
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    if(subscription->id == subscription_id) subscription->cursor = start;
+    xSemaphoreGive(subscriptions_lock);
+    *cursor = start;
+    if(lost_bytes != NULL) *lost_bytes = lost;
+    if(filtered_bytes != NULL) *filtered_bytes = filtered;
+    if(lost > 0) ESP_LOGW(TAG, "Subscription %" PRIu32 " lost %" PRIu64 " bytes to rx buffer overwrite.", subscription_id, lost);
+    return ESP_OK;
+}
+
+esp_err_t cncm_rx_subscribe(const cncm_rx_filter_t* filter, uint32_t* subscription_id)
+{
+    if(subscriptions_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(filter == NULL || subscription_id == NULL || (filter->classes & ~CNCM_RX_CLASS_ALL) != 0) return ESP_ERR_INVALID_ARG;
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    //Slots are reused in order like jobs, a subscription nobody read for a while is given up.
+    subscription_t* subscription = &subscriptions[next_subscription_id % CNCM_RX_MAX_SUBSCRIPTIONS];
+    for(size_t i = 0; i < CNCM_RX_MAX_SUBSCRIPTIONS && subscription->id != 0 &&
+        now - subscription->last_read_us < CNCM_RX_SUBSCRIPTION_IDLE_S * 1000000LL; i++)
+    {
+        next_subscription_id++;
+        if(next_subscription_id == 0) next_subscription_id = 1;
+        subscription = &subscriptions[next_subscription_id % CNCM_RX_MAX_SUBSCRIPTIONS];
+    }
+    if(subscription->id != 0 && now - subscription->last_read_us < CNCM_RX_SUBSCRIPTION_IDLE_S * 1000000LL)
+    {
+        xSemaphoreGive(subscriptions_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    if(subscription->id != 0) ESP_LOGI(TAG, "Subscription %" PRIu32 " expired.", subscription->id);
+    slot_write_begin(subscription);
+    subscription->id = next_subscription_id++;
+    if(next_subscription_id == 0) next_subscription_id = 1;
+    subscription->filter = *filter;
+    //Only new output, the lines already indexed don't carry this subscription's bit.
+    subscription->created_at = cncm_rx_head();
+    slot_write_end(subscription);
+    subscription->cursor = subscription->created_at;
+    subscription->last_read_us = now;
+    *subscription_id = subscription->id;
+    xSemaphoreGive(subscriptions_lock);
+    ESP_LOGI(TAG, "Subscription %" PRIu32 " created.", *subscription_id);
+    return ESP_OK;
+}
+
+esp_err_t cncm_rx_unsubscribe(uint32_t subscription_id)
+{
+    if(subscriptions_lock == NULL) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    subscription_t* subscription = subscription_find(subscription_id);
+    if(subscription != NULL)
+    {
+        slot_write_begin(subscription);
+        subscription->id = 0;
+        slot_write_end(subscription);
+    }
+    xSemaphoreGive(subscriptions_lock);
+    return (subscription == NULL) ? ESP_ERR_NOT_FOUND : ESP_OK;
+}
+
+esp_err_t cncm_rx_subscription_get(uint32_t subscription_id, cncm_rx_subscription_info_t* info)
+{
+    if(subscriptions_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(info == NULL) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    subscription_t* subscription = subscription_find(subscription_id);
+    if(subscription != NULL)
+    {
+        info->id = subscription->id;
+        info->filter = subscription->filter;
+        info->cursor = subscription->cursor;
+        //Nothing was counted yet if the tally still belongs to the slot's previous subscription.
+        subscription_tally_t* tally = &tallies[subscription - subscriptions];
+        bool counted = __atomic_load_n(&tally->id, __ATOMIC_ACQUIRE) == subscription_id;
+        info->lines_passed = counted ? __atomic_load_n(&tally->lines_passed, __ATOMIC_RELAXED) : 0;
+        info->lines_filtered = counted ? __atomic_load_n(&tally->lines_filtered, __ATOMIC_RELAXED) : 0;
+    }
+    xSemaphoreGive(subscriptions_lock);
+    return (subscription == NULL) ? ESP_ERR_NOT_FOUND : ESP_OK;
+}
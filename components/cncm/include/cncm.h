@@ -11,7 +11,6 @@
 
 #define CNCM_TX_BUFFER_CAPACITY (1024 * 1024)    //4 MiB
 #define CNCM_RX_BUFFER_CAPACITY (1024 * 600)    //1 MiB, External memeory must have at least RX_BUFFER_CAPACITY free.
-#define CNCM_RX_BUFFER_TRIGGER_LEVEL (32)
 #define CNCM_TX_CONSUMER_PRIORITY (ESP_TASK_MAIN_PRIO + 1)
 #define CNCM_USB_HOST_PRIORITY (CNCM_TX_CONSUMER_PRIORITY + 1)
 #define CNCM_USB_DEVICE_VID (CDC_HOST_ANY_VID)
@@ -23,12 +22,263 @@
 #define CNCM_TX_TIMEOUT_MS (1000)
 #define CNCM_TX_CONSUMER_STACK_SIZE (4096)
 #define CNCM_USB_EVENT_STACK_SIZE (4096)
-#define CNCM_MACHINE_OPEN_STACK_SIZE (4096)
+#define CNCM_MACHINE_MANAGER_STACK_SIZE (4096)
 #define CNCM_CDC_DRIVER_STACK_SIZE (4096)
 #define CNCM_DEFAULT_BAUDRATE (115200)
+#define CNCM_BAUDRATE_AUTO (0)  // Probe the fastest working baudrate at every connect.
+#define CNCM_BAUD_PROBE_ROUNDS (3)  // Consecutive clean round trips needed to accept a baudrate.
+#define CNCM_BAUD_PROBE_TIMEOUT_MS (250)
+#define CNCM_BAUD_PROBE_QUIET_MS (200)  // Silence expected on the line before probing starts.
+#define CNCM_BAUD_PROBE_SETTLE_MAX_MS (3000)
+#define CNCM_BAUD_PROBE_POLL_MS (10)
+#define CNCM_BAUD_PROBE_LINE_SIZE (96)
+#define CNCM_OPEN_TIMEOUT_MS (100)  // How long a single open attempt waits for a device to show up.
+#define CNCM_OPEN_MAX_ATTEMPTS (5)
+#define CNCM_OPEN_RETRY_DELAY_MS (20)   // Doubled after every failed attempt.
+#define CNCM_LINK_PROBE_PERIOD_MS (5000)    // Fallback probe while disconnected, in case an attach event was missed.
 #define CNCM_PRINTER_CONNECTED_LED GPIO_NUM_37
+#define CNCM_MACRO_PREFIX '@'   // A command starting with this invokes a stored macro, e.g. "@preheat 200 60".
+#define CNCM_MAX_MACRO_NAME_SIZE (15)   // NVS key length limit.
+#define CNCM_MAX_MACRO_SIZE (3900)  // Below the NVS string limit.
+#define CNCM_MAX_MACRO_ARGS (9)
+#define CNCM_MAX_MACRO_EXPANSION_SIZE (8192)
+#define CNCM_NO_JOB_SLOT (0xFF)
+#define CNCM_MAX_JOBS (16)  // Jobs remembered at once, including finished ones.
+#define CNCM_MAX_JOB_NAME_SIZE (31)
+#define CNCM_MAX_IN_FLIGHT_LINES (256)  // Lines sent and not acknowledged yet that can be matched to their jobs.
+#define CNCM_ACK_RING_CAPACITY (16 * 1024)  // Acks and their output on their way from the rx callback, in PSRAM.
+#define CNCM_ACK_CONSUMER_STACK_SIZE (4096)
+#define CNCM_ACK_CONSUMER_PRIORITY (CNCM_TX_CONSUMER_PRIORITY)
+#define CNCM_RX_LINE_SIZE (256)
+#define CNCM_RX_SCAN_WORDS (1)   // Look for line breaks in the machine output a word at a time, 0 for a byte at a time.
+#define CNCM_CHECKPOINT_DEFAULT_INTERVAL_S (10)   // At most one checkpoint write per interval, and only if it changed.
+#define CNCM_CHECKPOINT_MAX_INTERVAL_S (3600)
+#define CNCM_CHECKPOINT_WRITER_STACK_SIZE (3072)
+#define CNCM_CHECKPOINT_WRITER_PRIORITY (ESP_TASK_MAIN_PRIO)
+#define CNCM_RESUME_PREAMBLE_SIZE (512)
+#define CNCM_MAX_STATUS_QUERIES (8)     // Idempotent queries of a dialect that can be coalesced.
+#define CNCM_QUERY_ANSWER_SIZE (192)    // Last answer kept per query, longer ones are cut.
+#define CNCM_DEFAULT_QUERY_FRESHNESS_MS (1000)  // An answer this recent is shared instead of asking again.
+#define CNCM_MAX_QUERY_FRESHNESS_MS (60000)
+#define CNCM_SD_MAX_BLOCK_SIZE (512)    // Payload of a binary file transfer packet, lowered to what the firmware reports.
+#define CNCM_SD_MAX_FILENAME_SIZE (63)
+#define CNCM_SD_REPLY_TIMEOUT_MS (1000) // A packet that isn't acknowledged within this is sent again.
+#define CNCM_SD_MAX_RETRIES (10)        // Resends and timeouts of one packet in a row before the transfer fails.
+#define CNCM_SD_DRAIN_TIMEOUT_MS (30000)    // Time given to the lines in flight to be acknowledged before a transfer.
+#define CNCM_SD_DRAIN_QUIET_MS (200)
+#define CNCM_ARC_DEFAULT_TOLERANCE_MM (0.05f)   // Largest distance allowed between a fitted arc and the lines it replaces.
+#define CNCM_ARC_MIN_TOLERANCE_MM (0.001f)
+#define CNCM_ARC_MAX_TOLERANCE_MM (1.0f)
+#define CNCM_ARC_MAX_RADIUS_MM (1000.0f)    // Flatter runs are left as lines.
+#define CNCM_ARC_MIN_SEGMENTS (3)           // G1 lines an arc replaces at least.
+#define CNCM_ARC_MAX_SEGMENTS (32)          // Lines held back at most while fitting.
+#define CNCM_ARC_MAX_LINE_SIZE (64)         // Longer G1 lines are never fitted.
+#define CNCM_ARC_EXTRUSION_TOLERANCE (0.05f)    // Relative spread of extrusion per mm between the lines of one arc.
+#define CNCM_RX_MAX_SUBSCRIPTIONS (8)   // Filtered readers of the rx_queue at once, one bit each in the line index.
+#define CNCM_RX_FILTER_MAX_PREFIXES (4) // Per list.
+#define CNCM_RX_FILTER_PREFIX_SIZE (23)
+#define CNCM_RX_LINE_INDEX_SIZE (8192)  // Lines of machine output indexed for subscriptions, a power of two.
+#define CNCM_RX_SUBSCRIPTION_IDLE_S (600)   // A subscription not read for this long may be given to a new client.
+#define CNCM_MAX_TRACKED_COMMANDS (128) // Results of submitted commands kept at once, those waiting for their ack included.
+#define CNCM_CMD_RESPONSE_SIZE (95)     // Machine output kept per command, longer is cut.
+#define CNCM_CMD_MAX_WAITERS (4)        // Callers woken up on completions, more poll.
+#define CNCM_CMD_WAIT_POLL_MS (20)
+#define CNCM_LOG_PARTITION_LABEL "rxlog"   // Data partition holding the output log, the log is unavailable without it.
+#define CNCM_LOG_STAGING_SIZE (32768)   // Output waiting to be written to flash, a power of two. More is dropped.
+#define CNCM_LOG_FLUSH_MS (2000)        // Output staged for this long is written even if it doesn't fill a flash page.
+#define CNCM_LOG_EVENT_SIZE (128)
+#define CNCM_LOG_WRITER_STACK_SIZE (3072)
+#define CNCM_LOG_WRITER_PRIORITY (ESP_TASK_MAIN_PRIO)
 
 
+// Firmware protocol of the machine: line coding, how lines are acknowledged, status queries and emergency stop.
+typedef enum {
+    CNCM_DIALECT_MARLIN,
+    CNCM_DIALECT_GRBL,
+    CNCM_DIALECT_REPRAP,    // RepRapFirmware.
+    CNCM_DIALECT_KLIPPER,   // Klipper's G-code terminal.
+    CNCM_DIALECT_COUNT
+} cncm_dialect_t;
+
+// What a line from the machine is, flags since e.g. "ok T:20.0 /0.0" is both an ack and a status report.
+#define CNCM_LINE_OTHER (0)
+#define CNCM_LINE_ACK (1 << 0)      // Completes the oldest line in flight.
+#define CNCM_LINE_STATUS (1 << 1)   // Answer to the dialect's status query, or an auto report.
+#define CNCM_LINE_ERROR (1 << 2)
+
+// Line classes a response subscription can pass, each line has exactly one.
+#define CNCM_RX_CLASS_ACK (1 << 0)      // "ok" without a status report.
+#define CNCM_RX_CLASS_STATUS (1 << 1)   // Temperature or position report, "ok T:..." included.
+#define CNCM_RX_CLASS_ERROR (1 << 2)
+#define CNCM_RX_CLASS_BUSY (1 << 3)     // "echo:busy: processing" and other keepalives.
+#define CNCM_RX_CLASS_OTHER (1 << 4)
+#define CNCM_RX_CLASS_ALL (0x1F)
+
+typedef enum {
+    CNCM_CMD_QUEUED,    // In the tx_queue.
+    CNCM_CMD_SENT,      // Sent, waiting for the ack of each of its lines.
+    CNCM_CMD_OK,        // All its lines acknowledged.
+    CNCM_CMD_ERROR,     // All its lines acknowledged, with an error line before the ack of one of them.
+    CNCM_CMD_LOST,      // Sent but never acknowledged, the machine was disconnected or stopped acking.
+    CNCM_CMD_DROPPED    // The tx_queue was cleared before it was sent.
+} cncm_cmd_state_t;
+
+typedef struct {
+    uint32_t id;                // 0 if the command isn't tracked (anymore).
+    cncm_cmd_state_t state;
+    int64_t queued_us;          // Times since boot, 0 until then.
+    int64_t sent_us;
+    int64_t completed_us;
+    char response[CNCM_CMD_RESPONSE_SIZE + 1];  // Lines the machine sent up to each ack of the command, ack included.
+} cncm_cmd_result_t;
+
+typedef enum {
+    CNCM_LINK_DISCONNECTED,
+    CNCM_LINK_OPENING,
+    CNCM_LINK_CONNECTED
+} cncm_link_state_t;
+
+typedef struct {
+    cncm_link_state_t state;
+    uint32_t baudrate;              // Baudrate in use, the detected one in auto mode.
+    uint32_t reconnects;            // Successful opens after a disconnect or a config reset.
+    uint32_t failed_opens;          // Open or line configuration attempts that failed.
+    int64_t last_reconnect_us;      // Time from the last disconnect to the device being usable again.
+    int64_t max_reconnect_us;
+    int64_t last_attach_to_open_us; // Time from the last USB enumeration to the device being usable.
+} cncm_link_stats_t;
+
+typedef enum {
+    CNCM_JOB_QUEUED,    // Waiting for the lines before it in the tx_queue.
+    CNCM_JOB_RUNNING,   // Its first line was taken by tx_consumer.
+    CNCM_JOB_FINISHED,  // Closed and all its lines acknowledged (or lost to a disconnect).
+    CNCM_JOB_CANCELLED
+} cncm_job_state_t;
+
+typedef struct {
+    uint32_t id;
+    char name[CNCM_MAX_JOB_NAME_SIZE + 1];
+    cncm_job_state_t state;
+    bool closed;                // No more lines will be appended, so the totals are final.
+    uint32_t total_lines;
+    uint64_t total_bytes;
+    uint32_t lines_sent;
+    uint64_t bytes_sent;
+    uint32_t lines_acked;
+    uint32_t lines_lost;        // Sent but never acknowledged because the machine was disconnected.
+    int64_t created_us;         // Times since boot.
+    int64_t started_us;
+    int64_t finished_us;
+    float ack_rate;             // Acknowledged lines per second since the job started.
+    int64_t eta_us;             // Estimated time left from the ack rate, -1 if unknown (not running or not closed).
+} cncm_job_info_t;
+
+// Modal state of the machine as of a line, tracked from the G-code sent, enough to restore it on resume.
+typedef struct {
+    float x, y, z, e;           // Last commanded position, in the units in effect.
+    float feedrate;
+    int16_t hotend_target;      // Degrees, 0 if off.
+    int16_t bed_target;
+    uint16_t spindle_speed;
+    uint8_t spindle;            // 0 off, 3 clockwise (M3), 4 counter-clockwise (M4).
+    uint8_t fan;                // 0-255.
+    uint8_t tool;
+    bool absolute;              // G90, G91 otherwise.
+    bool absolute_e;            // M82, M83 otherwise.
+    bool inches;                // G20, G21 otherwise.
+} cncm_modal_state_t;
+
+typedef struct {
+    uint32_t job_id;            // Id in the boot it was saved in, ids start over at every boot.
+    char name[CNCM_MAX_JOB_NAME_SIZE + 1];
+    uint32_t line;              // Lines of the job completed (acknowledged, or lost before a later one was), as sent to
+                                // the machine: a macro counts its expanded lines, a fitted arc the lines it replaced.
+                                // A resume continues at the next one.
+    cncm_modal_state_t state;   // As of that line.
+} cncm_checkpoint_t;
+
+typedef struct {
+    uint32_t interval_s;
+    uint32_t writes;            // Checkpoints written to flash since boot, including erases.
+    int64_t last_write_us;      // Time spent writing and committing the last one.
+    int64_t max_write_us;
+    int64_t total_write_us;
+    uint32_t lag_lines;         // Lines completed since the stored checkpoint, that a power loss now would replay.
+} cncm_checkpoint_stats_t;
+
+typedef struct {
+    const char* query;          // e.g. "M105".
+    bool pending;               // In the tx_queue or waiting for its ack.
+    int64_t answered_us;        // Time since boot of the last answer, 0 if never answered.
+    char answer[CNCM_QUERY_ANSWER_SIZE];    // Lines the machine sent up to and including the ack, '\n' separated.
+    uint32_t sent;              // Times it was actually sent to the machine.
+    uint32_t coalesced;         // Times it was asked while pending or fresh, and not sent.
+} cncm_query_info_t;
+
+typedef enum {
+    CNCM_SD_IDLE,           // No transfer since boot.
+    CNCM_SD_TRANSFERRING,
+    CNCM_SD_DONE,
+    CNCM_SD_FAILED,
+    CNCM_SD_ABORTED
+} cncm_sd_state_t;
+
+typedef struct {
+    cncm_sd_state_t state;
+    char filename[CNCM_SD_MAX_FILENAME_SIZE + 1];
+    uint64_t bytes;             // Written to the file and acknowledged.
+    uint32_t packets;           // Acknowledged, control packets included.
+    uint32_t resends;           // Packets sent again because the firmware asked for it.
+    uint32_t timeouts;          // Packets sent again because no answer came.
+    uint16_t block_size;        // Payload per packet agreed on with the firmware.
+    bool compression_available; // The firmware reported heatshrink support, unused for now.
+    int64_t started_us;         // Times since boot, finished_us is 0 while transferring.
+    int64_t finished_us;
+    float bytes_per_s;          // Average since the file was opened.
+    esp_err_t error;            // Why the transfer failed, ESP_OK otherwise.
+} cncm_sd_stats_t;
+
+typedef struct {
+    bool enabled;
+    float tolerance_mm;
+    uint32_t lines_in;          // Job lines seen by the fitter since boot, while it was enabled.
+    uint32_t lines_out;         // Lines it queued for them, arcs included.
+    uint32_t arcs;              // G2/G3 lines queued.
+    uint32_t arc_segments;      // G1 lines replaced by those arcs.
+    uint32_t lines_held;        // Held back right now, waiting to see if the next line continues the arc.
+    float compression_ratio;    // Lines in per line out, 1 if nothing was queued yet.
+} cncm_arc_stats_t;
+
+// A line passes if it starts with none of exclude, and starts with one of include or is of one of the classes. Prefixes
+// are case sensitive, unused ones empty. Empty lines never pass.
+typedef struct {
+    uint8_t classes;            // CNCM_RX_CLASS_* bits.
+    uint32_t status_interval_ms;    // At most one status line per interval, by arrival time, 0 for all of them.
+    char include[CNCM_RX_FILTER_MAX_PREFIXES][CNCM_RX_FILTER_PREFIX_SIZE + 1];
+    char exclude[CNCM_RX_FILTER_MAX_PREFIXES][CNCM_RX_FILTER_PREFIX_SIZE + 1];
+} cncm_rx_filter_t;
+
+typedef struct {
+    uint32_t id;
+    cncm_rx_filter_t filter;
+    uint64_t cursor;            // Next rx_queue offset it reads from.
+    uint32_t lines_passed;      // Since it was created.
+    uint32_t lines_filtered;
+} cncm_rx_subscription_info_t;
+
+// Log offsets count every byte logged since the partition was first used, they don't change across reboots.
+typedef struct {
+    bool available;             // The partition exists.
+    bool enabled;
+    uint64_t capacity;          // Bytes kept at most, older ones are overwritten.
+    uint64_t start;             // Offset of the oldest byte still readable.
+    uint64_t end;               // Offset past the newest byte written to flash.
+    uint32_t staged;            // Bytes waiting to be written.
+    uint64_t dropped_bytes;     // Since boot, because the staging buffer was full or a write failed.
+    uint32_t pages_written;     // Full flash pages, since boot.
+    uint32_t sectors_erased;    // Since boot.
+} cncm_log_stats_t;
+
 /**
  * @brief Initializes the USB host and the CDC-ACM driver. Must be called first before any function in this file.
  * TODO: put return codes.
@@ -37,15 +287,71 @@ esp_err_t cncm_init();
 
 /**
  * @brief Adds a message to the tx_queue.
+ * If it starts with CNCM_MACRO_PREFIX, the stored macro is expanded and all of its lines are added, or none of them.
  * @param to_send [IN] string to add to the tx_queue.
- * @return ESP_ERR_INVALID_ARG if the command is empty or oversized. 
+ * @return ESP_ERR_INVALID_ARG if the command is empty or oversized, or the macro can't be expanded.
  * @return EPS_ERR_NO_MEM if memory allocation failed.
  * @return ESP_OK otherwise. 
  */
 esp_err_t cncm_tx_producer(const char* command);
 
 /**
- * @brief Reads from the rx_queue all responses that are available.
+ * @brief Same as cncm_tx_producer(), but an idempotent status query of the dialect (e.g. M105, M114, M27 for Marlin)
+ * isn't queued if the same query is already pending, or was answered within the query freshness window: all the
+ * requesters then share the one answer, in the responses and through cncm_query_list().
+ * Lines that hosts count acks for (e.g. from the TCP serial bridge) must go through cncm_tx_producer() instead.
+ * @param coalesced [OUT] set to true if the command wasn't queued because of an identical one, may be NULL.
+ * @return same as cncm_tx_producer().
+ */
+esp_err_t cncm_tx_producer_coalesce(const char* command, bool* coalesced);
+
+/**
+ * @brief Adds several messages to the tx_queue, all of them or none of them.
+ * Everything is validated, macros expanded, and the space they need checked before the first one is added.
+ * @param commands [IN] strings to add to the tx_queue, in order.
+ * @param commands_count number of strings in commands.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_INVALID_ARG if any command is empty or oversized, or a macro can't be expanded.
+ * @return ESP_ERR_NO_MEM if they don't all fit in the tx_queue, or memory allocation failed.
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_tx_producer_batch(const char* const* commands, size_t commands_count);
+
+/**
+ * @brief Same as cncm_tx_producer_batch(), but its status queries are coalesced like cncm_tx_producer_coalesce() does.
+ * The space checked is still that of all the commands.
+ * @param coalesced_count [OUT] number of commands that weren't queued because of an identical query.
+ * @return ESP_ERR_INVALID_ARG if coalesced_count is NULL.
+ * @return same as cncm_tx_producer_batch() otherwise.
+ */
+esp_err_t cncm_tx_producer_batch_coalesce(const char* const* commands, size_t commands_count, size_t* coalesced_count);
+
+/**
+ * @brief Same as cncm_tx_producer_batch(), and tracks the commands: each gets an id, its lines are matched to their
+ * acks, and the machine's output and errors before each ack are kept as its result. Never coalesced.
+ * @param first_id [OUT] id of the first command, the others follow in order.
+ * @return ESP_ERR_INVALID_ARG if there are no commands or more than CNCM_MAX_TRACKED_COMMANDS.
+ * @return ESP_ERR_NO_MEM if they don't fit in the tx_queue, or the result slots they need are still pending.
+ * @return same as cncm_tx_producer_batch() otherwise.
+ */
+esp_err_t cncm_tx_submit(const char* const* commands, size_t commands_count, uint32_t* first_id);
+
+/**
+ * @brief Gets the results of consecutive submitted commands, waiting for them to complete.
+ * @param first_id [IN] id of the first command.
+ * @param count [IN] 1 to CNCM_MAX_TRACKED_COMMANDS.
+ * @param timeout_ms [IN] how long to wait for the pending ones, 0 to return right away.
+ * @param results [OUT] array of count entries, an unknown command's has id 0.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if an argument is invalid.
+ * @return ESP_ERR_NOT_FOUND if a command was never submitted or its result was given to a later one.
+ * @return ESP_ERR_TIMEOUT if some are still pending, ESP_OK otherwise.
+ */
+esp_err_t cncm_tx_results(uint32_t first_id, size_t count, uint32_t timeout_ms, cncm_cmd_result_t* results);
+
+const char* cncm_cmd_state_name(cncm_cmd_state_t state);
+
+/**
+ * @brief Reads from the rx_queue all responses that are available since the last call, using a cursor shared by all callers.
  * @param to_receive [OUT] the destination buffer.
  * @param response_size [OUT] pointer to the size of the response.
  * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
@@ -55,12 +361,76 @@ esp_err_t cncm_tx_producer(const char* command);
  */
 esp_err_t cncm_rx_consumer(uint8_t* to_receive, size_t* response_size, size_t max_response_size);
 
+/**
+ * @brief Reads responses starting at the caller's own cursor, reading doesn't remove them from the rx_queue so any number
+ * of readers can follow the output independently.
+ * @param cursor [IN/OUT] byte offset of the first byte to read (0 on first call), advanced past the bytes returned.
+ * A cursor ahead of the rx_queue (e.g. kept from before a reboot) restarts from the oldest byte still held.
+ * @param to_receive [OUT] the destination buffer.
+ * @param response_size [OUT] pointer to the size of the response.
+ * @param max_response_size [IN] maximum number of bytes to copy into to_receive.
+ * @param lost_bytes [OUT] number of bytes after the cursor that were overwritten before being read, may be NULL.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_INVALID_ARG if cursor, to_receive or response_size is NULL.
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_rx_read(uint64_t* cursor, uint8_t* to_receive, size_t* response_size, size_t max_response_size, uint64_t* lost_bytes);
+
+/**
+ * @brief Gets the offset of the next byte to be received, a cursor starting there only reads new output.
+ * @return the offset, or 0 if cncm was not initialized.
+ */
+uint64_t cncm_rx_head();
+
+/**
+ * @brief Registers a filter on the machine output, applied to every line as it's received, only new output is seen.
+ * @param subscription [OUT] id of the subscription, never 0.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if an argument is invalid.
+ * @return ESP_ERR_NO_MEM if CNCM_RX_MAX_SUBSCRIPTIONS subscriptions were all read within CNCM_RX_SUBSCRIPTION_IDLE_S.
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_rx_subscribe(const cncm_rx_filter_t* filter, uint32_t* subscription);
+
+/**
+ * @brief Removes a subscription.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_NOT_FOUND if there is no such subscription.
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_rx_unsubscribe(uint32_t subscription);
+
+/**
+ * @brief Reads the whole lines that passed a subscription's filter, from the subscription's own cursor.
+ * @param to_receive [OUT] the destination buffer, lines are copied as the machine sent them, terminators included.
+ * @param response_size [OUT] number of bytes copied, at most max_response_size. A line longer than that is cut.
+ * @param cursor [OUT] rx_queue offset the next read starts from.
+ * @param lost_bytes [OUT] bytes overwritten before they were read, may be NULL.
+ * @param filtered_bytes [OUT] bytes of the lines the filter dropped in this read, may be NULL.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if a required argument is NULL.
+ * @return ESP_ERR_NOT_FOUND if there is no such subscription, ESP_OK otherwise.
+ */
+esp_err_t cncm_rx_read_filtered(uint32_t subscription, uint8_t* to_receive, size_t* response_size,
+                                size_t max_response_size, uint64_t* cursor, uint64_t* lost_bytes, uint64_t* filtered_bytes);
+
+/**
+ * @brief Gets a subscription's filter and counters.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if info is NULL.
+ * @return ESP_ERR_NOT_FOUND if there is no such subscription, ESP_OK otherwise.
+ */
+esp_err_t cncm_rx_subscription_get(uint32_t subscription, cncm_rx_subscription_info_t* info);
+
 /**
  * @brief returns true if a device is connected and false otherwise.
  * @return true if the device is open and returns false otherwise including the case if cncm was not initialized.
  */
 bool cncm_is_open();
 
+/**
+ * @brief Checks if the machine is being driven: lines are waiting in the tx_queue or for their "ok". Output the
+ * machine sends on its own (e.g. temperature auto-reports) doesn't make it busy.
+ * @return false if cncm was not initialized or it's idle, true otherwise.
+ */
+bool cncm_is_busy();
+
 /**
  * @brief clears the tx_buffer.
  * @return ESP_ERR_INVALID_STATE if cncm was not initialized. 
@@ -87,8 +457,300 @@ esp_err_t cncm_resume();
 
 /**
  * @brief changes the baudrate and reopens the machine with the new baudrate. At most blocks for CNCM_TX_TIMEOUT_MS.
+ * @param baudrate [IN] the new baudrate, or CNCM_BAUDRATE_AUTO to probe for the fastest working one at every connect.
  * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
- * @return Error codes of pause().
+ * @return NVS error codes, or error codes of pause().
  * @return ESP_OK otherwise.
  */
 esp_err_t cncm_reset_machine_config(uint32_t baudrate);
+
+/**
+ * @brief Changes the dialect and/or the baudrate, stores both persistently and reopens the machine once with them.
+ * While the machine is unplugged nothing is reopened, the next connect uses them. At most blocks for CNCM_TX_TIMEOUT_MS.
+ * @param dialect [IN] the new dialect, NULL keeps the current one.
+ * @param baudrate [IN] the new baudrate or CNCM_BAUDRATE_AUTO, NULL keeps the current one.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_INVALID_ARG if dialect is out of range.
+ * @return NVS error codes, or error codes of pause().
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_set_machine_config(const cncm_dialect_t* dialect, const uint32_t* baudrate);
+
+/**
+ * @brief Gets the machine connection state and reconnect latency metrics.
+ * @param stats [OUT] filled with a copy of the current link statistics.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_INVALID_ARG if stats is NULL.
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_get_link_stats(cncm_link_stats_t* stats);
+
+/**
+ * @brief Changes the firmware dialect, stored persistently, and reopens the machine with its line coding.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_INVALID_ARG if dialect is out of range.
+ * @return NVS error codes, or error codes of pause().
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_set_dialect(cncm_dialect_t dialect);
+
+cncm_dialect_t cncm_get_dialect();
+
+/**
+ * @brief Gets the short name of a dialect, e.g. "marlin".
+ */
+const char* cncm_dialect_name(cncm_dialect_t dialect);
+
+/**
+ * @brief Looks a dialect up by its short name.
+ * @return ESP_ERR_NOT_FOUND if there is no such dialect, ESP_ERR_INVALID_ARG if an argument is NULL, ESP_OK otherwise.
+ */
+esp_err_t cncm_dialect_from_name(const char* name, cncm_dialect_t* dialect);
+
+/**
+ * @brief Asks the machine for its status the way its dialect does it: realtime queries (GRBL's '?') are written
+ * straight to the machine, others (M105, M408) are queued behind the lines already in the tx_queue.
+ * The answer shows up in the responses like any other output.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, or the machine isn't connected for a realtime query.
+ * @return error codes of cncm_tx_producer() or of the USB transfer otherwise.
+ */
+esp_err_t cncm_status_query();
+
+/**
+ * @brief Drops everything in the tx_queue and writes the dialect's emergency stop (M112, or Ctrl-X for GRBL) straight
+ * to the machine, ahead of anything queued and even while paused. Lines in flight are counted as lost.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized or the machine isn't connected.
+ * @return error codes of the USB transfer otherwise.
+ */
+esp_err_t cncm_emergency_stop();
+
+/**
+ * @brief Changes how recent an answer to a status query must be to be shared instead of asking again, stored persistently.
+ * @param freshness_ms [IN] 0 (only coalesce pending queries) to CNCM_MAX_QUERY_FRESHNESS_MS.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if out of range.
+ * @return NVS error codes, ESP_OK otherwise.
+ */
+esp_err_t cncm_query_set_freshness(uint32_t freshness_ms);
+
+uint32_t cncm_query_get_freshness();
+
+/**
+ * @brief Gets the status queries of the current dialect, with their last answer and coalescing counters.
+ * @param infos [OUT] array of at least CNCM_MAX_STATUS_QUERIES entries.
+ * @param infos_count [OUT] number of entries filled.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if an argument is NULL, ESP_OK otherwise.
+ */
+esp_err_t cncm_query_list(cncm_query_info_t* infos, size_t* infos_count);
+
+/**
+ * @brief Configures arc fitting of job lines, stored persistently. While enabled, runs of short G1 lines of a job that
+ * stay within the tolerance of a circle are queued as one G2/G3, which the firmware must support (e.g. Marlin's
+ * ARC_SUPPORT, Klipper's [gcode_arcs]). Extrusion is kept, job progress still counts the original lines.
+ * @param enabled [IN] disabled by default.
+ * @param tolerance_mm [IN] CNCM_ARC_MIN_TOLERANCE_MM to CNCM_ARC_MAX_TOLERANCE_MM, rounded to micrometers.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if out of range.
+ * @return ESP_ERR_NO_MEM if the lines held by the arc fitter don't fit the tx_queue yet, nothing is changed.
+ * @return NVS error codes, ESP_OK otherwise.
+ */
+esp_err_t cncm_arc_set_config(bool enabled, float tolerance_mm);
+
+/**
+ * @brief Gets the arc fitting configuration and counters.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if stats is NULL, ESP_OK otherwise.
+ */
+esp_err_t cncm_arc_get_stats(cncm_arc_stats_t* stats);
+
+/**
+ * @brief Stores a macro persistently, replacing any macro with the same name.
+ * @param name [IN] up to CNCM_MAX_MACRO_NAME_SIZE letters, digits, '_' or '-'.
+ * @param body [IN] lines separated by CNCM_COMMAND_SEPARATOR, $1 ... $9 are replaced by the invocation arguments and $$ by '$'.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_INVALID_ARG if the name is invalid.
+ * @return ESP_ERR_INVALID_SIZE if the body is empty or longer than CNCM_MAX_MACRO_SIZE.
+ * @return NVS error codes, ESP_OK otherwise.
+ */
+esp_err_t cncm_macro_set(const char* name, const char* body);
+
+/**
+ * @brief Reads a stored macro.
+ * @param body [OUT] destination buffer, NULL terminated.
+ * @return ESP_ERR_NOT_FOUND if there is no such macro.
+ * @return ESP_ERR_INVALID_SIZE if body_size is too small.
+ * @return ESP_ERR_INVALID_STATE, ESP_ERR_INVALID_ARG like cncm_macro_set(), ESP_OK otherwise.
+ */
+esp_err_t cncm_macro_get(const char* name, char* body, size_t body_size);
+
+/**
+ * @brief Deletes a stored macro.
+ * @return ESP_ERR_NOT_FOUND if there is no such macro.
+ * @return ESP_ERR_INVALID_STATE, ESP_ERR_INVALID_ARG like cncm_macro_set(), ESP_OK otherwise.
+ */
+esp_err_t cncm_macro_delete(const char* name);
+
+/**
+ * @brief Lists the names of the stored macros.
+ * @param names [OUT] array of at least max_names names.
+ * @param names_count [OUT] number of names written.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, NVS error codes, ESP_OK otherwise.
+ */
+esp_err_t cncm_macro_list(char names[][CNCM_MAX_MACRO_NAME_SIZE + 1], size_t max_names, size_t* names_count);
+
+/**
+ * @brief Creates a job, lines appended to it are queued behind everything already in the tx_queue, so jobs run
+ * back-to-back in creation order.
+ * @param name [IN] label of the job, truncated to CNCM_MAX_JOB_NAME_SIZE.
+ * @param job_id [OUT] id of the new job, never 0.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_NO_MEM if CNCM_MAX_JOBS jobs are still pending or running.
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_job_create(const char* name, uint32_t* job_id);
+
+/**
+ * @brief Adds a line (or a macro invocation) of a job to the tx_queue.
+ * @return ESP_ERR_NOT_FOUND if there is no such job.
+ * @return ESP_ERR_INVALID_STATE if the job is closed, finished or cancelled.
+ * @return error codes of cncm_tx_producer() otherwise.
+ */
+esp_err_t cncm_job_append(uint32_t job_id, const char* command);
+
+/**
+ * @brief Marks that all lines of a job were appended, the job finishes when they are all acknowledged.
+ * @return ESP_ERR_NOT_FOUND if there is no such job, ESP_ERR_INVALID_STATE if it's over.
+ * @return ESP_ERR_NO_MEM if the lines held by the arc fitter don't fit the tx_queue yet, the job stays open.
+ * @return ESP_OK otherwise.
+ */
+esp_err_t cncm_job_close(uint32_t job_id);
+
+/**
+ * @brief Cancels a job, its lines still in the tx_queue are dropped instead of being sent.
+ * @return ESP_ERR_NOT_FOUND if there is no such job, ESP_ERR_INVALID_STATE if it's over, ESP_OK otherwise.
+ * @note Clearing the tx_queue cancels every job that had lines in it or wasn't closed.
+ */
+esp_err_t cncm_job_cancel(uint32_t job_id);
+
+/**
+ * @brief Gets the progress of a job.
+ * @return ESP_ERR_NOT_FOUND if there is no such job (or it was forgotten), ESP_OK otherwise.
+ */
+esp_err_t cncm_job_get(uint32_t job_id, cncm_job_info_t* info);
+
+/**
+ * @brief Gets the progress of all remembered jobs, oldest first.
+ * @param infos [OUT] array of at least max_infos entries.
+ * @param infos_count [OUT] number of entries filled.
+ */
+esp_err_t cncm_job_list(cncm_job_info_t* infos, size_t max_infos, size_t* infos_count);
+
+/**
+ * @brief Gets the checkpoint stored in flash, that survives a reboot: the last completed line of the job that was
+ * running, and the machine's modal state as of that line. It's written at most every checkpoint interval, and
+ * discarded when the job finishes without losing lines or is cancelled.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_INVALID_ARG if checkpoint is NULL.
+ * @return ESP_ERR_NOT_FOUND if there is no checkpoint, ESP_OK otherwise.
+ */
+esp_err_t cncm_checkpoint_get(cncm_checkpoint_t* checkpoint);
+
+/**
+ * @brief Gets the checkpoint write cost and how far the stored checkpoint lags behind.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if stats is NULL, ESP_OK otherwise.
+ */
+esp_err_t cncm_checkpoint_get_stats(cncm_checkpoint_stats_t* stats);
+
+/**
+ * @brief Changes how often the checkpoint may be written, stored persistently. Longer intervals write less (the NVS
+ * partition wears with every write), shorter ones replay fewer lines after a power loss.
+ * @param interval_s [IN] 1 to CNCM_CHECKPOINT_MAX_INTERVAL_S.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if out of range.
+ * @return NVS error codes, ESP_OK otherwise.
+ */
+esp_err_t cncm_checkpoint_set_interval(uint32_t interval_s);
+
+/**
+ * @brief Erases the stored checkpoint.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, NVS error codes, ESP_OK otherwise.
+ */
+esp_err_t cncm_checkpoint_discard();
+
+/**
+ * @brief Creates a job that resumes the stored checkpoint: the dialect's resume preamble (heat up, home X and Y, restore
+ * the position and the modal state) is queued in it, the caller then appends the lines of the original job starting
+ * after checkpoint line resume_line. The new job checkpoints in the original job's line numbers.
+ * @param job_id [OUT] id of the new job, left open.
+ * @param resume_line [OUT] lines of the original job already done, skip that many.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized.
+ * @return ESP_ERR_NOT_FOUND if there is no checkpoint.
+ * @return error codes of cncm_job_create() or cncm_tx_producer() otherwise.
+ */
+esp_err_t cncm_job_resume(uint32_t* job_id, uint32_t* resume_line);
+
+/**
+ * @brief Starts copying a file to the printer's SD card with Marlin's binary file transfer protocol (M28 B1), which
+ * runs at the speed of the USB link instead of the speed of printing. tx_consumer is paused and the lines in flight are
+ * waited for first, the machine's output is then consumed by the transfer until it ends. Marlin only, and the firmware
+ * must report Cap:BINARY_FILE_TRANSFER:1 in M115.
+ * @param filename [IN] name of the file on the SD card, at most CNCM_SD_MAX_FILENAME_SIZE bytes.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, the machine isn't connected or a transfer is running.
+ * @return ESP_ERR_INVALID_ARG if the filename is empty, too long or has a line break.
+ * @return ESP_ERR_NOT_SUPPORTED if the dialect isn't Marlin or the firmware lacks binary file transfer.
+ * @return ESP_ERR_TIMEOUT if the lines in flight weren't acknowledged or the firmware stopped answering.
+ * @return ESP_FAIL if the firmware refused to open the file, ESP_OK otherwise.
+ */
+esp_err_t cncm_sd_transfer_begin(const char* filename);
+
+/**
+ * @brief Writes the next bytes of the file, returns once the firmware acknowledged all of them.
+ * @return ESP_ERR_INVALID_STATE if no transfer is running.
+ * @return ESP_ERR_TIMEOUT or ESP_FAIL if the transfer failed, it's then over and the file is left incomplete.
+ * @return error codes of the USB transfer otherwise.
+ */
+esp_err_t cncm_sd_transfer_write(const uint8_t* data, size_t data_len);
+
+/**
+ * @brief Closes the file and goes back to the text protocol, tx_consumer is resumed unless it was paused already.
+ * @param start_print [IN] select the file and start printing it (M23, M24) through the tx_queue.
+ * @return ESP_ERR_INVALID_STATE if no transfer is running, same as cncm_sd_transfer_write() otherwise.
+ */
+esp_err_t cncm_sd_transfer_end(bool start_print);
+
+/**
+ * @brief Aborts the running transfer, the firmware deletes the partial file.
+ * @return ESP_ERR_INVALID_STATE if no transfer is running, ESP_OK otherwise.
+ */
+esp_err_t cncm_sd_transfer_abort();
+
+/**
+ * @brief Gets the progress and throughput of the running transfer, or of the last one.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if stats is NULL, ESP_OK otherwise.
+ */
+esp_err_t cncm_sd_transfer_get_stats(cncm_sd_stats_t* stats);
+
+const char* cncm_sd_state_name(cncm_sd_state_t state);
+
+/**
+ * @brief Enables or disables the flash log of the machine output, stored persistently. The log also records when the
+ * machine connects and disconnects, jobs start and end, the tx_queue is cleared and emergency stops.
+ * @param enabled [IN] disabled by default.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_NOT_SUPPORTED without the log partition.
+ * @return NVS error codes, ESP_OK otherwise.
+ */
+esp_err_t cncm_log_set_enabled(bool enabled);
+
+/**
+ * @brief Reads the flash log from an offset, without consuming it. Reads stop at the end of what is written to flash.
+ * @param offset [IN/OUT] where to read from, moved past what was read. An offset already overwritten starts at the
+ * oldest byte, one past the end at the start of the log.
+ * @param to_receive [OUT] buffer to receive the log.
+ * @param read_size [OUT] bytes read, 0 at the end of the log.
+ * @param max_read_size [IN] size of the to_receive buffer.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_NOT_SUPPORTED without the log partition.
+ * @return ESP_ERR_INVALID_ARG if a pointer is NULL, flash error codes, ESP_OK otherwise.
+ */
+esp_err_t cncm_log_read(uint64_t* offset, uint8_t* to_receive, size_t* read_size, size_t max_read_size);
+
+/**
+ * @brief Gets the state and counters of the flash log.
+ * @return ESP_ERR_INVALID_STATE if cncm was not initialized, ESP_ERR_INVALID_ARG if stats is NULL, ESP_OK otherwise.
+ */
+esp_err_t cncm_log_get_stats(cncm_log_stats_t* stats);
@@ -0,0 +1,68 @@
+#include <signal.h>
+#include <stdlib.h>
+
+#include "airhive_server.h"
+#include "airhive_networking.h"
+#include "airhive_boot.h"
+#include "airhive_bridge.h"
+#include "airhive_fetch.h"
+#include "mdns.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "cncm.h"
+
+#define HOST_STOP_POLL_MS (100)
+
+static const char* TAG = "Airhive-Host";
+
+// Same stages as on the device, run one after the other: nothing here waits on a radio or a USB enumeration.
+typedef struct {
+    const char* name;
+    esp_err_t (*init)();
+    airhive_boot_phase_t phase;
+} boot_stage_t;
+
+static const boot_stage_t boot_stages[] = {
+    {"cncm", cncm_init, AIRHIVE_BOOT_USB_READY},
+    {"wifi", airhive_wifi_sta_init, AIRHIVE_BOOT_WIFI_STARTED},
+    {"http", airhive_start_server, AIRHIVE_BOOT_HTTP_READY},
+    {"mdns", airhive_start_mdns, AIRHIVE_BOOT_MDNS_READY},
+    {"bridge", airhive_bridge_init, AIRHIVE_BOOT_BRIDGE_READY}
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_handler(int signum)
+{
+    stop_requested = 1;
+}
+
+void app_main(void)
+{
+    ESP_ERROR_CHECK(airhive_boot_init());
+    ESP_ERROR_CHECK(nvs_flash_init());
+    ESP_ERROR_CHECK(airhive_fetch_init());
+    airhive_boot_mark(AIRHIVE_BOOT_CORE_READY);
+    airhive_boot_mark(AIRHIVE_BOOT_GOT_IP);     // The host's network is up already.
+
+    for(size_t i = 0; i < sizeof(boot_stages) / sizeof(boot_stages[0]); i++)
+    {
+        esp_err_t ret = boot_stages[i].init();
+        if(ret == ESP_OK) airhive_boot_mark(boot_stages[i].phase);
+        else
+        {
+            ESP_LOGE(TAG, "Boot stage %s failed: %s", boot_stages[i].name, esp_err_to_name(ret));
+            airhive_boot_fail(boot_stages[i].phase, ret);
+        }
+    }
+
+    // Stopped like a device switched off cleanly: the mDNS goodbye goes out before the process ends.
+    signal(SIGTERM, stop_handler);
+    signal(SIGINT, stop_handler);
+    while(!stop_requested) vTaskDelay(pdMS_TO_TICKS(HOST_STOP_POLL_MS));
+    ESP_LOGI(TAG, "Stopping.");
+    mdns_free();
+    exit(0);
+}
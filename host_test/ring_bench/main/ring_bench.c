@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/message_buffer.h"
+#include "freertos/ringbuf.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+//Moves BENCH_RECORDS G-code lines from a producer task to a consumer task through the tx_queue ring and through the two
+//queues FreeRTOS and ESP-IDF offer for variable size records, the same way cncm would use each of them: the ring and
+//the ring buffer are written and read in place, the message buffer copies in and out. Both tasks have the same priority,
+//so a full or empty queue hands the CPU over as it does between cncm_enqueue() and tx_consumer() on the device.
+//Prints the best of BENCH_ROUNDS runs of each, and fails if a consumer didn't get the exact bytes that were produced.
+#define BENCH_RECORDS (1000000)
+#define BENCH_ROUNDS (3)
+#define BENCH_CAPACITY (64 * 1024)
+#define BENCH_LINES (4096)      //Power of two.
+#define BENCH_STACK_SIZE (4096)
+#define BENCH_PRIORITY (5)
+
+typedef enum {
+    BENCH_CNCM_RING,
+    BENCH_MESSAGE_BUFFER,
+    BENCH_RINGBUF,
+    BENCH_COUNT
+} bench_kind_t;
+
+static const char* bench_names[BENCH_COUNT] = { "cncm_ring", "xMessageBuffer", "xRingbuffer" };
+
+typedef struct {
+    bench_kind_t kind;
+    cncm_ring_t ring;
+    MessageBufferHandle_t message_buffer;
+    RingbufHandle_t ringbuf;
+    TaskHandle_t main_task;
+    uint64_t produced_sum;
+    uint64_t consumed_sum;
+    uint64_t bytes;
+    int64_t done_at_us;
+} bench_t;
+
+static char lines[BENCH_LINES][CNCM_MAX_COMMAND_MESSAGE_SIZE];
+static size_t lines_len[BENCH_LINES];
+
+//Lines of 20 to 60 bytes, like the moves of a sliced print, separator included.
+static void lines_make()
+{
+    uint32_t state = 1;
+    for(size_t i = 0; i < BENCH_LINES; i++)
+    {
+        state = state * 1664525 + 1013904223;
+        int len = snprintf(lines[i], sizeof(lines[i]), "G1 X%" PRIu32 ".%03" PRIu32 " Y%" PRIu32 ".%03" PRIu32 " E%" PRIu32 ".%05" PRIu32 "%s\n",
+                           state % 200, (state >> 8) % 1000, (state >> 4) % 200, (state >> 12) % 1000, (state >> 16) % 10,
+                           (state >> 3) % 100000, ((state >> 20) & 1) ? " F3000" : "");
+        lines_len[i] = len;
+    }
+}
+
+//Position dependent, so a dropped, repeated or reordered byte changes it.
+static inline uint64_t bench_sum(uint64_t sum, const uint8_t* data, size_t len)
+{
+    for(size_t i = 0; i < len; i++) sum = sum * 31 + data[i];
+    return sum;
+}
+
+static void bench_producer(void* arg)
+{
+    bench_t* bench = arg;
+    uint64_t sum = 0;
+    for(uint32_t i = 0; i < BENCH_RECORDS; i++)
+    {
+        const char* line = lines[i % BENCH_LINES];
+        size_t len = lines_len[i % BENCH_LINES];
+        sum = bench_sum(sum, (const uint8_t*)line, len);
+        if(bench->kind == BENCH_CNCM_RING)
+        {
+            uint8_t* span;
+            while((span = cncm_ring_reserve(&bench->ring, len)) == NULL) taskYIELD();
+            memcpy(span, line, len);
+            cncm_ring_commit(&bench->ring, 0, 1, 0, len);
+        }
+        else if(bench->kind == BENCH_MESSAGE_BUFFER)
+        {
+            xMessageBufferSend(bench->message_buffer, line, len, portMAX_DELAY);
+        }
+        else
+        {
+            void* span;
+            xRingbufferSendAcquire(bench->ringbuf, &span, len, portMAX_DELAY);
+            memcpy(span, line, len);
+            xRingbufferSendComplete(bench->ringbuf, span);
+        }
+    }
+    bench->produced_sum = sum;
+    vTaskDelete(NULL);
+}
+
+static void bench_consumer(void* arg)
+{
+    bench_t* bench = arg;
+    uint64_t sum = 0;
+    uint64_t bytes = 0;
+    uint8_t copy[CNCM_MAX_COMMAND_MESSAGE_SIZE];
+    for(uint32_t i = 0; i < BENCH_RECORDS; i++)
+    {
+        if(bench->kind == BENCH_CNCM_RING)
+        {
+            cncm_ring_span_t record;
+            do cncm_ring_wait(&bench->ring);
+            while(!cncm_ring_peek(&bench->ring, &record));
+            cncm_ring_release(&bench->ring, &record);
+            sum = bench_sum(sum, record.data, record.len);
+            bytes += record.len;
+            cncm_ring_finish(&bench->ring);
+        }
+        else if(bench->kind == BENCH_MESSAGE_BUFFER)
+        {
+            size_t len = xMessageBufferReceive(bench->message_buffer, copy, sizeof(copy), portMAX_DELAY);
+            sum = bench_sum(sum, copy, len);
+            bytes += len;
+        }
+        else
+        {
+            size_t len;
+            uint8_t* item = xRingbufferReceive(bench->ringbuf, &len, portMAX_DELAY);
+            sum = bench_sum(sum, item, len);
+            bytes += len;
+            vRingbufferReturnItem(bench->ringbuf, item);
+        }
+    }
+    bench->consumed_sum = sum;
+    bench->bytes = bytes;
+    bench->done_at_us = esp_timer_get_time();
+    xTaskNotifyGive(bench->main_task);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t bench_run(bench_kind_t kind, int64_t* duration_us, uint64_t* bytes)
+{
+    static bench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.kind = kind;
+    bench.main_task = xTaskGetCurrentTaskHandle();
+    if(kind == BENCH_CNCM_RING)
+    {
+        esp_err_t ret = cncm_ring_init(&bench.ring, BENCH_CAPACITY, CNCM_MAX_COMMAND_MESSAGE_SIZE, MALLOC_CAP_DEFAULT);
+        if(ret != ESP_OK) return ret;
+    }
+    else if(kind == BENCH_MESSAGE_BUFFER)
+    {
+        bench.message_buffer = xMessageBufferCreate(BENCH_CAPACITY);
+        if(bench.message_buffer == NULL) return ESP_ERR_NO_MEM;
+    }
+    else
+    {
+        bench.ringbuf = xRingbufferCreate(BENCH_CAPACITY, RINGBUF_TYPE_NOSPLIT);
+        if(bench.ringbuf == NULL) return ESP_ERR_NO_MEM;
+    }
+
+    int64_t start = esp_timer_get_time();
+    xTaskCreate(bench_consumer, "consumer", BENCH_STACK_SIZE, &bench, BENCH_PRIORITY, NULL);
+    xTaskCreate(bench_producer, "producer", BENCH_STACK_SIZE, &bench, BENCH_PRIORITY, NULL);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    vTaskDelay(1);     //Lets the producer finish deleting itself.
+    *duration_us = bench.done_at_us - start;
+    *bytes = bench.bytes;
+
+    if(kind == BENCH_CNCM_RING) heap_caps_free(bench.ring.buffer);
+    else if(kind == BENCH_MESSAGE_BUFFER) vMessageBufferDelete(bench.message_buffer);
+    else vRingbufferDelete(bench.ringbuf);
+    return (bench.consumed_sum == bench.produced_sum) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+void app_main(void)
+{
+    lines_make();
+    vTaskPrioritySet(NULL, BENCH_PRIORITY + 1);
+    int failures = 0;
+    printf("%d records, %d byte queues, best of %d rounds\n", BENCH_RECORDS, BENCH_CAPACITY, BENCH_ROUNDS);
+    for(bench_kind_t kind = 0; kind < BENCH_COUNT; kind++)
+    {
+        int64_t best_us = INT64_MAX;
+        uint64_t bytes = 0;
+        for(int round = 0; round < BENCH_ROUNDS; round++)
+        {
+            int64_t duration_us;
+            esp_err_t ret = bench_run(kind, &duration_us, &bytes);
+            if(ret != ESP_OK)
+            {
+                printf("%-15s FAILED: %s\n", bench_names[kind], esp_err_to_name(ret));
+                failures++;
+                break;
+            }
+            if(duration_us < best_us) best_us = duration_us;
+        }
+        if(best_us == INT64_MAX) continue;
+        printf("%-15s %8.1f ms %8.2f M records/s %8.1f MB/s\n", bench_names[kind], best_us / 1e3,
+               BENCH_RECORDS / (double)best_us, bytes / (double)best_us);
+    }
+    exit(failures ? 1 : 0);
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cncm.h"
+#include "cncm_private.h"
+
+//Checks the rx line splitting against byte at a time references on random machine output, with a fixed seed so a
+//failure can be replayed:
+// - cncm_scan_line_break() against cncm_scan_line_break_bytes() from every start offset of random buffers, so every
+//   alignment and every position of the first break is covered. The bytes are drawn mostly from the ones next to '\n'
+//   and '\r' or with the high bit set, where the word arithmetic could flag the wrong byte.
+// - cncm_lines_feed() against reference_lines_feed(), the byte loop cncm split lines with before, over the same stream
+//   cut into random chunks. Every line must match in content and end offset, and so must the partial line left over.
+#define TEST_SEED (0x5eed2026u)
+#define SCAN_ROUNDS (20000)
+#define SCAN_BUFFER_SIZE (96)
+#define STREAM_SIZE (1024 * 1024)
+#define STREAM_SPLITS (50)
+#define STREAM_MAX_LINE (3 * CNCM_RX_LINE_SIZE)
+
+static uint32_t rng_state = TEST_SEED;
+
+static uint32_t rng_next()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint32_t rng_below(uint32_t bound)
+{
+    return rng_next() % bound;
+}
+
+static const uint8_t tricky_bytes[] = { '\n', '\r', 0x00, 0x01, 0x09, 0x0B, 0x0C, 0x0E, 0x2A, 0x2D, 0x80, 0x8A, 0x8D,
+                                        0x8B, 0xFF, 0xF5, 0xF2, 'o', 'k', ' ' };
+
+//A byte that is a break with probability breaks/256, tricky or arbitrary otherwise.
+static uint8_t byte_draw(uint32_t breaks)
+{
+    if(rng_below(256) < breaks) return rng_below(2) ? '\n' : '\r';
+    uint8_t c;
+    do c = rng_below(2) ? tricky_bytes[rng_below(sizeof(tricky_bytes))] : (uint8_t)rng_next();
+    while(c == '\n' || c == '\r');
+    return c;
+}
+
+static int scan_test()
+{
+    static const uint32_t densities[] = { 0, 1, 8, 64, 200 };
+    uint8_t storage[SCAN_BUFFER_SIZE + 4];
+    for(int round = 0; round < SCAN_ROUNDS; round++)
+    {
+        uint8_t* buffer = storage + rng_below(4);   //The word loop starts after an unaligned head.
+        size_t buffer_len = rng_below(SCAN_BUFFER_SIZE + 1);
+        uint32_t breaks = densities[rng_below(sizeof(densities) / sizeof(densities[0]))];
+        for(size_t i = 0; i < buffer_len; i++) buffer[i] = byte_draw(breaks);
+        for(size_t start = 0; start <= buffer_len; start++)
+        {
+            size_t expected = cncm_scan_line_break_bytes(buffer + start, buffer_len - start);
+            size_t found = cncm_scan_line_break(buffer + start, buffer_len - start);
+            if(found == expected) continue;
+            printf("scan: round %d, %zu bytes from offset %zu: found %zu, expected %zu\n", round, buffer_len - start,
+                   start, found, expected);
+            return 1;
+        }
+    }
+    printf("scan: %d buffers, every start offset, same breaks\n", SCAN_ROUNDS);
+    return 0;
+}
+
+//What cncm_lines_feed() replaced, byte by byte.
+static void reference_lines_feed(cncm_lines_t* lines, const uint8_t* data, size_t data_len, uint64_t data_offset)
+{
+    for(size_t i = 0; i < data_len; i++)
+    {
+        char c = (char)data[i];
+        if(c == '\n' || lines->line_len == sizeof(lines->line))
+        {
+            lines->on_line(lines->line, lines->line_len, data_offset + i + (c == '\n' ? 1 : 0));
+            lines->line_len = 0;
+            if(c == '\n') continue;
+        }
+        if(c != '\r') lines->line[lines->line_len++] = c;
+    }
+}
+
+//Lines as the reference emitted them, the text of all of them back to back.
+static char* expected_text;
+static size_t expected_text_len;
+static size_t* expected_lens;
+static uint64_t* expected_ends;
+static size_t expected_count;
+static size_t checked;          //Lines of the current pass compared so far.
+static size_t checked_text_len;
+static bool mismatch;
+
+static void expected_add(const char* line, size_t line_len, uint64_t end)
+{
+    memcpy(expected_text + expected_text_len, line, line_len);
+    expected_text_len += line_len;
+    expected_lens[expected_count] = line_len;
+    expected_ends[expected_count] = end;
+    expected_count++;
+}
+
+static void line_check(const char* line, size_t line_len, uint64_t end)
+{
+    if(mismatch) return;
+    if(checked == expected_count || line_len != expected_lens[checked] || end != expected_ends[checked] ||
+       memcmp(line, expected_text + checked_text_len, line_len) != 0)
+    {
+        printf("lines: line %zu ending at %" PRIu64 " (%zu bytes) doesn't match the reference\n", checked, end, line_len);
+        mismatch = true;
+        return;
+    }
+    checked_text_len += line_len;
+    checked++;
+}
+
+//Lines of every kind: acks, reports ending in "\r\n", empty ones, lines longer than the line buffer and binary noise.
+static void stream_make(uint8_t* stream)
+{
+    size_t at = 0;
+    while(at < STREAM_SIZE)
+    {
+        size_t line_len;
+        switch(rng_below(4))
+        {
+            case 0: line_len = rng_below(4); break;
+            case 1: line_len = rng_below(64); break;
+            case 2: line_len = CNCM_RX_LINE_SIZE - 2 + rng_below(5); break;    //Around the cut.
+            default: line_len = rng_below(STREAM_MAX_LINE); break;
+        }
+        for(size_t i = 0; i < line_len && at < STREAM_SIZE; i++) stream[at++] = byte_draw(rng_below(2) ? 0 : 4);
+        if(at < STREAM_SIZE && rng_below(2)) stream[at++] = '\r';
+        if(at < STREAM_SIZE) stream[at++] = '\n';
+    }
+}
+
+static int lines_test()
+{
+    uint8_t* stream = malloc(STREAM_SIZE);
+    expected_text = malloc(STREAM_SIZE);
+    expected_lens = malloc((STREAM_SIZE + 1) * sizeof(size_t));
+    expected_ends = malloc((STREAM_SIZE + 1) * sizeof(uint64_t));
+    cncm_lines_t* reference = calloc(1, sizeof(cncm_lines_t));
+    cncm_lines_t* lines = calloc(1, sizeof(cncm_lines_t));
+    if(stream == NULL || expected_text == NULL || expected_lens == NULL || expected_ends == NULL || reference == NULL || lines == NULL)
+    {
+        printf("lines: not enough memory\n");
+        return 1;
+    }
+    stream_make(stream);
+    reference->on_line = expected_add;
+    reference_lines_feed(reference, stream, STREAM_SIZE, 0);
+
+    int failures = 0;
+    for(int split = 0; split < STREAM_SPLITS && failures == 0; split++)
+    {
+        //Tiny chunks, chunks around a line, and chunks up to a full bulk transfer.
+        static const size_t chunk_limits[] = { 8, 300, CNCM_MAX_BULK_IN_TRANSFER };
+        size_t chunk_limit = chunk_limits[split % 3];
+        lines->on_line = line_check;
+        lines->line_len = 0;
+        checked = 0;
+        checked_text_len = 0;
+        mismatch = false;
+        for(size_t at = 0; at < STREAM_SIZE && !mismatch; )
+        {
+            size_t chunk_len = 1 + rng_below(chunk_limit);
+            if(chunk_len > STREAM_SIZE - at) chunk_len = STREAM_SIZE - at;
+            cncm_lines_feed(lines, stream + at, chunk_len, at);
+            at += chunk_len;
+        }
+        if(!mismatch && checked != expected_count)
+        {
+            printf("lines: split %d gave %zu lines, the reference %zu\n", split, checked, expected_count);
+            mismatch = true;
+        }
+        if(!mismatch && (lines->line_len != reference->line_len || memcmp(lines->line, reference->line, lines->line_len) != 0))
+        {
+            printf("lines: split %d left a different partial line\n", split);
+            mismatch = true;
+        }
+        if(mismatch) failures++;
+    }
+    if(failures == 0) printf("lines: %d splits of %d bytes, same %zu lines\n", STREAM_SPLITS, STREAM_SIZE, expected_count);
+    free(stream);
+    free(expected_text);
+    free(expected_lens);
+    free(expected_ends);
+    free(reference);
+    free(lines);
+    return failures;
+}
+
+void app_main(void)
+{
+    printf("seed 0x%08" PRIx32 ", word scan %s\n", (uint32_t)TEST_SEED, CNCM_RX_SCAN_WORDS ? "on" : "off");
+    int failures = scan_test();
+    failures += lines_test();
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    exit(failures ? 1 : 0);
+}
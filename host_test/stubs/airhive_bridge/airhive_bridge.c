@@ -0,0 +1,21 @@
+#include "airhive_bridge.h"
+
+esp_err_t airhive_bridge_init()
+{
+    return ESP_OK;
+}
+
+esp_err_t airhive_bridge_set_enabled(bool enabled)
+{
+    return enabled ? ESP_ERR_NOT_SUPPORTED : ESP_OK;
+}
+
+bool airhive_bridge_is_enabled()
+{
+    return false;
+}
+
+bool airhive_bridge_has_client()
+{
+    return false;
+}
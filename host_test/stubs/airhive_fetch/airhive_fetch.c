@@ -0,0 +1,47 @@
+#include "airhive_fetch.h"
+#include "string.h"
+
+esp_err_t airhive_fetch_init()
+{
+    return ESP_OK;
+}
+
+esp_err_t airhive_fetch_start(const char* url, const char* name, uint32_t* job_id)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t airhive_fetch_start_sd(const char* url, const char* filename, bool print)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t airhive_fetch_cancel()
+{
+    return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t airhive_fetch_get_status(airhive_fetch_status_t* status)
+{
+    memset(status, 0, sizeof(*status));
+    status->state = AIRHIVE_FETCH_IDLE;
+    return ESP_OK;
+}
+
+bool airhive_fetch_is_running()
+{
+    return false;
+}
+
+const char* airhive_fetch_state_name(airhive_fetch_state_t state)
+{
+    switch(state)
+    {
+        case AIRHIVE_FETCH_IDLE: return "idle";
+        case AIRHIVE_FETCH_RUNNING: return "running";
+        case AIRHIVE_FETCH_DONE: return "done";
+        case AIRHIVE_FETCH_FAILED: return "failed";
+        case AIRHIVE_FETCH_CANCELLED: return "cancelled";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,39 @@
+#include "airhive_networking.h"
+#include "esp_log.h"
+
+static const char* TAG = "Airhive-Networking";
+static airhive_wifi_stats_t wifi_stats = { .power_save_idle_s = AIRHIVE_PS_DEFAULT_IDLE_S };
+
+ESP_EVENT_DEFINE_BASE(AIRHIVE_EVENT);
+
+esp_err_t airhive_wifi_sta_init()
+{
+    ESP_LOGI(TAG, "No WiFi on the linux target, using the host's network.");
+    return ESP_OK;
+}
+
+esp_err_t airhive_wifi_set_static_ip(const esp_netif_ip_info_t* ip_info)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void airhive_wifi_note_activity()
+{
+}
+
+void airhive_wifi_set_busy_check(bool (*busy_check)())
+{
+}
+
+esp_err_t airhive_wifi_set_ps_idle_timeout(uint32_t idle_s)
+{
+    wifi_stats.power_save_idle_s = idle_s;
+    return ESP_OK;
+}
+
+esp_err_t airhive_wifi_get_stats(airhive_wifi_stats_t* stats)
+{
+    if(stats == NULL) return ESP_ERR_INVALID_ARG;
+    *stats = wifi_stats;
+    return ESP_OK;
+}
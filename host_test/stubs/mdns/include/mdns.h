@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+//The part of the espressif/mdns API the firmware uses. One hostname and one service, its instance name is the
+//hostname, answered with PTR, SRV, TXT and A records from a thread of its own.
+#define MDNS_PORT (5353)
+#define MDNS_MULTICAST_ADDR "224.0.0.251"
+#define MDNS_HOST_TTL_S (120)
+#define MDNS_SERVICE_TTL_S (4500)
+#define MDNS_ANNOUNCE_COUNT (2)         //Unsolicited responses after the service is added, a second apart.
+#define MDNS_POLL_MS (200)              //Receive timeout of the thread, bounds how long mdns_free() waits.
+#define MDNS_PACKET_SIZE (1500)
+#define MDNS_NAME_SIZE (128)
+
+typedef struct {
+    const char* key;
+    const char* value;
+} mdns_txt_item_t;
+
+esp_err_t mdns_init(void);
+
+/**
+ * @brief Sends the goodbye records of the service, with a TTL of 0, and stops the responder.
+ */
+void mdns_free(void);
+
+esp_err_t mdns_hostname_set(const char* hostname);
+
+/**
+ * @brief Advertises the service, only one may be added. The TXT items are ignored, an empty TXT record is sent.
+ * @return ESP_ERR_INVALID_STATE if mdns_init() wasn't called or a service was already added, ESP_OK otherwise.
+ */
+esp_err_t mdns_service_add(const char* instance_name, const char* service_type, const char* proto, uint16_t port, mdns_txt_item_t txt[], size_t num_items);
@@ -0,0 +1,283 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "mdns.h"
+#include "esp_log.h"
+
+#define DNS_HEADER_SIZE (12)
+#define DNS_TYPE_A (1)
+#define DNS_TYPE_PTR (12)
+#define DNS_TYPE_TXT (16)
+#define DNS_TYPE_SRV (33)
+#define DNS_TYPE_ANY (255)
+#define DNS_CLASS_IN (1)
+#define DNS_CLASS_CACHE_FLUSH (0x8000)
+#define DNS_FLAGS_RESPONSE (0x8400)     //Response, authoritative.
+
+static const char* TAG = "mdns";
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t thread;
+static int sock = -1;
+static volatile bool stopping = false;
+static char hostname[64] = "";
+static char service_name[MDNS_NAME_SIZE] = "";     //"_http._tcp.local"
+static uint16_t service_port = 0;
+static bool service_added = false;
+static int announcements_left = 0;
+
+static size_t put_u16(uint8_t* packet, size_t at, uint16_t value)
+{
+    packet[at] = value >> 8;
+    packet[at + 1] = value & 0xFF;
+    return at + 2;
+}
+
+static size_t put_u32(uint8_t* packet, size_t at, uint32_t value)
+{
+    at = put_u16(packet, at, value >> 16);
+    return put_u16(packet, at, value & 0xFFFF);
+}
+
+//Writes a dotted name as labels, uncompressed.
+static size_t put_name(uint8_t* packet, size_t at, const char* name)
+{
+    while(*name != '\0')
+    {
+        const char* dot = strchr(name, '.');
+        size_t label_len = (dot != NULL) ? (size_t)(dot - name) : strlen(name);
+        packet[at++] = (uint8_t)label_len;
+        memcpy(packet + at, name, label_len);
+        at += label_len;
+        name += label_len + (dot != NULL ? 1 : 0);
+    }
+    packet[at++] = 0;
+    return at;
+}
+
+static size_t put_record(uint8_t* packet, size_t at, const char* name, uint16_t type, uint16_t class, uint32_t ttl)
+{
+    at = put_name(packet, at, name);
+    at = put_u16(packet, at, type);
+    at = put_u16(packet, at, class);
+    return put_u32(packet, at, ttl);
+}
+
+//PTR, SRV, TXT and A records of the service, ttl_scale 0 for the goodbye. Returns the packet length, lock held.
+static size_t response_build(uint8_t* packet, uint32_t ttl_scale)
+{
+    char instance[MDNS_NAME_SIZE + 64];
+    char host[sizeof(hostname) + 8];
+    snprintf(instance, sizeof(instance), "%s.%s", hostname, service_name);
+    snprintf(host, sizeof(host), "%s.local", hostname);
+    memset(packet, 0, DNS_HEADER_SIZE);
+    put_u16(packet, 2, DNS_FLAGS_RESPONSE);
+    put_u16(packet, 6, 4);
+    size_t at = DNS_HEADER_SIZE;
+
+    at = put_record(packet, at, service_name, DNS_TYPE_PTR, DNS_CLASS_IN, MDNS_SERVICE_TTL_S * ttl_scale);
+    size_t rdata_len_at = at;
+    at = put_name(packet, at + 2, instance);
+    put_u16(packet, rdata_len_at, at - rdata_len_at - 2);
+
+    at = put_record(packet, at, instance, DNS_TYPE_SRV, DNS_CLASS_IN | DNS_CLASS_CACHE_FLUSH, MDNS_HOST_TTL_S * ttl_scale);
+    rdata_len_at = at;
+    at = put_u16(packet, at + 2, 0);    //Priority.
+    at = put_u16(packet, at, 0);        //Weight.
+    at = put_u16(packet, at, service_port);
+    at = put_name(packet, at, host);
+    put_u16(packet, rdata_len_at, at - rdata_len_at - 2);
+
+    at = put_record(packet, at, instance, DNS_TYPE_TXT, DNS_CLASS_IN | DNS_CLASS_CACHE_FLUSH, MDNS_SERVICE_TTL_S * ttl_scale);
+    at = put_u16(packet, at, 1);
+    packet[at++] = 0;                   //A single empty string.
+
+    at = put_record(packet, at, host, DNS_TYPE_A, DNS_CLASS_IN | DNS_CLASS_CACHE_FLUSH, MDNS_HOST_TTL_S * ttl_scale);
+    at = put_u16(packet, at, 4);
+    struct in_addr loopback = { .s_addr = htonl(INADDR_LOOPBACK) };
+    memcpy(packet + at, &loopback, 4);  //Instances run on the host of the browser.
+    return at + 4;
+}
+
+static void response_send(uint32_t ttl_scale)
+{
+    uint8_t packet[MDNS_PACKET_SIZE];
+    pthread_mutex_lock(&lock);
+    size_t packet_len = service_added ? response_build(packet, ttl_scale) : 0;
+    pthread_mutex_unlock(&lock);
+    if(packet_len == 0) return;
+    struct sockaddr_in group = { .sin_family = AF_INET, .sin_port = htons(MDNS_PORT) };
+    inet_pton(AF_INET, MDNS_MULTICAST_ADDR, &group.sin_addr);
+    if(sendto(sock, packet, packet_len, 0, (struct sockaddr*)&group, sizeof(group)) < 0)
+    {
+        ESP_LOGW(TAG, "Couldn't send the response.");
+    }
+}
+
+//Reads a possibly compressed name at *at into a dotted string, returns false if it is malformed.
+static bool name_read(const uint8_t* packet, size_t packet_len, size_t* at, char* name, size_t name_size)
+{
+    size_t pos = *at;
+    size_t name_len = 0;
+    bool jumped = false;
+    for(int hops = 0; hops < 16; )
+    {
+        if(pos >= packet_len) return false;
+        uint8_t len = packet[pos];
+        if((len & 0xC0) == 0xC0)
+        {
+            if(pos + 1 >= packet_len) return false;
+            if(!jumped) *at = pos + 2;
+            jumped = true;
+            pos = ((len & 0x3F) << 8) | packet[pos + 1];
+            hops++;
+            continue;
+        }
+        if(len == 0)
+        {
+            if(!jumped) *at = pos + 1;
+            name[name_len] = '\0';
+            return true;
+        }
+        if(pos + 1 + len > packet_len || name_len + len + 2 > name_size) return false;
+        if(name_len > 0) name[name_len++] = '.';
+        memcpy(name + name_len, packet + pos + 1, len);
+        name_len += len;
+        pos += 1 + len;
+    }
+    return false;
+}
+
+//A query asking for the service type, the instance or the host gets the whole set of records.
+static bool query_wants_us(const uint8_t* packet, size_t packet_len)
+{
+    if(packet_len < DNS_HEADER_SIZE || (packet[2] & 0x80) != 0) return false;   //Responses aren't queries.
+    uint16_t questions = (packet[4] << 8) | packet[5];
+    size_t at = DNS_HEADER_SIZE;
+    char instance[MDNS_NAME_SIZE + 64];
+    char host[sizeof(hostname) + 8];
+    pthread_mutex_lock(&lock);
+    bool added = service_added;
+    snprintf(instance, sizeof(instance), "%s.%s", hostname, service_name);
+    snprintf(host, sizeof(host), "%s.local", hostname);
+    pthread_mutex_unlock(&lock);
+    for(uint16_t i = 0; added && i < questions; i++)
+    {
+        char name[MDNS_NAME_SIZE + 64];
+        if(!name_read(packet, packet_len, &at, name, sizeof(name)) || at + 4 > packet_len) return false;
+        uint16_t type = (packet[at] << 8) | packet[at + 1];
+        at += 4;
+        if(strcasecmp(name, service_name) == 0 && (type == DNS_TYPE_PTR || type == DNS_TYPE_ANY)) return true;
+        if(strcasecmp(name, instance) == 0) return true;
+        if(strcasecmp(name, host) == 0 && (type == DNS_TYPE_A || type == DNS_TYPE_ANY)) return true;
+    }
+    return false;
+}
+
+static int64_t now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static void* responder(void* arg)
+{
+    int64_t next_announce = 0;
+    while(!stopping)
+    {
+        pthread_mutex_lock(&lock);
+        bool announce = announcements_left > 0 && now_ms() >= next_announce;
+        if(announce) announcements_left--;
+        pthread_mutex_unlock(&lock);
+        if(announce)
+        {
+            response_send(1);
+            next_announce = now_ms() + 1000;
+        }
+        uint8_t packet[MDNS_PACKET_SIZE];
+        ssize_t packet_len = recv(sock, packet, sizeof(packet), 0);
+        if(packet_len > 0 && query_wants_us(packet, packet_len)) response_send(1);
+    }
+    return NULL;
+}
+
+esp_err_t mdns_init(void)
+{
+    if(sock >= 0) return ESP_ERR_INVALID_STATE;
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0) return ESP_FAIL;
+    //Every instance on the host listens on the mDNS port.
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one));
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = MDNS_POLL_MS * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in any = { .sin_family = AF_INET, .sin_port = htons(MDNS_PORT), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    struct ip_mreq membership = { .imr_interface.s_addr = htonl(INADDR_ANY) };
+    inet_pton(AF_INET, MDNS_MULTICAST_ADDR, &membership.imr_multiaddr);
+    if(bind(sock, (struct sockaddr*)&any, sizeof(any)) != 0 ||
+       setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0)
+    {
+        ESP_LOGE(TAG, "Couldn't join the mDNS group.");
+        close(sock);
+        sock = -1;
+        return ESP_FAIL;
+    }
+    stopping = false;
+    if(pthread_create(&thread, NULL, responder, NULL) != 0)
+    {
+        close(sock);
+        sock = -1;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void mdns_free(void)
+{
+    if(sock < 0) return;
+    stopping = true;
+    pthread_join(thread, NULL);
+    response_send(0);
+    close(sock);
+    sock = -1;
+    pthread_mutex_lock(&lock);
+    service_added = false;
+    pthread_mutex_unlock(&lock);
+}
+
+esp_err_t mdns_hostname_set(const char* name)
+{
+    if(name == NULL || strlen(name) >= sizeof(hostname)) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&lock);
+    strcpy(hostname, name);
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t mdns_service_add(const char* instance_name, const char* service_type, const char* proto, uint16_t port, mdns_txt_item_t txt[], size_t num_items)
+{
+    if(sock < 0) return ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&lock);
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+    if(!service_added && hostname[0] != '\0')
+    {
+        snprintf(service_name, sizeof(service_name), "%s.%s.local", service_type, proto);
+        service_port = port;
+        service_added = true;
+        announcements_left = MDNS_ANNOUNCE_COUNT;
+        ret = ESP_OK;
+    }
+    pthread_mutex_unlock(&lock);
+    if(ret == ESP_OK) ESP_LOGI(TAG, "Advertising %s.%s on port %u.", hostname, service_name, port);
+    return ret;
+}
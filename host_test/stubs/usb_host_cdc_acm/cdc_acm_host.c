@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "usb/usb_host.h"
+#include "usb/cdc_acm_host.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
+
+//A single printer is attached for good once the driver is installed. What the host sends goes into a stream buffer,
+//the printer task reads it a line at a time and answers through the data callback, from its own task like the driver
+//does. It speaks enough Marlin for cncm: "ok" for every line, the usual status reports, and garbage at a wrong rate.
+struct cdc_dev_s {
+    bool open;
+    bool dtr;
+    uint32_t baudrate;
+    cdc_acm_host_device_config_t config;
+};
+
+static const char* TAG = "cdc_acm_host";
+static struct cdc_dev_s printer_dev;
+static SemaphoreHandle_t dev_lock;      //Held while the data callback runs, so none runs once close returns.
+static StreamBufferHandle_t printer_rx;
+static cdc_acm_host_driver_config_t driver_config;
+static bool attached = false;
+static float position[4];               //X, Y, Z, E, absolute.
+
+esp_err_t usb_host_install(const usb_host_config_t* config)
+{
+    return ESP_OK;
+}
+
+esp_err_t usb_host_lib_handle_events(TickType_t timeout_ticks, uint32_t* event_flags_ret)
+{
+    vTaskDelay(timeout_ticks);
+    *event_flags_ret = 0;
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t usb_host_device_free_all(void)
+{
+    return ESP_OK;
+}
+
+//Sends text to the host in transfers of at most in_buffer_size bytes, dev_lock must be held.
+static void printer_send(const char* text, size_t text_len)
+{
+    if(!printer_dev.open || printer_dev.config.data_cb == NULL) return;
+    size_t transfer_size = printer_dev.config.in_buffer_size > 0 ? printer_dev.config.in_buffer_size : text_len;
+    for(size_t i = 0; i < text_len; i += transfer_size)
+    {
+        size_t chunk_len = text_len - i < transfer_size ? text_len - i : transfer_size;
+        printer_dev.config.data_cb((const uint8_t*)text + i, chunk_len, printer_dev.config.user_arg);
+    }
+}
+
+static void printer_reply(const char* text)
+{
+    xSemaphoreTake(dev_lock, portMAX_DELAY);
+    printer_send(text, strlen(text));
+    xSemaphoreGive(dev_lock);
+}
+
+//Strips "N<number> " in front and "*<checksum>" behind, the simulated printer trusts the link.
+static char* printer_command(char* line)
+{
+    char* star = strchr(line, '*');
+    if(star != NULL) *star = '\0';
+    while(*line == ' ') line++;
+    if(*line == 'N')
+    {
+        line++;
+        while(isdigit((unsigned char)*line)) line++;
+        while(*line == ' ') line++;
+    }
+    return line;
+}
+
+static void printer_move(const char* command)
+{
+    static const char axes[] = "XYZE";
+    for(const char* c = command; *c != '\0'; c++)
+    {
+        const char* axis = strchr(axes, toupper((unsigned char)*c));
+        if(axis != NULL && *axis != '\0') position[axis - axes] = strtof(c + 1, NULL);
+    }
+}
+
+static void printer_execute(char* line)
+{
+    char reply[256];
+    const char* command = printer_command(line);
+    char letter = toupper((unsigned char)command[0]);
+    long code = (letter == 'G' || letter == 'M') ? strtol(command + 1, NULL, 10) : -1;
+    if(letter == 'G' && (code == 0 || code == 1 || code == 92)) printer_move(command + 1);
+    if(letter == 'G' && code == 4)
+    {
+        const char* p = strchr(command, 'P');
+        if(p != NULL) vTaskDelay(pdMS_TO_TICKS(strtol(p + 1, NULL, 10)));
+    }
+    if(letter != 'M')
+    {
+        printer_reply("ok\n");
+        return;
+    }
+    switch(code)
+    {
+        case 105:
+            printer_reply("ok T:21.00 /0.00 B:21.00 /0.00 @:0 B@:0\n");
+            break;
+        case 114:
+            snprintf(reply, sizeof(reply), "X:%.2f Y:%.2f Z:%.2f E:%.2f Count X:0 Y:0 Z:0\nok\n",
+                     position[0], position[1], position[2], position[3]);
+            printer_reply(reply);
+            break;
+        case 115:
+            printer_reply("FIRMWARE_NAME:Marlin Airhive host simulator SOURCE_CODE_URL:none PROTOCOL_VERSION:1.0 "
+                          "MACHINE_TYPE:Simulated EXTRUDER_COUNT:1\nok\n");
+            break;
+        case 27:
+            printer_reply("Not SD printing.\nok\n");
+            break;
+        case 31:
+            printer_reply("echo:Print time: 0s\nok\n");
+            break;
+        case 119:
+            printer_reply("Reporting endstop status\nx_min: open\ny_min: open\nz_min: open\nok\n");
+            break;
+        case 20:
+            printer_reply("Begin file list\nEnd file list\nok\n");
+            break;
+        default:
+            printer_reply("ok\n");
+            break;
+    }
+}
+
+static void printer_task(void* arg)
+{
+    vTaskDelay(pdMS_TO_TICKS(HOST_PRINTER_ATTACH_DELAY_MS));
+    attached = true;
+    ESP_LOGI(TAG, "Simulated printer attached.");
+    if(driver_config.new_dev_cb != NULL) driver_config.new_dev_cb(NULL);
+
+    char line[HOST_PRINTER_LINE_SIZE];
+    size_t line_len = 0;
+    while(true)
+    {
+        uint8_t chunk[256];
+        size_t chunk_len = xStreamBufferReceive(printer_rx, chunk, sizeof(chunk), portMAX_DELAY);
+        for(size_t i = 0; i < chunk_len; i++)
+        {
+            char c = (char)chunk[i];
+            if(c != '\n' && c != '\r')
+            {
+                if(line_len < sizeof(line) - 1) line[line_len++] = c;
+                continue;
+            }
+            if(line_len == 0) continue;
+            line[line_len] = '\0';
+            line_len = 0;
+            if(printer_dev.baudrate != HOST_PRINTER_BAUDRATE) printer_reply("\xfe\x80\x1b\xff\n");
+            else printer_execute(line);
+        }
+    }
+}
+
+esp_err_t cdc_acm_host_install(const cdc_acm_host_driver_config_t* config)
+{
+    if(dev_lock != NULL) return ESP_ERR_INVALID_STATE;
+    driver_config = *config;
+    dev_lock = xSemaphoreCreateMutex();
+    printer_rx = xStreamBufferCreate(HOST_PRINTER_RX_SIZE, 1);
+    if(dev_lock == NULL || printer_rx == NULL) return ESP_ERR_NO_MEM;
+    if(xTaskCreate(printer_task, "host_printer", HOST_PRINTER_STACK_SIZE, NULL, config->driver_task_priority, NULL) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t cdc_acm_host_open(uint16_t vid, uint16_t pid, uint8_t interface_idx, const cdc_acm_host_device_config_t* dev_config, cdc_acm_dev_hdl_t* cdc_hdl_ret)
+{
+    if(dev_lock == NULL) return ESP_ERR_INVALID_STATE;
+    if(!attached) return ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(dev_lock, portMAX_DELAY);
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+    if(!printer_dev.open)
+    {
+        printer_dev.open = true;
+        printer_dev.dtr = false;
+        printer_dev.config = *dev_config;
+        xStreamBufferReset(printer_rx);
+        *cdc_hdl_ret = &printer_dev;
+        ret = ESP_OK;
+    }
+    xSemaphoreGive(dev_lock);
+    return ret;
+}
+
+esp_err_t cdc_acm_host_close(cdc_acm_dev_hdl_t cdc_hdl)
+{
+    if(cdc_hdl != &printer_dev) return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(dev_lock, portMAX_DELAY);
+    printer_dev.open = false;
+    xSemaphoreGive(dev_lock);
+    return ESP_OK;
+}
+
+esp_err_t cdc_acm_host_data_tx_blocking(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t* data, size_t data_len, uint32_t timeout_ms)
+{
+    if(cdc_hdl != &printer_dev || !printer_dev.open) return ESP_ERR_INVALID_STATE;
+    if(data_len > printer_dev.config.out_buffer_size) return ESP_ERR_INVALID_SIZE;
+    size_t sent = xStreamBufferSend(printer_rx, data, data_len, pdMS_TO_TICKS(timeout_ms));
+    return sent == data_len ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t cdc_acm_host_line_coding_set(cdc_acm_dev_hdl_t cdc_hdl, const cdc_acm_line_coding_t* line_coding)
+{
+    if(cdc_hdl != &printer_dev) return ESP_ERR_INVALID_ARG;
+    printer_dev.baudrate = line_coding->dwDTERate;
+    ESP_LOGD(TAG, "Line coding set to %" PRIu32 " baud.", line_coding->dwDTERate);
+    return ESP_OK;
+}
+
+//Raising DTR resets the board, which prints its banner like most printers do.
+esp_err_t cdc_acm_host_set_control_line_state(cdc_acm_dev_hdl_t cdc_hdl, bool dtr, bool rts)
+{
+    if(cdc_hdl != &printer_dev) return ESP_ERR_INVALID_ARG;
+    bool reset = dtr && !printer_dev.dtr;
+    printer_dev.dtr = dtr;
+    if(reset && printer_dev.baudrate == HOST_PRINTER_BAUDRATE) printer_reply("start\necho:Marlin Airhive host simulator\n");
+    return ESP_OK;
+}
+
+void cdc_acm_host_desc_print(cdc_acm_dev_hdl_t cdc_hdl)
+{
+    ESP_LOGI(TAG, "Simulated Marlin printer at %" PRIu32 " baud.", printer_dev.baudrate);
+}
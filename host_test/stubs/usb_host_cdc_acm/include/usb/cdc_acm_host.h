@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "usb/usb_host.h"
+
+//The part of the CDC-ACM host driver cncm uses, same types and semantics as espressif/usb_host_cdc_acm. Behind it a
+//simulated Marlin printer answers every line it is sent, see cdc_acm_host.c.
+#define HOST_PRINTER_BAUDRATE (115200)      //The only rate the simulated printer understands, others get garbage.
+#define HOST_PRINTER_ATTACH_DELAY_MS (100)  //From the driver install to the attach, like an enumeration.
+#define HOST_PRINTER_RX_SIZE (4096)         //Bytes sent to the printer and not read by it yet.
+#define HOST_PRINTER_LINE_SIZE (512)
+#define HOST_PRINTER_STACK_SIZE (4096)
+
+typedef struct cdc_dev_s* cdc_acm_dev_hdl_t;
+
+typedef struct {
+    uint32_t dwDTERate;
+    uint8_t bCharFormat;
+    uint8_t bParityType;
+    uint8_t bDataBits;
+} cdc_acm_line_coding_t;
+
+typedef enum {
+    CDC_ACM_HOST_ERROR,
+    CDC_ACM_HOST_SERIAL_STATE,
+    CDC_ACM_HOST_NETWORK_CONNECTION,
+    CDC_ACM_HOST_DEVICE_DISCONNECTED
+} cdc_acm_host_dev_event_t;
+
+typedef struct {
+    cdc_acm_host_dev_event_t type;
+    union {
+        int error;
+        uint16_t serial_state_val;
+        bool network_connected;
+        cdc_acm_dev_hdl_t cdc_hdl;
+    } data;
+} cdc_acm_host_dev_event_data_t;
+
+typedef void (*cdc_acm_new_dev_callback_t)(usb_device_handle_t usb_dev);
+typedef bool (*cdc_acm_data_callback_t)(const uint8_t* data, size_t data_len, void* user_arg);
+typedef void (*cdc_acm_host_dev_callback_t)(const cdc_acm_host_dev_event_data_t* event, void* user_ctx);
+
+typedef struct {
+    size_t driver_task_stack_size;
+    unsigned driver_task_priority;
+    int xCoreID;
+    cdc_acm_new_dev_callback_t new_dev_cb;
+} cdc_acm_host_driver_config_t;
+
+typedef struct {
+    uint32_t connection_timeout_ms;
+    size_t out_buffer_size;
+    size_t in_buffer_size;
+    cdc_acm_host_dev_callback_t event_cb;
+    cdc_acm_data_callback_t data_cb;
+    void* user_arg;
+} cdc_acm_host_device_config_t;
+
+esp_err_t cdc_acm_host_install(const cdc_acm_host_driver_config_t* driver_config);
+esp_err_t cdc_acm_host_open(uint16_t vid, uint16_t pid, uint8_t interface_idx, const cdc_acm_host_device_config_t* dev_config, cdc_acm_dev_hdl_t* cdc_hdl_ret);
+esp_err_t cdc_acm_host_close(cdc_acm_dev_hdl_t cdc_hdl);
+esp_err_t cdc_acm_host_data_tx_blocking(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t* data, size_t data_len, uint32_t timeout_ms);
+esp_err_t cdc_acm_host_line_coding_set(cdc_acm_dev_hdl_t cdc_hdl, const cdc_acm_line_coding_t* line_coding);
+esp_err_t cdc_acm_host_set_control_line_state(cdc_acm_dev_hdl_t cdc_hdl, bool dtr, bool rts);
+void cdc_acm_host_desc_print(cdc_acm_dev_hdl_t cdc_hdl);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+//The part of the USB host library cncm uses. There is no bus: the library only idles, the device is attached by the
+//CDC-ACM driver stub.
+#ifndef ESP_INTR_FLAG_LEVEL2
+#define ESP_INTR_FLAG_LEVEL2 (1 << 2)
+#endif
+
+#define USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS (0x01)
+#define USB_HOST_LIB_EVENT_FLAGS_ALL_FREE (0x02)
+
+typedef struct usb_device_handle_s* usb_device_handle_t;
+typedef bool (*usb_host_enum_filter_cb_t)(const void* dev_desc, uint8_t* bConfigurationValue);
+
+typedef struct {
+    bool skip_phy_setup;
+    bool root_port_unpowered;
+    int intr_flags;
+    usb_host_enum_filter_cb_t enum_filter_cb;
+} usb_host_config_t;
+
+esp_err_t usb_host_install(const usb_host_config_t* config);
+esp_err_t usb_host_lib_handle_events(TickType_t timeout_ticks, uint32_t* event_flags_ret);
+esp_err_t usb_host_device_free_all(void);
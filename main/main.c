@@ -1,19 +1,79 @@
 #include "airhive_server.h"
 #include "airhive_networking.h"
+#include "airhive_boot.h"
+#include "airhive_bridge.h"
+#include "airhive_fetch.h"
 #include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_wifi.h"
+#include "esp_log.h"
+#include "esp_task.h"
 #include "nvs_flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "cncm.h"
 
+#define BOOT_STAGE_STACK_SIZE (4096)
+#define BOOT_STAGE_DEPENDENCY_TIMEOUT_MS (30000)
+
+static const char* TAG = "Airhive-Main";
+
+// A startup stage runs in its own task once the phases it depends on are reached, so independent stages
+// (USB host, WiFi, HTTP, mDNS) come up concurrently and one failing doesn't keep the others from running.
+typedef struct {
+    const char* name;
+    esp_err_t (*init)();
+    airhive_boot_phase_t phase;     // Marked when init succeeds.
+    uint32_t depends_on;            // Mask of (1 << phase) that must be reached first.
+} boot_stage_t;
+
+static const boot_stage_t boot_stages[] = {
+    {"cncm", cncm_init, AIRHIVE_BOOT_USB_READY, 0},
+    {"wifi", airhive_wifi_sta_init, AIRHIVE_BOOT_WIFI_STARTED, 0},
+    {"http", airhive_start_server, AIRHIVE_BOOT_HTTP_READY, 0},
+    {"mdns", airhive_start_mdns, AIRHIVE_BOOT_MDNS_READY, 1 << AIRHIVE_BOOT_WIFI_STARTED},
+    {"bridge", airhive_bridge_init, AIRHIVE_BOOT_BRIDGE_READY, 1 << AIRHIVE_BOOT_USB_READY}
+};
+
+static void boot_stage_task(void* arg)
+{
+    const boot_stage_t* stage = (const boot_stage_t*)arg;
+    esp_err_t ret = airhive_boot_wait(stage->depends_on, BOOT_STAGE_DEPENDENCY_TIMEOUT_MS);
+    if(ret != ESP_OK) ESP_LOGE(TAG, "Boot stage %s: dependencies not ready.", stage->name);
+    else ret = stage->init();
+    if(ret == ESP_OK) airhive_boot_mark(stage->phase);
+    else airhive_boot_fail(stage->phase, ret);
+    vTaskDelete(NULL);
+}
+
+// Keeps WiFi power save off while the machine is being driven, a bridge client is streaming or a job is being fetched.
+static bool device_is_busy()
+{
+    return cncm_is_busy() || airhive_bridge_has_client() || airhive_fetch_is_running();
+}
+
+static void got_ip_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+    airhive_boot_mark(AIRHIVE_BOOT_GOT_IP);
+}
+
 void app_main(void)
 {
+    ESP_ERROR_CHECK(airhive_boot_init());
     ESP_ERROR_CHECK(nvs_flash_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    ESP_ERROR_CHECK(cncm_init());
     ESP_ERROR_CHECK(esp_netif_init());
     esp_netif_create_default_wifi_sta();
-    ESP_ERROR_CHECK(airhive_wifi_sta_init());
-    ESP_ERROR_CHECK(airhive_start_server());
-    ESP_ERROR_CHECK(airhive_start_mdns());
-}
\ No newline at end of file
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip_handler, NULL, NULL));
+    airhive_wifi_set_busy_check(device_is_busy);
+    ESP_ERROR_CHECK(airhive_fetch_init());
+    airhive_boot_mark(AIRHIVE_BOOT_CORE_READY);
+
+    for(size_t i = 0; i < sizeof(boot_stages) / sizeof(boot_stages[0]); i++)
+    {
+        if(xTaskCreate(boot_stage_task, boot_stages[i].name, BOOT_STAGE_STACK_SIZE, (void*)&boot_stages[i], ESP_TASK_MAIN_PRIO, NULL) != pdPASS)
+        {
+            airhive_boot_fail(boot_stages[i].phase, ESP_ERR_NO_MEM);
+        }
+    }
+}
@@ -0,0 +1,171 @@
+"""What the Airhive test scripts share: a client for the server API, the request bodies of the load mixes, and the linux
+target build of the firmware run as a local server.
+
+Only the standard library is used.
+"""
+
+import http.client
+import json
+import os
+import signal
+import socket
+import subprocess
+import sys
+import time
+import urllib.parse
+
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+HOST_BUILD_ELF = os.path.normpath(os.path.join(TESTS_DIR, "..", "host_test", "airhive_host", "build",
+                                              "airhive_host.elf"))
+HOST_BUILD_HELP = "cd host_test/airhive_host && idf.py --preview set-target linux && idf.py build"
+
+
+def decode(data):
+    """The answer as JSON, None if it is empty, the bytes themselves if it isn't JSON (httpd's own error pages)."""
+    if not data:
+        return None
+    try:
+        return json.loads(data)
+    except ValueError:
+        return data
+
+
+class Client:
+    """One persistent connection, like a host keeps.
+
+    The firmware only keeps max_open_sockets = 1 connection and evicts the least recently used one when another client
+    connects, so a request failing on a connection that already served requests is sent once more on a new one, and
+    counted in evictions. A request failing on a fresh connection is an error and raised.
+    """
+
+    def __init__(self, url, timeout):
+        self.url = urllib.parse.urlsplit(url)
+        self.timeout = timeout
+        self.connection = None
+        self.connection_used = False
+        self.evictions = 0
+
+    def connect(self):
+        self.connection = http.client.HTTPConnection(self.url.hostname, self.url.port or 80, timeout=self.timeout)
+        self.connection_used = False
+        self.connection.connect()
+        # http.client writes headers and body separately, Nagle would add a delayed-ACK stall to every POST.
+        self.connection.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def request(self, method, path, body=None):
+        """Sends body as it is if it is bytes, as JSON otherwise, returns the status and the decoded answer."""
+        status, data = self.request_raw(method, path, body)
+        return status, decode(data)
+
+    def request_raw(self, method, path, body=None):
+        """Same as request(), with the answer as the bytes that came."""
+        payload = body if body is None or isinstance(body, bytes) else json.dumps(body).encode()
+        headers = {"Content-Type": "application/json"} if payload else {}
+        while True:
+            if self.connection is None:
+                self.connect()
+            try:
+                self.connection.request(method, path, body=payload or None, headers=headers)
+                response = self.connection.getresponse()
+                data = response.read()
+            except (http.client.HTTPException, OSError):
+                evicted = self.connection_used
+                self.close()
+                if not evicted:
+                    raise
+                self.evictions += 1
+                continue
+            self.connection_used = True
+            if response.getheader("Connection", "").lower() == "close":
+                self.close()
+            return response.status, data
+
+    def close(self):
+        if self.connection is not None:
+            self.connection.close()
+            self.connection = None
+
+
+def make_command(rng, size=None):
+    """A random absolute move, padded or cut to a length drawn around size if it is given."""
+    command = "G1 X%.3f Y%.3f E%.5f F3000" % (rng.random() * 200, rng.random() * 200, rng.random())
+    if size is None:
+        return command
+    # Sizes vary around size so that JSON parsing isn't benchmarked on a single shape.
+    length = max(2, int(rng.gauss(size, size / 4)))
+    return command.ljust(length, ";")[:length]
+
+
+def make_body(name, args, rng):
+    """Body of a request of a load mix, b"" for the requests without one.
+
+    commands: args.commands_per_request lines, 1 to 20 at random if it is None, of about args.command_size bytes.
+    upload: lines up to args.upload_size bytes in all, from an eighth of it, so blocks of many sizes are taken and
+    given back. responses: args.responses_size as the size asked for, one of the usual sizes at random if it is None.
+    """
+    if name == "commands":
+        count = args.commands_per_request or rng.randint(1, 20)
+        return json.dumps({"commands": [make_command(rng, args.command_size) for _ in range(count)]}).encode()
+    if name == "upload":
+        size = rng.randint(args.upload_size // 8, args.upload_size)
+        commands, total = [], 0
+        while total < size:
+            commands.append(make_command(rng))
+            total += len(commands[-1]) + 4
+        return json.dumps({"commands": commands}).encode()
+    if name == "responses":
+        return json.dumps({"size": args.responses_size or rng.choice([64, 512, 2000, 5000])}).encode()
+    return b""
+
+
+class HostBuild:
+    """host_test/airhive_host, the firmware built for the ESP-IDF linux target, run as a local server in a with block.
+
+    It serves on port under the mDNS name name, with a simulated Marlin printer behind cncm, and is stopped with
+    SIGTERM like a device switched off cleanly. Its output goes to log if it is given.
+    """
+
+    def __init__(self, elf=HOST_BUILD_ELF, port=8080, name="Airhive-test", log=None, startup_timeout=10):
+        self.elf = elf
+        self.port = port
+        self.name = name
+        self.log = log
+        self.startup_timeout = startup_timeout
+        self.url = "http://127.0.0.1:%d" % port
+        self.process = None
+
+    def __enter__(self):
+        if not os.path.isfile(self.elf):
+            sys.exit("%s isn't built, build it with\n    %s" % (self.elf, HOST_BUILD_HELP))
+        # mallinfo2(), behind GET /heap, only covers the main arena: the server's threads must allocate from it too.
+        env = dict(os.environ, AIRHIVE_PORT=str(self.port), AIRHIVE_NAME=self.name, MALLOC_ARENA_MAX="1")
+        output = open(self.log, "w") if self.log else subprocess.DEVNULL
+        self.process = subprocess.Popen([self.elf], stdout=output, stderr=subprocess.STDOUT, env=env, cwd=TESTS_DIR)
+        if self.log:
+            output.close()
+        deadline = time.monotonic() + self.startup_timeout
+        while True:
+            if self.process.poll() is not None:
+                sys.exit("%s exited with %d while starting" % (self.elf, self.process.returncode))
+            try:
+                with socket.create_connection(("127.0.0.1", self.port), timeout=0.5):
+                    return self
+            except OSError:
+                if time.monotonic() > deadline:
+                    self.stop()
+                    sys.exit("%s didn't accept connections on port %d within %g s"
+                             % (self.elf, self.port, self.startup_timeout))
+                time.sleep(0.05)
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.stop()
+
+    def stop(self):
+        if self.process is None or self.process.poll() is not None:
+            return
+        self.process.send_signal(signal.SIGTERM)
+        try:
+            self.process.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+            self.process.wait()
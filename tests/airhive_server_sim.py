@@ -2,6 +2,9 @@ from flask import Flask, request, jsonify, make_response
 from zeroconf import Zeroconf, ServiceInfo
 import socket
 import argparse
+import logging
+import signal
+import sys
 
 app = Flask(__name__)
 
@@ -115,18 +118,32 @@ if __name__ == '__main__':
         type=int,
         help="An integer value to process"
     )
+    parser.add_argument("--port", type=int, help="HTTP port, 8000 + number by default")
+    parser.add_argument("--quiet", action="store_true",
+                        help="no debugger, reloader or request log, for fleets started by fleet_sim.py")
     args = parser.parse_args()
     n = args.number
+    port = args.port if args.port is not None else 8000 + n
 
     info = ServiceInfo(
         type_='_http._tcp.local.',
         name=f'Airhive{n}-test._http._tcp.local.',
         addresses=[socket.inet_aton("127.0.0.1")],
-        port=8000 + n,
+        port=port,
         server=f'Airhive{n}-test.local.',
         properties={}
     )
     zeroconf = Zeroconf()
     zeroconf.register_service(info, allow_name_change=True)
     print('mDNS service registered.')
-    app.run(port=8000 + n, debug=True)
+    # Unregistered on SIGTERM too, so that browsers see the instance leave like a device that is switched off cleanly.
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+    try:
+        if args.quiet:
+            logging.getLogger('werkzeug').setLevel(logging.ERROR)
+            app.run(port=port, debug=False, use_reloader=False, threaded=True)
+        else:
+            app.run(port=port, debug=True)
+    finally:
+        zeroconf.unregister_service(info)
+        zeroconf.close()
@@ -0,0 +1,124 @@
+"""Checkpoint write cost and resume accuracy benchmark for the Airhive firmware.
+
+Streams a synthetic print job at full speed to a device with a machine attached, and samples GET /checkpoint while it
+runs. Reports the flash write cost measured by the firmware (avg/max per checkpoint, writes per minute), how many lines
+the stored checkpoint lags behind the acknowledged ones (what a power loss would replay), and whether the position
+stored in each checkpoint is the one of the line it names, which is what a resume relies on.
+
+Only the standard library is used.
+
+Examples:
+    python bench_checkpoint.py --url http://Airhive-XXXXXXXXXXXX.local --lines 20000
+    python bench_checkpoint.py --url http://192.168.1.50 --interval 2 --json checkpoint.json
+"""
+
+import argparse
+import json
+import random
+import time
+
+from airhive_client import Client
+
+
+def make_job(lines, seed):
+    """Absolute moves, so the expected position after line n is the one written on it."""
+    rng = random.Random(seed)
+    commands, positions = [], []
+    e = 0.0
+    for _ in range(lines):
+        x, y = round(rng.random() * 200, 3), round(rng.random() * 200, 3)
+        e = round(e + rng.random(), 5)
+        commands.append("G1 X%.3f Y%.3f E%.5f F3000" % (x, y, e))
+        positions.append((x, y, e))
+    return commands, positions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", required=True, help="base URL of the device, e.g. http://192.168.1.50")
+    parser.add_argument("--lines", type=int, default=10000, help="lines in the synthetic job")
+    parser.add_argument("--chunk", type=int, default=100, help="lines per POST /jobs/commands")
+    parser.add_argument("--interval", type=int, help="checkpoint interval to set first, in seconds")
+    parser.add_argument("--sample-period", type=float, default=0.5, help="time between GET /checkpoint, in seconds")
+    parser.add_argument("--timeout", type=float, default=10)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    client = Client(args.url, args.timeout)
+    if args.interval is not None:
+        status, _ = client.request("PUT", "/checkpoint-config", {"interval_s": args.interval})
+        if status != 200:
+            raise SystemExit("PUT /checkpoint-config failed with %d" % status)
+    _, before = client.request("GET", "/checkpoint")
+    writes_before = before["stats"]["writes"]
+
+    name = "ckpt-bench-%d" % int(time.time())
+    commands, positions = make_job(args.lines, args.seed)
+    status, created = client.request("POST", "/jobs", {"name": name})
+    if status != 200:
+        raise SystemExit("POST /jobs failed with %d" % status)
+    job_id = created["job_id"]
+
+    start = time.monotonic()
+    lags, mismatches, checked = [], 0, 0
+    sent, next_sample = 0, 0.0
+    while True:
+        if sent < len(commands):
+            chunk = commands[sent:sent + args.chunk]
+            close = sent + len(chunk) == len(commands)
+            status, _ = client.request("POST", "/jobs/commands", {"job_id": job_id, "commands": chunk, "close": close})
+            if status == 200:
+                sent += len(chunk)
+            elif status in (500, 503):
+                time.sleep(0.05)  # tx_queue full.
+            else:
+                raise SystemExit("POST /jobs/commands failed with %d" % status)
+        now = time.monotonic()
+        if now < next_sample and sent < len(commands):
+            continue
+        next_sample = now + args.sample_period
+        _, checkpoint = client.request("GET", "/checkpoint")
+        lags.append(checkpoint["stats"]["lag_lines"])
+        stored = checkpoint["checkpoint"]
+        if stored is not None and stored["name"] == name and 0 < stored["line"] <= len(positions):
+            x, y, e = positions[stored["line"] - 1]
+            position = stored["state"]["position"]
+            checked += 1
+            if abs(position["x"] - x) > 1e-3 or abs(position["y"] - y) > 1e-3 or abs(position["e"] - e) > 1e-3:
+                mismatches += 1
+        _, jobs = client.request("GET", "/jobs")
+        job = next((j for j in jobs["jobs"] if j["job_id"] == job_id), None)
+        if job is None or job["state"] in ("finished", "cancelled"):
+            break
+        if sent == len(commands):
+            time.sleep(args.sample_period)
+    duration = time.monotonic() - start
+
+    _, after = client.request("GET", "/checkpoint")
+    stats = after["stats"]
+    lags.sort()
+    report = {
+        "lines": args.lines,
+        "duration_s": duration,
+        "lines_per_s": args.lines / duration,
+        "interval_s": stats["interval_s"],
+        "writes": stats["writes"] - writes_before,
+        "writes_per_min": (stats["writes"] - writes_before) * 60 / duration,
+        "avg_write_us": stats["avg_write_us"],
+        "max_write_us": stats["max_write_us"],
+        "lag_lines_p50": lags[len(lags) // 2] if lags else None,
+        "lag_lines_max": lags[-1] if lags else None,
+        "checkpoints_checked": checked,
+        "position_mismatches": mismatches,
+        "discarded_on_finish": after["checkpoint"] is None,
+    }
+    for key, value in report.items():
+        print("%-22s %s" % (key, "%.1f" % value if isinstance(value, float) else value))
+    if args.json:
+        with open(args.json, "w") as output:
+            json.dump(report, output, indent=2)
+
+
+if __name__ == "__main__":
+    main()
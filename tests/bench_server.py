@@ -0,0 +1,197 @@
+"""HTTP load test and latency benchmark for the Airhive server API.
+
+Runs against anything that speaks the API: a device on the network, host_test/airhive_host (the firmware built for the
+ESP-IDF linux target, with a simulated printer, started as below), or airhive_server_sim.py. Only the standard library
+is used so it runs anywhere the firmware is tested.
+
+Each worker keeps one persistent connection through airhive_client.Client, like a real host does, and picks requests
+from a weighted mix. A request the server evicted the connection of is sent again on a new one, and counted as an
+eviction of its endpoint.
+
+Examples:
+    python bench_server.py --url http://Airhive-XXXXXXXXXXXX.local --concurrency 4 --duration 30
+    AIRHIVE_PORT=8001 ../host_test/airhive_host/build/airhive_host.elf &
+    python bench_server.py --url http://127.0.0.1:8001 --mix commands=5,responses=5,status=1 --commands-per-request 50
+    python bench_server.py --url http://192.168.1.50 --mix stop=1,start=1,clear=1 --json results.json
+"""
+
+import argparse
+import http.client
+import json
+import random
+import threading
+import time
+
+from airhive_client import Client, make_body
+
+ENDPOINTS = {
+    # name: (method, path)
+    "commands": ("POST", "/commands"),
+    "responses": ("GET", "/responses"),
+    "status": ("GET", "/machine-status"),
+    "start": ("PUT", "/start"),
+    "stop": ("PUT", "/stop"),
+    "clear": ("PUT", "/clear"),
+}
+
+
+class EndpointStats:
+    def __init__(self):
+        self.latencies = []
+        self.status_counts = {}
+        self.errors = 0
+        self.connection_errors = 0
+        self.evictions = 0
+        self.request_bytes = 0
+        self.response_bytes = 0
+
+    def merge(self, other):
+        self.latencies.extend(other.latencies)
+        for status, count in other.status_counts.items():
+            self.status_counts[status] = self.status_counts.get(status, 0) + count
+        self.errors += other.errors
+        self.connection_errors += other.connection_errors
+        self.evictions += other.evictions
+        self.request_bytes += other.request_bytes
+        self.response_bytes += other.response_bytes
+
+
+def percentile(sorted_values, fraction):
+    if not sorted_values:
+        return None
+    index = min(len(sorted_values) - 1, int(round(fraction * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+class Worker(threading.Thread):
+    def __init__(self, worker_id, args, mix, deadline):
+        super().__init__(daemon=True)
+        self.args = args
+        self.mix = mix
+        self.deadline = deadline
+        self.rng = random.Random(args.seed + worker_id)
+        self.stats = {name: EndpointStats() for name in ENDPOINTS}
+        self.client = Client(args.url, args.timeout)
+
+    def run(self):
+        names = [name for name, _ in self.mix]
+        weights = [weight for _, weight in self.mix]
+        while time.monotonic() < self.deadline:
+            name = self.rng.choices(names, weights)[0]
+            method, path = ENDPOINTS[name]
+            body = make_body(name, self.args, self.rng)
+            stats = self.stats[name]
+            evictions = self.client.evictions
+            start = time.perf_counter()
+            try:
+                status, payload = self.client.request_raw(method, path, body)
+            except (http.client.HTTPException, OSError):
+                stats.errors += 1
+                stats.connection_errors += 1
+                # Don't spin on a target that refuses connections.
+                time.sleep(self.args.retry_delay)
+                continue
+            finally:
+                stats.evictions += self.client.evictions - evictions
+            elapsed = time.perf_counter() - start
+            stats.latencies.append(elapsed)
+            stats.status_counts[status] = stats.status_counts.get(status, 0) + 1
+            stats.request_bytes += len(body)
+            stats.response_bytes += len(payload)
+            if status >= 400:
+                stats.errors += 1
+            if self.args.think_time > 0:
+                time.sleep(self.args.think_time)
+        self.client.close()
+
+
+def parse_mix(text):
+    mix = []
+    for item in text.split(","):
+        name, _, weight = item.partition("=")
+        name = name.strip()
+        if name not in ENDPOINTS:
+            raise argparse.ArgumentTypeError("unknown endpoint '%s', expected one of %s" % (name, ", ".join(ENDPOINTS)))
+        mix.append((name, float(weight or 1)))
+    return mix
+
+
+def summarize(stats, duration):
+    report = {}
+    for name, endpoint_stats in stats.items():
+        requests = len(endpoint_stats.latencies) + endpoint_stats.connection_errors
+        if requests == 0:
+            continue
+        latencies = sorted(endpoint_stats.latencies)
+        report[name] = {
+            "requests": requests,
+            "throughput_rps": len(latencies) / duration,
+            "p50_ms": percentile(latencies, 0.50) * 1000 if latencies else None,
+            "p99_ms": percentile(latencies, 0.99) * 1000 if latencies else None,
+            "p999_ms": percentile(latencies, 0.999) * 1000 if latencies else None,
+            "max_ms": latencies[-1] * 1000 if latencies else None,
+            "error_rate": endpoint_stats.errors / requests,
+            "eviction_rate": endpoint_stats.evictions / requests,
+            "status_counts": {str(status): count for status, count in sorted(endpoint_stats.status_counts.items())},
+            "request_kib_per_s": endpoint_stats.request_bytes / 1024 / duration,
+            "response_kib_per_s": endpoint_stats.response_bytes / 1024 / duration,
+        }
+    return report
+
+
+def print_report(report, args, duration):
+    print("Target: %s, concurrency: %d, duration: %.1f s" % (args.url, args.concurrency, duration))
+    header = "%-10s %8s %9s %9s %9s %9s %9s %8s %8s" % (
+        "endpoint", "requests", "req/s", "p50 ms", "p99 ms", "p999 ms", "max ms", "errors", "evicted")
+    print(header)
+    print("-" * len(header))
+
+    def ms(value):
+        return "%9.1f" % value if value is not None else "%9s" % "-"
+
+    for name, row in report.items():
+        print("%-10s %8d %9.1f %s %s %s %s %7.2f%% %7.2f%%" % (
+            name, row["requests"], row["throughput_rps"], ms(row["p50_ms"]), ms(row["p99_ms"]), ms(row["p999_ms"]),
+            ms(row["max_ms"]), row["error_rate"] * 100, row["eviction_rate"] * 100))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", required=True, help="base URL of the server, e.g. http://192.168.1.50")
+    parser.add_argument("--concurrency", type=int, default=1, help="number of clients, each with its own connection")
+    parser.add_argument("--duration", type=float, default=10, help="test duration in seconds")
+    parser.add_argument("--mix", type=parse_mix, default=parse_mix("commands=1,responses=1,status=1"),
+                        help="weighted endpoint mix, e.g. commands=5,responses=5,status=1,stop=0.1,start=0.1,clear=0.1")
+    parser.add_argument("--commands-per-request", type=int, default=20)
+    parser.add_argument("--command-size", type=int, default=32, help="average command length in bytes")
+    parser.add_argument("--responses-size", type=int, default=5000, help="'size' sent to GET /responses")
+    parser.add_argument("--think-time", type=float, default=0, help="pause between requests of a client, in seconds")
+    parser.add_argument("--timeout", type=float, default=10, help="socket timeout in seconds")
+    parser.add_argument("--retry-delay", type=float, default=0.1, help="wait after a failed connection, in seconds")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    start = time.monotonic()
+    deadline = start + args.duration
+    workers = [Worker(i, args, args.mix, deadline) for i in range(args.concurrency)]
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    duration = time.monotonic() - start
+
+    totals = {name: EndpointStats() for name in ENDPOINTS}
+    for worker in workers:
+        for name, endpoint_stats in worker.stats.items():
+            totals[name].merge(endpoint_stats)
+    report = summarize(totals, duration)
+    print_report(report, args, duration)
+    if args.json:
+        with open(args.json, "w") as output:
+            json.dump({"url": args.url, "concurrency": args.concurrency, "duration_s": duration,
+                       "endpoints": report}, output, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,174 @@
+"""Pull mode test for the Airhive firmware: serves a G-code file over HTTP and has the device fetch it as a job.
+
+Starts a local HTTP server with Range support, asks the device to pull a synthetic job from it with POST /jobs/fetch,
+and follows GET /jobs/fetch and GET /jobs until the fetch is over. Faults can be injected to check that the device
+resumes from the last offset: dropping the connection in the middle of every Nth response, answering 503 to every Nth
+request, or ignoring Range altogether. Reports what the server saw (requests, bytes, ranges out of order) and what the
+device reports (lines queued, retries, waits on a full tx_queue), and checks the job has every line of the file.
+
+Only the standard library is used.
+
+Examples:
+    python fetch_test.py --url http://Airhive-XXXXXXXXXXXX.local --advertise 192.168.1.20 --lines 20000
+    python fetch_test.py --url http://192.168.1.50 --advertise 192.168.1.20 --drop-every 3 --fail-every 5
+"""
+
+import argparse
+import http.server
+import json
+import random
+import re
+import threading
+import time
+
+from airhive_client import Client
+
+
+def make_file(lines, seed):
+    """Moves with comments and blank lines, which the device skips, returns the file and its G-code line count."""
+    rng = random.Random(seed)
+    out, count = ["; generated by fetch_test.py", ""], 0
+    for i in range(lines):
+        out.append("G1 X%.3f Y%.3f E%.5f F3000%s" % (rng.random() * 200, rng.random() * 200, rng.random(),
+                                                     " ; move %d" % i if i % 10 == 0 else ""))
+        count += 1
+        if i % 100 == 0:
+            out.append("")
+    return ("\r\n".join(out) + "\r\n").encode(), count
+
+
+class FileServer(http.server.ThreadingHTTPServer):
+    def __init__(self, address, content, args):
+        super().__init__(address, FileHandler)
+        self.content = content
+        self.args = args
+        self.lock = threading.Lock()
+        self.requests = 0
+        self.bytes_sent = 0
+        self.drops = 0
+        self.failures = 0
+        self.next_offset = 0
+        self.rewinds = 0    # Ranges starting before the end of the previous one, i.e. retries.
+
+
+class FileHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"   # Keep-alive, like the device expects.
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        server, content = self.server, self.server.content
+        with server.lock:
+            server.requests += 1
+            number = server.requests
+        if server.args.fail_every and number % server.args.fail_every == 0:
+            with server.lock:
+                server.failures += 1
+            self.send_response(503)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        match = re.match(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+        if match is None or server.args.no_range:
+            first, last, status = 0, len(content) - 1, 200
+        else:
+            first = int(match.group(1))
+            last = min(int(match.group(2)) if match.group(2) else len(content) - 1, len(content) - 1)
+            status = 206
+            if first >= len(content):
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(content))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+        with server.lock:
+            if status == 206 and first < server.next_offset:
+                server.rewinds += 1
+            server.next_offset = last + 1
+        body = content[first:last + 1]
+        self.send_response(status)
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, len(content)))
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if server.args.drop_every and number % server.args.drop_every == 0 and len(body) > 1:
+            self.wfile.write(body[:len(body) // 2])
+            with server.lock:
+                server.drops += 1
+                server.bytes_sent += len(body) // 2
+            self.close_connection = True
+            return
+        self.wfile.write(body)
+        with server.lock:
+            server.bytes_sent += len(body)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", required=True, help="base URL of the device, e.g. http://192.168.1.50")
+    parser.add_argument("--advertise", required=True, help="address of this machine as seen from the device")
+    parser.add_argument("--port", type=int, default=8080, help="port of the local file server")
+    parser.add_argument("--lines", type=int, default=10000, help="G-code lines in the synthetic file")
+    parser.add_argument("--drop-every", type=int, default=0, help="cut every Nth response in half")
+    parser.add_argument("--fail-every", type=int, default=0, help="answer 503 to every Nth request")
+    parser.add_argument("--no-range", action="store_true", help="ignore Range and always send the whole file")
+    parser.add_argument("--poll-period", type=float, default=1.0)
+    parser.add_argument("--timeout", type=float, default=10)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    content, expected_lines = make_file(args.lines, args.seed)
+    server = FileServer(("", args.port), content, args)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    client = Client(args.url, args.timeout)
+    file_url = "http://%s:%d/job.gcode" % (args.advertise, args.port)
+    status, started = client.request("POST", "/jobs/fetch", {"url": file_url, "name": "fetch-test"})
+    if status != 200:
+        raise SystemExit("POST /jobs/fetch failed with %d" % status)
+    job_id = started["job_id"]
+
+    start = time.monotonic()
+    while True:
+        time.sleep(args.poll_period)
+        _, fetch = client.request("GET", "/jobs/fetch")
+        if fetch["state"] != "running":
+            break
+    fetch_duration = time.monotonic() - start
+    _, jobs = client.request("GET", "/jobs")
+    job = next((j for j in jobs["jobs"] if j["job_id"] == job_id), None)
+    server.shutdown()
+
+    report = {
+        "file_bytes": len(content),
+        "expected_lines": expected_lines,
+        "fetch_state": fetch["state"],
+        "fetch_duration_s": fetch_duration,
+        "device_lines": fetch["lines"],
+        "device_offset": fetch["offset"],
+        "device_requests": fetch["requests"],
+        "device_retries": fetch["retries"],
+        "device_full_waits": fetch["full_waits"],
+        "device_last_error": fetch["last_error"],
+        "job_total_lines": job["total_lines"] if job else None,
+        "job_state": job["state"] if job else None,
+        "server_requests": server.requests,
+        "server_bytes": server.bytes_sent,
+        "server_drops": server.drops,
+        "server_failures": server.failures,
+        "server_rewinds": server.rewinds,
+        "lines_match": fetch["lines"] == expected_lines,
+    }
+    for key, value in report.items():
+        print("%-20s %s" % (key, "%.1f" % value if isinstance(value, float) else value))
+    if args.json:
+        with open(args.json, "w") as output:
+            json.dump(report, output, indent=2)
+    if fetch["state"] != "done" or not report["lines_match"]:
+        raise SystemExit(1)
+
+
+if __name__ == "__main__":
+    main()
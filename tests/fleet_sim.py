@@ -0,0 +1,394 @@
+"""Fleet simulator: discovery, status polling and churn across many Airhive instances on one Linux host.
+
+Launches --instances copies of a server, each on its own port and with its own mDNS name (Airhive<n>-test), then:
+  1. waits for every instance to accept connections and reports the startup times,
+  2. browses _http._tcp like a host does and reports how long each instance took to be discovered,
+  3. polls GET /machine-status across the whole fleet from --pollers clients and reports throughput and latency,
+  4. keeps polling while instances are killed and restarted at random (--churn-period), and reports how long a
+     restarted instance takes to be discovered and to answer again, and how many polls failed meanwhile.
+
+By default every instance is the linux target build of the firmware, host_test/airhive_host: the real server and
+cncm, with the USB host and Wi-Fi stubbed and a simulated Marlin printer behind cncm. Build it first with
+    cd host_test/airhive_host && idf.py --preview set-target linux && idf.py build
+Each instance gets its port and mDNS name in AIRHIVE_PORT and AIRHIVE_NAME. --sim runs airhive_server_sim.py, the
+Flask simulator of the API, instead; it needs no ESP-IDF but only mimics the answers. Any other server can be launched
+with --command, a template where {n}, {port}, {name}, {elf} and {python} are replaced for every instance. Instances
+are stopped with SIGTERM, so they can unregister from mDNS like a device switched off cleanly; --kill-signal KILL
+simulates a power loss instead, where the entry only expires.
+
+zeroconf is needed for the discovery phases, --no-mdns skips them. Everything else only uses the standard library.
+
+Examples:
+    python fleet_sim.py --instances 50 --duration 30
+    python fleet_sim.py --instances 200 --pollers 16 --churn-duration 120 --churn-period 2 --json fleet.json
+    python fleet_sim.py --instances 50 --sim --no-mdns
+"""
+
+import argparse
+import http.client
+import json
+import os
+import random
+import shlex
+import signal
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+from airhive_client import HOST_BUILD_ELF
+
+SERVICE_TYPE = "_http._tcp.local."
+HOST_BUILD_COMMAND = "{elf}"
+SIM_COMMAND = "{python} airhive_server_sim.py {n} --port {port} --quiet"
+
+
+def percentile(values, fraction):
+    if not values:
+        return None
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def describe(values, unit="s"):
+    """min/p50/p95/max of a list of durations, for the report."""
+    if not values:
+        return {"count": 0}
+    return {"count": len(values), "min_" + unit: min(values), "p50_" + unit: percentile(values, 0.5),
+            "p95_" + unit: percentile(values, 0.95), "max_" + unit: max(values)}
+
+
+class Instance:
+    def __init__(self, n, port, command, elf):
+        self.n = n
+        self.port = port
+        self.name = "Airhive%d-test" % n
+        self.command = command
+        self.elf = elf
+        self.process = None
+        self.launched_at = None
+        self.ready_at = None
+        self.lock = threading.Lock()
+
+    def start(self):
+        args = shlex.split(self.command.format(n=self.n, port=self.port, name=self.name, elf=shlex.quote(self.elf),
+                                               python=shlex.quote(sys.executable)))
+        env = dict(os.environ, AIRHIVE_PORT=str(self.port), AIRHIVE_NAME=self.name)
+        with self.lock:
+            self.process = subprocess.Popen(args, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, env=env,
+                                            cwd=os.path.dirname(os.path.abspath(__file__)))
+            self.launched_at = time.monotonic()
+            self.ready_at = None
+
+    def stop(self, kill_signal):
+        with self.lock:
+            process = self.process
+            self.process = None
+        if process is None:
+            return
+        process.send_signal(kill_signal)
+        try:
+            process.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            process.kill()
+            process.wait()
+
+    def running(self):
+        with self.lock:
+            return self.process is not None and self.process.poll() is None
+
+    def wait_ready(self, deadline):
+        """Waits until the port accepts connections, returns the startup time or None."""
+        while time.monotonic() < deadline:
+            if not self.running():
+                return None
+            try:
+                with socket.create_connection(("127.0.0.1", self.port), timeout=0.5):
+                    self.ready_at = time.monotonic()
+                    return self.ready_at - self.launched_at
+            except OSError:
+                time.sleep(0.05)
+        return None
+
+
+class Discovery:
+    """Records when each Airhive name is added to and removed from the mDNS browse results."""
+
+    def __init__(self):
+        from zeroconf import ServiceBrowser, Zeroconf
+        self.lock = threading.Lock()
+        self.added = {}      # name -> monotonic time of the last add
+        self.removed = {}
+        self.events = 0
+        self.zeroconf = Zeroconf()
+        self.browser = ServiceBrowser(self.zeroconf, SERVICE_TYPE, self)
+
+    @staticmethod
+    def instance_name(service_name):
+        return service_name[:-len("." + SERVICE_TYPE)] if service_name.endswith("." + SERVICE_TYPE) else service_name
+
+    def add_service(self, zeroconf_inst, service_type, name):
+        if name.startswith("Airhive"):
+            with self.lock:
+                self.added[self.instance_name(name)] = time.monotonic()
+                self.events += 1
+
+    def remove_service(self, zeroconf_inst, service_type, name):
+        if name.startswith("Airhive"):
+            with self.lock:
+                self.removed[self.instance_name(name)] = time.monotonic()
+                self.added.pop(self.instance_name(name), None)
+                self.events += 1
+
+    def update_service(self, zeroconf_inst, service_type, name):
+        pass
+
+    def added_after(self, name, since):
+        with self.lock:
+            at = self.added.get(name)
+        return at if at is not None and at >= since else None
+
+    def close(self):
+        self.zeroconf.close()
+
+
+class Poller(threading.Thread):
+    """Polls GET /machine-status round robin over the fleet, one connection per instance like a dashboard does."""
+
+    def __init__(self, poller_id, instances, args):
+        super().__init__(daemon=True)
+        self.instances = instances
+        self.args = args
+        self.rng = random.Random(args.seed + poller_id)
+        self.connections = {}
+        self.stop_event = threading.Event()
+        self.lock = threading.Lock()
+        self.latencies = []
+        self.errors = 0
+
+    def take(self):
+        """Returns and resets the results so far, so each phase is measured on its own."""
+        with self.lock:
+            latencies, errors = self.latencies, self.errors
+            self.latencies, self.errors = [], 0
+        return latencies, errors
+
+    def poll(self, instance):
+        connection = self.connections.get(instance.n)
+        if connection is None:
+            connection = http.client.HTTPConnection("127.0.0.1", instance.port, timeout=self.args.timeout)
+            self.connections[instance.n] = connection
+        start = time.perf_counter()
+        try:
+            connection.request("GET", "/machine-status")
+            response = connection.getresponse()
+            response.read()
+            ok = response.status == 200
+        except (http.client.HTTPException, OSError):
+            connection.close()
+            del self.connections[instance.n]
+            ok = False
+        latency = time.perf_counter() - start
+        with self.lock:
+            if ok:
+                self.latencies.append(latency)
+            else:
+                self.errors += 1
+
+    def run(self):
+        order = list(self.instances)
+        self.rng.shuffle(order)
+        while not self.stop_event.is_set():
+            for instance in order:
+                if self.stop_event.is_set():
+                    break
+                self.poll(instance)
+                if self.args.poll_interval > 0:
+                    time.sleep(self.args.poll_interval)
+
+    def stop(self):
+        self.stop_event.set()
+
+
+def poll_phase(pollers, duration):
+    for poller in pollers:
+        poller.take()
+    start = time.monotonic()
+    time.sleep(duration)
+    elapsed = time.monotonic() - start
+    latencies, errors = [], 0
+    for poller in pollers:
+        poller_latencies, poller_errors = poller.take()
+        latencies += poller_latencies
+        errors += poller_errors
+    report = {"duration_s": elapsed, "requests": len(latencies), "errors": errors,
+              "requests_per_s": len(latencies) / elapsed if elapsed > 0 else 0}
+    report["latency"] = describe([latency * 1000 for latency in latencies], "ms")
+    return report
+
+
+def discovery_phase(discovery, instances, timeout):
+    deadline = time.monotonic() + timeout
+    times = {}
+    while time.monotonic() < deadline and len(times) < len(instances):
+        for instance in instances:
+            if instance.n not in times:
+                at = discovery.added_after(instance.name, instance.launched_at)
+                if at is not None:
+                    times[instance.n] = at - instance.launched_at
+        time.sleep(0.05)
+    report = describe(list(times.values()))
+    report["missing"] = sorted(instance.name for instance in instances if instance.n not in times)
+    return report
+
+
+def churn_phase(instances, discovery, pollers, args):
+    """Kills an instance every churn period and restarts it after --downtime, until the churn duration is over."""
+    rng = random.Random(args.seed)
+    kill_signal = getattr(signal, "SIG" + args.kill_signal)
+    for poller in pollers:
+        poller.take()
+    restarts = []   # (instance, restarted at)
+    down = []       # (instance, restart due at)
+    start = time.monotonic()
+    next_kill = start
+    while time.monotonic() - start < args.churn_duration or down:
+        now = time.monotonic()
+        if now >= next_kill and now - start < args.churn_duration:
+            candidates = [instance for instance in instances if instance not in [d[0] for d in down]]
+            if candidates:
+                victim = rng.choice(candidates)
+                victim.stop(kill_signal)
+                down.append((victim, now + args.downtime))
+            next_kill = now + args.churn_period
+        for entry in [d for d in down if d[1] <= now]:
+            down.remove(entry)
+            entry[0].start()
+            restarts.append(entry[0])
+        time.sleep(0.02)
+
+    ready_times, rediscovery_times = [], []
+    deadline = time.monotonic() + args.discovery_timeout
+    for instance in restarts:
+        ready = instance.wait_ready(deadline) if instance.ready_at is None else instance.ready_at - instance.launched_at
+        if ready is not None:
+            ready_times.append(ready)
+    if discovery is not None:
+        pending = list(restarts)
+        while pending and time.monotonic() < deadline:
+            for instance in list(pending):
+                at = discovery.added_after(instance.name, instance.launched_at)
+                if at is not None:
+                    rediscovery_times.append(at - instance.launched_at)
+                    pending.remove(instance)
+            time.sleep(0.05)
+    elapsed = time.monotonic() - start
+    latencies, errors = [], 0
+    for poller in pollers:
+        poller_latencies, poller_errors = poller.take()
+        latencies += poller_latencies
+        errors += poller_errors
+    report = {"duration_s": elapsed, "restarts": len(restarts), "requests": len(latencies), "errors": errors,
+              "requests_per_s": len(latencies) / elapsed if elapsed > 0 else 0,
+              "latency": describe([latency * 1000 for latency in latencies], "ms"),
+              "ready_after_restart": describe(ready_times)}
+    if discovery is not None:
+        report["rediscovered_after_restart"] = describe(rediscovery_times)
+        report["not_rediscovered"] = len(restarts) - len(rediscovery_times)
+    return report
+
+
+def print_section(title, report):
+    print("%s:" % title)
+    for key, value in report.items():
+        if isinstance(value, dict):
+            print("  %-28s %s" % (key, ", ".join("%s %s" % (k, "%.3f" % v if isinstance(v, float) else v)
+                                                 for k, v in value.items())))
+        elif isinstance(value, list):
+            print("  %-28s %s" % (key, ", ".join(value) if value else "none"))
+        else:
+            print("  %-28s %s" % (key, "%.3f" % value if isinstance(value, float) else value))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--instances", type=int, default=20)
+    parser.add_argument("--base-port", type=int, default=8001, help="instance n listens on base-port + n - 1")
+    parser.add_argument("--command", help="instance command, with {n}, {port}, {name}, {elf} and {python} replaced, "
+                        "the linux target build by default")
+    parser.add_argument("--elf", default=HOST_BUILD_ELF, help="linux target build of the firmware")
+    parser.add_argument("--sim", action="store_true", help="run the Flask simulator instead of the firmware")
+    parser.add_argument("--launch-interval", type=float, default=0.02, help="pause between launches, in seconds")
+    parser.add_argument("--startup-timeout", type=float, default=60)
+    parser.add_argument("--discovery-timeout", type=float, default=30)
+    parser.add_argument("--no-mdns", action="store_true", help="skip the discovery measurements")
+    parser.add_argument("--pollers", type=int, default=4, help="status polling clients")
+    parser.add_argument("--poll-interval", type=float, default=0, help="pause between polls of a client, in seconds")
+    parser.add_argument("--duration", type=float, default=20, help="steady state polling duration, in seconds")
+    parser.add_argument("--churn-duration", type=float, default=30, help="0 to skip the churn phase")
+    parser.add_argument("--churn-period", type=float, default=3, help="time between two kills, in seconds")
+    parser.add_argument("--downtime", type=float, default=2, help="time a killed instance stays down, in seconds")
+    parser.add_argument("--kill-signal", choices=["TERM", "KILL"], default="TERM")
+    parser.add_argument("--timeout", type=float, default=5, help="socket timeout of the pollers, in seconds")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+    if args.command is None:
+        args.command = SIM_COMMAND if args.sim else HOST_BUILD_COMMAND
+    if "{elf}" in args.command and not os.path.isfile(args.elf):
+        sys.exit("%s isn't built, see the help, or run the Flask simulator with --sim" % args.elf)
+
+    discovery = None
+    if not args.no_mdns:
+        try:
+            discovery = Discovery()
+        except ImportError:
+            sys.exit("zeroconf is needed for discovery, install it or run with --no-mdns")
+
+    instances = [Instance(n, args.base_port + n - 1, args.command, args.elf) for n in range(1, args.instances + 1)]
+    results = {"instances": args.instances, "command": args.command}
+    pollers = []
+    try:
+        for instance in instances:
+            instance.start()
+            time.sleep(args.launch_interval)
+        deadline = time.monotonic() + args.startup_timeout
+        startup = [instance.wait_ready(deadline) for instance in instances]
+        results["startup"] = describe([t for t in startup if t is not None])
+        results["startup"]["failed"] = sum(1 for t in startup if t is None)
+        print_section("Startup", results["startup"])
+        if results["startup"]["failed"] == len(instances):
+            sys.exit("No instance started, check --command")
+
+        if discovery is not None:
+            results["discovery"] = discovery_phase(discovery, instances, args.discovery_timeout)
+            print_section("Discovery (from launch)", results["discovery"])
+
+        pollers = [Poller(i, instances, args) for i in range(args.pollers)]
+        for poller in pollers:
+            poller.start()
+        results["polling"] = poll_phase(pollers, args.duration)
+        print_section("Status polling", results["polling"])
+
+        if args.churn_duration > 0:
+            results["churn"] = churn_phase(instances, discovery, pollers, args)
+            print_section("Churn", results["churn"])
+    finally:
+        for poller in pollers:
+            poller.stop()
+        for poller in pollers:
+            poller.join(timeout=args.timeout + 1)
+        for instance in instances:
+            instance.stop(signal.SIGTERM)
+        if discovery is not None:
+            results["mdns_events"] = discovery.events
+            discovery.close()
+
+    if args.json:
+        with open(args.json, "w") as output:
+            json.dump(results, output, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,225 @@
+"""Heap fragmentation soak test for the Airhive server.
+
+Replays a mix of the traffic a device sees over days (status polls, response reads, command posts, macro and job
+listings, large uploads and tx_queue clears) as fast as the device answers, and samples GET /heap every
+--sample-every requests. Each sample is taken while no other request is in flight, so the server's own module counters
+must be back to zero: anything left is a leak. At the end the largest free block and the fragmentation of each
+capability are compared between the first and the last quarter of the run, and their trend over the second half is
+fitted; the test fails if the largest free block keeps shrinking or the fragmentation keeps growing beyond the limits,
+or if the trend would bring the largest free block below --min-largest-block within --horizon-days of real use.
+
+At the default rate of one request every 5 s of a busy dashboard, --requests 100000 stands for about 6 days.
+
+Without --url it starts host_test/airhive_host, the firmware built for the ESP-IDF linux target, on --port and soaks it:
+the server and cncm are the device's, with a simulated Marlin printer, and the heap is glibc's, reported as internal
+RAM. glibc doesn't report its largest free block, GET /heap answers null for it and for the fragmentation there, so
+only the module leaks are checked. Build it first with
+    cd host_test/airhive_host && idf.py --preview set-target linux && idf.py build
+With --url it runs against a device instead; no machine needs to be attached. Only the standard library is used.
+
+Examples:
+    python soak_heap.py --requests 100000
+    python soak_heap.py --url http://Airhive-XXXXXXXXXXXX.local --requests 100000
+    python soak_heap.py --url http://192.168.1.50 --mix status=10,responses=10,upload=1 --json soak.json
+"""
+
+import argparse
+import contextlib
+import http.client
+import json
+import random
+import sys
+import time
+
+from airhive_client import HOST_BUILD_ELF, Client, HostBuild, make_body
+
+ENDPOINTS = {
+    "status": ("GET", "/machine-status"),
+    "responses": ("GET", "/responses"),
+    "commands": ("POST", "/commands"),
+    "upload": ("POST", "/commands"),
+    "macros": ("GET", "/macros"),
+    "jobs": ("GET", "/jobs"),
+    "network": ("GET", "/network-status"),
+    "clear": ("PUT", "/clear"),
+}
+DEFAULT_MIX = "status=20,responses=20,commands=10,upload=1,macros=2,jobs=2,network=2,clear=2"
+
+
+def parse_mix(text):
+    mix = []
+    for item in text.split(","):
+        name, _, weight = item.partition("=")
+        if name not in ENDPOINTS:
+            raise argparse.ArgumentTypeError("unknown endpoint '%s', expected one of %s" % (name, ", ".join(ENDPOINTS)))
+        mix.append((name, float(weight or 1)))
+    return mix
+
+
+def slope(points):
+    """Least squares slope of (x, y) points, 0 if there aren't enough."""
+    if len(points) < 2:
+        return 0.0
+    n = len(points)
+    mean_x = sum(x for x, _ in points) / n
+    mean_y = sum(y for _, y in points) / n
+    variance = sum((x - mean_x) ** 2 for x, _ in points)
+    if variance == 0:
+        return 0.0
+    return sum((x - mean_x) * (y - mean_y) for x, y in points) / variance
+
+
+def median(values):
+    ordered = sorted(values)
+    return ordered[len(ordered) // 2] if ordered else None
+
+
+def analyze(samples, args):
+    """Compares the start and the end of the run per capability, returns the report and the list of failures."""
+    report, failures = {}, []
+    quarter = max(1, len(samples) // 4)
+    first, last = samples[:quarter], samples[-quarter:]
+    second_half = samples[len(samples) // 2:]
+    for caps in samples[0]["capabilities"]:
+        if samples[0]["capabilities"][caps]["largest_free_block"] is None:
+            # The linux target build doesn't report the largest free block, nor the fragmentation that comes from it.
+            report[caps] = {"minimum_free": samples[-1]["capabilities"][caps]["minimum_free"]}
+            continue
+        largest_start = median([s["capabilities"][caps]["largest_free_block"] for s in first])
+        largest_end = median([s["capabilities"][caps]["largest_free_block"] for s in last])
+        fragmentation_start = median([s["capabilities"][caps]["fragmentation"] for s in first])
+        fragmentation_end = median([s["capabilities"][caps]["fragmentation"] for s in last])
+        # Per 10000 requests, over the second half only, once the heap had time to settle.
+        largest_trend = slope([(s["request"], s["capabilities"][caps]["largest_free_block"]) for s in second_half]) * 1e4
+        fragmentation_trend = slope([(s["request"], s["capabilities"][caps]["fragmentation"])
+                                     for s in second_half]) * 1e4
+        report[caps] = {
+            "largest_free_block_start": largest_start, "largest_free_block_end": largest_end,
+            "largest_free_block_per_10k_requests": largest_trend,
+            "fragmentation_start": fragmentation_start, "fragmentation_end": fragmentation_end,
+            "fragmentation_per_10k_requests": fragmentation_trend,
+            "minimum_free": samples[-1]["capabilities"][caps]["minimum_free"],
+        }
+        if largest_start and largest_end < largest_start * (1 - args.max_block_shrink) and largest_trend < 0:
+            failures.append("%s: largest free block shrank from %d to %d and is still shrinking"
+                            % (caps, largest_start, largest_end))
+        # A slow loss that stays under the limit during the run still matters if it would go on for weeks.
+        requests_per_day = 86400 / args.real_interval
+        projected = largest_end + largest_trend / 1e4 * requests_per_day * args.horizon_days
+        report[caps]["largest_free_block_projected"] = projected
+        if largest_trend < 0 and projected < args.min_largest_block:
+            failures.append("%s: at this rate the largest free block falls below %d bytes within %g days"
+                            % (caps, args.min_largest_block, args.horizon_days))
+        if fragmentation_end > fragmentation_start + args.max_fragmentation_growth and fragmentation_trend > 0:
+            failures.append("%s: fragmentation grew from %.3f to %.3f and is still growing"
+                            % (caps, fragmentation_start, fragmentation_end))
+    leaks = {}
+    for module, stats in samples[-1]["modules"].items():
+        if stats["live_bytes"] != 0:
+            leaks[module] = stats["live_bytes"]
+            failures.append("%s: %d bytes still allocated between requests" % (module, stats["live_bytes"]))
+    report["modules"] = samples[-1]["modules"]
+    report["leaked_bytes"] = leaks
+    return report, failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", help="base URL of a device, e.g. http://192.168.1.50, the linux target build is "
+                        "started and soaked without it")
+    parser.add_argument("--elf", default=HOST_BUILD_ELF, help="linux target build of the firmware")
+    parser.add_argument("--port", type=int, default=8080, help="port the linux target build serves on")
+    parser.add_argument("--log", help="file the output of the linux target build goes to")
+    parser.add_argument("--requests", type=int, default=20000)
+    parser.add_argument("--mix", type=parse_mix, default=parse_mix(DEFAULT_MIX), help="weighted endpoint mix")
+    parser.add_argument("--upload-size", type=int, default=48 * 1024, help="largest upload body, in bytes")
+    parser.add_argument("--commands-per-request", type=int, help="lines per command post, 1 to 20 at random by default")
+    parser.add_argument("--command-size", type=int, help="average command length in bytes, as generated by default")
+    parser.add_argument("--responses-size", type=int, help="'size' sent to GET /responses, the usual ones at random "
+                        "by default")
+    parser.add_argument("--sample-every", type=int, default=200, help="requests between two GET /heap")
+    parser.add_argument("--real-interval", type=float, default=5, help="seconds between requests in real use, "
+                        "only used to report the uptime the run stands for")
+    parser.add_argument("--max-block-shrink", type=float, default=0.25,
+                        help="largest free block loss allowed between the first and last quarter, as a fraction")
+    parser.add_argument("--max-fragmentation-growth", type=float, default=0.15,
+                        help="fragmentation increase allowed between the first and last quarter")
+    parser.add_argument("--min-largest-block", type=int, default=16 * 1024,
+                        help="largest free block the server needs, the trend must not reach it within the horizon")
+    parser.add_argument("--horizon-days", type=float, default=30, help="uptime the trend is projected over")
+    parser.add_argument("--timeout", type=float, default=10)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--json", help="also write the samples and the results to this file")
+    args = parser.parse_args()
+
+    with contextlib.nullcontext() if args.url else HostBuild(args.elf, args.port, "Airhive-soak", args.log) as host:
+        url = args.url or host.url
+        samples, statuses, errors, duration = soak(Client(url, args.timeout), args)
+    report(url, samples, statuses, errors, duration, args)
+
+
+def soak(client, args):
+    """Runs the mix, returns the GET /heap samples, the statuses seen, the connection errors and the duration."""
+    rng = random.Random(args.seed)
+    names = [name for name, _ in args.mix]
+    weights = [weight for _, weight in args.mix]
+    statuses, errors, samples = {}, 0, []
+    start = time.monotonic()
+    for request in range(args.requests + 1):
+        if request % args.sample_every == 0:
+            status, sample = client.request("GET", "/heap")
+            if status != 200:
+                sys.exit("GET /heap answered %s, the firmware is too old for this test" % status)
+            sample["request"] = request
+            samples.append(sample)
+            internal = sample["capabilities"]["internal"]
+            if internal["largest_free_block"] is None:
+                print("%7d requests  internal free %7d" % (request, internal["free"]))
+            else:
+                print("%7d requests  internal free %7d  largest %7d  fragmentation %.3f"
+                      % (request, internal["free"], internal["largest_free_block"], internal["fragmentation"]))
+        if request == args.requests:
+            break
+        name = rng.choices(names, weights)[0]
+        method, path = ENDPOINTS[name]
+        try:
+            status, _ = client.request(method, path, make_body(name, args, rng))
+        except (http.client.HTTPException, OSError):
+            errors += 1
+            continue
+        statuses[status] = statuses.get(status, 0) + 1
+    return samples, statuses, errors, time.monotonic() - start
+
+
+def report(url, samples, statuses, errors, duration, args):
+    results, failures = analyze(samples, args)
+    print("\n%d requests in %.0f s, stands for %.1f days of uptime at one request every %g s"
+          % (args.requests, duration, args.requests * args.real_interval / 86400, args.real_interval))
+    print("Statuses: %s, connection errors: %d" % (", ".join("%s: %d" % item for item in sorted(statuses.items())),
+                                                   errors))
+    for caps, result in results.items():
+        if caps in ("modules", "leaked_bytes"):
+            continue
+        if "largest_free_block_start" not in result:
+            print("%-9s largest free block and fragmentation not reported, minimum free %d"
+                  % (caps, result["minimum_free"]))
+            continue
+        print("%-9s largest free block %d -> %d (%+.0f per 10k requests), fragmentation %.3f -> %.3f (%+.4f per 10k)"
+              % (caps, result["largest_free_block_start"], result["largest_free_block_end"],
+                 result["largest_free_block_per_10k_requests"], result["fragmentation_start"],
+                 result["fragmentation_end"], result["fragmentation_per_10k_requests"]))
+    for module, stats in results["modules"].items():
+        print("%-9s %d allocs, %d failures, peak %d bytes, largest %d bytes"
+              % (module, stats["allocs"], stats["failures"], stats["peak_bytes"], stats["largest_alloc"]))
+    if args.json:
+        with open(args.json, "w") as output:
+            json.dump({"url": url, "requests": args.requests, "duration_s": duration, "statuses": statuses,
+                       "errors": errors, "results": results, "failures": failures, "samples": samples}, output, indent=2)
+    if failures:
+        print("\nFAILED:\n  " + "\n  ".join(failures))
+        sys.exit(1)
+    print("\nPASSED")
+
+
+if __name__ == "__main__":
+    main()